@@ -43,6 +43,8 @@
 #include <sys/time.h>
 #include <time.h>
 #include "obe.h"
+#include "common/tasks.h"
+#include "common/ring.h"
 
 #define MAX_DEVICES 1
 #define MAX_STREAMS 40
@@ -72,8 +74,12 @@
 #define AC3_BS_DVB      5696
 #define MISC_AUDIO_BS   3584
 
-/* Network output */
-#define TS_PACKETS_SIZE 1316
+/* Coded frame pools */
+#define OBE_CODED_FRAME_POOL_MIN_SIZE 16384
+#define OBE_CODED_FRAME_POOL_CLASSES 12
+
+/* Encoder statistics */
+#define OBE_ENCODER_STATS_SIZE 1024
 
 /* Audio sample patterns */
 #define MAX_AUDIO_SAMPLE_PATTERN 5
@@ -147,6 +153,7 @@ typedef struct
 
     /* Compressed Audio */
     int bitrate;
+    int sdi_audio_pair; /* SMPTE 337M, set if the stream is carried in an SDI audio pair */
 
     /* AAC */
     int aac_profile_and_level;
@@ -321,6 +328,9 @@ typedef struct
     pthread_mutex_t mutex;
     pthread_cond_t  in_cv;
     pthread_cond_t  out_cv;
+
+    /* Task which consumes the queue, if the consumer isn't a thread */
+    obe_task_t *task;
 } obe_queue_t;
 
 typedef struct
@@ -366,10 +376,14 @@ typedef struct
     int num_stream_ids;
     int *stream_id_list;
 
-    pthread_t filter_thread;
     obe_queue_t queue;
     int cancel_thread;
 
+    /* Filters run as tasks */
+    obe_task_t task;
+    void *filter_ctx;
+    int (*filter_frame)( void *ctx, obe_raw_frame_t *raw_frame );
+    void (*close_filter)( void *ctx );
 } obe_filter_t;
 
 typedef struct
@@ -382,21 +396,52 @@ typedef struct
     obe_queue_t queue;
     int cancel_thread;
 
+    /* Encoders which run as tasks */
+    obe_task_t task;
+    void *encoder_ctx;
+    int (*encode_frame)( void *ctx, obe_raw_frame_t *raw_frame );
+    void (*close_encoder)( void *ctx );
+
     hnd_t encoder_params;
 
     /* HE-AAC and E-AC3 */
     int num_samples;
+
+    /* Audio only. Sample format the audio filter converts to before queueing */
+    int input_sample_format;
+
+    /* Video only. The ring has a single writer and is read without locking */
+    obe_encoder_stats_t stats[OBE_ENCODER_STATS_SIZE];
+    volatile int64_t stats_idx;
+    obe_encoder_governor_t governor;
+
+    /* Rate control waiting to be picked up by the encoder, which applies it at the next IDR, and a counter
+     * of changes to encoder_params. Protected by the queue mutex */
+    int update_pending;
+    int update_bitrate;
+    int update_vbv_max_bitrate;
+    int update_vbv_buffer_size;
+    int params_version;
+
+    /* Keyframes coded so far, statmux reallocates once each encoder has coded another. Protected by statmux_mutex */
+    int keyframes;
+
+    /* Protected by the queue mutex */
+    obe_overload_policy_t overload;
+    obe_overload_stats_t overload_stats;
+    int overloaded;
 } obe_encoder_t;
 
 typedef struct
 {
     /* Output */
-    pthread_t output_thread;
-    int cancel_thread;
     obe_output_dest_t output_dest;
 
-    /* Muxed frame queue for transmission */
-    obe_queue_t queue;
+    /* File and HLS outputs only. IP outputs are all sent by the output thread in obe_t */
+    pthread_t output_thread;
+    int cancel_thread;
+    obe_ts_ring_t *ring;
+    int ring_reader;
 } obe_output_t;
 
 typedef struct
@@ -417,16 +462,27 @@ typedef struct
 
     int len;
     uint8_t *data;
+
+    /* Pool the frame was allocated from, if any */
+    struct obe_coded_frame_pool_t *pool;
+    int size_class;
 } obe_coded_frame_t;
 
-typedef struct
+/* Size-classed free lists of coded frames. Classes double in size from the minimum up to the maximum frame size.
+ * Frames are returned to the pool by destroy_coded_frame so the owner can close the pool while frames are in flight */
+typedef struct obe_coded_frame_pool_t
 {
-    int len;
-    uint8_t *data;
+    pthread_mutex_t mutex;
+    int num_classes;
+    int min_size;
 
-    /* MPEG-TS */
-    int64_t *pcr_list;
-} obe_muxed_data_t;
+    obe_coded_frame_t **free_frames[OBE_CODED_FRAME_POOL_CLASSES];
+    int num_free[OBE_CODED_FRAME_POOL_CLASSES];
+    int max_free[OBE_CODED_FRAME_POOL_CLASSES];
+
+    int outstanding;
+    int closed;
+} obe_coded_frame_pool_t;
 
 struct obe_t
 {
@@ -448,7 +504,7 @@ struct obe_t
     /* Frame drop flags
      * TODO: make this work for multiple inputs and outputs */
     pthread_mutex_t drop_mutex;
-    int encoder_drop;
+    int encoder_drops; /* Counts drops. Each encoder compares it with the count it last handled */
     int mux_drop;
 
     /* Streams */
@@ -469,6 +525,12 @@ struct obe_t
     pthread_t mux_smoothing_thread;
     int cancel_mux_smoothing_thread;
 
+    /* Statistical multiplexing */
+    pthread_t statmux_thread;
+    pthread_mutex_t statmux_mutex;
+    pthread_cond_t statmux_cv;
+    int cancel_statmux_thread;
+
     /* Filtering */
     int num_filters;
     obe_filter_t *filters[MAX_STREAMS];
@@ -478,9 +540,14 @@ struct obe_t
     int num_encoders;
     obe_encoder_t *encoders[MAX_STREAMS];
 
-    /* Output data */
+    /* Shared workers for the stages which run as tasks */
+    obe_task_pool_t *task_pool;
+
+    /* Output data. One thread sends each datagram to every output */
     int num_outputs;
     obe_output_t **outputs;
+    pthread_t output_thread;
+    int cancel_output_thread;
 
     /* Encoded frames in smoothing buffer */
     obe_queue_t     enc_smoothing_queue;
@@ -491,8 +558,10 @@ struct obe_t
     /* Encoded frame queue for muxing */
     obe_queue_t mux_queue;
 
-    /* Muxed frames in smoothing buffer */
-    obe_queue_t mux_smoothing_queue;
+    /* Muxed datagrams in smoothing buffer and waiting for output */
+    obe_ts_ring_t ts_ring;
+    int64_t pacing_offset; /* input clock minus PCR of the datagrams being published. Protected by the ring mutex */
+    obe_pacing_stats_t pacing_stats;
 
     /* Statistics and Monitoring */
 
@@ -507,6 +576,13 @@ typedef struct
 extern const obe_smoothing_func_t enc_smoothing;
 extern const obe_smoothing_func_t mux_smoothing;
 
+typedef struct
+{
+    void* (*start_statmux)( void *ptr );
+} obe_statmux_func_t;
+
+extern const obe_statmux_func_t statmux;
+
 int64_t obe_mdate( void );
 
 obe_device_t *new_device( void );
@@ -515,12 +591,14 @@ obe_raw_frame_t *new_raw_frame( void );
 void destroy_raw_frame( obe_raw_frame_t *raw_frame );
 obe_coded_frame_t *new_coded_frame( int stream_id, int len );
 void destroy_coded_frame( obe_coded_frame_t *coded_frame );
+obe_coded_frame_pool_t *new_coded_frame_pool( int max_size );
+obe_coded_frame_t *new_pooled_coded_frame( obe_coded_frame_pool_t *pool, int stream_id, int len );
+void close_coded_frame_pool( obe_coded_frame_pool_t *pool );
 void obe_release_video_data( void *ptr );
 void obe_release_audio_data( void *ptr );
 void obe_release_frame( void *ptr );
+int share_raw_frame( obe_raw_frame_t *raw_frame, obe_raw_frame_t **copies, int num_copies );
 
-obe_muxed_data_t *new_muxed_data( int len );
-void destroy_muxed_data( obe_muxed_data_t *muxed_data );
 
 void add_device( obe_t *h, obe_device_t *device );
 
@@ -531,8 +609,6 @@ int remove_item_from_queue( obe_queue_t *queue, void *item );
 int add_to_filter_queue( obe_t *h, obe_raw_frame_t *raw_frame );
 int add_to_encode_queue( obe_t *h, obe_raw_frame_t *raw_frame, int output_stream_id );
 int remove_early_frames( obe_t *h, int64_t pts );
-int add_to_output_queue( obe_t *h, obe_muxed_data_t *muxed_data );
-int remove_from_output_queue( obe_t *h );
 
 obe_int_input_stream_t *get_input_stream( obe_t *h, int input_stream_id );
 obe_encoder_t *get_encoder( obe_t *h, int stream_id );
@@ -543,7 +619,10 @@ int64_t get_wallclock_in_mpeg_ticks( void );
 void sleep_mpeg_ticks( int64_t i_delay );
 void obe_clock_tick( obe_t *h, int64_t value );
 int64_t get_input_clock_in_mpeg_ticks( obe_t *h );
+int64_t input_clock_to_wallclock( obe_t *h, int64_t i_time );
 void sleep_input_clock( obe_t *h, int64_t i_delay );
+int64_t sleep_input_clock_spin( obe_t *h, int64_t i_time, int64_t spin );
+void update_pacing_stats( obe_t *h, int64_t lateness );
 
 int get_non_display_location( int type );
 
@@ -0,0 +1,436 @@
+/*****************************************************************************
+ * tx_ring.c : UDP output through an AF_PACKET transmit ring
+ *****************************************************************************
+ * Copyright (C) 2010 Open Broadcast Systems Ltd.
+ *
+ * Authors: Kieran Kunhya <kieran@kunhya.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+#define _GNU_SOURCE
+
+#include "common/common.h"
+#include "common/network/network.h"
+#include "tx_ring.h"
+
+#include <arpa/inet.h>
+#include <ifaddrs.h>
+#include <linux/if_packet.h>
+#include <net/ethernet.h>
+#include <net/if_arp.h>
+#include <net/route.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+/* Frames never straddle a block so the ring is a flat array of frames */
+#define TX_RING_BLOCK_SIZE  (1 << 16)
+#define TX_RING_NUM_BLOCKS  64
+#define TX_RING_FRAME_SIZE  2048
+#define TX_RING_HEADER_SIZE (sizeof(struct ether_header) + sizeof(struct iphdr) + sizeof(struct udphdr))
+#define TX_RING_DATA_OFFSET (TPACKET3_HDRLEN - sizeof(struct sockaddr_ll))
+#define TX_RING_MAX_PAYLOAD (TX_RING_FRAME_SIZE - TX_RING_DATA_OFFSET - TX_RING_HEADER_SIZE)
+
+typedef struct
+{
+    int fd;
+    uint8_t *ring;
+    int ring_size;
+    int num_frames;
+    int frame_idx;
+    struct sockaddr_ll addr;
+
+    char iface[IFNAMSIZ];
+    struct in_addr next_hop;
+    int is_multicast;
+
+    /* The next hop's MAC address is looked up again periodically because the neighbour may change */
+    int has_mac;
+    int64_t last_resolve;
+
+    /* Ethernet, IP and UDP headers. Lengths, IP ID and checksum are filled in per frame */
+    uint8_t header[TX_RING_HEADER_SIZE];
+    uint16_t ip_id;
+} obe_tx_ring_ctx;
+
+/* Kernel routes to local addresses go through the loopback device */
+static int find_iface( obe_tx_ring_ctx *s, struct in_addr *src, struct in_addr *dest )
+{
+    struct ifaddrs *ifaddr, *ifa;
+    int found = 0;
+
+    if( getifaddrs( &ifaddr ) < 0 )
+        return -1;
+
+    for( ifa = ifaddr; ifa && !found; ifa = ifa->ifa_next )
+    {
+        if( ifa->ifa_addr && ifa->ifa_addr->sa_family == AF_INET &&
+            ((struct sockaddr_in *)ifa->ifa_addr)->sin_addr.s_addr == dest->s_addr )
+        {
+            for( struct ifaddrs *lo = ifaddr; lo; lo = lo->ifa_next )
+            {
+                if( lo->ifa_flags & IFF_LOOPBACK )
+                {
+                    av_strlcpy( s->iface, lo->ifa_name, sizeof(s->iface) );
+                    found = 1;
+                    break;
+                }
+            }
+        }
+    }
+
+    for( ifa = ifaddr; ifa && !found; ifa = ifa->ifa_next )
+    {
+        if( ifa->ifa_addr && ifa->ifa_addr->sa_family == AF_INET &&
+            ((struct sockaddr_in *)ifa->ifa_addr)->sin_addr.s_addr == src->s_addr )
+        {
+            av_strlcpy( s->iface, ifa->ifa_name, sizeof(s->iface) );
+            found = 1;
+        }
+    }
+
+    freeifaddrs( ifaddr );
+
+    return found ? 0 : -1;
+}
+
+/* Longest prefix match in the main routing table for the chosen interface */
+static void find_next_hop( obe_tx_ring_ctx *s, struct in_addr *dest )
+{
+    char line[256], name[IFNAMSIZ+1];
+    unsigned int route_dest, gateway, flags, mask;
+    int64_t best_mask = -1;
+    FILE *fp;
+
+    s->next_hop = *dest;
+
+    fp = fopen( "/proc/net/route", "r" );
+    if( !fp )
+        return;
+
+    while( fgets( line, sizeof(line), fp ) )
+    {
+        if( sscanf( line, "%16s %x %x %x %*d %*d %*d %x", name, &route_dest, &gateway, &flags, &mask ) != 5 ||
+            strcmp( name, s->iface ) || !( flags & RTF_UP ) || ( dest->s_addr & mask ) != route_dest ||
+            (int64_t)ntohl( mask ) <= best_mask )
+            continue;
+
+        best_mask = ntohl( mask );
+        s->next_hop.s_addr = flags & RTF_GATEWAY ? gateway : dest->s_addr;
+    }
+
+    fclose( fp );
+}
+
+static int resolve_mac( obe_tx_ring_ctx *s, uint8_t *mac )
+{
+    char line[256], ip[64], hw[64], name[IFNAMSIZ+1];
+    unsigned int flags;
+    int found = 0;
+    FILE *fp;
+
+    fp = fopen( "/proc/net/arp", "r" );
+    if( !fp )
+        return -1;
+
+    while( !found && fgets( line, sizeof(line), fp ) )
+    {
+        if( sscanf( line, "%63s %*x %x %63s %*s %16s", ip, &flags, hw, name ) != 4 ||
+            !( flags & ATF_COM ) || strcmp( name, s->iface ) || inet_addr( ip ) != s->next_hop.s_addr )
+            continue;
+
+        found = sscanf( hw, "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx", &mac[0], &mac[1], &mac[2], &mac[3], &mac[4], &mac[5] ) == 6;
+    }
+
+    fclose( fp );
+
+    return found ? 0 : -1;
+}
+
+int tx_ring_open( hnd_t *p_handle, struct sockaddr_storage *dest_addr, int local_port, int ttl, int miface, char *iface )
+{
+    obe_tx_ring_ctx *s;
+    struct sockaddr_in *dest = (struct sockaddr_in *)dest_addr;
+    struct sockaddr_in src;
+    socklen_t src_len = sizeof(src);
+    struct ifreq ifr = {{{0}}};
+    struct tpacket_req3 req = {0};
+    struct ether_header *eth;
+    struct iphdr *ip;
+    struct udphdr *udp;
+    int version = TPACKET_V3, fd;
+
+    *p_handle = NULL;
+
+    if( dest->sin_family != AF_INET )
+    {
+        fprintf( stderr, "[tx-ring] Only IPv4 destinations are supported\n" );
+        return -1;
+    }
+
+    s = calloc( 1, sizeof(*s) );
+    if( !s )
+    {
+        fprintf( stderr, "[tx-ring] malloc failed\n" );
+        return -1;
+    }
+    s->fd = -1;
+    s->ring = MAP_FAILED;
+    s->is_multicast = is_multicast_address( (struct sockaddr *)dest );
+
+    /* Let the kernel choose the source address as it would for the socket */
+    fd = socket( AF_INET, SOCK_DGRAM, 0 );
+    if( fd < 0 )
+        goto fail;
+    if( iface[0] )
+        setsockopt( fd, SOL_SOCKET, SO_BINDTODEVICE, iface, strlen( iface ) + 1 );
+    if( s->is_multicast && miface )
+    {
+        struct ip_mreqn mreq = { .imr_ifindex = miface };
+        setsockopt( fd, IPPROTO_IP, IP_MULTICAST_IF, &mreq, sizeof(mreq) );
+    }
+    if( connect( fd, (struct sockaddr *)dest, sizeof(*dest) ) < 0 || getsockname( fd, (struct sockaddr *)&src, &src_len ) < 0 )
+    {
+        close( fd );
+        fprintf( stderr, "[tx-ring] No route to destination\n" );
+        goto fail;
+    }
+    close( fd );
+
+    if( iface[0] )
+        av_strlcpy( s->iface, iface, sizeof(s->iface) );
+    else if( s->is_multicast && miface )
+        if_indextoname( miface, s->iface );
+    else if( find_iface( s, &src.sin_addr, &dest->sin_addr ) < 0 )
+    {
+        fprintf( stderr, "[tx-ring] Could not find output interface\n" );
+        goto fail;
+    }
+
+    s->fd = socket( AF_PACKET, SOCK_RAW, 0 );
+    if( s->fd < 0 )
+    {
+        fprintf( stderr, "[tx-ring] Could not open packet socket: %s\n", strerror( errno ) );
+        goto fail;
+    }
+
+    av_strlcpy( ifr.ifr_name, s->iface, sizeof(ifr.ifr_name) );
+    if( ioctl( s->fd, SIOCGIFHWADDR, &ifr ) < 0 ||
+        ( ifr.ifr_hwaddr.sa_family != ARPHRD_ETHER && ifr.ifr_hwaddr.sa_family != ARPHRD_LOOPBACK ) )
+    {
+        fprintf( stderr, "[tx-ring] %s is not an Ethernet interface\n", s->iface );
+        goto fail;
+    }
+
+    /* Frames written to the loopback device's ring never reach local sockets */
+    if( ifr.ifr_hwaddr.sa_family == ARPHRD_LOOPBACK )
+    {
+        fprintf( stderr, "[tx-ring] Local destinations are not supported\n" );
+        goto fail;
+    }
+
+    if( setsockopt( s->fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version) ) < 0 )
+    {
+        fprintf( stderr, "[tx-ring] TPACKET_V3 not supported\n" );
+        goto fail;
+    }
+
+    req.tp_block_size = TX_RING_BLOCK_SIZE;
+    req.tp_block_nr = TX_RING_NUM_BLOCKS;
+    req.tp_frame_size = TX_RING_FRAME_SIZE;
+    req.tp_frame_nr = TX_RING_BLOCK_SIZE / TX_RING_FRAME_SIZE * TX_RING_NUM_BLOCKS;
+    if( setsockopt( s->fd, SOL_PACKET, PACKET_TX_RING, &req, sizeof(req) ) < 0 )
+    {
+        fprintf( stderr, "[tx-ring] Could not set up transmit ring: %s\n", strerror( errno ) );
+        goto fail;
+    }
+
+    s->num_frames = req.tp_frame_nr;
+    s->ring_size = req.tp_block_size * req.tp_block_nr;
+    s->ring = mmap( NULL, s->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED, s->fd, 0 );
+    if( s->ring == MAP_FAILED )
+    {
+        fprintf( stderr, "[tx-ring] Could not map transmit ring\n" );
+        goto fail;
+    }
+
+    /* Bound with no protocol so that nothing is received. The protocol is given when the ring is flushed */
+    s->addr.sll_family = AF_PACKET;
+    s->addr.sll_ifindex = if_nametoindex( s->iface );
+    if( bind( s->fd, (struct sockaddr *)&s->addr, sizeof(s->addr) ) < 0 )
+    {
+        fprintf( stderr, "[tx-ring] Could not bind to %s\n", s->iface );
+        goto fail;
+    }
+    s->addr.sll_protocol = htons( ETH_P_IP );
+
+    eth = (struct ether_header *)s->header;
+    ip = (struct iphdr *)&s->header[sizeof(*eth)];
+    udp = (struct udphdr *)&s->header[sizeof(*eth) + sizeof(*ip)];
+
+    memcpy( eth->ether_shost, ifr.ifr_hwaddr.sa_data, ETH_ALEN );
+    eth->ether_type = htons( ETH_P_IP );
+
+    ip->version = 4;
+    ip->ihl = sizeof(*ip) / 4;
+    ip->frag_off = htons( IP_DF );
+    ip->ttl = ttl > 0 ? ttl : s->is_multicast ? 1 : 64;
+    ip->protocol = IPPROTO_UDP;
+    ip->saddr = src.sin_addr.s_addr;
+    ip->daddr = dest->sin_addr.s_addr;
+
+    /* A zero UDP checksum means none was computed */
+    udp->source = htons( local_port );
+    udp->dest = dest->sin_port;
+
+    if( s->is_multicast )
+    {
+        uint32_t group = ntohl( dest->sin_addr.s_addr );
+        uint8_t mac[ETH_ALEN] = { 0x01, 0x00, 0x5e, ( group >> 16 ) & 0x7f, ( group >> 8 ) & 0xff, group & 0xff };
+        memcpy( eth->ether_dhost, mac, ETH_ALEN );
+        s->has_mac = 1;
+    }
+    else
+        find_next_hop( s, &dest->sin_addr );
+
+    if( !tx_ring_ready( s ) )
+        fprintf( stderr, "[tx-ring] No neighbour entry for next hop yet, using sockets until there is one\n" );
+
+    *p_handle = s;
+
+    return 0;
+
+fail:
+    tx_ring_close( s );
+    return -1;
+}
+
+/* Returns whether the next hop's MAC address is known. Until it is, datagrams go through the
+ * socket, which also makes the kernel resolve it */
+int tx_ring_ready( hnd_t handle )
+{
+    obe_tx_ring_ctx *s = handle;
+    struct ether_header *eth = (struct ether_header *)s->header;
+    uint8_t mac[ETH_ALEN];
+    int64_t now;
+
+    if( s->is_multicast )
+        return 1;
+
+    now = get_wallclock_in_mpeg_ticks();
+    if( s->last_resolve && now - s->last_resolve < OBE_CLOCK )
+        return s->has_mac;
+    s->last_resolve = now;
+
+    /* Keep the last address if the entry has gone stale, since the kernel no longer sees the traffic */
+    if( resolve_mac( s, mac ) == 0 )
+    {
+        memcpy( eth->ether_dhost, mac, ETH_ALEN );
+        s->has_mac = 1;
+    }
+
+    return s->has_mac;
+}
+
+static uint16_t ip_checksum( uint16_t *data, int len )
+{
+    uint32_t sum = 0;
+
+    for( int i = 0; i < len / 2; i++ )
+        sum += data[i];
+    while( sum >> 16 )
+        sum = ( sum & 0xffff ) + ( sum >> 16 );
+
+    return ~sum;
+}
+
+/* Builds each datagram into a free frame and flushes them with one system call.
+ * Returns the number queued, which is short if the ring is full, or -1 on error */
+int tx_ring_write( hnd_t handle, struct iovec *iov, int iov_per_msg, int num_msgs )
+{
+    obe_tx_ring_ctx *s = handle;
+    struct tpacket3_hdr *frame;
+    struct iphdr *ip;
+    struct udphdr *udp;
+    uint8_t *data;
+    uint32_t status;
+    int i, len, ret;
+
+    for( i = 0; i < num_msgs; i++ )
+    {
+        frame = (struct tpacket3_hdr *)&s->ring[s->frame_idx * TX_RING_FRAME_SIZE];
+        status = *(volatile uint32_t *)&frame->tp_status;
+        if( status & TP_STATUS_WRONG_FORMAT )
+            return -1;
+        if( status != TP_STATUS_AVAILABLE )
+            break;
+
+        data = (uint8_t *)frame + TX_RING_DATA_OFFSET;
+        memcpy( data, s->header, TX_RING_HEADER_SIZE );
+
+        len = 0;
+        for( int j = 0; j < iov_per_msg; j++ )
+        {
+            struct iovec *vec = &iov[i*iov_per_msg + j];
+            if( len + vec->iov_len > TX_RING_MAX_PAYLOAD )
+                return -1;
+            memcpy( &data[TX_RING_HEADER_SIZE + len], vec->iov_base, vec->iov_len );
+            len += vec->iov_len;
+        }
+
+        ip = (struct iphdr *)&data[sizeof(struct ether_header)];
+        ip->tot_len = htons( sizeof(*ip) + sizeof(*udp) + len );
+        ip->id = htons( s->ip_id++ );
+        ip->check = ip_checksum( (uint16_t *)ip, sizeof(*ip) );
+
+        udp = (struct udphdr *)&data[sizeof(struct ether_header) + sizeof(*ip)];
+        udp->len = htons( sizeof(*udp) + len );
+
+        frame->tp_len = TX_RING_HEADER_SIZE + len;
+        frame->tp_next_offset = 0;
+        __sync_synchronize();
+        frame->tp_status = TP_STATUS_SEND_REQUEST;
+
+        s->frame_idx = ( s->frame_idx + 1 ) % s->num_frames;
+    }
+
+    if( !i )
+        return 0;
+
+    do
+    {
+        ret = sendto( s->fd, NULL, 0, MSG_DONTWAIT, (struct sockaddr *)&s->addr, sizeof(s->addr) );
+    } while( ret < 0 && errno == EINTR );
+
+    /* Frames the kernel hasn't taken yet go with the next flush */
+    if( ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOBUFS )
+        return -1;
+
+    return i;
+}
+
+void tx_ring_close( hnd_t handle )
+{
+    obe_tx_ring_ctx *s = handle;
+
+    if( s->ring != MAP_FAILED )
+        munmap( s->ring, s->ring_size );
+    if( s->fd >= 0 )
+        close( s->fd );
+    free( s );
+}
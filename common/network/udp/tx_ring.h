@@ -0,0 +1,34 @@
+/*****************************************************************************
+ * tx_ring.h : AF_PACKET transmit ring headers
+ *****************************************************************************
+ * Copyright (C) 2010 Open Broadcast Systems Ltd.
+ *
+ * Authors: Kieran Kunhya <kieran@kunhya.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+#ifndef OBE_COMMON_TX_RING_H
+#define OBE_COMMON_TX_RING_H
+
+#include <sys/uio.h>
+
+int tx_ring_open( hnd_t *p_handle, struct sockaddr_storage *dest_addr, int local_port, int ttl, int miface, char *iface );
+int tx_ring_ready( hnd_t handle );
+int tx_ring_write( hnd_t handle, struct iovec *iov, int iov_per_msg, int num_msgs );
+void tx_ring_close( hnd_t handle );
+
+#endif /* OBE_COMMON_TX_RING_H */
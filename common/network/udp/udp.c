@@ -22,10 +22,20 @@
  *
  *****************************************************************************/
 
+#define _GNU_SOURCE
+
 #include "common/common.h"
 #include "common/network/network.h"
 #include "output/output.h"
 #include "udp.h"
+#include "tx_ring.h"
+
+#include <netinet/udp.h>
+#include <fcntl.h>
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
 
 typedef struct
 {
@@ -33,6 +43,7 @@ typedef struct
     int port;
     int ttl;
     int miface;
+    char iface[IFNAMSIZ];
     int buffer_size;
     int reuse_socket;
     int is_connected;
@@ -42,6 +53,12 @@ typedef struct
     int local_port;
     struct sockaddr_storage dest_addr;
     int dest_addr_len;
+
+    /* Datagram size when using UDP segmentation offload, 0 if not */
+    int gso_size;
+
+    /* AF_PACKET transmit ring, NULL if datagrams go through the socket */
+    hnd_t tx_ring;
 } obe_udp_ctx;
 
 static int udp_set_multicast_opts( int sockfd, obe_udp_ctx *s )
@@ -193,6 +210,12 @@ static int udp_port( struct sockaddr_storage *addr, int addr_len )
  *         'localport=n' : set the local port
  *         'pkt_size=n'  : set max packet size
  *         'reuse=1'     : enable reusing the socket
+ *         'gso=1'       : send with UDP segmentation offload where supported
+ *         'txring=1'    : build IPv4 frames in an AF_PACKET transmit ring (needs CAP_NET_RAW, not for local addresses)
+ *         'iface=name'  : bind to a network interface
+ *         'fec=LxD'     : send SMPTE 2022-1 FEC with L columns and D rows (RTP only)
+ *         'path2=host:port' : send a SMPTE 2022-7 copy of the stream to a second destination (RTP only)
+ *         'miface2=name', 'iface2=name' : multicast and bound interfaces of the second path
  *
  * @param h media file context
  * @param uri of the remote server
@@ -238,6 +261,31 @@ void udp_populate_opts( obe_udp_opts_t *udp_opts, char *uri )
 
         if( av_find_info_tag( buf, sizeof(buf), "miface", p ) )
             udp_opts->miface = if_nametoindex( buf );
+
+        if( av_find_info_tag( buf, sizeof(buf), "gso", p ) )
+            udp_opts->gso = strtol( buf, NULL, 10 );
+
+        if( av_find_info_tag( buf, sizeof(buf), "txring", p ) )
+            udp_opts->tx_ring = strtol( buf, NULL, 10 );
+
+        if( av_find_info_tag( buf, sizeof(buf), "iface", p ) )
+            av_strlcpy( udp_opts->iface, buf, sizeof(udp_opts->iface) );
+
+        if( av_find_info_tag( buf, sizeof(buf), "fec", p ) )
+            sscanf( buf, "%dx%d", &udp_opts->fec_columns, &udp_opts->fec_rows );
+
+        if( av_find_info_tag( buf, sizeof(buf), "path2", p ) )
+        {
+            char url[300];
+            snprintf( url, sizeof(url), "udp://%s", buf );
+            av_url_split( NULL, 0, NULL, 0, udp_opts->path2_hostname, sizeof(udp_opts->path2_hostname), &udp_opts->path2_port, NULL, 0, url );
+        }
+
+        if( av_find_info_tag( buf, sizeof(buf), "miface2", p ) )
+            udp_opts->path2_miface = if_nametoindex( buf );
+
+        if( av_find_info_tag( buf, sizeof(buf), "iface2", p ) )
+            av_strlcpy( udp_opts->path2_iface, buf, sizeof(udp_opts->path2_iface) );
     }
 
     /* fill the dest addr */
@@ -262,6 +310,7 @@ int udp_open( hnd_t *p_handle, obe_udp_opts_t *udp_opts )
     s->ttl = udp_opts->ttl;
     s->buffer_size = udp_opts->buffer_size;
     s->miface = udp_opts->miface;
+    av_strlcpy( s->iface, udp_opts->iface, sizeof(s->iface) );
 
     if( udp_set_remote_url( s ) < 0 )
         goto fail;
@@ -270,6 +319,12 @@ int udp_open( hnd_t *p_handle, obe_udp_opts_t *udp_opts )
     if( udp_fd < 0 )
         goto fail;
 
+    if( s->iface[0] && setsockopt( udp_fd, SOL_SOCKET, SO_BINDTODEVICE, s->iface, strlen( s->iface ) + 1 ) < 0 )
+    {
+        fprintf( stderr, "[udp] Could not bind to interface %s\n", s->iface );
+        goto fail;
+    }
+
     if( s->reuse_socket || s->is_multicast )
     {
         s->reuse_socket = 1;
@@ -291,13 +346,48 @@ int udp_open( hnd_t *p_handle, obe_udp_opts_t *udp_opts )
         goto fail;
 
     /* limit the tx buf size to limit latency */
-    tmp = s->buffer_size;
-    if( setsockopt( udp_fd, SOL_SOCKET, SO_SNDBUF, &tmp, sizeof(tmp) ) < 0 )
+    if( !udp_opts->nonblocking )
+    {
+        tmp = s->buffer_size;
+        if( setsockopt( udp_fd, SOL_SOCKET, SO_SNDBUF, &tmp, sizeof(tmp) ) < 0 )
+            goto fail;
+    }
+    else
+    {
+        /* A non-blocking socket drops what doesn't fit, so only a given buffer_size makes it smaller.
+         * SO_SNDBUFFORCE goes past net.core.wmem_max but needs CAP_NET_ADMIN */
+        int size = s->buffer_size ? s->buffer_size : UDP_NONBLOCKING_BUFFER_SIZE;
+        socklen_t optlen = sizeof(tmp);
+
+        tmp = size;
+        if( setsockopt( udp_fd, SOL_SOCKET, SO_SNDBUFFORCE, &tmp, sizeof(tmp) ) < 0 &&
+            setsockopt( udp_fd, SOL_SOCKET, SO_SNDBUF, &tmp, sizeof(tmp) ) < 0 )
+            goto fail;
+
+        /* The kernel doubles the value it reports */
+        if( !getsockopt( udp_fd, SOL_SOCKET, SO_SNDBUF, &tmp, &optlen ) && tmp / 2 < size )
+            fprintf( stderr, "[udp] Send buffer limited to %i bytes, raise net.core.wmem_max\n", tmp / 2 );
+    }
+
+    if( udp_opts->gso && udp_opts->gso_size )
+    {
+        s->gso_size = udp_opts->gso_size;
+        if( setsockopt( udp_fd, IPPROTO_UDP, UDP_SEGMENT, &s->gso_size, sizeof(s->gso_size) ) < 0 )
+        {
+            fprintf( stderr, "[udp] UDP segmentation offload not supported, using sendmmsg\n" );
+            s->gso_size = 0;
+        }
+    }
+
+    if( udp_opts->nonblocking && fcntl( udp_fd, F_SETFL, fcntl( udp_fd, F_GETFL ) | O_NONBLOCK ) < 0 )
         goto fail;
 
     if( s->is_connected && connect( udp_fd, (struct sockaddr *)&s->dest_addr, s->dest_addr_len ) )
         goto fail;
 
+    if( udp_opts->tx_ring && tx_ring_open( &s->tx_ring, &s->dest_addr, s->local_port, s->ttl, s->miface, s->iface ) < 0 )
+        fprintf( stderr, "[udp] Transmit ring not available, using sockets\n" );
+
     s->udp_fd = udp_fd;
     *p_handle = s;
     return 0;
@@ -329,10 +419,113 @@ int udp_write( hnd_t handle, uint8_t *buf, int size )
     return size;
 }
 
+/* Hands the kernel as many datagrams as fit in one buffer per system call. Returns the number sent */
+static int udp_write_gso( obe_udp_ctx *s, struct iovec *iov, int iov_per_msg, int num_msgs )
+{
+    struct msghdr msg = {0};
+    int max_msgs = UDP_GSO_MAX_SIZE / s->gso_size;
+    int sent = 0, num;
+
+    if( !s->is_connected )
+    {
+        msg.msg_name = &s->dest_addr;
+        msg.msg_namelen = s->dest_addr_len;
+    }
+
+    while( sent < num_msgs )
+    {
+        num = MIN( num_msgs - sent, max_msgs );
+        msg.msg_iov = &iov[sent*iov_per_msg];
+        msg.msg_iovlen = num * iov_per_msg;
+
+        if( sendmsg( s->udp_fd, &msg, 0 ) < 0 )
+        {
+            if( errno == EINTR )
+                continue;
+            break;
+        }
+        sent += num;
+    }
+
+    return sent;
+}
+
+/* Sends num_msgs datagrams of iov_per_msg iovecs each in as few system calls as possible.
+ * With segmentation offload every datagram must be gso_size bytes. Returns the number sent,
+ * which is short if a non-blocking socket's buffer filled up */
+int udp_write_batch( hnd_t handle, struct iovec *iov, int iov_per_msg, int num_msgs )
+{
+    obe_udp_ctx *s = handle;
+    struct mmsghdr msgs[UDP_MAX_BATCH];
+    int sent = 0, ret;
+
+    num_msgs = MIN( num_msgs, UDP_MAX_BATCH );
+
+    if( s->tx_ring && tx_ring_ready( s->tx_ring ) )
+    {
+        sent = tx_ring_write( s->tx_ring, iov, iov_per_msg, num_msgs );
+        if( sent >= 0 )
+            return sent;
+
+        syslog( LOG_WARNING, "[udp] Transmit ring failed, using sockets\n" );
+        tx_ring_close( s->tx_ring );
+        s->tx_ring = NULL;
+        sent = 0;
+    }
+
+    if( s->gso_size )
+    {
+        sent = udp_write_gso( s, iov, iov_per_msg, num_msgs );
+        if( sent == num_msgs || errno == EAGAIN || errno == EWOULDBLOCK )
+            return sent;
+
+        /* Some devices can't segment or checksum so fall back for good */
+        if( errno != EIO && errno != EINVAL && errno != ENOPROTOOPT )
+        {
+            syslog( LOG_WARNING, "UDP packets failed to send \n" );
+            return -1;
+        }
+        syslog( LOG_WARNING, "[udp] UDP segmentation offload failed, using sendmmsg\n" );
+        s->gso_size = 0;
+    }
+
+    memset( msgs, 0, num_msgs * sizeof(*msgs) );
+
+    for( int i = sent; i < num_msgs; i++ )
+    {
+        if( !s->is_connected )
+        {
+            msgs[i].msg_hdr.msg_name = &s->dest_addr;
+            msgs[i].msg_hdr.msg_namelen = s->dest_addr_len;
+        }
+        msgs[i].msg_hdr.msg_iov = &iov[i*iov_per_msg];
+        msgs[i].msg_hdr.msg_iovlen = iov_per_msg;
+    }
+
+    while( sent < num_msgs )
+    {
+        ret = sendmmsg( s->udp_fd, &msgs[sent], num_msgs - sent, 0 );
+        if( ret < 0 )
+        {
+            if( errno == EINTR )
+                continue;
+            if( errno == EAGAIN || errno == EWOULDBLOCK )
+                break;
+            syslog( LOG_WARNING, "UDP packets failed to send \n" );
+            return -1;
+        }
+        sent += ret;
+    }
+
+    return sent;
+}
+
 void udp_close( hnd_t handle )
 {
     obe_udp_ctx *s = handle;
 
+    if( s->tx_ring )
+        tx_ring_close( s->tx_ring );
     close( s->udp_fd );
     free( s );
 }
@@ -24,6 +24,19 @@
 #ifndef OBE_COMMON_UDP_H
 #define OBE_COMMON_UDP_H
 
+#include <sys/uio.h>
+#include <net/if.h>
+
+/* Most datagrams sent by one call to udp_write_batch */
+#define UDP_MAX_BATCH 64
+
+/* Largest buffer handed to the kernel for UDP segmentation offload */
+#define UDP_GSO_MAX_SIZE 65000
+
+/* Send buffer of a non-blocking socket without a buffer_size. A full buffer drops datagrams instead of
+ * waiting so it holds several batches, allowing for the kernel's per-datagram overhead */
+#define UDP_NONBLOCKING_BUFFER_SIZE ( 4 * UDP_MAX_BATCH * 2048 )
+
 typedef struct obe_udp_opts_t
 {
     char hostname[1024];
@@ -33,11 +46,27 @@ typedef struct obe_udp_opts_t
     int  ttl;
     int  buffer_size;
     int  miface;
+    char iface[IFNAMSIZ];
+    int  gso;
+    int  gso_size;
+    int  nonblocking;
+    int  tx_ring;
+
+    /* SMPTE 2022-1 FEC matrix for RTP outputs, columns (L) by rows (D). 0 disables FEC */
+    int  fec_columns;
+    int  fec_rows;
+
+    /* SMPTE 2022-7 second path for RTP outputs. An empty hostname disables it */
+    char path2_hostname[1024];
+    int  path2_port;
+    int  path2_miface;
+    char path2_iface[IFNAMSIZ];
 } obe_udp_opts_t;
 
 void udp_populate_opts( obe_udp_opts_t *udp_opts, char *uri );
 int udp_open( hnd_t *p_handle, obe_udp_opts_t *udp_opts );
 int udp_write( hnd_t p_handle, uint8_t *buf, int size );
+int udp_write_batch( hnd_t p_handle, struct iovec *iov, int iov_per_msg, int num_msgs );
 void udp_close( hnd_t handle );
 
 #endif /* OBE_COMMON_UDP_H */
@@ -0,0 +1,149 @@
+/*****************************************************************************
+ * ring.c: TS datagram ring
+ *****************************************************************************
+ * Copyright (C) 2010 Open Broadcast Systems Ltd.
+ *
+ * Authors: Kieran Kunhya <kieran@kunhya.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+#include "common/common.h"
+#include "common/ring.h"
+
+int obe_ts_ring_init( obe_ts_ring_t *ring, int num_slots, int num_readers )
+{
+    int size = 1;
+
+    memset( ring, 0, sizeof(*ring) );
+
+    while( size < num_slots )
+        size <<= 1;
+
+    if( posix_memalign( (void**)&ring->slots, 64, size * sizeof(*ring->slots) ) )
+    {
+        ring->slots = NULL;
+        return -1;
+    }
+
+    ring->read_pos = calloc( MAX( num_readers, 1 ), sizeof(*ring->read_pos) );
+    if( !ring->read_pos )
+    {
+        free( ring->slots );
+        ring->slots = NULL;
+        return -1;
+    }
+
+    ring->num_slots = size;
+    ring->num_readers = num_readers;
+
+    pthread_mutex_init( &ring->mutex, NULL );
+    pthread_cond_init( &ring->write_cv, NULL );
+    pthread_cond_init( &ring->publish_cv, NULL );
+    pthread_cond_init( &ring->read_cv, NULL );
+
+    return 0;
+}
+
+void obe_ts_ring_destroy( obe_ts_ring_t *ring )
+{
+    if( !ring->slots )
+        return;
+
+    pthread_mutex_destroy( &ring->mutex );
+    pthread_cond_destroy( &ring->write_cv );
+    pthread_cond_destroy( &ring->publish_cv );
+    pthread_cond_destroy( &ring->read_cv );
+    free( ring->read_pos );
+    free( ring->slots );
+    ring->slots = NULL;
+}
+
+void obe_ts_ring_wake( obe_ts_ring_t *ring )
+{
+    if( !ring->slots )
+        return;
+
+    pthread_mutex_lock( &ring->mutex );
+    pthread_cond_broadcast( &ring->write_cv );
+    pthread_cond_broadcast( &ring->publish_cv );
+    pthread_cond_broadcast( &ring->read_cv );
+    pthread_mutex_unlock( &ring->mutex );
+}
+
+/* Oldest slot still in use. The caller holds the mutex */
+static int64_t get_oldest_pos( obe_ts_ring_t *ring )
+{
+    int64_t oldest = ring->publish_pos;
+
+    for( int i = 0; i < ring->num_readers; i++ )
+        oldest = MIN( oldest, ring->read_pos[i] );
+
+    return oldest;
+}
+
+int obe_ts_ring_write( obe_ts_ring_t *ring, uint8_t *data, int len, int64_t *pcr_list, volatile int *cancel )
+{
+    int num_packets = len / 188;
+    int64_t end_pos = ring->fill_pos + ( ring->fill_packets + num_packets + TS_PACKETS_PER_DATAGRAM - 1 ) / TS_PACKETS_PER_DATAGRAM;
+
+    pthread_mutex_lock( &ring->mutex );
+    while( end_pos - get_oldest_pos( ring ) > ring->num_slots && !*cancel )
+        pthread_cond_wait( &ring->read_cv, &ring->mutex );
+    pthread_mutex_unlock( &ring->mutex );
+
+    if( *cancel )
+        return -1;
+
+    for( int i = 0; i < num_packets; i++ )
+    {
+        obe_ts_datagram_t *slot = get_ts_slot( ring, ring->fill_pos );
+
+        if( !ring->fill_packets )
+            slot->pcr = pcr_list[i];
+
+        memcpy( &slot->data[ring->fill_packets * 188], &data[i * 188], 188 );
+
+        if( ++ring->fill_packets == TS_PACKETS_PER_DATAGRAM )
+        {
+            ring->fill_packets = 0;
+            ring->fill_pos++;
+        }
+    }
+
+    pthread_mutex_lock( &ring->mutex );
+    ring->write_pos = ring->fill_pos;
+    pthread_cond_broadcast( &ring->write_cv );
+    pthread_mutex_unlock( &ring->mutex );
+
+    return 0;
+}
+
+void obe_ts_ring_publish( obe_ts_ring_t *ring, int64_t pos )
+{
+    pthread_mutex_lock( &ring->mutex );
+    ring->publish_pos = pos;
+    pthread_cond_broadcast( &ring->publish_cv );
+    pthread_mutex_unlock( &ring->mutex );
+}
+
+void obe_ts_ring_detach( obe_ts_ring_t *ring, int reader )
+{
+    pthread_mutex_lock( &ring->mutex );
+    ring->read_pos[reader] = INT64_MAX;
+    pthread_cond_broadcast( &ring->read_cv );
+    pthread_mutex_unlock( &ring->mutex );
+}
@@ -0,0 +1,86 @@
+/*****************************************************************************
+ * ring.h: TS datagram ring headers
+ *****************************************************************************
+ * Copyright (C) 2010 Open Broadcast Systems Ltd.
+ *
+ * Authors: Kieran Kunhya <kieran@kunhya.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+#ifndef OBE_COMMON_RING_H
+#define OBE_COMMON_RING_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#define TS_PACKETS_SIZE 1316
+#define TS_PACKETS_PER_DATAGRAM (TS_PACKETS_SIZE / 188)
+
+/* Datagram of TS packets sent to the outputs */
+typedef struct
+{
+    int64_t pcr; /* PCR of the first packet */
+    uint8_t data[TS_PACKETS_SIZE];
+} __attribute__((aligned(64))) obe_ts_datagram_t;
+
+/* Fixed ring of datagram slots shared by the TS mux, mux smoothing and the outputs.
+ * Positions only increase and position n is in slots[n & (num_slots-1)].
+ *
+ * [publish_pos, write_pos) - muxed, waiting for mux smoothing to send them out on time
+ * [read_pos[i], publish_pos) - waiting to be sent by output i. Unpaced file outputs read up to write_pos
+ *
+ * The mux only writes slots which every output has finished with, so nothing is copied or
+ * reference counted after the mux writes the packets. */
+typedef struct
+{
+    obe_ts_datagram_t *slots;
+    int num_slots;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t write_cv;    /* write_pos changed */
+    pthread_cond_t publish_cv;  /* publish_pos changed */
+    pthread_cond_t read_cv;     /* a read position changed */
+
+    int64_t write_pos;
+    int64_t publish_pos;
+    int num_readers;
+    int64_t *read_pos;
+
+    /* Only used by the mux */
+    int64_t fill_pos;
+    int fill_packets;
+} obe_ts_ring_t;
+
+static inline obe_ts_datagram_t *get_ts_slot( obe_ts_ring_t *ring, int64_t pos )
+{
+    return &ring->slots[pos & (ring->num_slots-1)];
+}
+
+/* num_slots is rounded up to a power of two */
+int obe_ts_ring_init( obe_ts_ring_t *ring, int num_slots, int num_readers );
+void obe_ts_ring_destroy( obe_ts_ring_t *ring );
+/* Wakes all waiting threads so that they check their cancel flags */
+void obe_ts_ring_wake( obe_ts_ring_t *ring );
+
+/* Called by the mux. Blocks while the outputs are too far behind. Returns -1 if *cancel was set */
+int obe_ts_ring_write( obe_ts_ring_t *ring, uint8_t *data, int len, int64_t *pcr_list, volatile int *cancel );
+/* Called by mux smoothing once a slot is due to be sent */
+void obe_ts_ring_publish( obe_ts_ring_t *ring, int64_t pos );
+/* Called by an output which stops reading, including one which failed to start, so that it never holds up the mux */
+void obe_ts_ring_detach( obe_ts_ring_t *ring, int reader );
+
+#endif
@@ -0,0 +1,237 @@
+/*****************************************************************************
+ * tasks.c: work-stealing task pool
+ *****************************************************************************
+ * Copyright (C) 2010 Open Broadcast Systems Ltd.
+ *
+ * Authors: Kieran Kunhya <kieran@kunhya.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+#include "common/common.h"
+#include "common/tasks.h"
+
+/* Tasks scheduled from a worker go on its own deque so they run on the same core */
+static __thread obe_task_worker_t *current_worker;
+
+static void push_task( obe_task_worker_t *worker, obe_task_t *task )
+{
+    pthread_mutex_lock( &worker->mutex );
+    worker->deque[worker->tail] = task;
+    worker->tail = (worker->tail + 1) % worker->size;
+    pthread_mutex_unlock( &worker->mutex );
+}
+
+static obe_task_t *pop_task( obe_task_worker_t *worker )
+{
+    obe_task_t *task = NULL;
+
+    pthread_mutex_lock( &worker->mutex );
+    if( worker->head != worker->tail )
+    {
+        worker->tail = (worker->tail + worker->size - 1) % worker->size;
+        task = worker->deque[worker->tail];
+    }
+    pthread_mutex_unlock( &worker->mutex );
+
+    return task;
+}
+
+static obe_task_t *steal_task( obe_task_worker_t *worker )
+{
+    obe_task_t *task = NULL;
+
+    pthread_mutex_lock( &worker->mutex );
+    if( worker->head != worker->tail )
+    {
+        task = worker->deque[worker->head];
+        worker->head = (worker->head + 1) % worker->size;
+    }
+    pthread_mutex_unlock( &worker->mutex );
+
+    return task;
+}
+
+static void run_task( obe_task_t *task )
+{
+    task->state = OBE_TASK_RUNNING;
+
+    while( 1 )
+    {
+        task->run( task );
+
+        if( __sync_bool_compare_and_swap( &task->state, OBE_TASK_RUNNING, OBE_TASK_IDLE ) )
+            break;
+
+        /* Rescheduled while running */
+        task->state = OBE_TASK_RUNNING;
+    }
+}
+
+static void *start_worker( void *ptr )
+{
+    obe_task_worker_t *worker = ptr;
+    obe_task_pool_t *pool = worker->pool;
+    obe_task_t *task;
+    int idx = worker - pool->workers;
+
+    current_worker = worker;
+
+    while( 1 )
+    {
+        pthread_mutex_lock( &pool->mutex );
+
+        while( !pool->num_queued && !pool->cancel )
+            pthread_cond_wait( &pool->cv, &pool->mutex );
+
+        if( pool->cancel )
+        {
+            pthread_mutex_unlock( &pool->mutex );
+            break;
+        }
+
+        pthread_mutex_unlock( &pool->mutex );
+
+        task = pop_task( worker );
+        for( int i = 1; i < pool->num_workers && !task; i++ )
+            task = steal_task( &pool->workers[(idx + i) % pool->num_workers] );
+
+        /* Another worker got there first */
+        if( !task )
+            continue;
+
+        pthread_mutex_lock( &pool->mutex );
+        pool->num_queued--;
+        pthread_mutex_unlock( &pool->mutex );
+
+        run_task( task );
+    }
+
+    return NULL;
+}
+
+obe_task_pool_t *obe_task_pool_create( int num_workers, int max_tasks )
+{
+    obe_task_pool_t *pool = calloc( 1, sizeof(*pool) );
+    if( !pool )
+        return NULL;
+
+    pthread_mutex_init( &pool->mutex, NULL );
+    pthread_cond_init( &pool->cv, NULL );
+
+    pool->workers = calloc( num_workers, sizeof(*pool->workers) );
+    if( !pool->workers )
+        goto fail;
+
+    for( int i = 0; i < num_workers; i++ )
+    {
+        obe_task_worker_t *worker = &pool->workers[i];
+
+        worker->pool = pool;
+        pthread_mutex_init( &worker->mutex, NULL );
+        /* A task is only ever queued once so this can never overflow */
+        worker->size = max_tasks + 1;
+        worker->deque = calloc( worker->size, sizeof(*worker->deque) );
+        if( !worker->deque )
+            goto fail;
+
+        if( pthread_create( &worker->thread, NULL, start_worker, worker ) < 0 )
+        {
+            free( worker->deque );
+            goto fail;
+        }
+
+        pool->num_workers++;
+    }
+
+    return pool;
+
+fail:
+    fprintf( stderr, "Could not create task pool\n" );
+    obe_task_pool_destroy( pool );
+    return NULL;
+}
+
+void obe_task_init( obe_task_pool_t *pool, obe_task_t *task, void (*run)( obe_task_t *task ), void *opaque )
+{
+    task->pool = pool;
+    task->run = run;
+    task->opaque = opaque;
+    task->state = OBE_TASK_IDLE;
+}
+
+int obe_task_schedule( obe_task_t *task )
+{
+    obe_task_pool_t *pool = task->pool;
+    obe_task_worker_t *worker;
+
+    while( 1 )
+    {
+        int state = task->state;
+
+        if( state == OBE_TASK_IDLE )
+        {
+            if( __sync_bool_compare_and_swap( &task->state, OBE_TASK_IDLE, OBE_TASK_QUEUED ) )
+                break;
+        }
+        else if( state == OBE_TASK_RUNNING )
+        {
+            if( __sync_bool_compare_and_swap( &task->state, OBE_TASK_RUNNING, OBE_TASK_RERUN ) )
+                return 0;
+        }
+        else
+            return 0;
+    }
+
+    pthread_mutex_lock( &pool->mutex );
+    if( current_worker && current_worker->pool == pool )
+        worker = current_worker;
+    else
+    {
+        worker = &pool->workers[pool->next_worker];
+        pool->next_worker = (pool->next_worker + 1) % pool->num_workers;
+    }
+
+    push_task( worker, task );
+    pool->num_queued++;
+    pthread_cond_signal( &pool->cv );
+    pthread_mutex_unlock( &pool->mutex );
+
+    return 0;
+}
+
+void obe_task_pool_destroy( obe_task_pool_t *pool )
+{
+    if( !pool )
+        return;
+
+    pthread_mutex_lock( &pool->mutex );
+    pool->cancel = 1;
+    pthread_cond_broadcast( &pool->cv );
+    pthread_mutex_unlock( &pool->mutex );
+
+    for( int i = 0; i < pool->num_workers; i++ )
+    {
+        pthread_join( pool->workers[i].thread, NULL );
+        pthread_mutex_destroy( &pool->workers[i].mutex );
+        free( pool->workers[i].deque );
+    }
+
+    pthread_mutex_destroy( &pool->mutex );
+    pthread_cond_destroy( &pool->cv );
+    free( pool->workers );
+    free( pool );
+}
@@ -0,0 +1,82 @@
+/*****************************************************************************
+ * tasks.h: task pool headers
+ *****************************************************************************
+ * Copyright (C) 2010 Open Broadcast Systems Ltd.
+ *
+ * Authors: Kieran Kunhya <kieran@kunhya.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+#ifndef OBE_COMMON_TASKS_H
+#define OBE_COMMON_TASKS_H
+
+#include <pthread.h>
+
+/* A task is a pipeline stage which runs on a shared worker when its input queue has data.
+ * A task is never run by more than one worker at a time. If it is scheduled while running
+ * it is run again once it finishes. */
+enum obe_task_state_e
+{
+    OBE_TASK_IDLE,
+    OBE_TASK_QUEUED,
+    OBE_TASK_RUNNING,
+    OBE_TASK_RERUN,
+};
+
+struct obe_task_pool_t;
+
+typedef struct obe_task_t
+{
+    void (*run)( struct obe_task_t *task );
+    void *opaque;
+
+    struct obe_task_pool_t *pool;
+    volatile int state;
+} obe_task_t;
+
+typedef struct
+{
+    struct obe_task_pool_t *pool;
+    pthread_t thread;
+
+    /* The owner pops from the tail, thieves steal from the head */
+    pthread_mutex_t mutex;
+    obe_task_t **deque;
+    int head;
+    int tail;
+    int size;
+} obe_task_worker_t;
+
+typedef struct obe_task_pool_t
+{
+    int num_workers;
+    obe_task_worker_t *workers;
+    int next_worker;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t cv;
+    int num_queued;
+    int cancel;
+} obe_task_pool_t;
+
+obe_task_pool_t *obe_task_pool_create( int num_workers, int max_tasks );
+void obe_task_init( obe_task_pool_t *pool, obe_task_t *task, void (*run)( obe_task_t *task ), void *opaque );
+int obe_task_schedule( obe_task_t *task );
+/* Waits for running tasks to finish. Queued tasks are not run */
+void obe_task_pool_destroy( obe_task_pool_t *pool );
+
+#endif
@@ -26,11 +26,6 @@
 
 #include <libavutil/samplefmt.h>
 
-typedef struct
-{
-    void* (*start_encoder)( void *ptr );
-} obe_aud_enc_func_t;
-
 typedef struct
 {
     obe_t *h;
@@ -42,6 +37,16 @@ typedef struct
     int frames_per_pes;
 } obe_aud_enc_params_t;
 
+/* Audio encoders run as tasks on the shared task pool.
+ * open_encoder takes ownership of the parameters and returns the encoder context.
+ * encode_frame consumes the raw frame. */
+typedef struct
+{
+    void* (*open_encoder)( obe_aud_enc_params_t *enc_params );
+    int (*encode_frame)( void *ctx, obe_raw_frame_t *raw_frame );
+    void (*close_encoder)( void *ctx );
+} obe_aud_enc_func_t;
+
 extern const obe_aud_enc_func_t twolame_encoder;
 extern const obe_aud_enc_func_t lavc_encoder;
 
@@ -42,32 +42,75 @@ static const lavc_encoder_t lavc_encoders[] =
     { -1, -1 },
 };
 
-static void *start_encoder( void *ptr )
+typedef struct
+{
+    obe_aud_enc_params_t *enc_params;
+
+    int64_t cur_pts;
+    int64_t pts_increment;
+    int num_frames;
+    int total_size;
+
+    AVFifoBuffer *out_fifo;
+    AVAudioResampleContext *avr;
+    AVCodecContext *codec;
+    AVFrame *frame;
+    uint8_t *audio_planes[8];
+} lavc_ctx_t;
+
+static void close_encoder( void *ptr )
+{
+    lavc_ctx_t *ctx = ptr;
+
+    if( ctx->frame )
+       avcodec_free_frame( &ctx->frame );
+
+    if( ctx->audio_planes[0] )
+        av_free( ctx->audio_planes[0] );
+
+    if( ctx->out_fifo )
+        av_fifo_free( ctx->out_fifo );
+
+    if( ctx->avr )
+        avresample_free( &ctx->avr );
+
+    if( ctx->codec )
+    {
+        avcodec_close( ctx->codec );
+        av_free( ctx->codec );
+    }
+
+    free( ctx->enc_params );
+    free( ctx );
+}
+
+static void *open_encoder( obe_aud_enc_params_t *enc_params )
 {
-    obe_aud_enc_params_t *enc_params = ptr;
-    obe_t *h = enc_params->h;
     obe_encoder_t *encoder = enc_params->encoder;
     obe_output_stream_t *stream = enc_params->stream;
-    obe_raw_frame_t *raw_frame;
-    obe_coded_frame_t *coded_frame;
-    int64_t cur_pts = -1, pts_increment;
-    int i, frame_size, ret, got_pkt, num_frames = 0, total_size = 0;
-    AVFifoBuffer *out_fifo = NULL;
-    AVAudioResampleContext *avr = NULL;
-    AVPacket pkt;
-    AVCodecContext *codec = NULL;
-    AVFrame *frame = NULL;
+    lavc_ctx_t *ctx;
+    AVCodecContext *codec;
     AVDictionary *opts = NULL;
     char is_latm[2];
-    uint8_t *audio_planes[8] = { NULL };
+    int i, frame_size;
+
+    ctx = calloc( 1, sizeof(*ctx) );
+    if( !ctx )
+    {
+        fprintf( stderr, "Malloc failed\n" );
+        free( enc_params );
+        return NULL;
+    }
+    ctx->enc_params = enc_params;
+    ctx->cur_pts = -1;
 
     avcodec_register_all();
 
-    codec = avcodec_alloc_context3( NULL );
+    codec = ctx->codec = avcodec_alloc_context3( NULL );
     if( !codec )
     {
         fprintf( stderr, "Malloc failed\n" );
-        goto finish;
+        goto fail;
     }
 
     for( i = 0; lavc_encoders[i].obe_name != -1; i++ )
@@ -79,20 +122,20 @@ static void *start_encoder( void *ptr )
     if( lavc_encoders[i].obe_name == -1 )
     {
         fprintf( stderr, "[lavc] Could not find encoder1\n" );
-        goto finish;
+        goto fail;
     }
 
     AVCodec *enc = avcodec_find_encoder( lavc_encoders[i].lavc_name );
     if( !enc )
     {
         fprintf( stderr, "[lavc] Could not find encoder2\n" );
-        goto finish;
+        goto fail;
     }
 
     if( enc->sample_fmts[0] == -1 )
     {
         fprintf( stderr, "[lavc] No valid sample formats\n" );
-        goto finish;
+        goto fail;
     }
 
     codec->sample_rate = enc_params->sample_rate;
@@ -113,27 +156,34 @@ static void *start_encoder( void *ptr )
     if( avcodec_open2( codec, enc, &opts ) < 0 )
     {
         fprintf( stderr, "[lavc] Could not open encoder\n" );
-        goto finish;
+        goto fail;
     }
 
-    avr = avresample_alloc_context();
-    if( !avr )
+    /* The audio filter converts SDI samples straight to float, so libavresample only has to buffer.
+     * Anything else is left to libavresample because it needs dither */
+    encoder->input_sample_format = enc_params->input_sample_format;
+    if( enc_params->input_sample_format == AV_SAMPLE_FMT_S32P &&
+        ( codec->sample_fmt == AV_SAMPLE_FMT_FLTP || codec->sample_fmt == AV_SAMPLE_FMT_FLT ) )
+        encoder->input_sample_format = codec->sample_fmt;
+
+    ctx->avr = avresample_alloc_context();
+    if( !ctx->avr )
     {
         fprintf( stderr, "Malloc failed\n" );
-        goto finish;
+        goto fail;
     }
 
-    av_opt_set_int( avr, "in_channel_layout",   codec->channel_layout, 0 );
-    av_opt_set_int( avr, "in_sample_fmt",       enc_params->input_sample_format, 0 );
-    av_opt_set_int( avr, "in_sample_rate",      enc_params->sample_rate, 0 );
-    av_opt_set_int( avr, "out_channel_layout",  codec->channel_layout, 0 );
-    av_opt_set_int( avr, "out_sample_fmt",      codec->sample_fmt,     0 );
-    av_opt_set_int( avr, "dither_method",       AV_RESAMPLE_DITHER_TRIANGULAR_NS, 0 );
+    av_opt_set_int( ctx->avr, "in_channel_layout",   codec->channel_layout, 0 );
+    av_opt_set_int( ctx->avr, "in_sample_fmt",       encoder->input_sample_format, 0 );
+    av_opt_set_int( ctx->avr, "in_sample_rate",      enc_params->sample_rate, 0 );
+    av_opt_set_int( ctx->avr, "out_channel_layout",  codec->channel_layout, 0 );
+    av_opt_set_int( ctx->avr, "out_sample_fmt",      codec->sample_fmt,     0 );
+    av_opt_set_int( ctx->avr, "dither_method",       AV_RESAMPLE_DITHER_TRIANGULAR_NS, 0 );
 
-    if( avresample_open( avr ) < 0 )
+    if( avresample_open( ctx->avr ) < 0 )
     {
         fprintf( stderr, "Could not open AVResample\n" );
-        goto finish;
+        goto fail;
     }
 
     /* The number of samples per E-AC3 frame is unknown until the encoder is ready */
@@ -150,137 +200,118 @@ static void *start_encoder( void *ptr )
     frame_size = (double)codec->frame_size * 125 * stream->bitrate *
                  enc_params->frames_per_pes / enc_params->sample_rate;
     /* NB: libfdk-aac already doubles the frame size appropriately */
-    pts_increment = (double)codec->frame_size * OBE_CLOCK * enc_params->frames_per_pes / enc_params->sample_rate;
+    ctx->pts_increment = (double)codec->frame_size * OBE_CLOCK * enc_params->frames_per_pes / enc_params->sample_rate;
 
-    out_fifo = av_fifo_alloc( frame_size );
-    if( !out_fifo )
+    ctx->out_fifo = av_fifo_alloc( frame_size );
+    if( !ctx->out_fifo )
     {
         fprintf( stderr, "Malloc failed\n" );
-        goto finish;
+        goto fail;
     }
 
-    frame = avcodec_alloc_frame();
-    if( !frame )
+    ctx->frame = avcodec_alloc_frame();
+    if( !ctx->frame )
     {
         fprintf( stderr, "Could not allocate frame\n" );
-        goto finish;
+        goto fail;
     }
 
-    if( av_samples_alloc( audio_planes, NULL, codec->channels, codec->frame_size, codec->sample_fmt, 0 ) < 0 )
+    if( av_samples_alloc( ctx->audio_planes, NULL, codec->channels, codec->frame_size, codec->sample_fmt, 0 ) < 0 )
     {
         fprintf( stderr, "Could not allocate audio samples\n" );
-        goto finish;
+        goto fail;
     }
 
-    while( 1 )
-    {
-        /* TODO: detect bitrate or channel reconfig */
-        pthread_mutex_lock( &encoder->queue.mutex );
+    return ctx;
 
-        while( !encoder->queue.size && !encoder->cancel_thread )
-            pthread_cond_wait( &encoder->queue.in_cv, &encoder->queue.mutex );
+fail:
+    close_encoder( ctx );
+    return NULL;
+}
 
-        if( encoder->cancel_thread )
-        {
-            pthread_mutex_unlock( &encoder->queue.mutex );
-            goto finish;
-        }
+static int encode_frame( void *ptr, obe_raw_frame_t *raw_frame )
+{
+    lavc_ctx_t *ctx = ptr;
+    obe_aud_enc_params_t *enc_params = ctx->enc_params;
+    obe_t *h = enc_params->h;
+    obe_encoder_t *encoder = enc_params->encoder;
+    AVCodecContext *codec = ctx->codec;
+    obe_coded_frame_t *coded_frame;
+    AVPacket pkt;
+    int ret, got_pkt;
 
-        raw_frame = encoder->queue.queue[0];
-        pthread_mutex_unlock( &encoder->queue.mutex );
+    /* TODO: detect bitrate or channel reconfig */
+    if( ctx->cur_pts == -1 )
+        ctx->cur_pts = raw_frame->pts;
 
-        if( cur_pts == -1 )
-            cur_pts = raw_frame->pts;
+    ret = avresample_convert( ctx->avr, NULL, 0, raw_frame->audio_frame.num_samples, raw_frame->audio_frame.audio_data,
+                              raw_frame->audio_frame.linesize, raw_frame->audio_frame.num_samples );
 
-        if( avresample_convert( avr, NULL, 0, raw_frame->audio_frame.num_samples, raw_frame->audio_frame.audio_data,
-                                raw_frame->audio_frame.linesize, raw_frame->audio_frame.num_samples ) < 0 )
-        {
-            syslog( LOG_ERR, "[lavc] Sample format conversion failed\n" );
-            break;
-        }
+    raw_frame->release_data( raw_frame );
+    raw_frame->release_frame( raw_frame );
 
-        raw_frame->release_data( raw_frame );
-        raw_frame->release_frame( raw_frame );
-        remove_from_queue( &encoder->queue );
+    if( ret < 0 )
+    {
+        syslog( LOG_ERR, "[lavc] Sample format conversion failed\n" );
+        return -1;
+    }
 
-        while( avresample_available( avr ) >= codec->frame_size )
+    while( avresample_available( ctx->avr ) >= codec->frame_size )
+    {
+        got_pkt = 0;
+        avcodec_get_frame_defaults( ctx->frame );
+        ctx->frame->nb_samples = codec->frame_size;
+        memcpy( ctx->frame->data, ctx->audio_planes, sizeof(ctx->frame->data) );
+        avresample_read( ctx->avr, ctx->frame->data, codec->frame_size );
+
+        av_init_packet( &pkt );
+        pkt.data = NULL;
+        pkt.size = 0;
+
+        ret = avcodec_encode_audio2( codec, &pkt, ctx->frame, &got_pkt );
+        if( ret < 0 )
         {
-            got_pkt = 0;
-            avcodec_get_frame_defaults( frame );
-            frame->nb_samples = codec->frame_size;
-            memcpy( frame->data, audio_planes, sizeof(frame->data) );
-            avresample_read( avr, frame->data, codec->frame_size );
-
-            av_init_packet( &pkt );
-            pkt.data = NULL;
-            pkt.size = 0;
-
-            ret = avcodec_encode_audio2( codec, &pkt, frame, &got_pkt );
-            if( ret < 0 )
-            {
-                syslog( LOG_ERR, "[lavc] Audio encoding failed\n" );
-                goto finish;
-            }
+            syslog( LOG_ERR, "[lavc] Audio encoding failed\n" );
+            return -1;
+        }
 
-            if( !got_pkt )
-                continue;
+        if( !got_pkt )
+            continue;
 
-            total_size += pkt.size;
-            num_frames++;
+        ctx->total_size += pkt.size;
+        ctx->num_frames++;
 
-            if( av_fifo_realloc2( out_fifo, av_fifo_size( out_fifo ) + pkt.size ) < 0 )
-            {
-                syslog( LOG_ERR, "Malloc failed\n" );
-                break;
-            }
+        if( av_fifo_realloc2( ctx->out_fifo, av_fifo_size( ctx->out_fifo ) + pkt.size ) < 0 )
+        {
+            syslog( LOG_ERR, "Malloc failed\n" );
+            return -1;
+        }
 
-            av_fifo_generic_write( out_fifo, pkt.data, pkt.size, NULL );
-            obe_free_packet( &pkt );
+        av_fifo_generic_write( ctx->out_fifo, pkt.data, pkt.size, NULL );
+        obe_free_packet( &pkt );
 
-            if( num_frames == enc_params->frames_per_pes )
+        if( ctx->num_frames == enc_params->frames_per_pes )
+        {
+            coded_frame = new_coded_frame( encoder->output_stream_id, ctx->total_size );
+            if( !coded_frame )
             {
-                coded_frame = new_coded_frame( encoder->output_stream_id, total_size );
-                if( !coded_frame )
-                {
-                    syslog( LOG_ERR, "Malloc failed\n" );
-                    goto finish;
-                }
-
-                av_fifo_generic_read( out_fifo, coded_frame->data, total_size, NULL );
-
-                coded_frame->pts = cur_pts;
-                coded_frame->random_access = 1; /* Every frame output is a random access point */
-                add_to_queue( &h->mux_queue, coded_frame );
-
-                /* We need to generate PTS because frame sizes have changed */
-                cur_pts += pts_increment;
-                total_size = num_frames = 0;
+                syslog( LOG_ERR, "Malloc failed\n" );
+                return -1;
             }
-        }
-    }
-
-finish:
-    if( frame )
-       avcodec_free_frame( &frame );
 
-    if( audio_planes[0] )
-        av_free( audio_planes[0] );
+            av_fifo_generic_read( ctx->out_fifo, coded_frame->data, ctx->total_size, NULL );
 
-    if( out_fifo )
-        av_fifo_free( out_fifo );
+            coded_frame->pts = ctx->cur_pts;
+            coded_frame->random_access = 1; /* Every frame output is a random access point */
+            add_to_queue( &h->mux_queue, coded_frame );
 
-    if( avr )
-        avresample_free( &avr );
-
-    if( codec )
-    {
-        avcodec_close( codec );
-        av_free( codec );
+            /* We need to generate PTS because frame sizes have changed */
+            ctx->cur_pts += ctx->pts_increment;
+            ctx->total_size = ctx->num_frames = 0;
+        }
     }
 
-    free( enc_params );
-
-    return NULL;
+    return 0;
 }
 
-const obe_aud_enc_func_t lavc_encoder = { start_encoder };
+const obe_aud_enc_func_t lavc_encoder = { open_encoder, encode_frame, close_encoder };
@@ -30,32 +30,63 @@
 
 #define MP2_AUDIO_BUFFER_SIZE 50000
 
-static void *start_encoder( void *ptr )
+typedef struct
+{
+    obe_aud_enc_params_t *enc_params;
+
+    twolame_options *tl_opts;
+    int frame_size;
+    int64_t cur_pts;
+    uint8_t *output_buf;
+    AVAudioResampleContext *avr;
+    AVFifoBuffer *fifo;
+} twolame_ctx_t;
+
+static void close_encoder( void *ptr )
+{
+    twolame_ctx_t *ctx = ptr;
+
+    if( ctx->output_buf )
+        free( ctx->output_buf );
+
+    if( ctx->avr )
+        avresample_free( &ctx->avr );
+
+    if( ctx->fifo )
+        av_fifo_free( ctx->fifo );
+
+    if( ctx->tl_opts )
+        twolame_close( &ctx->tl_opts );
+    free( ctx->enc_params );
+    free( ctx );
+}
+
+static void *open_encoder( obe_aud_enc_params_t *enc_params )
 {
-    obe_aud_enc_params_t *enc_params = ptr;
-    obe_t *h = enc_params->h;
     obe_encoder_t *encoder = enc_params->encoder;
     obe_output_stream_t *stream = enc_params->stream;
-    obe_raw_frame_t *raw_frame;
-    obe_coded_frame_t *coded_frame;
+    twolame_ctx_t *ctx;
+    twolame_options *tl_opts;
 
-    twolame_options *tl_opts = NULL;
-    int output_size, frame_size, linesize; /* Linesize in libavresample terminology is the entire buffer size for packed formats */
-    int64_t cur_pts = -1;
-    float *audio_buf = NULL;
-    uint8_t *output_buf = NULL;
-    AVAudioResampleContext *avr = NULL;
-    AVFifoBuffer *fifo = NULL;
+    ctx = calloc( 1, sizeof(*ctx) );
+    if( !ctx )
+    {
+        fprintf( stderr, "Malloc failed\n" );
+        free( enc_params );
+        return NULL;
+    }
+    ctx->enc_params = enc_params;
+    ctx->cur_pts = -1;
 
     /* Lock the mutex until we verify parameters */
     pthread_mutex_lock( &encoder->queue.mutex );
 
-    tl_opts = twolame_init();
+    tl_opts = ctx->tl_opts = twolame_init();
     if( !tl_opts )
     {
         fprintf( stderr, "[twolame] could not load options" );
         pthread_mutex_unlock( &encoder->queue.mutex );
-        goto end;
+        goto fail;
     }
 
     /* TODO: setup bitrate reconfig, errors */
@@ -71,143 +102,134 @@ static void *start_encoder( void *ptr )
 
     twolame_init_params( tl_opts );
 
-    frame_size = twolame_get_framelength( tl_opts ) * enc_params->frames_per_pes;
+    ctx->frame_size = twolame_get_framelength( tl_opts ) * enc_params->frames_per_pes;
 
     encoder->is_ready = 1;
     /* Broadcast because input and muxer can be stuck waiting for encoder */
     pthread_cond_broadcast( &encoder->queue.in_cv );
     pthread_mutex_unlock( &encoder->queue.mutex );
 
-    output_buf = malloc( MP2_AUDIO_BUFFER_SIZE );
-    if( !output_buf )
+    ctx->output_buf = malloc( MP2_AUDIO_BUFFER_SIZE );
+    if( !ctx->output_buf )
     {
         fprintf( stderr, "Malloc failed\n" );
-        goto end;
+        goto fail;
     }
 
-    avr = avresample_alloc_context();
-    if( !avr )
+    /* The audio filter converts SDI samples straight to float */
+    encoder->input_sample_format = enc_params->input_sample_format == AV_SAMPLE_FMT_S32P ? AV_SAMPLE_FMT_FLT :
+                                   enc_params->input_sample_format;
+
+    ctx->avr = avresample_alloc_context();
+    if( !ctx->avr )
     {
         fprintf( stderr, "Malloc failed\n" );
-        goto end;
+        goto fail;
     }
 
-    av_opt_set_int( avr, "in_channel_layout",   stream->channel_layout,  0 );
-    av_opt_set_int( avr, "in_sample_fmt",       enc_params->input_sample_format, 0 );
-    av_opt_set_int( avr, "in_sample_rate",      enc_params->sample_rate, 0 );
-    av_opt_set_int( avr, "out_channel_layout",  stream->channel_layout, 0 );
-    av_opt_set_int( avr, "out_sample_fmt",      AV_SAMPLE_FMT_FLT,   0 );
-    av_opt_set_int( avr, "dither_method",       AV_RESAMPLE_DITHER_TRIANGULAR_NS, 0 );
+    av_opt_set_int( ctx->avr, "in_channel_layout",   stream->channel_layout,  0 );
+    av_opt_set_int( ctx->avr, "in_sample_fmt",       encoder->input_sample_format, 0 );
+    av_opt_set_int( ctx->avr, "in_sample_rate",      enc_params->sample_rate, 0 );
+    av_opt_set_int( ctx->avr, "out_channel_layout",  stream->channel_layout, 0 );
+    av_opt_set_int( ctx->avr, "out_sample_fmt",      AV_SAMPLE_FMT_FLT,   0 );
+    av_opt_set_int( ctx->avr, "dither_method",       AV_RESAMPLE_DITHER_TRIANGULAR_NS, 0 );
 
-    if( avresample_open( avr ) < 0 )
+    if( avresample_open( ctx->avr ) < 0 )
     {
         fprintf( stderr, "Could not open AVResample\n" );
-        goto end;
+        goto fail;
     }
 
     /* Setup the output FIFO */
-    fifo = av_fifo_alloc( frame_size );
-    if( !fifo )
+    ctx->fifo = av_fifo_alloc( ctx->frame_size );
+    if( !ctx->fifo )
     {
         fprintf( stderr, "Malloc failed\n" );
-        goto end;
+        goto fail;
     }
 
-    while( 1 )
-    {
-        pthread_mutex_lock( &encoder->queue.mutex );
-
-        while( !encoder->queue.size && !encoder->cancel_thread )
-            pthread_cond_wait( &encoder->queue.in_cv, &encoder->queue.mutex );
+    return ctx;
 
-        if( encoder->cancel_thread )
-        {
-            pthread_mutex_unlock( &encoder->queue.mutex );
-            break;
-        }
+fail:
+    close_encoder( ctx );
+    return NULL;
+}
 
-        raw_frame = encoder->queue.queue[0];
-        pthread_mutex_unlock( &encoder->queue.mutex );
+static int encode_frame( void *ptr, obe_raw_frame_t *raw_frame )
+{
+    twolame_ctx_t *ctx = ptr;
+    obe_aud_enc_params_t *enc_params = ctx->enc_params;
+    obe_t *h = enc_params->h;
+    obe_encoder_t *encoder = enc_params->encoder;
+    obe_coded_frame_t *coded_frame;
+    int output_size, linesize; /* Linesize in libavresample terminology is the entire buffer size for packed formats */
+    float *audio_buf = NULL;
+    int ret = -1;
 
-        if( cur_pts == -1 )
-            cur_pts = raw_frame->pts;
+    if( ctx->cur_pts == -1 )
+        ctx->cur_pts = raw_frame->pts;
 
-        /* Allocate the output buffer */
-        if( av_samples_alloc( (uint8_t**)&audio_buf, &linesize, av_get_channel_layout_nb_channels( raw_frame->audio_frame.channel_layout ),
-                              raw_frame->audio_frame.linesize, AV_SAMPLE_FMT_FLT, 0 ) < 0 )
-        {
-            syslog( LOG_ERR, "Malloc failed\n" );
-            goto end;
-        }
+    /* Allocate the output buffer */
+    if( av_samples_alloc( (uint8_t**)&audio_buf, &linesize, av_get_channel_layout_nb_channels( raw_frame->audio_frame.channel_layout ),
+                          raw_frame->audio_frame.linesize, AV_SAMPLE_FMT_FLT, 0 ) < 0 )
+    {
+        syslog( LOG_ERR, "Malloc failed\n" );
+        goto end;
+    }
 
-        if( avresample_convert( avr, NULL, 0, raw_frame->audio_frame.num_samples, raw_frame->audio_frame.audio_data,
-                                raw_frame->audio_frame.linesize, raw_frame->audio_frame.num_samples ) < 0 )
-        {
-            syslog( LOG_ERR, "[twolame] Sample format conversion failed\n" );
-            break;
-        }
+    if( avresample_convert( ctx->avr, NULL, 0, raw_frame->audio_frame.num_samples, raw_frame->audio_frame.audio_data,
+                            raw_frame->audio_frame.linesize, raw_frame->audio_frame.num_samples ) < 0 )
+    {
+        syslog( LOG_ERR, "[twolame] Sample format conversion failed\n" );
+        goto end;
+    }
 
-        avresample_read( avr, (uint8_t**)&audio_buf, avresample_available( avr ) );
+    avresample_read( ctx->avr, (uint8_t**)&audio_buf, avresample_available( ctx->avr ) );
 
-        output_size = twolame_encode_buffer_float32_interleaved( tl_opts, audio_buf, raw_frame->audio_frame.num_samples, output_buf, MP2_AUDIO_BUFFER_SIZE );
+    output_size = twolame_encode_buffer_float32_interleaved( ctx->tl_opts, audio_buf, raw_frame->audio_frame.num_samples,
+                                                             ctx->output_buf, MP2_AUDIO_BUFFER_SIZE );
 
-        if( output_size < 0 )
-        {
-            syslog( LOG_ERR, "[twolame] Encode failed\n" );
-            break;
-        }
+    if( output_size < 0 )
+    {
+        syslog( LOG_ERR, "[twolame] Encode failed\n" );
+        goto end;
+    }
 
-        free( audio_buf );
-        audio_buf = NULL;
+    if( av_fifo_realloc2( ctx->fifo, av_fifo_size( ctx->fifo ) + output_size ) < 0 )
+    {
+        syslog( LOG_ERR, "Malloc failed\n" );
+        goto end;
+    }
 
-        raw_frame->release_data( raw_frame );
-        raw_frame->release_frame( raw_frame );
-        remove_from_queue( &encoder->queue );
+    av_fifo_generic_write( ctx->fifo, ctx->output_buf, output_size, NULL );
 
-        if( av_fifo_realloc2( fifo, av_fifo_size( fifo ) + output_size ) < 0 )
+    while( av_fifo_size( ctx->fifo ) >= ctx->frame_size )
+    {
+        coded_frame = new_coded_frame( encoder->output_stream_id, ctx->frame_size );
+        if( !coded_frame )
         {
             syslog( LOG_ERR, "Malloc failed\n" );
-            break;
+            goto end;
         }
+        av_fifo_generic_read( ctx->fifo, coded_frame->data, ctx->frame_size, NULL );
+        coded_frame->pts = ctx->cur_pts;
+        coded_frame->random_access = 1; /* Every frame output is a random access point */
 
-        av_fifo_generic_write( fifo, output_buf, output_size, NULL );
-
-        while( av_fifo_size( fifo ) >= frame_size )
-        {
-            coded_frame = new_coded_frame( encoder->output_stream_id, frame_size );
-            if( !coded_frame )
-            {
-                syslog( LOG_ERR, "Malloc failed\n" );
-                goto end;
-            }
-            av_fifo_generic_read( fifo, coded_frame->data, frame_size, NULL );
-            coded_frame->pts = cur_pts;
-            coded_frame->random_access = 1; /* Every frame output is a random access point */
-
-            add_to_queue( &h->mux_queue, coded_frame );
-            /* We need to generate PTS because frame sizes have changed */
-            cur_pts += (double)MP2_NUM_SAMPLES * OBE_CLOCK * enc_params->frames_per_pes / enc_params->sample_rate;
-        }
+        add_to_queue( &h->mux_queue, coded_frame );
+        /* We need to generate PTS because frame sizes have changed */
+        ctx->cur_pts += (double)MP2_NUM_SAMPLES * OBE_CLOCK * enc_params->frames_per_pes / enc_params->sample_rate;
     }
 
-end:
-    if( output_buf )
-        free( output_buf );
+    ret = 0;
 
+end:
     if( audio_buf )
         free( audio_buf );
 
-    if( avr )
-        avresample_free( &avr );
-
-    if( fifo )
-        av_fifo_free( fifo );
+    raw_frame->release_data( raw_frame );
+    raw_frame->release_frame( raw_frame );
 
-    if( tl_opts )
-        twolame_close( &tl_opts );
-    free( enc_params );
-
-    return NULL;
+    return ret;
 }
 
-const obe_aud_enc_func_t twolame_encoder = { start_encoder };
+const obe_aud_enc_func_t twolame_encoder = { open_encoder, encode_frame, close_encoder };
@@ -26,7 +26,7 @@
 static void *start_smoothing( void *ptr )
 {
     obe_t *h = ptr;
-    int num_enc_smoothing_frames = 0, buffer_frames = 0;
+    int num_enc_smoothing_frames = 0, buffer_frames = 0, num_video_encoders = 0;
     int64_t start_dts = -1, start_pts = -1, last_clock = -1;
     obe_coded_frame_t *coded_frame = NULL;
 
@@ -45,11 +45,14 @@ static void *start_smoothing( void *ptr )
                 while( !h->encoders[i]->is_ready )
                     pthread_cond_wait( &h->encoders[i]->queue.in_cv, &h->encoders[i]->queue.mutex );
                 x264_param_t *params = h->encoders[i]->encoder_params;
-                buffer_frames = params->sc.i_buffer_size;
+                buffer_frames = MAX( buffer_frames, params->sc.i_buffer_size );
                 pthread_mutex_unlock( &h->encoders[i]->queue.mutex );
-                break;
+                num_video_encoders++;
             }
         }
+
+        /* Each video rendition contributes one frame per frame period */
+        buffer_frames *= MAX( num_video_encoders, 1 );
     }
 
     //int64_t send_delta = 0;
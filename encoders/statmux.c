@@ -0,0 +1,255 @@
+/*****************************************************************************
+ * statmux.c : Statistical multiplexing of video encoders
+ *****************************************************************************
+ * Copyright (C) 2010 Open Broadcast Systems Ltd.
+ *
+ * Authors: Kieran Kunhya <kieran@kunhya.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+#include <math.h>
+#include "common/common.h"
+
+/* Limits on how far one update can move an encoder's rate and on the smallest share it can get */
+#define STATMUX_MAX_STEP      0.25
+#define STATMUX_MIN_SHARE     0.25
+#define STATMUX_MIN_CHANGE    0.02
+
+typedef struct
+{
+    obe_encoder_t *encoder;
+    obe_output_stream_t *output_stream;
+
+    /* Configured rate control. The buffer duration (bufsize/maxrate) and bitrate/maxrate ratio are kept */
+    int orig_max_bitrate;
+    int orig_buffer_size;
+    int orig_bitrate;
+
+    int max_bitrate; /* last requested */
+    int min_bitrate;
+    double complexity;
+    double target;
+    int new_bitrate;
+    int cur_bitrate;
+
+    /* Encoder keyframe count at the last update */
+    int keyframes;
+} obe_statmux_stream_t;
+
+/* Complexity is bits scaled by quantiser step size, which is roughly constant for a given picture
+ * whatever rate it is coded at. Averaged over the frames coded since the last update */
+static double get_complexity( obe_t *h, obe_statmux_stream_t *stream, obe_encoder_stats_t *stats, int max_stats )
+{
+    int num_stats = obe_get_encoder_stats( h, stream->encoder->output_stream_id, stats, max_stats );
+    double complexity = 0;
+    int num_frames = 0;
+
+    for( int i = 0; i < num_stats; i++ )
+    {
+        if( !stats[i].frame_size )
+            continue;
+        complexity += stats[i].frame_size * 8.0 * 0.85 * pow( 2, (stats[i].qp - 12) / 6.0 );
+        num_frames++;
+    }
+
+    return num_frames ? complexity / num_frames : stream->complexity;
+}
+
+/* The most an encoder can be using, as a requested rate is only applied at its next IDR */
+static int get_cur_bitrate( obe_statmux_stream_t *stream )
+{
+    int applied;
+
+    pthread_mutex_lock( &stream->encoder->queue.mutex );
+    applied = ((x264_param_t*)stream->encoder->encoder_params)->rc.i_vbv_max_bitrate;
+    pthread_mutex_unlock( &stream->encoder->queue.mutex );
+
+    return MAX( applied, stream->max_bitrate );
+}
+
+/* Every encoder has coded a keyframe since the last update. The caller holds statmux_mutex */
+static int gop_complete( obe_statmux_stream_t *streams, int num_streams )
+{
+    for( int i = 0; i < num_streams; i++ )
+    {
+        if( streams[i].encoder->keyframes == streams[i].keyframes )
+            return 0;
+    }
+
+    return 1;
+}
+
+static void *start_statmux( void *ptr )
+{
+    obe_t *h = ptr;
+    obe_statmux_stream_t streams[MAX_STREAMS];
+    obe_encoder_stats_t *stats = NULL;
+    int num_streams = 0, pool_bitrate, min_total, max_stats = 0, free_bitrate, increase;
+    double total_complexity, total, scale;
+
+    pool_bitrate = h->mux_opts.statmux_bitrate;
+    if( !pool_bitrate )
+    {
+        /* Leave room for PSI, PES and TS overhead */
+        pool_bitrate = (int64_t)h->mux_opts.ts_muxrate * 9 / 10000;
+        for( int i = 0; i < h->num_output_streams; i++ )
+        {
+            if( h->output_streams[i].stream_action == STREAM_ENCODE && h->output_streams[i].stream_format != VIDEO_AVC &&
+                h->output_streams[i].stream_format != VIDEO_MPEG2 )
+                pool_bitrate -= h->output_streams[i].bitrate;
+        }
+    }
+
+    for( int i = 0; i < h->num_encoders; i++ )
+    {
+        obe_output_stream_t *output_stream = get_output_stream( h, h->encoders[i]->output_stream_id );
+        if( !h->encoders[i]->is_video || output_stream->stream_format != VIDEO_AVC )
+            continue;
+
+        pthread_mutex_lock( &h->encoders[i]->queue.mutex );
+        while( !h->encoders[i]->is_ready && !h->cancel_statmux_thread )
+            pthread_cond_wait( &h->encoders[i]->queue.in_cv, &h->encoders[i]->queue.mutex );
+        pthread_mutex_unlock( &h->encoders[i]->queue.mutex );
+
+        if( h->cancel_statmux_thread )
+            return NULL;
+
+        x264_param_t *params = h->encoders[i]->encoder_params;
+
+        obe_statmux_stream_t *stream = &streams[num_streams++];
+        stream->encoder = h->encoders[i];
+        stream->output_stream = output_stream;
+        stream->orig_max_bitrate = stream->max_bitrate = params->rc.i_vbv_max_bitrate;
+        stream->orig_buffer_size = params->rc.i_vbv_buffer_size;
+        stream->orig_bitrate = params->rc.i_bitrate;
+        stream->min_bitrate = stream->orig_max_bitrate * STATMUX_MIN_SHARE;
+        stream->complexity = stream->orig_max_bitrate;
+
+        pthread_mutex_lock( &h->statmux_mutex );
+        stream->keyframes = h->encoders[i]->keyframes;
+        pthread_mutex_unlock( &h->statmux_mutex );
+
+        max_stats = MAX( max_stats, params->i_keyint_max );
+    }
+
+    if( num_streams < 2 )
+    {
+        syslog( LOG_WARNING, "[statmux]: fewer than two AVC encoders, statmux disabled\n" );
+        return NULL;
+    }
+
+    min_total = 0;
+    for( int i = 0; i < num_streams; i++ )
+        min_total += streams[i].min_bitrate;
+
+    if( min_total > pool_bitrate )
+    {
+        syslog( LOG_ERR, "[statmux]: bitrate pool of %i kbit/s is too small\n", pool_bitrate );
+        return NULL;
+    }
+
+    max_stats = MIN( max_stats, OBE_ENCODER_STATS_SIZE );
+    stats = malloc( max_stats * sizeof(*stats) );
+    if( !stats )
+    {
+        syslog( LOG_ERR, "Malloc failed\n" );
+        return NULL;
+    }
+
+    /* Reallocate once every encoder has started a new GOP so the statistics cover a whole GOP of each */
+    while( 1 )
+    {
+        pthread_mutex_lock( &h->statmux_mutex );
+        while( !h->cancel_statmux_thread && !gop_complete( streams, num_streams ) )
+            pthread_cond_wait( &h->statmux_cv, &h->statmux_mutex );
+        if( h->cancel_statmux_thread )
+        {
+            pthread_mutex_unlock( &h->statmux_mutex );
+            break;
+        }
+        for( int i = 0; i < num_streams; i++ )
+            streams[i].keyframes = streams[i].encoder->keyframes;
+        pthread_mutex_unlock( &h->statmux_mutex );
+
+        total_complexity = 0;
+        for( int i = 0; i < num_streams; i++ )
+        {
+            streams[i].complexity = get_complexity( h, &streams[i], stats, max_stats );
+            total_complexity += streams[i].complexity;
+        }
+
+        if( total_complexity <= 0 )
+            continue;
+
+        /* Share what is left after the minimums in proportion to complexity, limiting how far each
+         * encoder moves per update, then scale back down if the limits took the total over the pool */
+        total = 0;
+        for( int i = 0; i < num_streams; i++ )
+        {
+            double target = streams[i].min_bitrate + (pool_bitrate - min_total) * streams[i].complexity / total_complexity;
+            target = MIN( target, streams[i].max_bitrate * (1 + STATMUX_MAX_STEP) );
+            target = MAX( target, streams[i].max_bitrate * (1 - STATMUX_MAX_STEP) );
+            streams[i].target = target;
+            total += target;
+        }
+
+        /* Encoders change rate at their own IDRs, so an increase only gets what is free while the other
+         * encoders may still be at their old rates. The rest comes at a later update */
+        free_bitrate = pool_bitrate;
+        increase = 0;
+        for( int i = 0; i < num_streams; i++ )
+        {
+            obe_statmux_stream_t *stream = &streams[i];
+
+            stream->cur_bitrate = get_cur_bitrate( stream );
+            stream->new_bitrate = stream->target * MIN( pool_bitrate / total, 1.0 );
+            stream->new_bitrate = MAX( stream->new_bitrate, stream->min_bitrate );
+            free_bitrate -= stream->cur_bitrate;
+            increase += MAX( stream->new_bitrate - stream->cur_bitrate, 0 );
+        }
+
+        scale = increase ? MIN( MAX( (double)free_bitrate / increase, 0 ), 1.0 ) : 1.0;
+
+        for( int i = 0; i < num_streams; i++ )
+        {
+            obe_statmux_stream_t *stream = &streams[i];
+            obe_output_stream_t new_stream;
+            int new_bitrate = stream->new_bitrate;
+
+            if( new_bitrate > stream->cur_bitrate )
+                new_bitrate = stream->cur_bitrate + ( new_bitrate - stream->cur_bitrate ) * scale;
+            if( abs( new_bitrate - stream->max_bitrate ) < stream->max_bitrate * STATMUX_MIN_CHANGE )
+                continue;
+
+            memcpy( &new_stream, stream->output_stream, sizeof(new_stream) );
+            new_stream.avc_param.rc.i_vbv_max_bitrate = new_bitrate;
+            new_stream.avc_param.rc.i_vbv_buffer_size = (int64_t)new_bitrate * stream->orig_buffer_size / stream->orig_max_bitrate;
+            new_stream.avc_param.rc.i_bitrate = (int64_t)new_bitrate * stream->orig_bitrate / stream->orig_max_bitrate;
+
+            if( obe_update_stream( h, &new_stream ) < 0 )
+                continue;
+
+            stream->max_bitrate = new_bitrate;
+        }
+    }
+
+    free( stats );
+
+    return NULL;
+}
+
+const obe_statmux_func_t statmux = { start_statmux };
@@ -98,6 +98,88 @@ static int convert_obe_to_x264_pic( x264_picture_t *pic, obe_raw_frame_t *raw_fr
     return 0;
 }
 
+/* A rate control change reopens the encoder, whose HRD timing then restarts from zero. It is moved so that
+ * it carries on from the previous encoder and the mux and smoothing see one continuous stream */
+typedef struct
+{
+    int reanchor;
+    int64_t offset;
+    int64_t arrival_offset;
+
+    /* Last frame handed on, after the offsets */
+    int64_t pts_delta; /* output pts less input pts */
+    int64_t last_dts;
+    int64_t last_final_arrival;
+    int64_t last_idr; /* i_pts */
+} obe_hrd_anchor_t;
+
+static int output_frame( obe_t *h, obe_encoder_t *encoder, obe_coded_frame_pool_t *pool, x264_nal_t *nal, int frame_size,
+                         x264_picture_t *pic_out, int64_t pts, int64_t arrival_time, obe_hrd_anchor_t *anchor )
+{
+    obe_coded_frame_t *coded_frame = new_pooled_coded_frame( pool, encoder->output_stream_id, frame_size );
+    if( !coded_frame )
+    {
+        syslog( LOG_ERR, "Malloc failed\n" );
+        return -1;
+    }
+
+    /* The mux times the other streams from the offset between output and input pts so keep it.
+     * The first frame of the new encoder must not arrive before the last frame of the old one */
+    if( anchor->reanchor )
+    {
+        anchor->offset = pts + anchor->pts_delta - (int64_t)pic_out->hrd_timing.dpb_output_time;
+        anchor->arrival_offset = anchor->offset + MAX( 0, anchor->last_final_arrival -
+                                 ( (int64_t)pic_out->hrd_timing.cpb_initial_arrival_time + anchor->offset ) );
+        anchor->reanchor = 0;
+    }
+
+    memcpy( coded_frame->data, nal[0].p_payload, frame_size );
+    coded_frame->is_video = 1;
+    coded_frame->len = frame_size;
+    coded_frame->cpb_initial_arrival_time = pic_out->hrd_timing.cpb_initial_arrival_time + anchor->arrival_offset;
+    coded_frame->cpb_final_arrival_time = pic_out->hrd_timing.cpb_final_arrival_time + anchor->arrival_offset;
+    coded_frame->real_dts = pic_out->hrd_timing.cpb_removal_time + anchor->offset;
+    coded_frame->real_pts = pic_out->hrd_timing.dpb_output_time + anchor->offset;
+    coded_frame->pts = pts;
+    coded_frame->random_access = pic_out->b_keyframe;
+    coded_frame->priority = IS_X264_TYPE_I( pic_out->i_type );
+
+    anchor->pts_delta = coded_frame->real_pts - pts;
+    anchor->last_dts = coded_frame->real_dts;
+    anchor->last_final_arrival = coded_frame->cpb_final_arrival_time;
+
+    if( pic_out->b_keyframe )
+    {
+        anchor->last_idr = pic_out->i_pts;
+
+        pthread_mutex_lock( &h->statmux_mutex );
+        encoder->keyframes++;
+        pthread_cond_signal( &h->statmux_cv );
+        pthread_mutex_unlock( &h->statmux_mutex );
+    }
+
+    if( h->obe_system == OBE_SYSTEM_TYPE_LOWEST_LATENCY || h->obe_system == OBE_SYSTEM_TYPE_LOW_LATENCY )
+    {
+        coded_frame->arrival_time = arrival_time;
+        add_to_queue( &h->mux_queue, coded_frame );
+        //printf("\n Encode Latency %"PRIi64" \n", obe_mdate() - coded_frame->arrival_time );
+    }
+    else
+        add_to_queue( &h->enc_smoothing_queue, coded_frame );
+
+    return 0;
+}
+
+/* Fraction of the new VBV that is full when the first frame of a reopened encoder is removed, given that
+ * its data can only start arriving once the old encoder's last frame has */
+static float get_vbv_buffer_init( x264_param_t *param, obe_hrd_anchor_t *anchor, int64_t frame_duration )
+{
+    int64_t buffer_duration = (int64_t)param->rc.i_vbv_buffer_size * OBE_CLOCK / param->rc.i_vbv_max_bitrate;
+    float init = (float)( anchor->last_dts + frame_duration - anchor->last_final_arrival ) / buffer_duration;
+
+    return MIN( MAX( init, 0.01 ), 1.0 );
+}
+
 static void *start_encoder( void *ptr )
 {
     obe_vid_enc_params_t *enc_params = ptr;
@@ -105,13 +187,18 @@ static void *start_encoder( void *ptr )
     obe_encoder_t *encoder = enc_params->encoder;
     x264_t *s = NULL;
     x264_picture_t pic, pic_out;
+    x264_param_t open_param;
     x264_nal_t *nal;
-    int i_nal, frame_size = 0;
-    int64_t pts = 0, arrival_time = 0, frame_duration, buffer_duration;
-    int64_t *pts2;
-    float buffer_fill;
+    int i_nal, frame_size = 0, pts_ring_size = 0, max_frame_size;
+    int64_t pts = 0, arrival_time = 0, frame_duration, buffer_duration, encode_start, avg_encode_time = 0;
+    int64_t *pts_ring = NULL;
+    float buffer_fill, load;
+    int encoder_drops = 0, speedcontrol_reset, update_pending = 0, update_bitrate = 0, update_vbv_max_bitrate = 0, update_vbv_buffer_size = 0;
     obe_raw_frame_t *raw_frame;
-    obe_coded_frame_t *coded_frame;
+    obe_encoder_stats_t *stats;
+    obe_encoder_governor_t governor;
+    obe_coded_frame_pool_t *pool = NULL;
+    obe_hrd_anchor_t anchor = {0};
 
     /* TODO: check for width, height changes */
 
@@ -138,6 +225,23 @@ static void *start_encoder( void *ptr )
     }
     memcpy( encoder->encoder_params, &enc_params->avc_param, sizeof(enc_params->avc_param) );
 
+    /* The input pts of each frame in the encoder's lookahead is kept in a ring indexed by i_pts */
+    pts_ring_size = x264_encoder_maximum_delayed_frames( s ) + 1;
+    pts_ring = malloc( pts_ring_size * sizeof(*pts_ring) );
+
+    /* A coded frame can never be larger than the VBV buffer */
+    max_frame_size = enc_params->avc_param.rc.i_vbv_buffer_size * 1000 / 8;
+    if( !max_frame_size )
+        max_frame_size = enc_params->avc_param.i_width * enc_params->avc_param.i_height * 3;
+    pool = new_coded_frame_pool( max_frame_size );
+
+    if( !pts_ring || !pool )
+    {
+        pthread_mutex_unlock( &encoder->queue.mutex );
+        syslog( LOG_ERR, "Malloc failed\n" );
+        goto end;
+    }
+
     encoder->is_ready = 1;
     /* XXX: This will need fixing for soft pulldown streams */
     frame_duration = av_rescale_q( 1, (AVRational){enc_params->avc_param.i_fps_den, enc_params->avc_param.i_fps_num}, (AVRational){1, OBE_CLOCK} );
@@ -160,23 +264,107 @@ static void *start_encoder( void *ptr )
             break;
         }
 
+        memcpy( &governor, &encoder->governor, sizeof(governor) );
+        if( encoder->update_pending )
+        {
+            update_bitrate = encoder->update_bitrate;
+            update_vbv_max_bitrate = encoder->update_vbv_max_bitrate;
+            update_vbv_buffer_size = encoder->update_vbv_buffer_size;
+            encoder->update_pending = 0;
+            update_pending = 1;
+        }
+        buffer_fill = 0;
+        speedcontrol_reset = 0;
+
         /* Reset the speedcontrol buffer if the source has dropped frames. Otherwise speedcontrol
-         * stays in an underflow state and is locked to the fastest preset */
+         * stays in an underflow state and is locked to the fastest preset. Every encoder sees each drop */
         pthread_mutex_lock( &h->drop_mutex );
-        if( h->encoder_drop )
+        if( h->encoder_drops != encoder_drops )
         {
             pthread_mutex_lock( &h->enc_smoothing_queue.mutex );
             h->enc_smoothing_buffer_complete = 0;
             pthread_mutex_unlock( &h->enc_smoothing_queue.mutex );
             syslog( LOG_INFO, "Speedcontrol reset\n" );
             x264_speedcontrol_sync( s, enc_params->avc_param.sc.i_buffer_size, enc_params->avc_param.sc.f_buffer_init, 0 );
-            h->encoder_drop = 0;
+            encoder_drops = h->encoder_drops;
+            speedcontrol_reset = 1;
         }
         pthread_mutex_unlock( &h->drop_mutex );
 
         raw_frame = encoder->queue.queue[0];
         pthread_mutex_unlock( &encoder->queue.mutex );
 
+        /* libx264 can't change the VBV while NAL HRD is in use, so a rate control change flushes the encoder
+         * and reopens it with the new values where the next IDR is due. Without fixed IDRs it is done at once */
+        if( update_pending && ( pts >= anchor.last_idr + enc_params->avc_param.i_keyint_max ||
+            enc_params->avc_param.i_keyint_max == X264_KEYINT_MAX_INFINITE || enc_params->avc_param.b_intra_refresh ) )
+        {
+            while( x264_encoder_delayed_frames( s ) )
+            {
+                frame_size = x264_encoder_encode( s, &nal, &i_nal, NULL, &pic_out );
+                if( frame_size < 0 )
+                {
+                    syslog( LOG_ERR, "x264_encoder_encode failed\n" );
+                    goto end;
+                }
+
+                if( frame_size && output_frame( h, encoder, pool, nal, frame_size, &pic_out,
+                                                pts_ring[pic_out.i_pts % pts_ring_size], arrival_time, &anchor ) < 0 )
+                    goto end;
+            }
+            x264_encoder_close( s );
+
+            memcpy( &open_param, &enc_params->avc_param, sizeof(open_param) );
+            open_param.rc.i_bitrate = update_bitrate;
+            open_param.rc.i_vbv_max_bitrate = update_vbv_max_bitrate;
+            open_param.rc.i_vbv_buffer_size = update_vbv_buffer_size;
+            open_param.rc.f_vbv_buffer_init = get_vbv_buffer_init( &open_param, &anchor, frame_duration );
+            s = x264_encoder_open( &open_param );
+            if( !s )
+            {
+                syslog( LOG_ERR, "[x264]: encoder reconfiguration failed, keeping the previous rate control\n" );
+                memcpy( &open_param, &enc_params->avc_param, sizeof(open_param) );
+                open_param.rc.f_vbv_buffer_init = get_vbv_buffer_init( &open_param, &anchor, frame_duration );
+                s = x264_encoder_open( &open_param );
+                if( !s )
+                {
+                    syslog( LOG_ERR, "[x264]: encoder configuration failed\n" );
+                    break;
+                }
+            }
+            else
+                syslog( LOG_INFO, "[x264]: bitrate %i kbit/s, vbv-maxrate %i kbit/s, vbv-bufsize %i kbit\n",
+                        update_bitrate, update_vbv_max_bitrate, update_vbv_buffer_size );
+
+            /* Publish what libx264 accepted but keep the configured initial fill for mux smoothing */
+            x264_encoder_parameters( s, &open_param );
+            open_param.rc.f_vbv_buffer_init = enc_params->avc_param.rc.f_vbv_buffer_init;
+            memcpy( &enc_params->avc_param, &open_param, sizeof(open_param) );
+
+            /* The old encoder's frames have all been output so the ring can be resized */
+            if( x264_encoder_maximum_delayed_frames( s ) + 1 > pts_ring_size )
+            {
+                pts_ring_size = x264_encoder_maximum_delayed_frames( s ) + 1;
+                free( pts_ring );
+                pts_ring = malloc( pts_ring_size * sizeof(*pts_ring) );
+                if( !pts_ring )
+                {
+                    syslog( LOG_ERR, "Malloc failed\n" );
+                    break;
+                }
+            }
+
+            /* The new encoder starts with an IDR */
+            anchor.reanchor = 1;
+            anchor.last_idr = pts;
+            update_pending = 0;
+
+            pthread_mutex_lock( &encoder->queue.mutex );
+            memcpy( encoder->encoder_params, &enc_params->avc_param, sizeof(enc_params->avc_param) );
+            encoder->params_version++;
+            pthread_mutex_unlock( &encoder->queue.mutex );
+        }
+
         if( convert_obe_to_x264_pic( &pic, raw_frame ) < 0 )
         {
             syslog( LOG_ERR, "Malloc failed\n" );
@@ -185,14 +373,7 @@ static void *start_encoder( void *ptr )
 
         /* FIXME: if frames are dropped this might not be true */
         pic.i_pts = pts++;
-        pts2 = malloc( sizeof(int64_t) );
-        if( !pts2 )
-        {
-            syslog( LOG_ERR, "Malloc failed\n" );
-            break;
-        }
-        pts2[0] = raw_frame->pts;
-        pic.opaque = pts2;
+        pts_ring[pic.i_pts % pts_ring_size] = raw_frame->pts;
         pic.param = NULL;
 
         /* If the AFD has changed, then change the SAR. x264 will write the SAR at the next keyframe
@@ -230,14 +411,36 @@ static void *start_encoder( void *ptr )
                 else
                     buffer_fill = (float)(-1 * last_frame_delta)/buffer_duration;
 
+                /* Push speedcontrol towards faster presets if the encoder is over its CPU budget */
+                load = (float)avg_encode_time * OBE_CLOCK / 1000000 / frame_duration;
+                if( governor.cpu_budget && load > governor.cpu_budget && buffer_fill > 0 )
+                    buffer_fill *= governor.cpu_budget / load;
+
+                if( governor.min_buffer_fill && buffer_fill < governor.min_buffer_fill )
+                    buffer_fill = governor.min_buffer_fill;
+
                 x264_speedcontrol_sync( s, buffer_fill, enc_params->avc_param.sc.i_buffer_size, 1 );
             }
 
             pthread_mutex_unlock( &h->enc_smoothing_queue.mutex );
         }
 
+        encode_start = obe_mdate();
         frame_size = x264_encoder_encode( s, &nal, &i_nal, &pic, &pic_out );
 
+        stats = &encoder->stats[encoder->stats_idx % OBE_ENCODER_STATS_SIZE];
+        stats->pts = raw_frame->pts;
+        stats->buffer_fill = buffer_fill;
+        stats->encode_time = obe_mdate() - encode_start;
+        stats->frame_size = MAX( frame_size, 0 );
+        stats->frame_type = frame_size > 0 ? pic_out.i_type : 0;
+        stats->qp = frame_size > 0 ? pic_out.i_qpplus1 - 1 : 0;
+        stats->speedcontrol_reset = speedcontrol_reset;
+        __sync_synchronize();
+        encoder->stats_idx++;
+
+        avg_encode_time = avg_encode_time ? ( avg_encode_time * 7 + stats->encode_time ) / 8 : stats->encode_time;
+
         arrival_time = raw_frame->arrival_time;
         raw_frame->release_data( raw_frame );
         raw_frame->release_frame( raw_frame );
@@ -249,41 +452,17 @@ static void *start_encoder( void *ptr )
             break;
         }
 
-        if( frame_size )
-        {
-            coded_frame = new_coded_frame( encoder->output_stream_id, frame_size );
-            if( !coded_frame )
-            {
-                syslog( LOG_ERR, "Malloc failed\n" );
-                break;
-            }
-            memcpy( coded_frame->data, nal[0].p_payload, frame_size );
-            coded_frame->is_video = 1;
-            coded_frame->len = frame_size;
-            coded_frame->cpb_initial_arrival_time = pic_out.hrd_timing.cpb_initial_arrival_time;
-            coded_frame->cpb_final_arrival_time = pic_out.hrd_timing.cpb_final_arrival_time;
-            coded_frame->real_dts = pic_out.hrd_timing.cpb_removal_time;
-            coded_frame->real_pts = pic_out.hrd_timing.dpb_output_time;
-            pts2 = pic_out.opaque;
-            coded_frame->pts = pts2[0];
-            coded_frame->random_access = pic_out.b_keyframe;
-            coded_frame->priority = IS_X264_TYPE_I( pic_out.i_type );
-            free( pic_out.opaque );
-
-            if( h->obe_system == OBE_SYSTEM_TYPE_LOWEST_LATENCY || h->obe_system == OBE_SYSTEM_TYPE_LOW_LATENCY )
-            {
-                coded_frame->arrival_time = arrival_time;
-                add_to_queue( &h->mux_queue, coded_frame );
-                //printf("\n Encode Latency %"PRIi64" \n", obe_mdate() - coded_frame->arrival_time );
-            }
-            else
-                add_to_queue( &h->enc_smoothing_queue, coded_frame );
-        }
+        if( frame_size && output_frame( h, encoder, pool, nal, frame_size, &pic_out,
+                                        pts_ring[pic_out.i_pts % pts_ring_size], arrival_time, &anchor ) < 0 )
+            break;
      }
 
 end:
     if( s )
         x264_encoder_close( s );
+    if( pool )
+        close_coded_frame_pool( pool );
+    free( pts_ring );
     free( enc_params );
 
     return NULL;
@@ -0,0 +1,347 @@
+/*****************************************************************************
+ * mpeg2.c : libavcodec MPEG-2 encoding functions
+ *****************************************************************************
+ * Copyright (C) 2010 Open Broadcast Systems Ltd.
+ *
+ * Authors: Kieran Kunhya <kieran@kunhya.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ ******************************************************************************/
+
+#include "common/common.h"
+#include "common/lavc.h"
+#include "encoders/video/video.h"
+#include <libavutil/mathematics.h>
+
+/* MPEG-2 only reorders by one frame so more B-frames than this just cost quality */
+#define MPEG2_MAX_BFRAMES 2
+
+typedef struct
+{
+    int64_t pts;
+    int64_t arrival_time;
+
+    /* MPEG-2 picture user data for this frame */
+    int user_data_len;
+    uint8_t *user_data;
+} mpeg2_frame_info_t;
+
+/* MPEG-2 carries the same ATSC A/53 and AFD user data as AVC, minus the ITU-T T.35 country and provider codes */
+static int convert_obe_to_mpeg2_user_data( mpeg2_frame_info_t *info, obe_raw_frame_t *raw_frame )
+{
+    const uint8_t start_code[] = { 0x00, 0x00, 0x01, 0xb2 };
+    const uint8_t itu_t_t35[] = { 0xb5, 0x00, 0x31 };
+    int len = 0;
+    uint8_t *p;
+
+    for( int i = 0; i < raw_frame->num_user_data; i++ )
+    {
+        obe_user_data_t *user_data = &raw_frame->user_data[i];
+        if( user_data->type == USER_DATA_AVC_REGISTERED_ITU_T35 && user_data->len > sizeof(itu_t_t35) &&
+            !memcmp( user_data->data, itu_t_t35, sizeof(itu_t_t35) ) )
+            len += sizeof(start_code) + user_data->len - sizeof(itu_t_t35);
+    }
+
+    info->user_data_len = 0;
+    if( len )
+    {
+        p = realloc( info->user_data, len );
+        if( !p )
+            return -1;
+        info->user_data = p;
+
+        for( int i = 0; i < raw_frame->num_user_data; i++ )
+        {
+            obe_user_data_t *user_data = &raw_frame->user_data[i];
+            if( user_data->type == USER_DATA_AVC_REGISTERED_ITU_T35 && user_data->len > sizeof(itu_t_t35) &&
+                !memcmp( user_data->data, itu_t_t35, sizeof(itu_t_t35) ) )
+            {
+                memcpy( p, start_code, sizeof(start_code) );
+                memcpy( p + sizeof(start_code), user_data->data + sizeof(itu_t_t35), user_data->len - sizeof(itu_t_t35) );
+                p += sizeof(start_code) + user_data->len - sizeof(itu_t_t35);
+            }
+            else
+                syslog( LOG_WARNING, "Invalid user data presented to encoder - type %i \n", user_data->type );
+        }
+        info->user_data_len = len;
+    }
+
+    return 0;
+}
+
+/* Picture user data goes after the picture headers and extensions, before the first slice */
+static int find_first_slice( uint8_t *data, int len )
+{
+    for( int i = 0; i + 3 < len; i++ )
+    {
+        if( data[i] == 0 && data[i+1] == 0 && data[i+2] == 1 && data[i+3] >= 0x01 && data[i+3] <= 0xaf )
+            return i;
+    }
+
+    return len;
+}
+
+static void *start_encoder( void *ptr )
+{
+    obe_vid_enc_params_t *enc_params = ptr;
+    obe_t *h = enc_params->h;
+    obe_encoder_t *encoder = enc_params->encoder;
+    x264_param_t *param = &enc_params->avc_param;
+    AVCodec *enc;
+    AVCodecContext *codec = NULL;
+    AVFrame *frame = NULL;
+    AVPacket pkt;
+    int ret, got_pkt, slice_pos, ring_size = 0, is_cbr, is_hd;
+    int64_t pts = 0, num_coded = 0, frame_duration, cpb_delay, bitrate, encode_start;
+    int64_t initial_arrival_time, final_arrival_time = 0, real_dts, real_pts;
+    obe_raw_frame_t *raw_frame;
+    obe_encoder_stats_t *stats;
+    obe_coded_frame_t *coded_frame;
+    obe_coded_frame_pool_t *pool = NULL;
+    mpeg2_frame_info_t *ring = NULL, *info;
+
+    /* TODO: check for width, height changes */
+
+    /* Lock the mutex until we verify and fetch new parameters */
+    pthread_mutex_lock( &encoder->queue.mutex );
+
+    avcodec_register_all();
+
+    enc = avcodec_find_encoder( AV_CODEC_ID_MPEG2VIDEO );
+    codec = avcodec_alloc_context3( enc );
+    frame = avcodec_alloc_frame();
+    if( !enc || !codec || !frame )
+    {
+        pthread_mutex_unlock( &encoder->queue.mutex );
+        fprintf( stderr, "[mpeg2]: could not allocate encoder\n" );
+        goto end;
+    }
+
+    is_hd = param->i_width > 720 || param->i_height > 576;
+    is_cbr = param->i_nal_hrd == X264_NAL_HRD_FAKE_CBR;
+    bitrate = (int64_t)( param->rc.i_bitrate ? param->rc.i_bitrate : param->rc.i_vbv_max_bitrate ) * 1000;
+    param->i_bframe = MIN( param->i_bframe, MPEG2_MAX_BFRAMES );
+
+    codec->width = param->i_width;
+    codec->height = param->i_height;
+    codec->time_base = (AVRational){ param->i_fps_den, param->i_fps_num };
+    codec->pix_fmt = ( param->i_csp & X264_CSP_MASK ) == X264_CSP_I422 ? PIX_FMT_YUV422P : PIX_FMT_YUV420P;
+    codec->sample_aspect_ratio = (AVRational){ param->vui.i_sar_width, param->vui.i_sar_height };
+    codec->gop_size = param->i_keyint_max;
+    codec->max_b_frames = param->i_bframe;
+    codec->bit_rate = bitrate;
+    codec->rc_max_rate = (int64_t)param->rc.i_vbv_max_bitrate * 1000;
+    codec->rc_min_rate = is_cbr ? codec->rc_max_rate : 0;
+    codec->rc_buffer_size = param->rc.i_vbv_buffer_size * 1000;
+    codec->rc_initial_buffer_occupancy = codec->rc_buffer_size * param->rc.f_vbv_buffer_init;
+    codec->thread_count = param->i_threads;
+    codec->thread_type = FF_THREAD_SLICE;
+    if( !param->b_open_gop )
+        codec->flags |= CODEC_FLAG_CLOSED_GOP;
+    if( param->b_interlaced )
+        codec->flags |= CODEC_FLAG_INTERLACED_DCT | CODEC_FLAG_INTERLACED_ME;
+
+    /* Main or 4:2:2 profile at Main or High level */
+    if( codec->pix_fmt == PIX_FMT_YUV422P )
+    {
+        codec->profile = FF_PROFILE_MPEG2_422;
+        codec->level = is_hd ? 2 : 5;
+    }
+    else
+    {
+        codec->profile = FF_PROFILE_MPEG2_MAIN;
+        codec->level = is_hd ? 4 : 8;
+    }
+
+    if( avcodec_open2( codec, enc, NULL ) < 0 )
+    {
+        pthread_mutex_unlock( &encoder->queue.mutex );
+        fprintf( stderr, "[mpeg2]: encoder configuration failed\n" );
+        goto end;
+    }
+
+    /* The mux and smoothing read the rate control settings from here */
+    encoder->encoder_params = malloc( sizeof(*param) );
+    if( !encoder->encoder_params )
+    {
+        pthread_mutex_unlock( &encoder->queue.mutex );
+        syslog( LOG_ERR, "Malloc failed\n" );
+        goto end;
+    }
+    memcpy( encoder->encoder_params, param, sizeof(*param) );
+
+    /* Input pts and user data of each frame still inside the encoder, indexed by frame number */
+    ring_size = codec->max_b_frames + 2;
+    ring = calloc( ring_size, sizeof(*ring) );
+
+    /* A coded frame can never be larger than the VBV buffer */
+    pool = new_coded_frame_pool( codec->rc_buffer_size ? codec->rc_buffer_size / 8 : codec->width * codec->height * 3 );
+
+    if( !ring || !pool )
+    {
+        pthread_mutex_unlock( &encoder->queue.mutex );
+        syslog( LOG_ERR, "Malloc failed\n" );
+        goto end;
+    }
+
+    /* Timing follows the same CPB model x264 gives the mux. The first frame is removed once the buffer reaches its initial fill */
+    frame_duration = av_rescale_q( 1, codec->time_base, (AVRational){1, OBE_CLOCK} );
+    cpb_delay = param->rc.i_vbv_max_bitrate ? av_rescale( codec->rc_initial_buffer_occupancy, OBE_CLOCK, codec->rc_max_rate ) : 0;
+
+    encoder->is_ready = 1;
+    /* Broadcast because input and muxer can be stuck waiting for encoder */
+    pthread_cond_broadcast( &encoder->queue.in_cv );
+    pthread_mutex_unlock( &encoder->queue.mutex );
+
+    while( 1 )
+    {
+        pthread_mutex_lock( &encoder->queue.mutex );
+
+        while( !encoder->queue.size && !encoder->cancel_thread )
+            pthread_cond_wait( &encoder->queue.in_cv, &encoder->queue.mutex );
+
+        if( encoder->cancel_thread )
+        {
+            pthread_mutex_unlock( &encoder->queue.mutex );
+            break;
+        }
+
+        raw_frame = encoder->queue.queue[0];
+        pthread_mutex_unlock( &encoder->queue.mutex );
+
+        info = &ring[pts % ring_size];
+        info->pts = raw_frame->pts;
+        info->arrival_time = raw_frame->arrival_time;
+        if( convert_obe_to_mpeg2_user_data( info, raw_frame ) < 0 )
+        {
+            syslog( LOG_ERR, "Malloc failed\n" );
+            break;
+        }
+
+        /* The SAR is written in the next sequence header */
+        if( raw_frame->sar_width != codec->sample_aspect_ratio.num || raw_frame->sar_height != codec->sample_aspect_ratio.den )
+            codec->sample_aspect_ratio = (AVRational){ raw_frame->sar_width, raw_frame->sar_height };
+
+        avcodec_get_frame_defaults( frame );
+        for( int i = 0; i < raw_frame->img.planes; i++ )
+        {
+            frame->data[i] = raw_frame->img.plane[i];
+            frame->linesize[i] = raw_frame->img.stride[i];
+        }
+        frame->pts = pts++;
+        frame->interlaced_frame = param->b_interlaced;
+        frame->top_field_first = param->b_tff;
+
+        av_init_packet( &pkt );
+        pkt.data = NULL;
+        pkt.size = 0;
+        got_pkt = 0;
+
+        /* libavcodec copies the picture whenever it has to hold on to it so the frame can be released straight away */
+        encode_start = obe_mdate();
+        ret = avcodec_encode_video2( codec, &pkt, frame, &got_pkt );
+
+        stats = &encoder->stats[encoder->stats_idx % OBE_ENCODER_STATS_SIZE];
+        stats->pts = raw_frame->pts;
+        stats->buffer_fill = 0;
+        stats->encode_time = obe_mdate() - encode_start;
+        stats->frame_size = got_pkt ? pkt.size : 0;
+        stats->frame_type = !got_pkt ? 0 :
+                            codec->coded_frame->pict_type == AV_PICTURE_TYPE_I ? X264_TYPE_I :
+                            codec->coded_frame->pict_type == AV_PICTURE_TYPE_P ? X264_TYPE_P : X264_TYPE_B;
+        stats->qp = got_pkt ? codec->coded_frame->quality / FF_QP2LAMBDA : 0;
+        stats->speedcontrol_reset = 0;
+        __sync_synchronize();
+        encoder->stats_idx++;
+
+        raw_frame->release_data( raw_frame );
+        raw_frame->release_frame( raw_frame );
+        remove_from_queue( &encoder->queue );
+
+        if( ret < 0 )
+        {
+            syslog( LOG_ERR, "[mpeg2]: encode failed\n" );
+            break;
+        }
+
+        if( !got_pkt )
+            continue;
+
+        info = &ring[pkt.pts % ring_size];
+        coded_frame = new_pooled_coded_frame( pool, encoder->output_stream_id, pkt.size + info->user_data_len );
+        if( !coded_frame )
+        {
+            syslog( LOG_ERR, "Malloc failed\n" );
+            obe_free_packet( &pkt );
+            break;
+        }
+
+        slice_pos = find_first_slice( pkt.data, pkt.size );
+        memcpy( coded_frame->data, pkt.data, slice_pos );
+        memcpy( coded_frame->data + slice_pos, info->user_data, info->user_data_len );
+        memcpy( coded_frame->data + slice_pos + info->user_data_len, pkt.data + slice_pos, pkt.size - slice_pos );
+
+        /* Frames are removed at a constant rate in coded order and displayed a frame later if there are B-frames */
+        real_dts = cpb_delay + num_coded * frame_duration;
+        real_pts = cpb_delay + ( pkt.pts + !!codec->max_b_frames ) * frame_duration;
+        if( is_cbr )
+            initial_arrival_time = final_arrival_time;
+        else
+            initial_arrival_time = MAX( final_arrival_time, real_dts - cpb_delay );
+        final_arrival_time = initial_arrival_time + av_rescale( (int64_t)coded_frame->len * 8, OBE_CLOCK, bitrate );
+        num_coded++;
+
+        coded_frame->is_video = 1;
+        coded_frame->cpb_initial_arrival_time = initial_arrival_time;
+        coded_frame->cpb_final_arrival_time = final_arrival_time;
+        coded_frame->real_dts = real_dts;
+        coded_frame->real_pts = real_pts;
+        coded_frame->pts = info->pts;
+        coded_frame->random_access = !!( pkt.flags & AV_PKT_FLAG_KEY );
+        coded_frame->priority = coded_frame->random_access;
+        obe_free_packet( &pkt );
+
+        if( h->obe_system == OBE_SYSTEM_TYPE_LOWEST_LATENCY || h->obe_system == OBE_SYSTEM_TYPE_LOW_LATENCY )
+        {
+            coded_frame->arrival_time = info->arrival_time;
+            add_to_queue( &h->mux_queue, coded_frame );
+        }
+        else
+            add_to_queue( &h->enc_smoothing_queue, coded_frame );
+    }
+
+end:
+    if( codec )
+    {
+        avcodec_close( codec );
+        av_free( codec );
+    }
+    if( frame )
+        avcodec_free_frame( &frame );
+    if( pool )
+        close_coded_frame_pool( pool );
+    if( ring )
+    {
+        for( int i = 0; i < ring_size; i++ )
+            free( ring[i].user_data );
+        free( ring );
+    }
+    free( enc_params );
+
+    return NULL;
+}
+
+const obe_vid_enc_func_t mpeg2_encoder = { start_encoder };
@@ -37,5 +37,6 @@ typedef struct
 } obe_vid_enc_params_t;
 
 extern const obe_vid_enc_func_t x264_encoder;
+extern const obe_vid_enc_func_t mpeg2_encoder;
 
 #endif
@@ -0,0 +1,121 @@
+/*****************************************************************************
+ * 302m.c : SMPTE 302M packetiser
+ *****************************************************************************
+ * Copyright (C) 2010 NAMETBD
+ *
+ * Authors: Kieran Kunhya <kieran@kunhya.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+#include "common/common.h"
+#include "302m.h"
+
+void obe_302m_reset( obe_302m_ctx_t *ctx )
+{
+    /* 302M sends each AES3 subframe LSB first */
+    for( int i = 0; i < 256; i++ )
+    {
+        int b = 0;
+        for( int j = 0; j < 8; j++ )
+            b |= ( ( i >> j ) & 1 ) << ( 7 - j );
+        ctx->reverse[i] = b;
+    }
+
+    ctx->framing_index = 0;
+}
+
+static int pair_size( int bit_depth )
+{
+    /* Two subframes of samples plus four VUCF bits each */
+    return ( bit_depth + 4 ) >> 2;
+}
+
+int obe_302m_frame_size( obe_302m_ctx_t *ctx, int num_samples )
+{
+    return SMPTE_302M_AES3_HEADER_LEN + pair_size( ctx->bit_depth ) * ( ctx->num_channels >> 1 ) * num_samples;
+}
+
+int obe_302m_pack( obe_302m_ctx_t *ctx, uint8_t *dst, int32_t **samples, int num_samples )
+{
+    const uint8_t *rev = ctx->reverse;
+    int size = pair_size( ctx->bit_depth );
+    int num_pairs = ctx->num_channels >> 1;
+    int stride = size * num_pairs;
+    int payload_len = stride * num_samples;
+    uint8_t *payload = dst + SMPTE_302M_AES3_HEADER_LEN;
+
+    if( payload_len > SMPTE_302M_MAX_PAYLOAD )
+        return -1;
+
+    /* AES3 header: audio_packet_size, number_channels, channel_identification (0), bits_per_sample, alignment_bits */
+    dst[0] = payload_len >> 8;
+    dst[1] = payload_len & 0xff;
+    dst[2] = ( ( ctx->num_channels - 2 ) >> 1 ) << 6;
+    dst[3] = ( ( ctx->bit_depth - 16 ) >> 2 ) << 4;
+
+    /* Each pair is packed across the whole frame in turn so the loads stay sequential */
+    for( int i = 0; i < num_pairs; i++ )
+    {
+        const uint32_t *left  = (const uint32_t*)samples[2*i];
+        const uint32_t *right = (const uint32_t*)samples[2*i+1];
+        uint8_t *o = payload + i * size;
+        int framing_index = ctx->framing_index;
+
+        for( int j = 0; j < num_samples; j++ )
+        {
+            uint32_t l = left[j], r = right[j];
+            /* The F bit follows the left sample's top nibble, which is reversed together with it at 20 bits */
+            uint8_t vucf = framing_index == 0 ? ( ctx->bit_depth == 20 ? 0x80 : 0x10 ) : 0;
+
+            if( ctx->bit_depth == 24 )
+            {
+                o[0] = rev[(l >>  8) & 0xff];
+                o[1] = rev[(l >> 16) & 0xff];
+                o[2] = rev[(l >> 24) & 0xff];
+                o[3] = rev[(r >>  4) & 0xf0] | vucf;
+                o[4] = rev[(r >> 12) & 0xff];
+                o[5] = rev[(r >> 20) & 0xff];
+                o[6] = rev[(r >> 28) & 0x0f];
+            }
+            else if( ctx->bit_depth == 20 )
+            {
+                o[0] = rev[(l >> 12) & 0xff];
+                o[1] = rev[(l >> 20) & 0xff];
+                o[2] = rev[((l >> 28) & 0x0f) | vucf];
+                o[3] = rev[(r >> 12) & 0xff];
+                o[4] = rev[(r >> 20) & 0xff];
+                o[5] = rev[(r >> 28) & 0x0f];
+            }
+            else
+            {
+                o[0] = rev[(l >> 16) & 0xff];
+                o[1] = rev[(l >> 24) & 0xff];
+                o[2] = rev[(r >> 12) & 0xf0] | vucf;
+                o[3] = rev[(r >> 20) & 0xff];
+                o[4] = rev[(r >> 28) & 0x0f];
+            }
+
+            o += stride;
+            if( ++framing_index == SMPTE_302M_FRAMING_LEN )
+                framing_index = 0;
+        }
+    }
+
+    ctx->framing_index = ( ctx->framing_index + num_samples ) % SMPTE_302M_FRAMING_LEN;
+
+    return SMPTE_302M_AES3_HEADER_LEN + payload_len;
+}
@@ -0,0 +1,51 @@
+/*****************************************************************************
+ * 302m.h : SMPTE 302M headers
+ *****************************************************************************
+ * Copyright (C) 2010 NAMETBD
+ *
+ * Authors: Kieran Kunhya <kieran@kunhya.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+#ifndef OBE_FILTERS_AUDIO_302M_H
+#define OBE_FILTERS_AUDIO_302M_H
+
+#define SMPTE_302M_AES3_HEADER_LEN 4
+/* audio_packet_size is a 16-bit field */
+#define SMPTE_302M_MAX_PAYLOAD     65535
+/* AES3 channel status block length in frames */
+#define SMPTE_302M_FRAMING_LEN     192
+
+typedef struct
+{
+    int output_stream_id;
+    int first_channel;
+    int num_channels; /* 2, 4, 6 or 8 */
+    int bit_depth;    /* 16, 20 or 24 */
+
+    int framing_index;
+    uint8_t reverse[256];
+} obe_302m_ctx_t;
+
+void obe_302m_reset( obe_302m_ctx_t *ctx );
+int obe_302m_frame_size( obe_302m_ctx_t *ctx, int num_samples );
+
+/* Samples are planar left-justified 32-bit words starting at the first selected channel.
+ * Writes the AES3 header and payload and returns the length or -1 if the frame is too large */
+int obe_302m_pack( obe_302m_ctx_t *ctx, uint8_t *dst, int32_t **samples, int num_samples );
+
+#endif
@@ -21,21 +21,155 @@
  *
  *****************************************************************************/
 
-#define 337M_SYNCWORD_1_16_BIT 0xf872
-#define 337M_SYNCWORD_1_20_BIT 0x6f872
-#define 337M_SYNCWORD_1_24_BIT 0x96f872
-
-#define 337M_SYNCWORD_2_16_BIT 0x4e1f
-#define 337M_SYNCWORD_2_20_BIT 0x54e1f
-#define 337M_SYNCWORD_2_24_BIT 0xa54e1f
-
-#define 337M_DATA_TYPE_NULL      0
-#define 337M_DATA_TYPE_AC_3      1
-#define 337M_DATA_TYPE_TIMESTAMP 2
-#define 337M_DATA_TYPE_MP2       6
-#define 337M_DATA_TYPE_AAC       10
-#define 337M_DATA_TYPE_HE_AAC    11
-#define 337M_DATA_TYPE_E_AC_3    16
-#define 337M_DATA_TYPE_E_DIST    28
-
-// 337M startcode search function TODO
+#include "common/common.h"
+#include "337m.h"
+
+typedef struct
+{
+    int data_type;
+    int format;
+    int is_latm;
+} obe_337m_format_t;
+
+static const obe_337m_format_t smpte_337m_formats[] =
+{
+    { SMPTE_337M_DATA_TYPE_AC_3,    AUDIO_AC_3,   0 },
+    { SMPTE_337M_DATA_TYPE_MP1_L2,  AUDIO_MP2,    0 },
+    { SMPTE_337M_DATA_TYPE_MP2,     AUDIO_MP2,    0 },
+    { SMPTE_337M_DATA_TYPE_MP2_AAC, AUDIO_AAC,    0 },
+    { SMPTE_337M_DATA_TYPE_AAC,     AUDIO_AAC,    1 },
+    { SMPTE_337M_DATA_TYPE_HE_AAC,  AUDIO_AAC,    1 },
+    { SMPTE_337M_DATA_TYPE_E_AC_3,  AUDIO_E_AC_3, 0 },
+    { -1, -1, -1 },
+};
+
+int obe_337m_data_type_to_format( int data_type )
+{
+    for( int i = 0; smpte_337m_formats[i].data_type != -1; i++ )
+    {
+        if( smpte_337m_formats[i].data_type == data_type )
+            return smpte_337m_formats[i].format;
+    }
+
+    return -1;
+}
+
+int obe_337m_is_latm( int data_type )
+{
+    for( int i = 0; smpte_337m_formats[i].data_type != -1; i++ )
+    {
+        if( smpte_337m_formats[i].data_type == data_type )
+            return smpte_337m_formats[i].is_latm;
+    }
+
+    return 0;
+}
+
+/* Pa and Pb are on consecutive subframes of the pair. Samples are left-justified so check from the largest word size */
+static int get_sync_bit_depth( uint32_t pa, uint32_t pb )
+{
+    if( (pa >> 8) == SMPTE_337M_SYNCWORD_1_24_BIT && (pb >> 8) == SMPTE_337M_SYNCWORD_2_24_BIT )
+        return 24;
+    else if( (pa >> 12) == SMPTE_337M_SYNCWORD_1_20_BIT && (pb >> 12) == SMPTE_337M_SYNCWORD_2_20_BIT )
+        return 20;
+    else if( (pa >> 16) == SMPTE_337M_SYNCWORD_1_16_BIT && (pb >> 16) == SMPTE_337M_SYNCWORD_2_16_BIT )
+        return 16;
+
+    return 0;
+}
+
+void obe_337m_probe_pairs( const int32_t *samples, int num_channels, int num_samples, int *data_types )
+{
+    for( int i = 0; i < num_channels / 2; i++ )
+    {
+        const int32_t *left = &samples[i*2], *right = &samples[i*2+1];
+
+        for( int j = 0; j < num_samples - 1 && !data_types[i]; j++ )
+        {
+            int bit_depth = get_sync_bit_depth( left[j*num_channels], right[j*num_channels] );
+            if( bit_depth )
+            {
+                /* Pc follows Pa in the next sample */
+                int data_type = ((uint32_t)left[(j+1)*num_channels] >> (32 - bit_depth)) & SMPTE_337M_DATA_TYPE_MASK;
+                if( obe_337m_data_type_to_format( data_type ) >= 0 )
+                    data_types[i] = data_type;
+            }
+        }
+    }
+}
+
+void obe_337m_reset( obe_337m_ctx_t *ctx )
+{
+    ctx->state = SMPTE_337M_STATE_SYNC;
+    ctx->payload_len = ctx->payload_pos = 0;
+    ctx->bit_buf = 0;
+    ctx->bit_cnt = 0;
+    ctx->burst_complete = 0;
+}
+
+static void write_word( obe_337m_ctx_t *ctx, uint32_t word )
+{
+    ctx->bit_buf = (ctx->bit_buf << ctx->bit_depth) | word;
+    ctx->bit_cnt += ctx->bit_depth;
+
+    while( ctx->bit_cnt >= 8 && ctx->payload_pos < ctx->payload_len )
+    {
+        ctx->bit_cnt -= 8;
+        ctx->payload[ctx->payload_pos++] = ctx->bit_buf >> ctx->bit_cnt;
+    }
+}
+
+/* Returns the number of samples consumed. Stops early when a burst has been completed. */
+int obe_337m_parse( obe_337m_ctx_t *ctx, const int32_t *left, const int32_t *right, int stride, int num_samples,
+                    int64_t pts, int sample_rate )
+{
+    int i, shift = 32 - ctx->bit_depth, pd;
+
+    for( i = 0; i < num_samples && !ctx->burst_complete; i++ )
+    {
+        uint32_t l = left[i*stride], r = right[i*stride];
+
+        if( ctx->state == SMPTE_337M_STATE_SYNC )
+        {
+            ctx->bit_depth = get_sync_bit_depth( l, r );
+            if( ctx->bit_depth )
+            {
+                shift = 32 - ctx->bit_depth;
+                ctx->burst_pts = pts + (int64_t)i * OBE_CLOCK / sample_rate;
+                ctx->state = SMPTE_337M_STATE_PREAMBLE;
+            }
+        }
+        else if( ctx->state == SMPTE_337M_STATE_PREAMBLE )
+        {
+            ctx->data_type = (l >> shift) & SMPTE_337M_DATA_TYPE_MASK;
+            pd = r >> shift;
+
+            /* Pd is in bits except for E-AC-3 where it is in bytes */
+            ctx->payload_len = ctx->data_type == SMPTE_337M_DATA_TYPE_E_AC_3 ? pd : (pd + 7) >> 3;
+
+            if( obe_337m_data_type_to_format( ctx->data_type ) < 0 || !ctx->payload_len ||
+                ctx->payload_len > SMPTE_337M_MAX_PAYLOAD )
+                obe_337m_reset( ctx );
+            else
+            {
+                ctx->payload_pos = ctx->bit_cnt = 0;
+                ctx->bit_buf = 0;
+                ctx->state = SMPTE_337M_STATE_PAYLOAD;
+            }
+        }
+        else
+        {
+            write_word( ctx, l >> shift );
+            if( ctx->payload_pos < ctx->payload_len )
+                write_word( ctx, r >> shift );
+
+            if( ctx->payload_pos == ctx->payload_len )
+            {
+                ctx->state = SMPTE_337M_STATE_SYNC;
+                ctx->burst_complete = 1;
+            }
+        }
+    }
+
+    return i;
+}
@@ -0,0 +1,88 @@
+/*****************************************************************************
+ * 337m.h : SMPTE 337M headers
+ *****************************************************************************
+ * Copyright (C) 2010 NAMETBD
+ *
+ * Authors: Kieran Kunhya <kieran@kunhya.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+#ifndef OBE_FILTERS_AUDIO_337M_H
+#define OBE_FILTERS_AUDIO_337M_H
+
+#define SMPTE_337M_SYNCWORD_1_16_BIT 0xf872
+#define SMPTE_337M_SYNCWORD_1_20_BIT 0x6f872
+#define SMPTE_337M_SYNCWORD_1_24_BIT 0x96f872
+
+#define SMPTE_337M_SYNCWORD_2_16_BIT 0x4e1f
+#define SMPTE_337M_SYNCWORD_2_20_BIT 0x54e1f
+#define SMPTE_337M_SYNCWORD_2_24_BIT 0xa54e1f
+
+#define SMPTE_337M_DATA_TYPE_NULL      0
+#define SMPTE_337M_DATA_TYPE_AC_3      1
+#define SMPTE_337M_DATA_TYPE_TIMESTAMP 2
+#define SMPTE_337M_DATA_TYPE_MP1_L2    5
+#define SMPTE_337M_DATA_TYPE_MP2       6
+#define SMPTE_337M_DATA_TYPE_MP2_AAC   7
+#define SMPTE_337M_DATA_TYPE_AAC       10
+#define SMPTE_337M_DATA_TYPE_HE_AAC    11
+#define SMPTE_337M_DATA_TYPE_E_AC_3    16
+#define SMPTE_337M_DATA_TYPE_E_DIST    28
+
+#define SMPTE_337M_DATA_TYPE_MASK      0x1f
+
+/* Largest burst payload we accept (E-AC-3 can be up to 4096 bytes) */
+#define SMPTE_337M_MAX_PAYLOAD 8192
+
+enum smpte_337m_state_e
+{
+    SMPTE_337M_STATE_SYNC,
+    SMPTE_337M_STATE_PREAMBLE,
+    SMPTE_337M_STATE_PAYLOAD,
+};
+
+typedef struct
+{
+    int output_stream_id;
+    int sdi_audio_pair;
+
+    int state;
+    int bit_depth;
+    int data_type;
+
+    /* Payload of the current burst */
+    int payload_len;
+    int payload_pos;
+    uint8_t payload[SMPTE_337M_MAX_PAYLOAD];
+    uint64_t bit_buf;
+    int bit_cnt;
+
+    int64_t burst_pts;
+    int burst_complete;
+} obe_337m_ctx_t;
+
+int obe_337m_data_type_to_format( int data_type );
+int obe_337m_is_latm( int data_type );
+
+/* Samples are left-justified 32-bit words, stride is in samples (e.g. number of channels if interleaved) */
+void obe_337m_probe_pairs( const int32_t *samples, int num_channels, int num_samples, int *data_types );
+
+void obe_337m_reset( obe_337m_ctx_t *ctx );
+int obe_337m_parse( obe_337m_ctx_t *ctx, const int32_t *left, const int32_t *right, int stride, int num_samples,
+                    int64_t pts, int sample_rate );
+
+#endif
@@ -22,73 +22,420 @@
 
 #include "common/common.h"
 #include "audio.h"
+#include "337m/337m.h"
+#include "302m/302m.h"
 
-static void *start_filter( void *ptr )
+/* The samples for every encoded pair of one SDI audio frame are converted into a single arena.
+ * Arenas go back to the free list once every encoder has released its frame. */
+typedef struct obe_aud_arena_t
+{
+    struct obe_aud_arena_pool_t *pool;
+    struct obe_aud_arena_t *next;
+    int refcount;
+    int size;
+    uint8_t *data;
+} obe_aud_arena_t;
+
+typedef struct obe_aud_arena_pool_t
+{
+    pthread_mutex_t mutex;
+    obe_aud_arena_t *free_arenas;
+    int outstanding;
+    int closed;
+} obe_aud_arena_pool_t;
+
+static void free_arena_pool( obe_aud_arena_pool_t *pool )
+{
+    obe_aud_arena_t *arena;
+
+    while( pool->free_arenas )
+    {
+        arena = pool->free_arenas;
+        pool->free_arenas = arena->next;
+        av_free( arena->data );
+        free( arena );
+    }
+
+    pthread_mutex_destroy( &pool->mutex );
+    free( pool );
+}
+
+static void release_arena_data( void *ptr )
+{
+    obe_raw_frame_t *raw_frame = ptr;
+    obe_aud_arena_t *arena = raw_frame->opaque;
+    obe_aud_arena_pool_t *pool = arena->pool;
+    int destroy_pool = 0;
+
+    pthread_mutex_lock( &pool->mutex );
+    if( !--arena->refcount )
+    {
+        pool->outstanding--;
+        if( !pool->closed )
+        {
+            arena->next = pool->free_arenas;
+            pool->free_arenas = arena;
+        }
+        else
+        {
+            av_free( arena->data );
+            free( arena );
+            destroy_pool = !pool->outstanding;
+        }
+    }
+    pthread_mutex_unlock( &pool->mutex );
+
+    if( destroy_pool )
+        free_arena_pool( pool );
+}
+
+static obe_aud_arena_t *get_arena( obe_aud_arena_pool_t *pool, int size )
+{
+    obe_aud_arena_t *arena = NULL;
+
+    pthread_mutex_lock( &pool->mutex );
+    if( pool->free_arenas )
+    {
+        arena = pool->free_arenas;
+        pool->free_arenas = arena->next;
+    }
+    pthread_mutex_unlock( &pool->mutex );
+
+    if( !arena )
+    {
+        arena = calloc( 1, sizeof(*arena) );
+        if( !arena )
+            return NULL;
+        arena->pool = pool;
+    }
+
+    if( arena->size < size )
+    {
+        av_free( arena->data );
+        arena->data = av_malloc( size );
+        if( !arena->data )
+        {
+            free( arena );
+            return NULL;
+        }
+        arena->size = size;
+    }
+
+    pthread_mutex_lock( &pool->mutex );
+    pool->outstanding++;
+    pthread_mutex_unlock( &pool->mutex );
+
+    return arena;
+}
+
+static void close_arena_pool( obe_aud_arena_pool_t *pool )
+{
+    int destroy_pool;
+
+    /* Encoders may still hold some arenas. The last one to be released frees the pool */
+    pthread_mutex_lock( &pool->mutex );
+    pool->closed = 1;
+    destroy_pool = !pool->outstanding;
+    pthread_mutex_unlock( &pool->mutex );
+
+    if( destroy_pool )
+        free_arena_pool( pool );
+}
+
+/* 24-bit SDI samples are left-justified in S32 so a plain scale is exact in float */
+static void convert_s32p( uint8_t **dst, int dst_fmt, int32_t **src, int num_channels, int num_samples )
+{
+    const float scale = 1.0f / 2147483648.0f;
+
+    if( dst_fmt == AV_SAMPLE_FMT_FLTP )
+    {
+        for( int i = 0; i < num_channels; i++ )
+        {
+            float *restrict out = (float*)dst[i];
+            const int32_t *restrict in = src[i];
+            for( int j = 0; j < num_samples; j++ )
+                out[j] = in[j] * scale;
+        }
+    }
+    else if( dst_fmt == AV_SAMPLE_FMT_FLT )
+    {
+        for( int i = 0; i < num_channels; i++ )
+        {
+            float *restrict out = (float*)dst[0] + i;
+            const int32_t *restrict in = src[i];
+            for( int j = 0; j < num_samples; j++ )
+                out[j*num_channels] = in[j] * scale;
+        }
+    }
+    else
+    {
+        for( int i = 0; i < num_channels; i++ )
+            memcpy( dst[i], src[i], num_samples * sizeof(int32_t) );
+    }
+}
+
+typedef struct
+{
+    obe_t *h;
+    obe_337m_ctx_t *smpte337m[MAX_CHANNELS/2];
+    obe_302m_ctx_t *smpte302m[MAX_CHANNELS/2];
+    int num_337m;
+    int num_302m;
+    int sample_rate;
+    obe_aud_arena_pool_t *arena_pool;
+} obe_aud_filter_ctx_t;
+
+static void close_filter( void *handle )
+{
+    obe_aud_filter_ctx_t *ctx = handle;
+
+    for( int i = 0; i < ctx->num_337m; i++ )
+        free( ctx->smpte337m[i] );
+
+    for( int i = 0; i < ctx->num_302m; i++ )
+        free( ctx->smpte302m[i] );
+
+    if( ctx->arena_pool )
+        close_arena_pool( ctx->arena_pool );
+
+    free( ctx );
+}
+
+static void *open_filter( obe_aud_filter_params_t *filter_params )
 {
-    obe_raw_frame_t *raw_frame, *split_raw_frame;
-    obe_aud_filter_params_t *filter_params = ptr;
     obe_t *h = filter_params->h;
-    obe_filter_t *filter = filter_params->filter;
     obe_output_stream_t *output_stream;
-    int num_channels;
+    obe_int_input_stream_t *input_stream;
+    obe_aud_filter_ctx_t *ctx;
+
+    free( filter_params );
+
+    ctx = calloc( 1, sizeof(*ctx) );
+    if( !ctx )
+    {
+        fprintf( stderr, "Malloc failed\n" );
+        return NULL;
+    }
+    ctx->h = h;
+    ctx->sample_rate = 48000;
 
-    while( 1 )
+    ctx->arena_pool = calloc( 1, sizeof(*ctx->arena_pool) );
+    if( !ctx->arena_pool )
     {
-        pthread_mutex_lock( &filter->queue.mutex );
+        fprintf( stderr, "Malloc failed\n" );
+        goto fail;
+    }
+    pthread_mutex_init( &ctx->arena_pool->mutex, NULL );
 
-        while( !filter->queue.size && !filter->cancel_thread )
-            pthread_cond_wait( &filter->queue.in_cv, &filter->queue.mutex );
+    /* Passed-through SMPTE 337M streams are extracted here instead of being encoded */
+    for( int i = 0; i < h->num_output_streams; i++ )
+    {
+        output_stream = &h->output_streams[i];
+        input_stream = get_input_stream( h, output_stream->input_stream_id );
+        if( output_stream->stream_action != STREAM_PASSTHROUGH || !input_stream || !input_stream->sdi_audio_pair ||
+            ctx->num_337m == MAX_CHANNELS/2 )
+            continue;
 
-        if( filter->cancel_thread )
+        obe_337m_ctx_t *smpte337m = calloc( 1, sizeof(*smpte337m) );
+        if( !smpte337m )
         {
-            pthread_mutex_unlock( &filter->queue.mutex );
-            break;
+            fprintf( stderr, "Malloc failed\n" );
+            goto fail;
         }
+        obe_337m_reset( smpte337m );
+        smpte337m->output_stream_id = output_stream->output_stream_id;
+        smpte337m->sdi_audio_pair = input_stream->sdi_audio_pair;
+        ctx->sample_rate = input_stream->sample_rate;
+        ctx->smpte337m[ctx->num_337m++] = smpte337m;
+    }
 
-        raw_frame = filter->queue.queue[0];
-        pthread_mutex_unlock( &filter->queue.mutex );
+    /* Passed-through PCM is packed into SMPTE 302M here */
+    for( int i = 0; i < h->num_output_streams; i++ )
+    {
+        output_stream = &h->output_streams[i];
+        input_stream = get_input_stream( h, output_stream->input_stream_id );
+        if( output_stream->stream_action != STREAM_PASSTHROUGH || !input_stream || input_stream->sdi_audio_pair ||
+            input_stream->stream_format != AUDIO_PCM || ctx->num_302m == MAX_CHANNELS/2 )
+            continue;
 
-        /* ignore the video track */
-        for( int i = 1; i < h->num_encoders; i++ )
+        obe_302m_ctx_t *smpte302m = calloc( 1, sizeof(*smpte302m) );
+        if( !smpte302m )
         {
-            output_stream = get_output_stream( h, h->encoders[i]->output_stream_id );
-            num_channels = av_get_channel_layout_nb_channels( output_stream->channel_layout );
+            fprintf( stderr, "Malloc failed\n" );
+            goto fail;
+        }
+        obe_302m_reset( smpte302m );
+        smpte302m->output_stream_id = output_stream->output_stream_id;
+        smpte302m->first_channel = (MAX( output_stream->sdi_audio_pair, 1 )-1)<<1;
+        smpte302m->num_channels = av_get_channel_layout_nb_channels( output_stream->channel_layout );
+        smpte302m->bit_depth = output_stream->bit_depth;
+        ctx->smpte302m[ctx->num_302m++] = smpte302m;
+    }
 
-            split_raw_frame = new_raw_frame();
-            if( !split_raw_frame )
-            {
-                syslog( LOG_ERR, "Malloc failed\n" );
-                return NULL;
-            }
-            memcpy( split_raw_frame, raw_frame, sizeof(*split_raw_frame) );
-            memset( split_raw_frame->audio_frame.audio_data, 0, sizeof(split_raw_frame->audio_frame.audio_data) );
-            split_raw_frame->audio_frame.linesize = split_raw_frame->audio_frame.num_channels = 0;
-            split_raw_frame->audio_frame.channel_layout = output_stream->channel_layout;
+    return ctx;
 
-            if( av_samples_alloc( split_raw_frame->audio_frame.audio_data, &split_raw_frame->audio_frame.linesize, num_channels,
-                                  split_raw_frame->audio_frame.num_samples, split_raw_frame->audio_frame.sample_fmt, 0 ) < 0 )
+fail:
+    close_filter( ctx );
+    return NULL;
+}
+
+static int filter_frame( void *handle, obe_raw_frame_t *raw_frame )
+{
+    obe_aud_filter_ctx_t *ctx = handle;
+    obe_t *h = ctx->h;
+    obe_raw_frame_t *split_raw_frame;
+    obe_output_stream_t *output_stream;
+    obe_coded_frame_t *coded_frame;
+    obe_aud_arena_t *arena = NULL;
+    int num_channels, arena_size, offset, size, linesize, num_splits;
+    obe_raw_frame_t *split_raw_frames[MAX_STREAMS];
+    uint8_t *planes[MAX_CHANNELS];
+
+    /* Size every encoded pair once so they can all be converted into one arena */
+    arena_size = 0;
+    for( int i = 0; i < h->num_encoders; i++ )
+    {
+        if( h->encoders[i]->is_video )
+            continue;
+
+        output_stream = get_output_stream( h, h->encoders[i]->output_stream_id );
+        num_channels = av_get_channel_layout_nb_channels( output_stream->channel_layout );
+        size = av_samples_get_buffer_size( NULL, num_channels, raw_frame->audio_frame.num_samples,
+                                           h->encoders[i]->input_sample_format, 0 );
+        if( size < 0 )
+        {
+            syslog( LOG_ERR, "[audio] Invalid sample format\n" );
+            goto fail;
+        }
+        arena_size += size;
+    }
+
+    if( arena_size )
+    {
+        arena = get_arena( ctx->arena_pool, arena_size );
+        if( !arena )
+        {
+            syslog( LOG_ERR, "Malloc failed\n" );
+            goto fail;
+        }
+    }
+
+    num_splits = offset = 0;
+    for( int i = 0; i < h->num_encoders; i++ )
+    {
+        /* ignore the video tracks */
+        if( h->encoders[i]->is_video || !arena )
+            continue;
+
+        output_stream = get_output_stream( h, h->encoders[i]->output_stream_id );
+        num_channels = av_get_channel_layout_nb_channels( output_stream->channel_layout );
+
+        split_raw_frame = new_raw_frame();
+        if( !split_raw_frame )
+        {
+            syslog( LOG_ERR, "Malloc failed\n" );
+            goto fail;
+        }
+        memcpy( split_raw_frame, raw_frame, sizeof(*split_raw_frame) );
+        memset( split_raw_frame->audio_frame.audio_data, 0, sizeof(split_raw_frame->audio_frame.audio_data) );
+        split_raw_frame->num_user_data = 0;
+        split_raw_frame->user_data = NULL;
+        split_raw_frame->audio_frame.num_channels = 0;
+        split_raw_frame->audio_frame.channel_layout = output_stream->channel_layout;
+        split_raw_frame->audio_frame.sample_fmt = h->encoders[i]->input_sample_format;
+        split_raw_frame->opaque = arena;
+        split_raw_frame->release_data = release_arena_data;
+
+        size = av_samples_fill_arrays( planes, &linesize, arena->data + offset, num_channels,
+                                       raw_frame->audio_frame.num_samples, split_raw_frame->audio_frame.sample_fmt, 0 );
+        memcpy( split_raw_frame->audio_frame.audio_data, planes, num_channels * sizeof(*planes) );
+        split_raw_frame->audio_frame.linesize = linesize;
+        offset += size;
+
+        /* TODO: offset the channel pointers by the user's request */
+        convert_s32p( split_raw_frame->audio_frame.audio_data, split_raw_frame->audio_frame.sample_fmt,
+                      (int32_t**)&raw_frame->audio_frame.audio_data[((output_stream->sdi_audio_pair-1)<<1)+output_stream->mono_channel],
+                      num_channels, raw_frame->audio_frame.num_samples );
+
+        split_raw_frames[num_splits++] = split_raw_frame;
+    }
+
+    /* Queue only once everything is converted so an encoder can't return the arena early */
+    if( arena )
+        arena->refcount = num_splits;
+    for( int i = 0, j = 0; i < h->num_encoders; i++ )
+    {
+        if( !h->encoders[i]->is_video && arena )
+            add_to_encode_queue( h, split_raw_frames[j++], h->encoders[i]->output_stream_id );
+    }
+
+    for( int i = 0; i < ctx->num_337m; i++ )
+    {
+        obe_337m_ctx_t *smpte337m = ctx->smpte337m[i];
+        int32_t *left = (int32_t*)raw_frame->audio_frame.audio_data[(smpte337m->sdi_audio_pair-1)<<1];
+        int32_t *right = (int32_t*)raw_frame->audio_frame.audio_data[((smpte337m->sdi_audio_pair-1)<<1)+1];
+        int pos = 0;
+
+        while( pos < raw_frame->audio_frame.num_samples )
+        {
+            pos += obe_337m_parse( smpte337m, &left[pos], &right[pos], 1, raw_frame->audio_frame.num_samples - pos,
+                                   raw_frame->pts + (int64_t)pos * OBE_CLOCK / ctx->sample_rate, ctx->sample_rate );
+
+            if( smpte337m->burst_complete )
             {
-                syslog( LOG_ERR, "Malloc failed\n" );
-                return NULL;
+                coded_frame = new_coded_frame( smpte337m->output_stream_id, smpte337m->payload_len );
+                if( !coded_frame )
+                {
+                    syslog( LOG_ERR, "Malloc failed\n" );
+                    goto fail;
+                }
+
+                memcpy( coded_frame->data, smpte337m->payload, smpte337m->payload_len );
+                coded_frame->pts = smpte337m->burst_pts;
+                coded_frame->random_access = 1;
+                add_to_queue( &h->mux_queue, coded_frame );
+                smpte337m->burst_complete = 0;
             }
+        }
+    }
+
+    for( int i = 0; i < ctx->num_302m; i++ )
+    {
+        obe_302m_ctx_t *smpte302m = ctx->smpte302m[i];
 
-            /* TODO: offset the channel pointers by the user's request */
-            av_samples_copy( split_raw_frame->audio_frame.audio_data,
-                             &raw_frame->audio_frame.audio_data[((output_stream->sdi_audio_pair-1)<<1)+output_stream->mono_channel], 0, 0,
-                             split_raw_frame->audio_frame.num_samples, num_channels, split_raw_frame->audio_frame.sample_fmt );
+        if( smpte302m->first_channel + smpte302m->num_channels > raw_frame->audio_frame.num_channels )
+            continue;
 
-            add_to_encode_queue( h, split_raw_frame, h->encoders[i]->output_stream_id );
+        coded_frame = new_coded_frame( smpte302m->output_stream_id, obe_302m_frame_size( smpte302m, raw_frame->audio_frame.num_samples ) );
+        if( !coded_frame )
+        {
+            syslog( LOG_ERR, "Malloc failed\n" );
+            goto fail;
         }
 
-        remove_from_queue( &filter->queue );
-        raw_frame->release_data( raw_frame );
-        raw_frame->release_frame( raw_frame );
-        raw_frame = NULL;
+        if( obe_302m_pack( smpte302m, coded_frame->data, (int32_t**)&raw_frame->audio_frame.audio_data[smpte302m->first_channel],
+                           raw_frame->audio_frame.num_samples ) < 0 )
+        {
+            syslog( LOG_ERR, "[302m] Frame too large\n" );
+            destroy_coded_frame( coded_frame );
+            continue;
+        }
+
+        coded_frame->pts = raw_frame->pts;
+        coded_frame->random_access = 1;
+        add_to_queue( &h->mux_queue, coded_frame );
     }
 
-    free( filter_params );
+    raw_frame->release_data( raw_frame );
+    raw_frame->release_frame( raw_frame );
 
-    return NULL;
+    return 0;
+
+fail:
+    raw_frame->release_data( raw_frame );
+    raw_frame->release_frame( raw_frame );
+
+    return -1;
 }
 
-const obe_aud_filter_func_t audio_filter = { start_filter };
+const obe_aud_filter_func_t audio_filter = { open_filter, filter_frame, close_filter };
@@ -25,17 +25,22 @@
 #define OBE_FILTERS_AUDIO_H
 #include <libavutil/samplefmt.h>
 
-typedef struct
-{
-    void* (*start_filter)( void *ptr );
-} obe_aud_filter_func_t;
-
 typedef struct
 {
     obe_t *h;
     obe_filter_t *filter;
 } obe_aud_filter_params_t;
 
+/* The audio filter runs as a task on the shared task pool.
+ * open_filter takes ownership of the parameters and returns the filter context.
+ * filter_frame consumes the raw frame. */
+typedef struct
+{
+    void* (*open_filter)( obe_aud_filter_params_t *filter_params );
+    int (*filter_frame)( void *ctx, obe_raw_frame_t *raw_frame );
+    void (*close_filter)( void *ctx );
+} obe_aud_filter_func_t;
+
 extern const obe_aud_filter_func_t audio_filter;
 
 #endif
@@ -38,8 +38,30 @@ typedef uint16_t pixel;
 typedef uint8_t pixel;
 #endif
 
+/* Each distinct output size and colourspace is filtered once and shared by the encoders which use it */
 typedef struct
 {
+    int width;
+    int height;
+    int target_csp;
+
+    /* resize */
+    struct SwsContext *sws_ctx;
+    enum PixelFormat dst_pix_fmt;
+
+    int num_output_streams;
+    int output_stream_ids[MAX_STREAMS];
+} obe_vid_filter_rendition_t;
+
+typedef struct
+{
+    obe_t *h;
+    obe_int_input_stream_t *input_stream;
+    obe_output_stream_t *output_stream; /* the first rendition decides the SAR */
+
+    obe_vid_filter_rendition_t *renditions;
+    int num_renditions;
+
     /* cpu flags */
     uint32_t avutil_cpu;
 
@@ -47,9 +69,7 @@ typedef struct
     void (*scale_plane)( uint16_t *src, int stride, int width, int height, int lshift, int rshift );
 
     /* resize */
-    struct SwsContext *sws_ctx;
     int sws_ctx_flags;
-    enum PixelFormat dst_pix_fmt;
 
     /* downsample */
     void (*downsample_chroma_row_top)( uint16_t *src, uint16_t *dst, int width, int stride );
@@ -270,33 +290,37 @@ static void blank_lines( obe_raw_frame_t *raw_frame )
     blank_line( y, u, v, raw_frame->img.width / 2 );
 }
 
-static int resize_frame( obe_vid_filter_ctx_t *vfilt, obe_raw_frame_t *raw_frame, int width )
+static int resize_frame( obe_vid_filter_ctx_t *vfilt, obe_vid_filter_rendition_t *rendition, obe_raw_frame_t *raw_frame )
 {
     obe_image_t tmp_image = {0};
 
-    if( !vfilt->sws_ctx || raw_frame->reset_obe )
+    if( !rendition->sws_ctx || raw_frame->reset_obe )
     {
         if( IS_INTERLACED( raw_frame->img.format ) )
-            vfilt->dst_pix_fmt = raw_frame->img.csp;
+            rendition->dst_pix_fmt = raw_frame->img.csp;
         else
-            vfilt->dst_pix_fmt = raw_frame->img.csp == PIX_FMT_YUV422P10 ? PIX_FMT_YUV420P10 : PIX_FMT_YUV420P;
+            rendition->dst_pix_fmt = raw_frame->img.csp == PIX_FMT_YUV422P10 ? PIX_FMT_YUV420P10 : PIX_FMT_YUV420P;
 
         vfilt->sws_ctx_flags |= SWS_FULL_CHR_H_INP | SWS_ACCURATE_RND | SWS_LANCZOS;
 
-        vfilt->sws_ctx = sws_getContext( raw_frame->img.width, raw_frame->img.height, raw_frame->img.csp,
-                                         width, raw_frame->img.height, vfilt->dst_pix_fmt,
-                                         vfilt->sws_ctx_flags, NULL, NULL, NULL );
-        if( !vfilt->sws_ctx )
+        if( rendition->sws_ctx )
+            sws_freeContext( rendition->sws_ctx );
+
+        /* Only progressive video is scaled vertically */
+        rendition->sws_ctx = sws_getContext( raw_frame->img.width, raw_frame->img.height, raw_frame->img.csp,
+                                             rendition->width, rendition->height, rendition->dst_pix_fmt,
+                                             vfilt->sws_ctx_flags, NULL, NULL, NULL );
+        if( !rendition->sws_ctx )
         {
             fprintf( stderr, "Video scaling failed\n" );
             return -1;
         }
     }
 
-    tmp_image.width = width;
-    tmp_image.height = raw_frame->img.height;
-    tmp_image.planes = av_pix_fmt_descriptors[vfilt->dst_pix_fmt].nb_components;
-    tmp_image.csp = vfilt->dst_pix_fmt;
+    tmp_image.width = rendition->width;
+    tmp_image.height = rendition->height;
+    tmp_image.planes = av_pix_fmt_descriptors[rendition->dst_pix_fmt].nb_components;
+    tmp_image.csp = rendition->dst_pix_fmt;
     tmp_image.format = raw_frame->img.format;
 
     if( av_image_alloc( tmp_image.plane, tmp_image.stride, tmp_image.width, tmp_image.height+1,
@@ -306,8 +330,8 @@ static int resize_frame( obe_vid_filter_ctx_t *vfilt, obe_raw_frame_t *raw_frame
         return -1;
     }
 
-    sws_scale( vfilt->sws_ctx, (const uint8_t* const*)raw_frame->img.plane, raw_frame->img.stride,
-               0, tmp_image.height, tmp_image.plane, tmp_image.stride );
+    sws_scale( rendition->sws_ctx, (const uint8_t* const*)raw_frame->img.plane, raw_frame->img.stride,
+               0, raw_frame->img.height, tmp_image.plane, tmp_image.stride );
 
     raw_frame->release_data( raw_frame );
     memcpy( &raw_frame->alloc_img, &tmp_image, sizeof(obe_image_t) );
@@ -655,103 +679,180 @@ static int encapsulate_user_data( obe_raw_frame_t *raw_frame, obe_int_input_stre
     return ret;
 }
 
-static void *start_filter( void *ptr )
+static int filter_rendition( obe_vid_filter_ctx_t *vfilt, obe_vid_filter_rendition_t *rendition, obe_raw_frame_t *raw_frame )
 {
-    obe_vid_filter_params_t *filter_params = ptr;
-    obe_t *h = filter_params->h;
-    obe_filter_t *filter = filter_params->filter;
-    obe_int_input_stream_t *input_stream = filter_params->input_stream;
-    obe_raw_frame_t *raw_frame;
-    obe_output_stream_t *output_stream = get_output_stream( h, 0 ); /* FIXME when output_stream_id for video is not zero */
     int h_shift, v_shift;
     const AVPixFmtDescriptor *pfd;
 
+    /* Resize if necessary. Together with colourspace conversion if progressive */
+    if( raw_frame->img.width != rendition->width || raw_frame->img.height != rendition->height ||
+        ( !IS_INTERLACED( raw_frame->img.format ) && rendition->target_csp == X264_CSP_I420 ) )
+    {
+        if( resize_frame( vfilt, rendition, raw_frame ) < 0 )
+            return -1;
+    }
+
+    if( av_pix_fmt_get_chroma_sub_sample( raw_frame->img.csp, &h_shift, &v_shift ) < 0 )
+        return -1;
+
+    /* Downconvert using interlaced scaling if input is 4:2:2 and target is 4:2:0 */
+    if( h_shift == 1 && v_shift == 0 && rendition->target_csp == X264_CSP_I420 )
+    {
+        if( downconvert_image_interlaced( vfilt, raw_frame ) < 0 )
+            return -1;
+    }
+
+    pfd = av_pix_fmt_desc_get( raw_frame->img.csp );
+    if( pfd->comp[0].depth_minus1+1 == 10 && X264_BIT_DEPTH == 8 )
+    {
+        if( dither_image( vfilt, raw_frame ) < 0 )
+            return -1;
+    }
+
+    return 0;
+}
+
+static void close_filter( void *handle )
+{
+    obe_vid_filter_ctx_t *vfilt = handle;
+
+    if( vfilt->renditions )
+    {
+        for( int i = 0; i < vfilt->num_renditions; i++ )
+        {
+            if( vfilt->renditions[i].sws_ctx )
+                sws_freeContext( vfilt->renditions[i].sws_ctx );
+        }
+        free( vfilt->renditions );
+    }
+
+    free( vfilt );
+}
+
+static void *open_filter( obe_vid_filter_params_t *filter_params )
+{
+    obe_t *h = filter_params->h;
+    obe_int_input_stream_t *input_stream = filter_params->input_stream;
+    obe_vid_filter_rendition_t *renditions;
+
+    free( filter_params );
+
     obe_vid_filter_ctx_t *vfilt = calloc( 1, sizeof(*vfilt) );
     if( !vfilt )
     {
         fprintf( stderr, "Malloc failed\n" );
-        goto end;
+        return NULL;
+    }
+
+    vfilt->h = h;
+    vfilt->input_stream = input_stream;
+    renditions = vfilt->renditions = calloc( MAX_STREAMS, sizeof(*renditions) );
+    if( !renditions )
+    {
+        fprintf( stderr, "Malloc failed\n" );
+        goto fail;
     }
 
     init_filter( vfilt );
 
-    while( 1 )
+    /* Group the video encoders fed by this input by output size and colourspace */
+    for( int i = 0; i < h->num_output_streams; i++ )
     {
-        /* TODO: support resolution changes */
-        /* TODO: support changes in pixel format */
+        obe_output_stream_t *stream = &h->output_streams[i];
+        if( stream->stream_action != STREAM_ENCODE || ( stream->stream_format != VIDEO_AVC && stream->stream_format != VIDEO_MPEG2 ) ||
+            stream->input_stream_id != input_stream->input_stream_id )
+            continue;
 
-        pthread_mutex_lock( &filter->queue.mutex );
+        if( !vfilt->output_stream )
+            vfilt->output_stream = stream;
 
-        while( !filter->queue.size && !filter->cancel_thread )
-            pthread_cond_wait( &filter->queue.in_cv, &filter->queue.mutex );
+        int j = 0;
+        while( j < vfilt->num_renditions && ( renditions[j].width != stream->avc_param.i_width ||
+               renditions[j].height != stream->avc_param.i_height ||
+               renditions[j].target_csp != ( stream->avc_param.i_csp & X264_CSP_MASK ) ) )
+            j++;
 
-        if( filter->cancel_thread )
+        if( j == vfilt->num_renditions )
         {
-            pthread_mutex_unlock( &filter->queue.mutex );
-            goto end;
+            renditions[j].width = stream->avc_param.i_width;
+            renditions[j].height = stream->avc_param.i_height;
+            renditions[j].target_csp = stream->avc_param.i_csp & X264_CSP_MASK;
+            vfilt->num_renditions++;
         }
 
-        raw_frame = filter->queue.queue[0];
-        pthread_mutex_unlock( &filter->queue.mutex );
+        renditions[j].output_stream_ids[renditions[j].num_output_streams++] = stream->output_stream_id;
+    }
 
-        /* TODO: scale 8-bit to 10-bit
-         * TODO: convert from 4:2:0 to 4:2:2 */
+    if( !vfilt->num_renditions )
+    {
+        fprintf( stderr, "No video output streams\n" );
+        goto fail;
+    }
 
-        if( raw_frame->img.format == INPUT_VIDEO_FORMAT_PAL )
-            blank_lines( raw_frame );
+    return vfilt;
 
-        /* Resize if necessary. Together with colourspace conversion if progressive */
-        if( raw_frame->img.width != output_stream->avc_param.i_width || (!IS_INTERLACED( raw_frame->img.format ) &&
-                                                                          filter_params->target_csp == X264_CSP_I420 ) )
-        {
-            if( resize_frame( vfilt, raw_frame, output_stream->avc_param.i_width ) < 0 )
-                goto end;
-        }
+fail:
+    close_filter( vfilt );
+    return NULL;
+}
 
-        if( av_pix_fmt_get_chroma_sub_sample( raw_frame->img.csp, &h_shift, &v_shift ) < 0 )
-            goto end;
+static int filter_frame( void *handle, obe_raw_frame_t *raw_frame )
+{
+    obe_vid_filter_ctx_t *vfilt = handle;
+    obe_t *h = vfilt->h;
+    obe_raw_frame_t *rendition_frames[MAX_STREAMS], *stream_frames[MAX_STREAMS];
+    obe_vid_filter_rendition_t *rendition;
 
-        /* Downconvert using interlaced scaling if input is 4:2:2 and target is 4:2:0 */
-        if( h_shift == 1 && v_shift == 0 && filter_params->target_csp == X264_CSP_I420 )
-        {
-            if( downconvert_image_interlaced( vfilt, raw_frame ) < 0 )
-                goto end;
-        }
+    /* TODO: support resolution changes */
+    /* TODO: support changes in pixel format */
 
-        pfd = av_pix_fmt_desc_get( raw_frame->img.csp );
-        if( pfd->comp[0].depth_minus1+1 == 10 && X264_BIT_DEPTH == 8 )
-        {
-            if( dither_image( vfilt, raw_frame ) < 0 )
-                goto end;
-        }
+    /* TODO: scale 8-bit to 10-bit
+     * TODO: convert from 4:2:0 to 4:2:2 */
 
-        if( encapsulate_user_data( raw_frame, input_stream ) < 0 )
-            goto end;
+    if( raw_frame->img.format == INPUT_VIDEO_FORMAT_PAL )
+        blank_lines( raw_frame );
 
-        /* If SAR, on an SD stream, has not been updated by AFD or WSS, set to default 4:3
-         * TODO: make this user-choosable. OBE will prioritise any SAR information from AFD or WSS over any user settings */
-        if( raw_frame->sar_width == 1 && raw_frame->sar_height == 1 )
-        {
-            set_sar( raw_frame, IS_SD( raw_frame->img.format ) ? output_stream->is_wide : 1 );
-            raw_frame->sar_guess = 1;
-        }
+    if( encapsulate_user_data( raw_frame, vfilt->input_stream ) < 0 )
+        goto fail;
 
-        remove_from_queue( &filter->queue );
-        add_to_encode_queue( h, raw_frame, 0 );
+    /* If SAR, on an SD stream, has not been updated by AFD or WSS, set to default 4:3
+     * TODO: make this user-choosable. OBE will prioritise any SAR information from AFD or WSS over any user settings */
+    if( raw_frame->sar_width == 1 && raw_frame->sar_height == 1 )
+    {
+        set_sar( raw_frame, IS_SD( raw_frame->img.format ) ? vfilt->output_stream->is_wide : 1 );
+        raw_frame->sar_guess = 1;
     }
 
-end:
-    if( vfilt )
+    if( share_raw_frame( raw_frame, rendition_frames, vfilt->num_renditions ) < 0 )
     {
-        if( vfilt->sws_ctx )
-            sws_freeContext( vfilt->sws_ctx );
+        syslog( LOG_ERR, "Malloc failed\n" );
+        goto fail;
+    }
+
+    for( int i = 0; i < vfilt->num_renditions; i++ )
+    {
+        rendition = &vfilt->renditions[i];
+
+        if( filter_rendition( vfilt, rendition, rendition_frames[i] ) < 0 )
+            return -1;
 
-        free( vfilt );
+        if( share_raw_frame( rendition_frames[i], stream_frames, rendition->num_output_streams ) < 0 )
+        {
+            syslog( LOG_ERR, "Malloc failed\n" );
+            return -1;
+        }
+
+        for( int j = 0; j < rendition->num_output_streams; j++ )
+            add_to_encode_queue( h, stream_frames[j], rendition->output_stream_ids[j] );
     }
 
-    free( filter_params );
+    return 0;
 
-    return NULL;
+fail:
+    raw_frame->release_data( raw_frame );
+    raw_frame->release_frame( raw_frame );
+
+    return -1;
 }
 
-const obe_vid_filter_func_t video_filter = { start_filter };
+const obe_vid_filter_func_t video_filter = { open_filter, filter_frame, close_filter };
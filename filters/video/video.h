@@ -24,19 +24,21 @@
 #ifndef OBE_FILTERS_VIDEO_H
 #define OBE_FILTERS_VIDEO_H
 
-typedef struct
-{
-    void* (*start_filter)( void *ptr );
-} obe_vid_filter_func_t;
-
 typedef struct
 {
     obe_t *h;
     obe_filter_t *filter;
     obe_int_input_stream_t *input_stream;
-    int target_csp;
 } obe_vid_filter_params_t;
 
+/* The video filter runs as a task on the shared task pool, like the audio filter */
+typedef struct
+{
+    void* (*open_filter)( obe_vid_filter_params_t *filter_params );
+    int (*filter_frame)( void *ctx, obe_raw_frame_t *raw_frame );
+    void (*close_filter)( void *ctx );
+} obe_vid_filter_func_t;
+
 extern const obe_vid_filter_func_t video_filter;
 
 #endif
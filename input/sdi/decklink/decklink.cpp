@@ -33,6 +33,7 @@ extern "C"
 #include "input/sdi/ancillary.h"
 #include "input/sdi/vbi.h"
 #include "input/sdi/x86/sdi.h"
+#include "filters/audio/337m/337m.h"
 #include <libavresample/avresample.h>
 #include <libavutil/opt.h>
 }
@@ -108,10 +109,8 @@ typedef struct
        see section 2.4.15 of the blackmagic decklink sdk documentation. */
     IDeckLinkConfiguration *p_config;
 
-#if 0
-    int      probe_buf_len;
-    int32_t  *audio_probe_buf;
-#endif
+    /* SMPTE 337M data type of each audio pair found during probe */
+    int      smpte337m_data_type[MAX_CHANNELS/2];
 
     /* Video */
     AVCodec         *dec;
@@ -328,7 +327,16 @@ HRESULT DeckLinkCaptureDelegate::VideoInputFrameArrived( IDeckLinkVideoInputFram
     BMDTimeValue stream_time, frame_duration;
 
     if( decklink_opts_->probe_success )
+    {
+        /* Keep looking for SMPTE 337M until the probe finishes */
+        if( audioframe )
+        {
+            audioframe->GetBytes( &frame_bytes );
+            obe_337m_probe_pairs( (int32_t*)frame_bytes, decklink_opts_->num_channels, audioframe->GetSampleFrameCount(),
+                                  decklink_ctx->smpte337m_data_type );
+        }
         return S_OK;
+    }
 
     av_init_packet( &pkt );
 
@@ -356,7 +364,8 @@ HRESULT DeckLinkCaptureDelegate::VideoInputFrameArrived( IDeckLinkVideoInputFram
                 syslog( LOG_WARNING, "Decklink card index %i: No frame received for %"PRIi64" ms", decklink_opts_->card_idx,
                        (cur_frame_time - decklink_ctx->last_frame_time) / 1000 );
                 pthread_mutex_lock( &h->drop_mutex );
-                h->encoder_drop = h->mux_drop = 1;
+                h->encoder_drops++;
+                h->mux_drop = 1;
                 pthread_mutex_unlock( &h->drop_mutex );
             }
 
@@ -437,29 +446,46 @@ HRESULT DeckLinkCaptureDelegate::VideoInputFrameArrived( IDeckLinkVideoInputFram
 
         if( IS_SD( decklink_opts_->video_format ) && first_line != last_line )
         {
-            /* Add a some VBI lines to the ancillary buffer */
-            frame_ptr = (uint32_t*)frame_bytes;
+            obe_sdi_non_display_data_t *non_display_parser = &decklink_ctx->non_display_parser;
 
             /* NTSC starts from line 283 so add an extra line */
             num_vbi_lines = NUM_ACTIVE_VBI_LINES + ( decklink_opts_->video_format == INPUT_VIDEO_FORMAT_NTSC );
             for( int i = 0; i < num_vbi_lines; i++ )
-            {
-                decklink_ctx->unpack_line( frame_ptr, anc_buf_pos, width );
-                anc_buf_pos += anc_line_stride / 2;
-                frame_ptr += stride / 4;
                 last_line = sdi_next_line( decklink_opts_->video_format, last_line );
+
+            if( !decklink_ctx->has_setup_vbi )
+            {
+                vbi_raw_decoder_init( &non_display_parser->vbi_decoder );
+
+                non_display_parser->ntsc = decklink_opts_->video_format == INPUT_VIDEO_FORMAT_NTSC;
+                non_display_parser->vbi_decoder.start[0] = first_line;
+                non_display_parser->vbi_decoder.start[1] = sdi_next_line( decklink_opts_->video_format, first_line );
+                non_display_parser->vbi_decoder.count[0] = last_line - non_display_parser->vbi_decoder.start[1] + 1;
+                non_display_parser->vbi_decoder.count[1] = non_display_parser->vbi_decoder.count[0];
+
+                /* Only slice the lines which carry services the user has selected */
+                if( setup_vbi_window( h, non_display_parser, decklink_opts_->video_format, first_line, num_anc_lines + num_vbi_lines ) < 0 )
+                    goto fail;
+
+                if( setup_vbi_parser( non_display_parser ) < 0 )
+                    goto fail;
+
+                decklink_ctx->has_setup_vbi = 1;
             }
-            num_anc_lines += num_vbi_lines;
 
-            vbi_buf = (uint8_t*)av_malloc( width * 2 * num_anc_lines );
-            if( !vbi_buf )
+            /* Add a some VBI lines to the ancillary buffer if they are needed */
+            if( non_display_parser->vbi_window_offset + non_display_parser->vbi_window_lines > num_anc_lines )
             {
-                syslog( LOG_ERR, "Malloc failed\n" );
-                goto end;
+                frame_ptr = (uint32_t*)frame_bytes;
+                for( int i = 0; i < num_vbi_lines; i++ )
+                {
+                    decklink_ctx->unpack_line( frame_ptr, anc_buf_pos, width );
+                    anc_buf_pos += anc_line_stride / 2;
+                    frame_ptr += stride / 4;
+                }
             }
+            num_anc_lines += num_vbi_lines;
 
-            /* Scale the lines from 10-bit to 8-bit */
-            decklink_ctx->downscale_line( anc_buf, vbi_buf, num_anc_lines );
             anc_buf_pos = anc_buf;
 
             /* Handle Video Index information */
@@ -471,29 +497,27 @@ HRESULT DeckLinkCaptureDelegate::VideoInputFrameArrived( IDeckLinkVideoInputFram
                 tmp_line++;
             }
 
-            if( decode_video_index_information( h, &decklink_ctx->non_display_parser, anc_buf_pos, raw_frame, vii_line ) < 0 )
+            if( decode_video_index_information( h, non_display_parser, anc_buf_pos, raw_frame, vii_line ) < 0 )
                 goto fail;
 
-            if( !decklink_ctx->has_setup_vbi )
+            if( non_display_parser->vbi_window_lines )
             {
-                vbi_raw_decoder_init( &decklink_ctx->non_display_parser.vbi_decoder );
+                vbi_buf = (uint8_t*)av_malloc( width * 2 * non_display_parser->vbi_window_lines );
+                if( !vbi_buf )
+                {
+                    syslog( LOG_ERR, "Malloc failed\n" );
+                    goto end;
+                }
 
-                decklink_ctx->non_display_parser.ntsc = decklink_opts_->video_format == INPUT_VIDEO_FORMAT_NTSC;
-                decklink_ctx->non_display_parser.vbi_decoder.start[0] = first_line;
-                decklink_ctx->non_display_parser.vbi_decoder.start[1] = sdi_next_line( decklink_opts_->video_format, first_line );
-                decklink_ctx->non_display_parser.vbi_decoder.count[0] = last_line - decklink_ctx->non_display_parser.vbi_decoder.start[1] + 1;
-                decklink_ctx->non_display_parser.vbi_decoder.count[1] = decklink_ctx->non_display_parser.vbi_decoder.count[0];
+                /* Scale the lines from 10-bit to 8-bit */
+                decklink_ctx->downscale_line( anc_buf + non_display_parser->vbi_window_offset * anc_line_stride / 2, vbi_buf,
+                                              non_display_parser->vbi_window_lines );
 
-                if( setup_vbi_parser( &decklink_ctx->non_display_parser ) < 0 )
+                if( decode_vbi( h, non_display_parser, vbi_buf, raw_frame ) < 0 )
                     goto fail;
 
-                decklink_ctx->has_setup_vbi = 1;
+                av_free( vbi_buf );
             }
-
-            if( decode_vbi( h, &decklink_ctx->non_display_parser, vbi_buf, raw_frame ) < 0 )
-                goto fail;
-
-            av_free( vbi_buf );
         }
 
         av_free( anc_buf );
@@ -571,9 +595,13 @@ HRESULT DeckLinkCaptureDelegate::VideoInputFrameArrived( IDeckLinkVideoInputFram
         }
     }
 
-    /* TODO: probe SMPTE 337M audio */
-
-    if( audioframe && !decklink_opts_->probe )
+    if( audioframe && decklink_opts_->probe )
+    {
+        audioframe->GetBytes( &frame_bytes );
+        obe_337m_probe_pairs( (int32_t*)frame_bytes, decklink_opts_->num_channels, audioframe->GetSampleFrameCount(),
+                              decklink_ctx->smpte337m_data_type );
+    }
+    else if( audioframe )
     {
         audioframe->GetBytes( &frame_bytes );
         raw_frame = new_raw_frame();
@@ -1025,7 +1053,6 @@ static void *probe_stream( void *ptr )
         goto finish;
     }
 
-    /* TODO: probe for SMPTE 337M */
     /* TODO: factor some of the code below out */
 
     for( int i = 0; i < 2; i++ )
@@ -1066,6 +1093,28 @@ static void *probe_stream( void *ptr )
         }
     }
 
+    for( int i = 0; i < decklink_opts->num_channels / 2; i++ )
+    {
+        int data_type = decklink_opts->decklink_ctx.smpte337m_data_type[i];
+        if( obe_337m_data_type_to_format( data_type ) < 0 )
+            continue;
+
+        streams[cur_stream] = (obe_int_input_stream_t*)calloc( 1, sizeof(*streams[cur_stream]) );
+        if( !streams[cur_stream] )
+            goto finish;
+
+        pthread_mutex_lock( &h->device_list_mutex );
+        streams[cur_stream]->input_stream_id = h->cur_input_stream_id++;
+        pthread_mutex_unlock( &h->device_list_mutex );
+
+        streams[cur_stream]->stream_type = STREAM_TYPE_AUDIO;
+        streams[cur_stream]->stream_format = obe_337m_data_type_to_format( data_type );
+        streams[cur_stream]->is_latm = obe_337m_is_latm( data_type );
+        streams[cur_stream]->sdi_audio_pair = i + 1;
+        streams[cur_stream]->sample_rate = 48000;
+        cur_stream++;
+    }
+
     if( non_display_parser->has_vbi_frame )
     {
         streams[cur_stream] = (obe_int_input_stream_t*)calloc( 1, sizeof(*streams[cur_stream]) );
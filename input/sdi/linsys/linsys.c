@@ -43,6 +43,7 @@
 #include "input/sdi/ancillary.h"
 #include "input/sdi/vbi.h"
 #include "input/sdi/x86/sdi.h"
+#include "filters/audio/337m/337m.h"
 
 #include <libavutil/mathematics.h>
 #include <libavutil/bswap.h>
@@ -153,10 +154,8 @@ typedef struct
 
     int64_t      last_frame_time;
 
-#if 0
-    int          probe_buf_len;
-    int32_t      *audio_probe_buf;
-#endif
+    /* SMPTE 337M data type of each audio pair found during probe */
+    int          smpte337m_data_type[MAX_CHANNELS/2];
 
     /* VBI */
     int has_setup_vbi;
@@ -296,6 +295,7 @@ static int handle_video_frame( linsys_opts_t *linsys_opts, uint8_t *data )
     uint16_t *anc_buf = NULL, *anc_buf_pos = NULL;
     uint16_t *y_src, *u_src, *v_src;
     uint8_t *vbi_buf;
+    obe_sdi_non_display_data_t *non_display_parser = &linsys_ctx->non_display_parser;
     int64_t pts, sdi_clock;
 
     obe_image_t *output;
@@ -317,7 +317,8 @@ static int handle_video_frame( linsys_opts_t *linsys_opts, uint8_t *data )
             syslog( LOG_WARNING, "Linsys card index %i: No frame received for %"PRIi64" ms", linsys_opts->card_idx,
                    (cur_frame_time - linsys_ctx->last_frame_time) / 1000 );
             pthread_mutex_lock( &h->drop_mutex );
-            h->encoder_drop = h->mux_drop = 1;
+            h->encoder_drops++;
+            h->mux_drop = 1;
             pthread_mutex_unlock( &h->drop_mutex );
         }
 
@@ -486,30 +487,45 @@ static int handle_video_frame( linsys_opts_t *linsys_opts, uint8_t *data )
         else
             num_vbi_lines += linsys_opts->video_format == INPUT_VIDEO_FORMAT_NTSC;
 
-        num_anc_lines += num_vbi_lines;
         /* last_line is the last line that has been written, whereas cur_line is the next line to be processed */
         last_line = sdi_next_line( linsys_opts->video_format, cur_line-1 );
-
-        /* Add the visible VBI lines to the ancillary buffer */
         for( int i = 0; i < num_vbi_lines; i++ )
-        {
-            linsys_ctx->pack_line( y_src, u_src, v_src, anc_buf_pos, linsys_ctx->width );
-            anc_buf_pos += anc_line_stride / 2;
-            y_src += output->stride[0] / 2;
-            u_src += output->stride[1] / 2;
-            v_src += output->stride[2] / 2;
             last_line = sdi_next_line( linsys_opts->video_format, last_line );
+
+        if( !linsys_ctx->has_setup_vbi )
+        {
+            vbi_raw_decoder_init( &non_display_parser->vbi_decoder );
+
+            non_display_parser->ntsc = linsys_opts->video_format == INPUT_VIDEO_FORMAT_NTSC;
+            non_display_parser->vbi_decoder.start[0] = first_line;
+            non_display_parser->vbi_decoder.start[1] = sdi_next_line( linsys_opts->video_format, first_line );
+            non_display_parser->vbi_decoder.count[0] = last_line - non_display_parser->vbi_decoder.start[1] + 1;
+            non_display_parser->vbi_decoder.count[1] = non_display_parser->vbi_decoder.count[0];
+
+            /* Only slice the lines which carry services the user has selected */
+            if( setup_vbi_window( h, non_display_parser, linsys_opts->video_format, first_line, num_anc_lines + num_vbi_lines ) < 0 )
+                goto fail;
+
+            if( setup_vbi_parser( non_display_parser ) < 0 )
+                goto fail;
+
+            linsys_ctx->has_setup_vbi = 1;
         }
 
-        vbi_buf = av_malloc( linsys_ctx->width * 2 * num_anc_lines );
-        if( !vbi_buf )
+        /* Add the visible VBI lines to the ancillary buffer if they are needed */
+        if( non_display_parser->vbi_window_offset + non_display_parser->vbi_window_lines > num_anc_lines )
         {
-            syslog( LOG_ERR, "Malloc failed\n" );
-            goto fail;
+            for( int i = 0; i < num_vbi_lines; i++ )
+            {
+                linsys_ctx->pack_line( y_src, u_src, v_src, anc_buf_pos, linsys_ctx->width );
+                anc_buf_pos += anc_line_stride / 2;
+                y_src += output->stride[0] / 2;
+                u_src += output->stride[1] / 2;
+                v_src += output->stride[2] / 2;
+            }
         }
+        num_anc_lines += num_vbi_lines;
 
-        /* Scale the lines from 10-bit to 8-bit */
-        linsys_ctx->downscale_line( anc_buf, vbi_buf, num_anc_lines );
         anc_buf_pos = anc_buf;
 
         if( linsys_ctx->has_vanc )
@@ -523,30 +539,28 @@ static int handle_video_frame( linsys_opts_t *linsys_opts, uint8_t *data )
                 tmp_line++;
             }
 
-            if( decode_video_index_information( h, &linsys_ctx->non_display_parser, anc_buf_pos, raw_frame, vii_line ) < 0 )
+            if( decode_video_index_information( h, non_display_parser, anc_buf_pos, raw_frame, vii_line ) < 0 )
                 goto fail;
         }
 
-        if( !linsys_ctx->has_setup_vbi )
+        if( non_display_parser->vbi_window_lines )
         {
-            vbi_raw_decoder_init( &linsys_ctx->non_display_parser.vbi_decoder );
+            vbi_buf = av_malloc( linsys_ctx->width * 2 * non_display_parser->vbi_window_lines );
+            if( !vbi_buf )
+            {
+                syslog( LOG_ERR, "Malloc failed\n" );
+                goto fail;
+            }
 
-            linsys_ctx->non_display_parser.ntsc = linsys_opts->video_format == INPUT_VIDEO_FORMAT_NTSC;
-            linsys_ctx->non_display_parser.vbi_decoder.start[0] = first_line;
-            linsys_ctx->non_display_parser.vbi_decoder.start[1] = sdi_next_line( linsys_opts->video_format, first_line );
-            linsys_ctx->non_display_parser.vbi_decoder.count[0] = last_line - linsys_ctx->non_display_parser.vbi_decoder.start[1] + 1;
-            linsys_ctx->non_display_parser.vbi_decoder.count[1] = linsys_ctx->non_display_parser.vbi_decoder.count[0];
+            /* Scale the lines from 10-bit to 8-bit */
+            linsys_ctx->downscale_line( anc_buf + non_display_parser->vbi_window_offset * anc_line_stride / 2, vbi_buf,
+                                        non_display_parser->vbi_window_lines );
 
-            if( setup_vbi_parser( &linsys_ctx->non_display_parser ) < 0 )
+            if( decode_vbi( h, non_display_parser, vbi_buf, raw_frame ) < 0 )
                 goto fail;
 
-            linsys_ctx->has_setup_vbi = 1;
+            av_free( vbi_buf );
         }
-
-        if( decode_vbi( h, &linsys_ctx->non_display_parser, vbi_buf, raw_frame ) < 0 )
-            goto fail;
-
-        av_free( vbi_buf );
     }
 
     av_free( anc_buf );
@@ -779,7 +793,11 @@ static int capture_data( linsys_opts_t *linsys_opts )
             return -1;
         }
 
-        if( !linsys_opts->probe && handle_audio_frame( linsys_opts, linsys_ctx->abuffers[linsys_ctx->current_abuffer] ) < 0 )
+        if( linsys_opts->probe )
+            obe_337m_probe_pairs( (int32_t*)linsys_ctx->abuffers[linsys_ctx->current_abuffer], linsys_opts->num_channels,
+                                  linsys_ctx->abuffer_size / ( sizeof(int32_t) * linsys_opts->num_channels ),
+                                  linsys_ctx->smpte337m_data_type );
+        else if( handle_audio_frame( linsys_opts, linsys_ctx->abuffers[linsys_ctx->current_abuffer] ) < 0 )
             return -1;
 
         if( ioctl( linsys_ctx->afd, SDIAUDIO_IOC_QBUF, linsys_ctx->current_abuffer ) < 0 )
@@ -1218,6 +1236,28 @@ static void *probe_stream( void *ptr )
         }
     }
 
+    for( int i = 0; i < linsys_opts.num_channels / 2; i++ )
+    {
+        int data_type = linsys_opts.linsys_ctx.smpte337m_data_type[i];
+        if( obe_337m_data_type_to_format( data_type ) < 0 )
+            continue;
+
+        streams[num_streams] = calloc( 1, sizeof(*streams[num_streams]) );
+        if( !streams[num_streams] )
+            goto finish;
+
+        pthread_mutex_lock( &h->device_list_mutex );
+        streams[num_streams]->input_stream_id = h->cur_input_stream_id++;
+        pthread_mutex_unlock( &h->device_list_mutex );
+
+        streams[num_streams]->stream_type = STREAM_TYPE_AUDIO;
+        streams[num_streams]->stream_format = obe_337m_data_type_to_format( data_type );
+        streams[num_streams]->is_latm = obe_337m_is_latm( data_type );
+        streams[num_streams]->sdi_audio_pair = i + 1;
+        streams[num_streams]->sample_rate = 48000;
+        num_streams++;
+    }
+
     if( non_display_parser->num_frame_data )
         free( non_display_parser->frame_data );
 
@@ -215,7 +215,7 @@ int check_user_selected_non_display_data( obe_t *h, int type, int location )
 
     if( location == USER_DATA_LOCATION_DVB_STREAM )
     {
-        output_stream = get_output_stream( h, VBI_RAW );
+        output_stream = get_output_stream_by_format( h, VBI_RAW );
         if( !output_stream )
             return 0;
 
@@ -233,23 +233,33 @@ int check_user_selected_non_display_data( obe_t *h, int type, int location )
     }
     else if( location == USER_DATA_LOCATION_FRAME )
     {
-        /* Assumes video frame has stream_id=0 */
-        output_stream = get_output_stream( h, 0 );
-        /* Should never happen */
-        if( !output_stream )
-            return 0;
-
-        switch( type )
+        /* Data is passed through if any video rendition selects it */
+        for( int i = 0; i < h->num_output_streams; i++ )
         {
-            case CAPTIONS_CEA_608:
-                return output_stream->video_anc.cea_608;
-            case CAPTIONS_CEA_708:
-                return output_stream->video_anc.cea_708;
-            case MISC_AFD:
-                return output_stream->video_anc.afd;
-            /* Actually WSS to AFD conversion */
-            case MISC_WSS:
-                return output_stream->video_anc.wss_to_afd;
+            output_stream = &h->output_streams[i];
+            if( output_stream->stream_format != VIDEO_AVC && output_stream->stream_format != VIDEO_MPEG2 )
+                continue;
+
+            switch( type )
+            {
+                case CAPTIONS_CEA_608:
+                    if( output_stream->video_anc.cea_608 )
+                        return 1;
+                    break;
+                case CAPTIONS_CEA_708:
+                    if( output_stream->video_anc.cea_708 )
+                        return 1;
+                    break;
+                case MISC_AFD:
+                    if( output_stream->video_anc.afd )
+                        return 1;
+                    break;
+                /* Actually WSS to AFD conversion */
+                case MISC_WSS:
+                    if( output_stream->video_anc.wss_to_afd )
+                        return 1;
+                    break;
+            }
         }
     }
 
@@ -261,6 +271,7 @@ int add_teletext_service( obe_sdi_non_display_data_t *non_display_data, obe_int_
     stream->frame_data = calloc( 1, sizeof(*stream->frame_data) );
     if( !stream->frame_data )
         return -1;
+    stream->num_frame_data = 1;
 
     for( int i = 0; i < non_display_data->num_frame_data; i++ )
     {
@@ -269,7 +280,7 @@ int add_teletext_service( obe_sdi_non_display_data_t *non_display_data, obe_int_
             stream->frame_data[0].type = non_display_data->frame_data[i].type;
             stream->frame_data[0].source = non_display_data->frame_data[i].source;
             stream->frame_data[0].num_lines = non_display_data->frame_data[i].num_lines;
-            memcpy( stream->frame_data[0].lines, non_display_data->frame_data[0].lines, non_display_data->frame_data[0].num_lines * sizeof(int) );
+            memcpy( stream->frame_data[0].lines, non_display_data->frame_data[i].lines, non_display_data->frame_data[i].num_lines * sizeof(int) );
         }
     }
 
@@ -62,6 +62,10 @@ typedef struct
     int has_vbi_frame;
     int has_ttx_frame;
 
+    /* Lines of the ancillary buffer which carry selected VBI services, none if vbi_window_lines is zero */
+    int vbi_window_offset;
+    int vbi_window_lines;
+
     /* Ancillary VBI */
     int num_anc_vbi;
     obe_anc_vbi_t anc_vbi[100];
@@ -147,6 +147,97 @@ int setup_vbi_parser( obe_sdi_non_display_data_t *non_display_data )
     return 0;
 }
 
+static int is_vbi_service_selected( obe_t *h, int type, int source )
+{
+    /* WSS from VBI is converted to AFD */
+    if( source == MISC_WSS || type == MISC_WSS )
+        return check_user_selected_non_display_data( h, MISC_WSS, USER_DATA_LOCATION_FRAME ) ||
+               check_user_selected_non_display_data( h, MISC_WSS, USER_DATA_LOCATION_DVB_STREAM );
+    else if( type == MISC_TELETEXT )
+        return !!get_output_stream_by_format( h, MISC_TELETEXT ) ||
+               check_user_selected_non_display_data( h, MISC_TELETEXT, USER_DATA_LOCATION_DVB_STREAM );
+
+    return check_user_selected_non_display_data( h, type, get_non_display_location( type ) );
+}
+
+/* Position of a line in an ancillary buffer which starts at first_line */
+static int get_vbi_line_pos( int format, int first_line, int num_lines, int line )
+{
+    int cur_line = first_line;
+
+    for( int i = 0; i < num_lines; i++ )
+    {
+        if( cur_line == line )
+            return i;
+        cur_line = sdi_next_line( format, cur_line );
+    }
+
+    return -1;
+}
+
+int setup_vbi_window( obe_t *h, obe_sdi_non_display_data_t *non_display_data, int format, int first_line, int num_lines )
+{
+    obe_device_t *device = non_display_data->device;
+    obe_int_input_stream_t *stream;
+    obe_frame_data_t *frame_data;
+    int min_pos = num_lines, max_pos = -1, pos, has_ttx_lines = 0;
+
+    /* Default to the whole buffer which the decoder has already been set up for. Probing needs every line. */
+    non_display_data->vbi_window_offset = 0;
+    non_display_data->vbi_window_lines = num_lines;
+
+    if( non_display_data->probe || !device )
+        return 0;
+
+    for( int i = 0; i < device->num_input_streams; i++ )
+    {
+        stream = device->streams[i];
+        for( int j = 0; j < stream->num_frame_data; j++ )
+        {
+            frame_data = &stream->frame_data[j];
+            if( ( frame_data->source != VBI_RAW && frame_data->source != MISC_WSS ) ||
+                !is_vbi_service_selected( h, frame_data->type, frame_data->source ) )
+                continue;
+
+            has_ttx_lines |= frame_data->type == MISC_TELETEXT;
+
+            for( int k = 0; k < frame_data->num_lines; k++ )
+            {
+                pos = get_vbi_line_pos( format, first_line, num_lines, frame_data->lines[k] );
+                if( pos >= 0 )
+                {
+                    min_pos = MIN( min_pos, pos );
+                    max_pos = MAX( max_pos, pos );
+                }
+            }
+        }
+    }
+
+    /* Not every input exposes the teletext lines so decode everything in that case */
+    if( !has_ttx_lines && is_vbi_service_selected( h, MISC_TELETEXT, VBI_RAW ) )
+        return 0;
+
+    if( max_pos < 0 )
+    {
+        non_display_data->vbi_window_lines = 0;
+        return 0;
+    }
+
+    /* Lines are interleaved starting from field one so keep the window field-aligned */
+    min_pos &= ~1;
+    max_pos = MIN( max_pos | 1, num_lines - 1 );
+
+    non_display_data->vbi_window_offset = min_pos;
+    non_display_data->vbi_window_lines = ( max_pos - min_pos + 1 ) & ~1;
+    non_display_data->vbi_decoder.start[0] = first_line;
+    for( int i = 0; i < min_pos; i++ )
+        non_display_data->vbi_decoder.start[0] = sdi_next_line( format, non_display_data->vbi_decoder.start[0] );
+    non_display_data->vbi_decoder.start[1] = sdi_next_line( format, non_display_data->vbi_decoder.start[0] );
+    non_display_data->vbi_decoder.count[0] = non_display_data->vbi_decoder.count[1] = non_display_data->vbi_window_lines / 2;
+
+    return 0;
+}
+
 #define REMOVE_LINES( num_lines ) \
     memmove( &sliced[i], &sliced[i+(num_lines)], (decoded_lines-i-(num_lines)) * sizeof(vbi_sliced) ); \
     if( decoded_lines >= num_lines )  \
@@ -226,6 +317,19 @@ int decode_vbi( obe_t *h, obe_sdi_non_display_data_t *non_display_data, uint8_t
             else if( vbi_type != CAPTIONS_CEA_608 && vbi_type != MISC_WSS )
                 non_display_data->has_vbi_frame = 1;
 
+            /* Record which line the service is on so the VBI decoder can skip unused lines */
+            tmp = realloc( non_display_data->frame_data, (non_display_data->num_frame_data+1) * sizeof(*non_display_data->frame_data) );
+            if( !tmp )
+                goto fail;
+
+            non_display_data->frame_data = tmp;
+            frame_data = &non_display_data->frame_data[non_display_data->num_frame_data++];
+            frame_data->type = vbi_type;
+            frame_data->source = VBI_RAW;
+            frame_data->num_lines = 0;
+            frame_data->lines[frame_data->num_lines++] = sliced[i].line;
+            frame_data->location = get_non_display_location( vbi_type );
+
             /* WSS is converted to AFD so tell the user this */
             if( vbi_type == MISC_WSS )
             {
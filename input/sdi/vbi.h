@@ -65,6 +65,7 @@ const static int data_indentifier_table[][2] =
 };
 
 int setup_vbi_parser( obe_sdi_non_display_data_t *non_display_data );
+int setup_vbi_window( obe_t *h, obe_sdi_non_display_data_t *non_display_data, int format, int first_line, int num_lines );
 int decode_vbi( obe_t *h, obe_sdi_non_display_data_t *non_display_data, uint8_t *lines, obe_raw_frame_t *raw_frame );
 int decode_video_index_information( obe_t *h, obe_sdi_non_display_data_t *non_display_data, uint16_t *line, obe_raw_frame_t *raw_frame, int line_number );
 int send_vbi_and_ttx( obe_t *h, obe_sdi_non_display_data_t *non_display_parser, int64_t pts );
@@ -22,46 +22,33 @@
  *****************************************************************************/
 
 #include <libavutil/mathematics.h>
-#include <libavutil/intreadwrite.h>
-#include <libavutil/fifo.h>
-#include <libavutil/buffer.h>
 #include "common/common.h"
 
+/* Duration of the initial VBV fill of the video encoder. The caller holds the encoder's queue mutex */
+static int64_t get_temporal_vbv_size( obe_encoder_t *encoder )
+{
+    x264_param_t *params = encoder->encoder_params;
+
+    return av_rescale_q_rnd( (int64_t)params->rc.i_vbv_buffer_size * params->rc.f_vbv_buffer_init,
+                             (AVRational){1, params->rc.i_vbv_max_bitrate }, (AVRational){ 1, OBE_CLOCK }, AV_ROUND_UP );
+}
+
 static void *start_smoothing( void *ptr )
 {
     obe_t *h = ptr;
-    int num_muxed_data = 0, buffer_complete = 0;
+    obe_ts_ring_t *ring = &h->ts_ring;
+    obe_encoder_t *video_encoder = NULL;
+    int buffer_complete = 0, params_version = 0;
     int64_t start_clock = -1, start_pcr, end_pcr, temporal_vbv_size = 0, cur_pcr;
-    obe_muxed_data_t **muxed_data = NULL, *start_data, *end_data;
-    AVFifoBuffer *fifo_data = NULL, *fifo_pcr = NULL;
-    AVBufferRef **output_buffers = NULL;
+    int64_t pace_pos = 0, write_pos = 0, publish_end;
+    int64_t spin = (int64_t)h->mux_opts.pacing_spin * ( OBE_CLOCK / 1000000 );
+    int64_t slack = (int64_t)h->mux_opts.pacing_slack * ( OBE_CLOCK / 1000000 );
+    int64_t slot = (int64_t)h->mux_opts.pacing_slot * ( OBE_CLOCK / 1000000 );
 
     struct sched_param param = {0};
     param.sched_priority = 99;
     pthread_setschedparam( pthread_self(), SCHED_FIFO, &param );
 
-    /* This thread buffers one VBV worth of frames */
-    fifo_data = av_fifo_alloc( TS_PACKETS_SIZE );
-    if( !fifo_data )
-    {
-        fprintf( stderr, "[mux-smoothing] Could not allocate data fifo" );
-        return NULL;
-    }
-
-    fifo_pcr = av_fifo_alloc( 7 * sizeof(int64_t) );
-    if( !fifo_pcr )
-    {
-        fprintf( stderr, "[mux-smoothing] Could not allocate pcr fifo" );
-        return NULL;
-    }
-
-    output_buffers = malloc( h->num_outputs * sizeof(*output_buffers) );
-    if( !output_buffers )
-    {
-        fprintf( stderr, "[mux-smoothing] Could not allocate output buffers" );
-        return NULL;
-    }
-
     if( h->obe_system != OBE_SYSTEM_TYPE_LOWEST_LATENCY )
     {
         for( int i = 0; i < h->num_encoders; i++ )
@@ -71,30 +58,41 @@ static void *start_smoothing( void *ptr )
                 pthread_mutex_lock( &h->encoders[i]->queue.mutex );
                 while( !h->encoders[i]->is_ready )
                     pthread_cond_wait( &h->encoders[i]->queue.in_cv, &h->encoders[i]->queue.mutex );
-                x264_param_t *params = h->encoders[i]->encoder_params;
-                temporal_vbv_size = av_rescale_q_rnd(
-                (int64_t)params->rc.i_vbv_buffer_size * params->rc.f_vbv_buffer_init,
-                (AVRational){1, params->rc.i_vbv_max_bitrate }, (AVRational){ 1, OBE_CLOCK }, AV_ROUND_UP );
+                video_encoder = h->encoders[i];
+                temporal_vbv_size = get_temporal_vbv_size( video_encoder );
+                params_version = video_encoder->params_version;
                 pthread_mutex_unlock( &h->encoders[i]->queue.mutex );
                 break;
             }
         }
     }
 
+    /* This thread buffers one VBV worth of datagrams in the ring then releases them to the outputs on time */
     while( 1 )
     {
-        pthread_mutex_lock( &h->mux_smoothing_queue.mutex );
+        pthread_mutex_lock( &ring->mutex );
 
-        while( h->mux_smoothing_queue.size == num_muxed_data && !h->cancel_mux_smoothing_thread )
-            pthread_cond_wait( &h->mux_smoothing_queue.in_cv, &h->mux_smoothing_queue.mutex );
+        while( ring->write_pos == write_pos && !h->cancel_mux_smoothing_thread )
+            pthread_cond_wait( &ring->write_cv, &ring->mutex );
 
         if( h->cancel_mux_smoothing_thread )
         {
-            pthread_mutex_unlock( &h->mux_smoothing_queue.mutex );
+            pthread_mutex_unlock( &ring->mutex );
             break;
         }
 
-        num_muxed_data = h->mux_smoothing_queue.size;
+        write_pos = ring->write_pos;
+        pthread_mutex_unlock( &ring->mutex );
+
+        /* Follow rate control changes made while running. The buffer is not flushed: the new size
+         * only changes how much is buffered when the buffer next refills */
+        if( video_encoder && video_encoder->params_version != params_version )
+        {
+            pthread_mutex_lock( &video_encoder->queue.mutex );
+            temporal_vbv_size = get_temporal_vbv_size( video_encoder );
+            params_version = video_encoder->params_version;
+            pthread_mutex_unlock( &video_encoder->queue.mutex );
+        }
 
         /* Refill the buffer after a drop */
         pthread_mutex_lock( &h->drop_mutex );
@@ -102,8 +100,6 @@ static void *start_smoothing( void *ptr )
         {
             syslog( LOG_INFO, "Mux smoothing buffer reset\n" );
             h->mux_drop = 0;
-            av_fifo_reset( fifo_data );
-            av_fifo_reset( fifo_pcr );
             buffer_complete = 0;
             start_clock = -1;
         }
@@ -111,103 +107,47 @@ static void *start_smoothing( void *ptr )
 
         if( !buffer_complete )
         {
-            start_data = h->mux_smoothing_queue.queue[0];
-            end_data = h->mux_smoothing_queue.queue[num_muxed_data-1];
+            start_pcr = get_ts_slot( ring, pace_pos )->pcr;
+            end_pcr = get_ts_slot( ring, write_pos-1 )->pcr;
 
-            start_pcr = start_data->pcr_list[0];
-            end_pcr = end_data->pcr_list[(end_data->len / 188)-1];
-            if( end_pcr - start_pcr >= temporal_vbv_size )
+            /* The mux blocks once the ring is full so don't wait for more than it can hold */
+            if( end_pcr - start_pcr >= temporal_vbv_size || write_pos - pace_pos >= ring->num_slots / 2 )
             {
                 buffer_complete = 1;
                 start_clock = -1;
             }
             else
-            {
-                pthread_mutex_unlock( &h->mux_smoothing_queue.mutex );
                 continue;
-            }
         }
 
-        //printf("\n mux smoothed frames %i \n", num_muxed_data );
-
-        muxed_data = malloc( num_muxed_data * sizeof(*muxed_data) );
-        if( !muxed_data )
+        for( ; pace_pos < write_pos; pace_pos = publish_end )
         {
-            pthread_mutex_unlock( &h->mux_smoothing_queue.mutex );
-            syslog( LOG_ERR, "Malloc failed\n" );
-            return NULL;
-        }
-        memcpy( muxed_data, h->mux_smoothing_queue.queue, num_muxed_data * sizeof(*muxed_data) );
-        pthread_mutex_unlock( &h->mux_smoothing_queue.mutex );
-
-        for( int i = 0; i < num_muxed_data; i++ )
-        {
-            if( av_fifo_realloc2( fifo_data, av_fifo_size( fifo_data ) + muxed_data[i]->len ) < 0 )
-            {
-                syslog( LOG_ERR, "Malloc failed\n" );
-                return NULL;
-            }
-
-            av_fifo_generic_write( fifo_data, muxed_data[i]->data, muxed_data[i]->len, NULL );
-
-            if( av_fifo_realloc2( fifo_pcr, av_fifo_size( fifo_pcr ) + ((muxed_data[i]->len * sizeof(int64_t)) / 188) ) < 0 )
-            {
-                syslog( LOG_ERR, "Malloc failed\n" );
-                return NULL;
-            }
-
-            av_fifo_generic_write( fifo_pcr, muxed_data[i]->pcr_list, (muxed_data[i]->len * sizeof(int64_t)) / 188, NULL );
-
-            remove_from_queue( &h->mux_smoothing_queue );
-            destroy_muxed_data( muxed_data[i] );
-        }
-
-        free( muxed_data );
-        muxed_data = NULL;
-        num_muxed_data = 0;
-
-        while( av_fifo_size( fifo_data ) >= TS_PACKETS_SIZE )
-        {
-            output_buffers[0] = av_buffer_alloc( TS_PACKETS_SIZE + 7 * sizeof(int64_t) );
-            av_fifo_generic_read( fifo_pcr, output_buffers[0]->data, 7 * sizeof(int64_t), NULL );
-            av_fifo_generic_read( fifo_data, &output_buffers[0]->data[7 * sizeof(int64_t)], TS_PACKETS_SIZE, NULL );
-
-            for( int i = 1; i < h->num_outputs; i++ )
-            {
-                output_buffers[i] = av_buffer_ref( output_buffers[0] );
-                if( !output_buffers[i] )
-                {
-                    syslog( LOG_ERR, "Malloc failed\n" );
-                    return NULL;
-                }
-            }
-
-            cur_pcr = AV_RN64( output_buffers[0]->data );
+            cur_pcr = get_ts_slot( ring, pace_pos )->pcr;
 
+            /* Deadlines are absolute so oversleeping one datagram does not delay the rest */
             if( start_clock != -1 )
-            {
-                sleep_input_clock( h, cur_pcr - start_pcr + start_clock );
-            }
+                sleep_input_clock_spin( h, cur_pcr - start_pcr + start_clock - slack, spin );
 
+            /* The IP output thread measures lateness against the deadline of each datagram's PCR */
             if( start_clock == -1 )
             {
                 start_clock = get_input_clock_in_mpeg_ticks( h );
                 start_pcr = cur_pcr;
-            }
 
-            for( int i = 0; i < h->num_outputs; i++ )
-            {
-                if( add_to_queue( &h->outputs[i]->queue, output_buffers[i] ) < 0 )
-                    return NULL;
-                output_buffers[i] = NULL;
+                pthread_mutex_lock( &ring->mutex );
+                h->pacing_offset = start_clock - start_pcr;
+                pthread_mutex_unlock( &ring->mutex );
             }
+
+            /* Release the rest of the slot with it so the output can send them together */
+            publish_end = pace_pos + 1;
+            while( publish_end < write_pos && get_ts_slot( ring, publish_end )->pcr - cur_pcr < slot )
+                publish_end++;
+
+            obe_ts_ring_publish( ring, publish_end );
         }
     }
 
-    av_fifo_free( fifo_data );
-    av_fifo_free( fifo_pcr );
-    free( output_buffers );
-
     return NULL;
 }
 
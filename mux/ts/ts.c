@@ -32,7 +32,7 @@ static const int mpegts_stream_info[][3] =
 {
     { VIDEO_AVC,   LIBMPEGTS_VIDEO_AVC,      LIBMPEGTS_STREAM_ID_MPEGVIDEO },
     { VIDEO_MPEG2, LIBMPEGTS_VIDEO_MPEG2,    LIBMPEGTS_STREAM_ID_MPEGVIDEO },
-    /* TODO 302M */
+    { AUDIO_PCM,   LIBMPEGTS_AUDIO_302M,     LIBMPEGTS_STREAM_ID_PRIVATE_1 },
     { AUDIO_MP2,   LIBMPEGTS_AUDIO_MPEG2,    LIBMPEGTS_STREAM_ID_MPEGAUDIO },
     { AUDIO_AC_3,  LIBMPEGTS_AUDIO_AC3,      LIBMPEGTS_STREAM_ID_PRIVATE_1 },
     { AUDIO_E_AC_3,  LIBMPEGTS_AUDIO_EAC3,   LIBMPEGTS_STREAM_ID_PRIVATE_1 },
@@ -73,6 +73,54 @@ static obe_output_stream_t *get_output_mux_stream( obe_mux_params_t *mux_params,
     return NULL;
 }
 
+/* Per-program state of the mux */
+typedef struct
+{
+    int video_pid;
+    int width;
+    int height;
+    int has_avc;
+
+    int pcr_pid;
+    int64_t last_pcr;
+    int64_t pcr_errors;
+} ts_program_info_t;
+
+/* Checks that each program's PCR is repeated at least every 40ms (TR 101 290 PCR_repetition_error) */
+static void check_pcr( ts_program_info_t *program_info, int num_programs, uint8_t *data, int len )
+{
+    for( uint8_t *pkt = data; pkt < data + len; pkt += 188 )
+    {
+        int pid = ( ( pkt[1] & 0x1f ) << 8 ) | pkt[2];
+
+        /* adaptation field with a PCR */
+        if( !( pkt[3] & 0x20 ) || pkt[4] < 7 || !( pkt[5] & 0x10 ) )
+            continue;
+
+        for( int i = 0; i < num_programs; i++ )
+        {
+            ts_program_info_t *info = &program_info[i];
+            if( info->pcr_pid != pid )
+                continue;
+
+            int64_t pcr = ( ( (int64_t)pkt[6] << 25 ) | ( pkt[7] << 17 ) | ( pkt[8] << 9 ) | ( pkt[9] << 1 ) | ( pkt[10] >> 7 ) ) * 300 +
+                          ( ( pkt[10] & 1 ) << 8 ) + pkt[11];
+
+            if( info->last_pcr >= 0 )
+            {
+                int64_t delta = pcr - info->last_pcr;
+                if( delta < 0 )
+                    delta += 300LL << 33;
+
+                if( delta > OBE_CLOCK * 40 / 1000 && !( info->pcr_errors++ % 100 ) )
+                    syslog( LOG_WARNING, "[ts] PCR interval of %"PRIi64" ms on PID %i (%"PRIi64" errors)\n",
+                            (int64_t)( delta / ( OBE_CLOCK / 1000 ) ), pid, info->pcr_errors );
+            }
+            info->last_pcr = pcr;
+        }
+    }
+}
+
 static void encoder_wait( obe_t *h, int output_stream_id )
 {
     /* Wait for encoder to be ready */
@@ -89,22 +137,22 @@ void *open_muxer( void *ptr )
     obe_t *h = mux_params->h;
     obe_mux_opts_t *mux_opts = &h->mux_opts;
     int cur_pid = MIN_PID;
-    int stream_format, video_pid = 0, video_found = 0, width = 0,
-    height = 0, has_dds = 0, len = 0, num_frames = 0;
+    int stream_format, video_found = 0, has_dds = 0, len = 0, num_frames = 0, num_programs = 0;
+    int *program_idx = NULL;
     uint8_t *output;
     int64_t first_video_pts = -1, video_dts, first_video_real_pts = -1;
     int64_t *pcr_list;
     ts_writer_t *w;
     ts_main_t params = {0};
-    ts_program_t program = {0};
-    ts_stream_t *stream;
+    ts_program_t *programs = NULL, *program;
+    ts_program_info_t *program_info = NULL, *info;
+    ts_stream_t *stream, **stream_map = NULL;
     ts_dvb_sub_t subtitles;
     ts_dvb_vbi_t *vbi_services;
     ts_frame_t *frames;
     obe_int_input_stream_t *input_stream;
     obe_output_stream_t *output_stream;
     obe_encoder_t *encoder;
-    obe_muxed_data_t *muxed_data;
     obe_coded_frame_t *coded_frame;
     char *service_name = "OBE Service";
     char *provider_name = "Open Broadcast Encoder";
@@ -130,39 +178,86 @@ void *open_muxer( void *ptr )
         return NULL;
     }
 
-    params.num_programs = 1;
-    params.programs = &program;
-    program.is_3dtv = !!mux_opts->is_3dtv;
-    // TODO more mux opts
-
-    program.streams = calloc( mux_params->num_output_streams, sizeof(*program.streams) );
-    if( !program.streams )
+    num_programs = MAX( mux_opts->num_programs, 1 );
+    programs = calloc( num_programs, sizeof(*programs) );
+    program_info = calloc( num_programs, sizeof(*program_info) );
+    stream_map = calloc( mux_params->num_output_streams, sizeof(*stream_map) );
+    program_idx = calloc( mux_params->num_output_streams, sizeof(*program_idx) );
+    if( !programs || !program_info || !stream_map || !program_idx )
     {
         fprintf( stderr, "malloc failed\n" );
         goto end;
     }
 
-    program.num_streams = mux_params->num_output_streams;
+    params.num_programs = num_programs;
+    params.programs = programs;
+
+    for( int i = 0; i < mux_params->num_output_streams; i++ )
+    {
+        program_idx[i] = mux_opts->num_programs ? -1 : 0;
+        for( int j = 0; j < mux_opts->num_programs; j++ )
+        {
+            for( int k = 0; k < mux_opts->programs[j].num_output_streams; k++ )
+            {
+                if( mux_opts->programs[j].output_stream_ids[k] == mux_params->output_streams[i].output_stream_id )
+                    program_idx[i] = j;
+            }
+        }
+
+        if( program_idx[i] < 0 )
+        {
+            fprintf( stderr, "[ts] Output stream %i is not in a program\n", mux_params->output_streams[i].output_stream_id );
+            goto end;
+        }
+        programs[program_idx[i]].num_streams++;
+    }
+
+    for( int i = 0; i < num_programs; i++ )
+    {
+        if( !programs[i].num_streams )
+        {
+            fprintf( stderr, "[ts] Program %i has no streams\n", i );
+            goto end;
+        }
+
+        programs[i].streams = calloc( programs[i].num_streams, sizeof(*programs[i].streams) );
+        if( !programs[i].streams )
+        {
+            fprintf( stderr, "malloc failed\n" );
+            goto end;
+        }
+        programs[i].num_streams = 0;
+        programs[i].is_3dtv = !!mux_opts->is_3dtv;
+        // TODO more mux opts
+    }
 
     if( mux_opts->passthrough )
     {
         /* TODO lock when we can add multiple devices */
         params.ts_id = h->devices[0]->ts_id;
-        program.program_num = h->devices[0]->program_num;
-        program.pmt_pid = h->devices[0]->pmt_pid;
-        program.pcr_pid = h->devices[0]->pcr_pid;
+        programs[0].program_num = h->devices[0]->program_num;
+        programs[0].pmt_pid = h->devices[0]->pmt_pid;
+        programs[0].pcr_pid = h->devices[0]->pcr_pid;
     }
     else
     {
         params.ts_id = mux_opts->ts_id ? mux_opts->ts_id : 1;
-        program.program_num = mux_opts->program_num ? mux_opts->program_num : 1;
-        program.pmt_pid = mux_opts->pmt_pid ? mux_opts->pmt_pid : cur_pid++;
+        for( int i = 0; i < num_programs; i++ )
+        {
+            int program_num = mux_opts->num_programs ? mux_opts->programs[i].program_num : mux_opts->program_num;
+            int pmt_pid = mux_opts->num_programs ? mux_opts->programs[i].pmt_pid : mux_opts->pmt_pid;
+
+            programs[i].program_num = program_num ? program_num : i+1;
+            programs[i].pmt_pid = pmt_pid ? pmt_pid : cur_pid++;
+        }
         /* PCR PID is done later once we know the video pid */
     }
 
-    for( int i = 0; i < program.num_streams; i++ )
+    for( int i = 0; i < mux_params->num_output_streams; i++ )
     {
-        stream = &program.streams[i];
+        program = &programs[program_idx[i]];
+        info = &program_info[program_idx[i]];
+        stream = stream_map[i] = &program->streams[program->num_streams++];
         output_stream = &mux_params->output_streams[i];
         input_stream = get_input_stream( h, output_stream->input_stream_id );
 
@@ -207,18 +302,37 @@ void *open_muxer( void *ptr )
             stream->stream_identifier = output_stream->ts_opts.stream_identifier;
         }
 
-        if( stream_format == VIDEO_AVC )
+        if( stream_format == VIDEO_AVC || stream_format == VIDEO_MPEG2 )
         {
             encoder_wait( h, output_stream->output_stream_id );
 
-            width = output_stream->avc_param.i_width;
-            height = output_stream->avc_param.i_height;
-            video_pid = stream->pid;
+            /* With several renditions the PCR goes on the first one and the service type follows the largest */
+            info->width = MAX( info->width, output_stream->avc_param.i_width );
+            info->height = MAX( info->height, output_stream->avc_param.i_height );
+            if( !info->video_pid )
+                info->video_pid = stream->pid;
+            info->has_avc |= stream_format == VIDEO_AVC;
         }
         else if( stream_format == AUDIO_MP2 )
             stream->audio_frame_size = (double)MP2_NUM_SAMPLES * 90000LL * output_stream->ts_opts.frames_per_pes / input_stream->sample_rate;
         else if( stream_format == AUDIO_AC_3 )
             stream->audio_frame_size = (double)AC3_NUM_SAMPLES * 90000LL * output_stream->ts_opts.frames_per_pes / input_stream->sample_rate;
+        else if( ( stream_format == AUDIO_E_AC_3 || stream_format == AUDIO_AAC ) && output_stream->stream_action == STREAM_PASSTHROUGH )
+        {
+            /* SMPTE 337M passthrough - assume the common frame sizes */
+            int num_samples = stream_format == AUDIO_AAC ? AAC_NUM_SAMPLES : AC3_NUM_SAMPLES;
+            stream->audio_frame_size = (double)num_samples * 90000LL * output_stream->ts_opts.frames_per_pes / input_stream->sample_rate;
+        }
+        else if( stream_format == AUDIO_PCM )
+        {
+            /* SMPTE 302M carries one PES per video frame */
+            for( int j = 0; j < h->devices[0]->num_input_streams; j++ )
+            {
+                obe_int_input_stream_t *video_stream = h->devices[0]->streams[j];
+                if( video_stream && video_stream->stream_type == STREAM_TYPE_VIDEO && video_stream->timebase_den )
+                    stream->audio_frame_size = 90000LL * video_stream->timebase_num / video_stream->timebase_den;
+            }
+        }
         else if( stream_format == AUDIO_E_AC_3 || stream_format == AUDIO_AAC )
         {
             encoder_wait( h, output_stream->output_stream_id );
@@ -228,12 +342,29 @@ void *open_muxer( void *ptr )
     }
 
     /* Video stream isn't guaranteed to be first so populate program parameters here */
-    if( !mux_opts->passthrough )
-        program.pcr_pid = mux_opts->pcr_pid ? mux_opts->pcr_pid : video_pid;
+    for( int i = 0; i < num_programs; i++ )
+    {
+        obe_mux_program_t *mux_program = mux_opts->num_programs ? &mux_opts->programs[i] : NULL;
+        char *program_service_name = mux_program && mux_program->service_name ? mux_program->service_name : mux_opts->service_name;
+        char *program_provider_name = mux_program && mux_program->provider_name ? mux_program->provider_name : mux_opts->provider_name;
+        info = &program_info[i];
 
-    program.sdt.service_type = height >= 720 ? DVB_SERVICE_TYPE_ADVANCED_CODEC_HD : DVB_SERVICE_TYPE_ADVANCED_CODEC_SD;
-    program.sdt.service_name = mux_opts->service_name ? mux_opts->service_name : service_name;
-    program.sdt.provider_name = mux_opts->provider_name ? mux_opts->provider_name : provider_name;
+        if( !mux_opts->passthrough )
+        {
+            int pcr_pid = mux_program ? mux_program->pcr_pid : mux_opts->pcr_pid;
+            programs[i].pcr_pid = pcr_pid ? pcr_pid : info->video_pid ? info->video_pid : programs[i].streams[0].pid;
+        }
+
+        if( info->has_avc )
+            programs[i].sdt.service_type = info->height >= 720 ? DVB_SERVICE_TYPE_ADVANCED_CODEC_HD : DVB_SERVICE_TYPE_ADVANCED_CODEC_SD;
+        else
+            programs[i].sdt.service_type = DVB_SERVICE_TYPE_DIGITAL_TELEVISION;
+        programs[i].sdt.service_name = program_service_name ? program_service_name : service_name;
+        programs[i].sdt.provider_name = program_provider_name ? program_provider_name : provider_name;
+
+        info->pcr_pid = programs[i].pcr_pid;
+        info->last_pcr = -1;
+    }
 
     if( ts_setup_transport_stream( w, &params ) < 0 )
     {
@@ -251,9 +382,10 @@ void *open_muxer( void *ptr )
     }
 
     /* setup any streams if necessary */
-    for( int i = 0; i < program.num_streams; i++ )
+    for( int i = 0; i < mux_params->num_output_streams; i++ )
     {
-        stream = &program.streams[i];
+        stream = stream_map[i];
+        info = &program_info[program_idx[i]];
         output_stream = &mux_params->output_streams[i];
         input_stream = get_input_stream( h, output_stream->input_stream_id );
         encoder = get_encoder( h, output_stream->output_stream_id );
@@ -276,6 +408,18 @@ void *open_muxer( void *ptr )
                 goto end;
             }
         }
+        else if( stream_format == VIDEO_MPEG2 )
+        {
+            x264_param_t *p_param = encoder->encoder_params;
+            int is_hd = p_param->i_width > 720 || p_param->i_height > 576;
+            int profile = ( p_param->i_csp & X264_CSP_MASK ) == X264_CSP_I422 ? MPEG2_PROFILE_422 : MPEG2_PROFILE_MAIN;
+
+            if( ts_setup_mpegvideo_stream( w, stream->pid, is_hd ? MPEG2_LEVEL_HIGH : MPEG2_LEVEL_MAIN, profile, 0, 0, 0 ) < 0 )
+            {
+                fprintf( stderr, "[ts] Could not setup video stream\n" );
+                goto end;
+            }
+        }
         else if( stream_format == AUDIO_AAC )
         {
             /* TODO: handle associated switching */
@@ -300,6 +444,15 @@ void *open_muxer( void *ptr )
                 goto end;
             }
         }
+        else if( stream_format == AUDIO_PCM )
+        {
+            if( ts_setup_302m_stream( w, stream->pid, output_stream->bit_depth,
+                                      av_get_channel_layout_nb_channels( output_stream->channel_layout ) ) < 0 )
+            {
+                fprintf( stderr, "[ts] Could not setup SMPTE 302M stream\n" );
+                goto end;
+            }
+        }
         else if( stream_format == SUBTITLES_DVB )
         {
             memcpy( subtitles.lang_code, input_stream->lang_code, 4 );
@@ -307,7 +460,7 @@ void *open_muxer( void *ptr )
             subtitles.composition_page_id = input_stream->composition_page_id;
             subtitles.ancillary_page_id = input_stream->ancillary_page_id;
             /* A lot of streams don't have DDS flagged correctly so we assume all HD uses DDS */
-            has_dds = width >= 1280 && height >= 720;
+            has_dds = info->width >= 1280 && info->height >= 720;
             if( ts_setup_dvb_subtitles( w, stream->pid, has_dds, 1, &subtitles ) < 0 )
             {
                 fprintf( stderr, "[ts] Could not setup DVB Subtitle stream\n" );
@@ -485,23 +638,12 @@ void *open_muxer( void *ptr )
 
         if( len )
         {
-            muxed_data = new_muxed_data( len );
-            if( !muxed_data )
-            {
-                syslog( LOG_ERR, "Malloc failed\n" );
-                goto end;
-            }
-
-            memcpy( muxed_data->data, output, len );
-            muxed_data->pcr_list = malloc( (len / 188) * sizeof(int64_t) );
-            if( !muxed_data->pcr_list )
+            check_pcr( program_info, num_programs, output, len );
+            if( obe_ts_ring_write( &h->ts_ring, output, len, pcr_list, &h->cancel_mux_thread ) < 0 )
             {
-                syslog( LOG_ERR, "Malloc failed\n" );
-                destroy_muxed_data( muxed_data );
+                free( frames );
                 goto end;
             }
-            memcpy( muxed_data->pcr_list, pcr_list, (len / 188) * sizeof(int64_t) );
-            add_to_queue( &h->mux_smoothing_queue, muxed_data );
         }
 
         for( int i = 0; i < num_frames; i++ )
@@ -518,7 +660,12 @@ end:
 
     /* TODO: clean more */
 
-    free( program.streams );
+    for( int i = 0; programs && i < num_programs; i++ )
+        free( programs[i].streams );
+    free( programs );
+    free( program_info );
+    free( stream_map );
+    free( program_idx );
     free( ptr );
 
     return NULL;
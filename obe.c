@@ -79,6 +79,123 @@ obe_raw_frame_t *new_raw_frame( void )
     return raw_frame;
 }
 
+typedef struct
+{
+    obe_raw_frame_t raw_frame;
+    pthread_mutex_t mutex;
+    int refcount;
+} obe_shared_frame_t;
+
+static void release_shared_data( void *ptr )
+{
+    obe_raw_frame_t *raw_frame = ptr;
+    obe_shared_frame_t *shared = raw_frame->opaque;
+    int refcount;
+
+    pthread_mutex_lock( &shared->mutex );
+    refcount = --shared->refcount;
+    pthread_mutex_unlock( &shared->mutex );
+
+    if( !refcount )
+    {
+        shared->raw_frame.release_data( &shared->raw_frame );
+        pthread_mutex_destroy( &shared->mutex );
+        free( shared );
+    }
+
+    /* Any data allocated after this point belongs to this frame only */
+    raw_frame->opaque = NULL;
+    raw_frame->release_data = obe_release_video_data;
+}
+
+static int copy_user_data( obe_raw_frame_t *dst, obe_raw_frame_t *src )
+{
+    dst->num_user_data = 0;
+    dst->user_data = NULL;
+    if( !src->num_user_data )
+        return 0;
+
+    dst->user_data = calloc( src->num_user_data, sizeof(*dst->user_data) );
+    if( !dst->user_data )
+        return -1;
+
+    for( int i = 0; i < src->num_user_data; i++ )
+    {
+        memcpy( &dst->user_data[i], &src->user_data[i], sizeof(*dst->user_data) );
+        dst->user_data[i].data = malloc( src->user_data[i].len );
+        if( !dst->user_data[i].data )
+            return -1;
+        memcpy( dst->user_data[i].data, src->user_data[i].data, src->user_data[i].len );
+        dst->num_user_data++;
+    }
+
+    return 0;
+}
+
+/* Splits a video frame into num_copies frames which share its image. Each copy owns its own user-data.
+ * The original frame is consumed and its image is released when the last copy releases its data. */
+int share_raw_frame( obe_raw_frame_t *raw_frame, obe_raw_frame_t **copies, int num_copies )
+{
+    obe_shared_frame_t *shared;
+    int i;
+
+    if( num_copies == 1 )
+    {
+        copies[0] = raw_frame;
+        return 0;
+    }
+
+    shared = calloc( 1, sizeof(*shared) );
+    if( !shared )
+        return -1;
+
+    memcpy( &shared->raw_frame, raw_frame, sizeof(*raw_frame) );
+    shared->raw_frame.num_user_data = 0;
+    shared->raw_frame.user_data = NULL;
+    pthread_mutex_init( &shared->mutex, NULL );
+    shared->refcount = num_copies;
+
+    for( i = 0; i < num_copies; i++ )
+    {
+        copies[i] = new_raw_frame();
+        if( !copies[i] )
+            goto fail;
+
+        memcpy( copies[i], raw_frame, sizeof(*raw_frame) );
+        copies[i]->opaque = shared;
+        copies[i]->release_data = release_shared_data;
+
+        /* The first copy takes the original user-data */
+        if( i && copy_user_data( copies[i], raw_frame ) < 0 )
+        {
+            i++;
+            goto fail;
+        }
+    }
+
+    free( raw_frame );
+
+    return 0;
+
+fail:
+    /* Leave the original frame intact */
+    while( i-- > 1 )
+    {
+        if( copies[i] )
+        {
+            for( int j = 0; j < copies[i]->num_user_data; j++ )
+                free( copies[i]->user_data[j].data );
+            free( copies[i]->user_data );
+            free( copies[i] );
+        }
+    }
+    free( copies[0] );
+    pthread_mutex_destroy( &shared->mutex );
+    free( shared );
+
+    return -1;
+}
+
 /* Coded frame */
 obe_coded_frame_t *new_coded_frame( int output_stream_id, int len )
 {
@@ -99,12 +216,137 @@ obe_coded_frame_t *new_coded_frame( int output_stream_id, int len )
     return coded_frame;
 }
 
+static void free_coded_frame_pool( obe_coded_frame_pool_t *pool )
+{
+    for( int i = 0; i < pool->num_classes; i++ )
+    {
+        for( int j = 0; j < pool->num_free[i]; j++ )
+        {
+            free( pool->free_frames[i][j]->data );
+            free( pool->free_frames[i][j] );
+        }
+        free( pool->free_frames[i] );
+    }
+
+    pthread_mutex_destroy( &pool->mutex );
+    free( pool );
+}
+
 void destroy_coded_frame( obe_coded_frame_t *coded_frame )
 {
+    obe_coded_frame_pool_t *pool = coded_frame->pool;
+    int i = coded_frame->size_class, destroy_pool = 0;
+    obe_coded_frame_t **tmp;
+
+    if( pool )
+    {
+        pthread_mutex_lock( &pool->mutex );
+        pool->outstanding--;
+        if( !pool->closed )
+        {
+            if( pool->num_free[i] == pool->max_free[i] )
+            {
+                tmp = realloc( pool->free_frames[i], (pool->max_free[i]+1) * sizeof(*pool->free_frames[i]) );
+                if( tmp )
+                {
+                    pool->free_frames[i] = tmp;
+                    pool->max_free[i]++;
+                }
+            }
+
+            if( pool->num_free[i] < pool->max_free[i] )
+            {
+                pool->free_frames[i][pool->num_free[i]++] = coded_frame;
+                pthread_mutex_unlock( &pool->mutex );
+                return;
+            }
+        }
+        else
+            destroy_pool = !pool->outstanding;
+        pthread_mutex_unlock( &pool->mutex );
+
+        if( destroy_pool )
+            free_coded_frame_pool( pool );
+    }
+
     free( coded_frame->data );
     free( coded_frame );
 }
 
+/* Coded frame pool */
+obe_coded_frame_pool_t *new_coded_frame_pool( int max_size )
+{
+    obe_coded_frame_pool_t *pool = calloc( 1, sizeof(*pool) );
+    if( !pool )
+        return NULL;
+
+    pthread_mutex_init( &pool->mutex, NULL );
+    pool->min_size = OBE_CODED_FRAME_POOL_MIN_SIZE;
+    pool->num_classes = 1;
+    while( pool->num_classes < OBE_CODED_FRAME_POOL_CLASSES && (pool->min_size << (pool->num_classes-1)) < max_size )
+        pool->num_classes++;
+
+    return pool;
+}
+
+obe_coded_frame_t *new_pooled_coded_frame( obe_coded_frame_pool_t *pool, int output_stream_id, int len )
+{
+    obe_coded_frame_t *coded_frame = NULL;
+    int i = 0;
+
+    while( i < pool->num_classes && (pool->min_size << i) < len )
+        i++;
+
+    /* Larger than the biggest class */
+    if( i == pool->num_classes )
+        return new_coded_frame( output_stream_id, len );
+
+    pthread_mutex_lock( &pool->mutex );
+    if( pool->num_free[i] )
+        coded_frame = pool->free_frames[i][--pool->num_free[i]];
+    pool->outstanding++;
+    pthread_mutex_unlock( &pool->mutex );
+
+    if( coded_frame )
+    {
+        uint8_t *data = coded_frame->data;
+        memset( coded_frame, 0, sizeof(*coded_frame) );
+        coded_frame->data = data;
+    }
+    else
+    {
+        coded_frame = new_coded_frame( output_stream_id, pool->min_size << i );
+        if( !coded_frame )
+        {
+            pthread_mutex_lock( &pool->mutex );
+            pool->outstanding--;
+            pthread_mutex_unlock( &pool->mutex );
+            return NULL;
+        }
+    }
+
+    coded_frame->output_stream_id = output_stream_id;
+    coded_frame->len = len;
+    coded_frame->pool = pool;
+    coded_frame->size_class = i;
+
+    return coded_frame;
+}
+
+/* Frames still in flight are freed when they are destroyed */
+void close_coded_frame_pool( obe_coded_frame_pool_t *pool )
+{
+    int destroy_pool;
+
+    pthread_mutex_lock( &pool->mutex );
+    pool->closed = 1;
+    destroy_pool = !pool->outstanding;
+    pthread_mutex_unlock( &pool->mutex );
+
+    if( destroy_pool )
+        free_coded_frame_pool( pool );
+}
+
 void obe_release_video_data( void *ptr )
 {
      obe_raw_frame_t *raw_frame = ptr;
@@ -126,34 +368,6 @@ void obe_release_frame( void *ptr )
      free( raw_frame );
 }
 
-/* Muxed data */
-obe_muxed_data_t *new_muxed_data( int len )
-{
-    obe_muxed_data_t *muxed_data = calloc( 1, sizeof(*muxed_data) );
-    if( !muxed_data )
-        return NULL;
-
-    muxed_data->len = len;
-    muxed_data->data = malloc( len );
-    if( !muxed_data->data )
-    {
-        syslog( LOG_ERR, "Malloc failed\n" );
-        free( muxed_data );
-        return NULL;
-    }
-
-    return muxed_data;
-}
-
-void destroy_muxed_data( obe_muxed_data_t *muxed_data )
-{
-    if( muxed_data->pcr_list )
-        free( muxed_data->pcr_list );
-
-    free( muxed_data->data );
-    free( muxed_data );
-}
-
 /** Add/Remove misc **/
 void add_device( obe_t *h, obe_device_t *device )
 {
@@ -197,6 +411,9 @@ int add_to_queue( obe_queue_t *queue, void *item )
     pthread_cond_signal( &queue->in_cv );
     pthread_mutex_unlock( &queue->mutex );
 
+    if( queue->task )
+        obe_task_schedule( queue->task );
+
     return 0;
 }
 
@@ -286,11 +503,81 @@ static void destroy_filter( obe_filter_t *filter )
 
     obe_destroy_queue( &filter->queue );
 
+    if( filter->filter_ctx )
+        filter->close_filter( filter->filter_ctx );
+
     free( filter->stream_id_list );
     free( filter );
 }
 
 /* Encode queue */
+/* Applies the overload policy of a video encoder before raw_frame is queued */
+static void shed_encoder_frames( obe_t *h, obe_encoder_t *encoder, obe_raw_frame_t *raw_frame )
+{
+    obe_raw_frame_t *shed_frames[100];
+    obe_overload_stats_t *stats = &encoder->overload_stats;
+    int num_shed = 0, signal = 0;
+    int64_t age;
+
+    pthread_mutex_lock( &encoder->queue.mutex );
+    if( !encoder->queue.size || encoder->overload.action == OBE_OVERLOAD_NONE )
+    {
+        pthread_mutex_unlock( &encoder->queue.mutex );
+        return;
+    }
+
+    age = raw_frame->pts - ((obe_raw_frame_t*)encoder->queue.queue[0])->pts;
+    stats->max_queue_age = MAX( stats->max_queue_age, age );
+
+    if( age <= encoder->overload.max_queue_age )
+    {
+        encoder->overloaded = 0;
+        pthread_mutex_unlock( &encoder->queue.mutex );
+        return;
+    }
+
+    /* Count each overload once rather than once per frame */
+    if( !encoder->overloaded )
+    {
+        stats->overloads++;
+        signal = 1;
+    }
+    encoder->overloaded = 1;
+
+    /* The encoder is working on queue[0] so leave it in place */
+    if( encoder->overload.action == OBE_OVERLOAD_DROP )
+    {
+        while( encoder->queue.size > 1 && num_shed < 100 &&
+               raw_frame->pts - ((obe_raw_frame_t*)encoder->queue.queue[1])->pts > encoder->overload.max_queue_age )
+        {
+            shed_frames[num_shed++] = encoder->queue.queue[1];
+            memmove( &encoder->queue.queue[1], &encoder->queue.queue[2], sizeof(*encoder->queue.queue) * (encoder->queue.size-2) );
+            encoder->queue.size--;
+        }
+        stats->frames_dropped += num_shed;
+        signal |= num_shed > 0;
+    }
+
+    stats->signals += signal;
+    pthread_mutex_unlock( &encoder->queue.mutex );
+
+    for( int i = 0; i < num_shed; i++ )
+    {
+        shed_frames[i]->release_data( shed_frames[i] );
+        shed_frames[i]->release_frame( shed_frames[i] );
+    }
+
+    if( signal )
+    {
+        syslog( LOG_WARNING, "Encoder %i overloaded: queue age %"PRIi64" ms, dropped %i frames (%"PRIi64" in total)\n",
+                encoder->output_stream_id, (int64_t)(age / (OBE_CLOCK/1000)), num_shed, stats->frames_dropped );
+        pthread_mutex_lock( &h->drop_mutex );
+        h->encoder_drops++;
+        h->mux_drop = 1;
+        pthread_mutex_unlock( &h->drop_mutex );
+    }
+}
+
 int add_to_encode_queue( obe_t *h, obe_raw_frame_t *raw_frame, int output_stream_id )
 {
     obe_encoder_t *encoder = NULL;
@@ -307,6 +594,9 @@ int add_to_encode_queue( obe_t *h, obe_raw_frame_t *raw_frame, int output_stream
     if( !encoder )
         return -1;
 
+    if( encoder->is_video )
+        shed_encoder_frames( h, encoder, raw_frame );
+
     return add_to_queue( &encoder->queue, raw_frame );
 }
 
@@ -354,19 +644,14 @@ static void destroy_mux( obe_t *h )
         free( h->mux_opts.service_name );
     if( h->mux_opts.provider_name )
         free( h->mux_opts.provider_name );
-}
 
-static void destroy_mux_smoothing( obe_queue_t *queue )
-{
-    obe_muxed_data_t *muxed_data;
-    pthread_mutex_lock( &queue->mutex );
-    for( int i = 0; i < queue->size; i++ )
+    for( int i = 0; i < h->mux_opts.num_programs; i++ )
     {
-        muxed_data = queue->queue[i];
-        destroy_muxed_data( muxed_data );
+        free( h->mux_opts.programs[i].service_name );
+        free( h->mux_opts.programs[i].provider_name );
+        free( h->mux_opts.programs[i].output_stream_ids );
     }
-
-    obe_destroy_queue( queue );
+    free( h->mux_opts.programs );
 }
 
 int remove_early_frames( obe_t *h, int64_t pts )
@@ -394,14 +679,9 @@ int remove_early_frames( obe_t *h, int64_t pts )
     return 0;
 }
 
-/* Output queue */
+/* Output */
 static void destroy_output( obe_output_t *output )
 {
-    pthread_mutex_lock( &output->queue.mutex );
-    for( int i = 0; i < output->queue.size; i++ )
-        av_buffer_unref( output->queue.queue[i] );
-
-    obe_destroy_queue( &output->queue );
     free( output );
 }
 
@@ -539,6 +819,53 @@ void sleep_input_clock( obe_t *h, int64_t i_time )
     sleep_mpeg_ticks( wallclock_time );
 }
 
+int64_t input_clock_to_wallclock( obe_t *h, int64_t i_time )
+{
+    int64_t wallclock_time;
+    pthread_mutex_lock( &h->obe_clock_mutex );
+    wallclock_time = ( i_time - h->obe_clock_last_pts ) + h->obe_clock_last_wallclock;
+    pthread_mutex_unlock( &h->obe_clock_mutex );
+
+    return wallclock_time;
+}
+
+/* Sleeps until spin ticks before i_time then busy-waits until i_time. Returns how late it woke */
+int64_t sleep_input_clock_spin( obe_t *h, int64_t i_time, int64_t spin )
+{
+    int64_t wallclock_time = input_clock_to_wallclock( h, i_time ), now;
+
+    now = get_wallclock_in_mpeg_ticks();
+    if( wallclock_time - now > spin )
+    {
+        sleep_mpeg_ticks( wallclock_time - spin );
+        now = get_wallclock_in_mpeg_ticks();
+    }
+
+    while( now < wallclock_time )
+        now = get_wallclock_in_mpeg_ticks();
+
+    return now - wallclock_time;
+}
+
+static const int pacing_bucket_limits[OBE_PACING_BUCKETS-1] = { 1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000 };
+
+void update_pacing_stats( obe_t *h, int64_t lateness )
+{
+    obe_pacing_stats_t *stats = &h->pacing_stats;
+    int64_t lateness_us = lateness / ( OBE_CLOCK / 1000000 );
+    int i = 0;
+
+    if( lateness < 0 )
+        stats->num_early++;
+
+    while( i < OBE_PACING_BUCKETS-1 && lateness_us >= pacing_bucket_limits[i] )
+        i++;
+
+    stats->buckets[i]++;
+    stats->max_lateness = MAX( stats->max_lateness, lateness_us );
+    stats->num_datagrams++;
+}
+
 int get_non_display_location( int type )
 {
     /* Set the appropriate location */
@@ -722,6 +1049,7 @@ int obe_probe_device( obe_t *h, obe_input_t *input_device, obe_input_program_t *
             memcpy( &stream_out->channel_layout, &stream_in->channel_layout,
             offsetof( obe_input_stream_t, bitrate ) - offsetof( obe_input_stream_t, channel_layout ) );
             stream_out->aac_is_latm = stream_in->is_latm;
+            stream_out->sdi_audio_pair = stream_in->sdi_audio_pair;
         }
 
         memcpy( stream_out->lang_code, stream_in->lang_code, 4 );
@@ -902,6 +1230,49 @@ int obe_setup_muxer( obe_t *h, obe_mux_opts_t *mux_opts )
         strcpy( h->mux_opts.provider_name, mux_opts->provider_name );
     }
 
+    h->mux_opts.num_programs = 0;
+    h->mux_opts.programs = NULL;
+    if( mux_opts->num_programs )
+    {
+        if( mux_opts->passthrough )
+        {
+            fprintf( stderr, "Multiple programs cannot be used in passthrough mode \n" );
+            return -1;
+        }
+
+        h->mux_opts.programs = calloc( mux_opts->num_programs, sizeof(*h->mux_opts.programs) );
+        if( !h->mux_opts.programs )
+        {
+            fprintf( stderr, "Malloc failed \n" );
+            return -1;
+        }
+        h->mux_opts.num_programs = mux_opts->num_programs;
+
+        for( int i = 0; i < mux_opts->num_programs; i++ )
+        {
+            obe_mux_program_t *src = &mux_opts->programs[i];
+            obe_mux_program_t *dst = &h->mux_opts.programs[i];
+
+            if( !src->num_output_streams )
+            {
+                fprintf( stderr, "Program %i has no streams \n", i );
+                return -1;
+            }
+
+            memcpy( dst, src, sizeof(*dst) );
+            dst->service_name = src->service_name ? strdup( src->service_name ) : NULL;
+            dst->provider_name = src->provider_name ? strdup( src->provider_name ) : NULL;
+            dst->output_stream_ids = malloc( src->num_output_streams * sizeof(*dst->output_stream_ids) );
+            if( ( src->service_name && !dst->service_name ) || ( src->provider_name && !dst->provider_name ) ||
+                !dst->output_stream_ids )
+            {
+                fprintf( stderr, "Malloc failed \n" );
+                return -1;
+            }
+            memcpy( dst->output_stream_ids, src->output_stream_ids, src->num_output_streams * sizeof(*dst->output_stream_ids) );
+        }
+    }
+
     return 0;
 }
 
@@ -946,6 +1317,220 @@ int obe_setup_output( obe_t *h, obe_output_opts_t *output_opts )
     return 0;
 }
 
+int obe_get_encoder_stats( obe_t *h, int output_stream_id, obe_encoder_stats_t *stats, int max_stats )
+{
+    obe_encoder_t *encoder = get_encoder( h, output_stream_id );
+    int64_t start_idx, end_idx, first_valid;
+    int num_stats;
+
+    if( !encoder || !encoder->is_video )
+        return -1;
+
+    end_idx = encoder->stats_idx;
+    __sync_synchronize();
+    start_idx = MAX( end_idx - MIN( max_stats, OBE_ENCODER_STATS_SIZE ), 0 );
+
+    for( int64_t i = start_idx; i < end_idx; i++ )
+        memcpy( &stats[i-start_idx], &encoder->stats[i % OBE_ENCODER_STATS_SIZE], sizeof(*stats) );
+
+    /* Discard any entries the encoder overwrote while we were copying */
+    __sync_synchronize();
+    first_valid = MAX( encoder->stats_idx - OBE_ENCODER_STATS_SIZE + 1, start_idx );
+    num_stats = end_idx - first_valid;
+    if( num_stats <= 0 )
+        return 0;
+
+    memmove( stats, &stats[first_valid-start_idx], num_stats * sizeof(*stats) );
+
+    return num_stats;
+}
+
+int obe_set_encoder_governor( obe_t *h, int output_stream_id, obe_encoder_governor_t *governor )
+{
+    obe_encoder_t *encoder = get_encoder( h, output_stream_id );
+
+    if( !encoder || !encoder->is_video )
+    {
+        fprintf( stderr, "Invalid video stream\n" );
+        return -1;
+    }
+
+    if( governor->cpu_budget < 0 || governor->min_buffer_fill > 0 )
+    {
+        fprintf( stderr, "Invalid governor settings\n" );
+        return -1;
+    }
+
+    pthread_mutex_lock( &encoder->queue.mutex );
+    memcpy( &encoder->governor, governor, sizeof(*governor) );
+    pthread_mutex_unlock( &encoder->queue.mutex );
+
+    return 0;
+}
+
+int obe_update_stream( obe_t *h, obe_output_stream_t *output_stream )
+{
+    obe_output_stream_t *cur_stream = get_output_stream( h, output_stream->output_stream_id );
+    obe_encoder_t *encoder = get_encoder( h, output_stream->output_stream_id );
+    x264_param_t *avc_param = &output_stream->avc_param;
+
+    if( !cur_stream || !encoder || !encoder->is_video || cur_stream->stream_format != VIDEO_AVC )
+    {
+        fprintf( stderr, "Only running AVC streams can be updated\n" );
+        return -1;
+    }
+
+    if( avc_param->rc.i_vbv_max_bitrate <= 0 || avc_param->rc.i_bitrate < 0 ||
+        avc_param->rc.i_bitrate > avc_param->rc.i_vbv_max_bitrate ||
+        ( h->obe_system != OBE_SYSTEM_TYPE_LOWEST_LATENCY && avc_param->rc.i_vbv_buffer_size <= 0 ) )
+    {
+        fprintf( stderr, "Invalid bitrate or VBV settings\n" );
+        return -1;
+    }
+
+    if( (int64_t)avc_param->rc.i_vbv_max_bitrate * 1000 > h->mux_opts.ts_muxrate )
+    {
+        fprintf( stderr, "Bitrate is higher than the mux rate\n" );
+        return -1;
+    }
+
+    pthread_mutex_lock( &encoder->queue.mutex );
+    encoder->update_bitrate = avc_param->rc.i_bitrate;
+    encoder->update_vbv_max_bitrate = avc_param->rc.i_vbv_max_bitrate;
+    encoder->update_vbv_buffer_size = avc_param->rc.i_vbv_buffer_size;
+    /* One frame, as in obe_start */
+    if( h->obe_system == OBE_SYSTEM_TYPE_LOWEST_LATENCY )
+        encoder->update_vbv_buffer_size = (double)avc_param->rc.i_vbv_max_bitrate * cur_stream->avc_param.i_fps_den / cur_stream->avc_param.i_fps_num;
+    encoder->update_pending = 1;
+    cur_stream->avc_param.rc.i_bitrate = encoder->update_bitrate;
+    cur_stream->avc_param.rc.i_vbv_max_bitrate = encoder->update_vbv_max_bitrate;
+    cur_stream->avc_param.rc.i_vbv_buffer_size = encoder->update_vbv_buffer_size;
+    pthread_mutex_unlock( &encoder->queue.mutex );
+
+    return 0;
+}
+
+int obe_get_pacing_stats( obe_t *h, obe_pacing_stats_t *stats )
+{
+    /* Counters are only written by the IP output thread so a torn copy is at most one batch out */
+    memcpy( stats, &h->pacing_stats, sizeof(*stats) );
+
+    return 0;
+}
+
+int obe_set_overload_policy( obe_t *h, int output_stream_id, obe_overload_policy_t *policy )
+{
+    obe_encoder_t *encoder = get_encoder( h, output_stream_id );
+
+    if( !encoder || !encoder->is_video )
+    {
+        fprintf( stderr, "Invalid video stream\n" );
+        return -1;
+    }
+
+    if( policy->action < OBE_OVERLOAD_NONE || policy->action > OBE_OVERLOAD_DROP ||
+        ( policy->action != OBE_OVERLOAD_NONE && policy->max_queue_age <= 0 ) )
+    {
+        fprintf( stderr, "Invalid overload policy\n" );
+        return -1;
+    }
+
+    pthread_mutex_lock( &encoder->queue.mutex );
+    memcpy( &encoder->overload, policy, sizeof(*policy) );
+    encoder->overloaded = 0;
+    pthread_mutex_unlock( &encoder->queue.mutex );
+
+    return 0;
+}
+
+int obe_get_overload_stats( obe_t *h, int output_stream_id, obe_overload_stats_t *stats )
+{
+    obe_encoder_t *encoder = get_encoder( h, output_stream_id );
+
+    if( !encoder || !encoder->is_video )
+        return -1;
+
+    pthread_mutex_lock( &encoder->queue.mutex );
+    memcpy( stats, &encoder->overload_stats, sizeof(*stats) );
+    pthread_mutex_unlock( &encoder->queue.mutex );
+
+    return 0;
+}
+
+/* Filters and audio encoders only wait for input so they share a pool of workers rather than
+ * having a thread each. A task drains whatever is queued and returns without blocking. */
+static void run_filter_task( obe_task_t *task )
+{
+    obe_filter_t *filter = task->opaque;
+    obe_raw_frame_t *raw_frame;
+
+    while( 1 )
+    {
+        pthread_mutex_lock( &filter->queue.mutex );
+        if( !filter->queue.size || filter->cancel_thread )
+        {
+            pthread_mutex_unlock( &filter->queue.mutex );
+            return;
+        }
+        raw_frame = filter->queue.queue[0];
+        pthread_mutex_unlock( &filter->queue.mutex );
+
+        remove_from_queue( &filter->queue );
+
+        if( filter->filter_frame( filter->filter_ctx, raw_frame ) < 0 )
+        {
+            pthread_mutex_lock( &filter->queue.mutex );
+            filter->cancel_thread = 1;
+            pthread_mutex_unlock( &filter->queue.mutex );
+            return;
+        }
+    }
+}
+
+static void run_encoder_task( obe_task_t *task )
+{
+    obe_encoder_t *encoder = task->opaque;
+    obe_raw_frame_t *raw_frame;
+
+    while( 1 )
+    {
+        pthread_mutex_lock( &encoder->queue.mutex );
+        if( !encoder->queue.size || encoder->cancel_thread )
+        {
+            pthread_mutex_unlock( &encoder->queue.mutex );
+            return;
+        }
+        raw_frame = encoder->queue.queue[0];
+        pthread_mutex_unlock( &encoder->queue.mutex );
+
+        remove_from_queue( &encoder->queue );
+
+        if( encoder->encode_frame( encoder->encoder_ctx, raw_frame ) < 0 )
+        {
+            pthread_mutex_lock( &encoder->queue.mutex );
+            encoder->cancel_thread = 1;
+            pthread_mutex_unlock( &encoder->queue.mutex );
+            return;
+        }
+    }
+}
+
+/* The ring holds two video VBV buffers and half a second for the mux and outputs at the mux rate */
+static int get_ts_ring_size( obe_t *h )
+{
+    double duration = 0.5;
+
+    for( int i = 0; i < h->num_output_streams; i++ )
+    {
+        x264_param_t *avc_param = &h->output_streams[i].avc_param;
+        if( h->output_streams[i].stream_action == STREAM_ENCODE && avc_param->rc.i_vbv_max_bitrate &&
+            ( h->output_streams[i].stream_format == VIDEO_AVC || h->output_streams[i].stream_format == VIDEO_MPEG2 ) )
+            duration = MAX( duration, 0.5 + 2.0 * avc_param->rc.i_vbv_buffer_size / avc_param->rc.i_vbv_max_bitrate );
+    }
+
+    return duration * h->mux_opts.ts_muxrate / ( TS_PACKETS_SIZE * 8 ) + 1;
+}
+
 int obe_start( obe_t *h )
 {
     obe_int_input_stream_t  *input_stream;
@@ -955,10 +1540,13 @@ int obe_start( obe_t *h )
     obe_aud_enc_params_t *aud_enc_params;
 
     obe_input_func_t  input;
+    obe_vid_enc_func_t video_encoder;
     obe_aud_enc_func_t audio_encoder;
     obe_output_func_t output;
+    int num_ring_readers = 0;
 
-    int num_samples = 0;
+    int num_samples = 0, num_tasks = 0;
+    void *encoder_ctx;
 
     /* TODO: a lot of sanity checks */
     /* TODO: decide upon thread priorities */
@@ -968,9 +1556,10 @@ int obe_start( obe_t *h )
     pthread_mutex_init( &h->drop_mutex, NULL );
     obe_init_queue( &h->enc_smoothing_queue );
     obe_init_queue( &h->mux_queue );
-    obe_init_queue( &h->mux_smoothing_queue );
     pthread_mutex_init( &h->obe_clock_mutex, NULL );
     pthread_cond_init( &h->obe_clock_cv, NULL );
+    pthread_mutex_init( &h->statmux_mutex, NULL );
+    pthread_cond_init( &h->statmux_cv, NULL );
 
     if( h->devices[0]->device_type == INPUT_URL )
     {
@@ -990,19 +1579,66 @@ int obe_start( obe_t *h )
         goto fail;
     }
 
+    /* The IP output thread reads the ring as reader 0 and each file or HLS output has its own reader */
+    for( int i = 0; i < h->num_outputs; i++ )
+    {
+        if( h->outputs[i]->output_dest.type == OUTPUT_FILE || h->outputs[i]->output_dest.type == OUTPUT_HLS )
+            h->outputs[i]->ring_reader = ++num_ring_readers;
+    }
+
+    if( obe_ts_ring_init( &h->ts_ring, get_ts_ring_size( h ), num_ring_readers + 1 ) < 0 )
+    {
+        fprintf( stderr, "Malloc failed \n" );
+        goto fail;
+    }
+
     /* Open Output Threads */
+    output = ip_output;
+
+    if( pthread_create( &h->output_thread, NULL, output.open_output, (void*)h ) < 0 )
+    {
+        fprintf( stderr, "Couldn't create output thread \n" );
+        goto fail;
+    }
+
     for( int i = 0; i < h->num_outputs; i++ )
     {
-        obe_init_queue( &h->outputs[i]->queue );
-        output = ip_output;
+        if( h->outputs[i]->output_dest.type != OUTPUT_FILE && h->outputs[i]->output_dest.type != OUTPUT_HLS )
+            continue;
+
+        h->outputs[i]->ring = &h->ts_ring;
+        output = file_output;
 
         if( pthread_create( &h->outputs[i]->output_thread, NULL, output.open_output, (void*)h->outputs[i] ) < 0 )
         {
-            fprintf( stderr, "Couldn't create output thread \n" );
+            fprintf( stderr, "Couldn't create file output thread \n" );
             goto fail;
         }
     }
 
+    /* Every filter and audio encoder is a task. There is a worker per CPU, or per task if there are fewer */
+    for( int i = 0; i < h->num_output_streams; i++ )
+    {
+        if( h->output_streams[i].stream_action == STREAM_ENCODE && h->output_streams[i].stream_format != VIDEO_AVC &&
+            h->output_streams[i].stream_format != VIDEO_MPEG2 )
+            num_tasks++;
+    }
+
+    for( int i = 0; i < h->devices[0]->num_input_streams; i++ )
+    {
+        input_stream = h->devices[0]->streams[i];
+        if( input_stream && ( input_stream->stream_type == STREAM_TYPE_VIDEO ||
+            ( input_stream->stream_type == STREAM_TYPE_AUDIO && !input_stream->sdi_audio_pair ) ) )
+            num_tasks++;
+    }
+
+    h->task_pool = obe_task_pool_create( MIN( num_tasks, sysconf( _SC_NPROCESSORS_ONLN ) ), num_tasks );
+    if( !h->task_pool )
+    {
+        fprintf( stderr, "Couldn't create task pool \n" );
+        goto fail;
+    }
+
     /* Open Encoder Threads */
     for( int i = 0; i < h->num_output_streams; i++ )
     {
@@ -1017,8 +1653,9 @@ int obe_start( obe_t *h )
             obe_init_queue( &h->encoders[h->num_encoders]->queue );
             h->encoders[h->num_encoders]->output_stream_id = h->output_streams[i].output_stream_id;
 
-            if( h->output_streams[i].stream_format == VIDEO_AVC )
+            if( h->output_streams[i].stream_format == VIDEO_AVC || h->output_streams[i].stream_format == VIDEO_MPEG2 )
             {
+                /* MPEG-2 takes its rate control settings from the same parameters */
                 x264_param_t *x264_param = &h->output_streams[i].avc_param;
                 if( h->obe_system == OBE_SYSTEM_TYPE_LOWEST_LATENCY )
                 {
@@ -1035,9 +1672,11 @@ int obe_start( obe_t *h )
                 vid_enc_params->h = h;
                 vid_enc_params->encoder = h->encoders[h->num_encoders];
                 h->encoders[h->num_encoders]->is_video = 1;
+                memcpy( &h->encoders[h->num_encoders]->overload, &h->output_streams[i].overload, sizeof(obe_overload_policy_t) );
 
                 memcpy( &vid_enc_params->avc_param, &h->output_streams[i].avc_param, sizeof(x264_param_t) );
-                if( pthread_create( &h->encoders[h->num_encoders]->encoder_thread, NULL, x264_encoder.start_encoder, (void*)vid_enc_params ) < 0 )
+                video_encoder = h->output_streams[i].stream_format == VIDEO_MPEG2 ? mpeg2_encoder : x264_encoder;
+                if( pthread_create( &h->encoders[h->num_encoders]->encoder_thread, NULL, video_encoder.start_encoder, (void*)vid_enc_params ) < 0 )
                 {
                     fprintf( stderr, "Couldn't create encode thread \n" );
                     goto fail;
@@ -1086,15 +1725,32 @@ int obe_start( obe_t *h )
                 else
                     h->output_streams[i].ts_opts.frames_per_pes = aud_enc_params->frames_per_pes = 1;
 
-                if( pthread_create( &h->encoders[h->num_encoders]->encoder_thread, NULL, audio_encoder.start_encoder, (void*)aud_enc_params ) < 0 )
+                encoder_ctx = audio_encoder.open_encoder( aud_enc_params );
+                if( !encoder_ctx )
                 {
-                    fprintf( stderr, "Couldn't create encode thread \n" );
+                    fprintf( stderr, "Couldn't open audio encoder \n" );
                     goto fail;
                 }
+
+                h->encoders[h->num_encoders]->encoder_ctx = encoder_ctx;
+                h->encoders[h->num_encoders]->encode_frame = audio_encoder.encode_frame;
+                h->encoders[h->num_encoders]->close_encoder = audio_encoder.close_encoder;
+                obe_task_init( h->task_pool, &h->encoders[h->num_encoders]->task, run_encoder_task, h->encoders[h->num_encoders] );
+                h->encoders[h->num_encoders]->queue.task = &h->encoders[h->num_encoders]->task;
             }
 
             h->num_encoders++;
         }
+        else
+        {
+            /* SMPTE 337M bursts are extracted by the audio filter and sent to the mux one burst per PES.
+             * PCM is packed into one SMPTE 302M frame per input frame */
+            input_stream = get_input_stream( h, h->output_streams[i].input_stream_id );
+            if( input_stream && ( input_stream->sdi_audio_pair || input_stream->stream_format == AUDIO_PCM ) )
+                h->output_streams[i].ts_opts.frames_per_pes = 1;
+            if( input_stream && !input_stream->sdi_audio_pair && input_stream->stream_format == AUDIO_PCM && !h->output_streams[i].bit_depth )
+                h->output_streams[i].bit_depth = 24;
+        }
     }
 
     if( h->obe_system == OBE_SYSTEM_TYPE_GENERIC )
@@ -1107,6 +1763,16 @@ int obe_start( obe_t *h )
         }
     }
 
+    if( h->mux_opts.statmux )
+    {
+        /* Open Statmux Thread */
+        if( pthread_create( &h->statmux_thread, NULL, statmux.start_statmux, (void*)h ) < 0 )
+        {
+            fprintf( stderr, "Couldn't create statmux thread \n" );
+            goto fail;
+        }
+    }
+
     /* Open Mux Smoothing Thread */
     if( pthread_create( &h->mux_smoothing_thread, NULL, mux_smoothing.start_smoothing, (void*)h ) < 0 )
     {
@@ -1133,11 +1799,13 @@ int obe_start( obe_t *h )
         goto fail;
     }
 
-    /* Open Filter Thread */
+    /* Open Filters */
     for( int i = 0; i < h->devices[0]->num_input_streams; i++ )
     {
         input_stream = h->devices[0]->streams[i];
-        if( input_stream && ( input_stream->stream_type == STREAM_TYPE_VIDEO || input_stream->stream_type == STREAM_TYPE_AUDIO ) )
+        /* SMPTE 337M streams are handled by the filter of the PCM stream they are carried in */
+        if( input_stream && ( input_stream->stream_type == STREAM_TYPE_VIDEO ||
+            ( input_stream->stream_type == STREAM_TYPE_AUDIO && !input_stream->sdi_audio_pair ) ) )
         {
             h->filters[h->num_filters] = calloc( 1, sizeof(obe_filter_t) );
             if( !h->filters[h->num_filters] )
@@ -1167,13 +1835,15 @@ int obe_start( obe_t *h )
                 vid_filter_params->h = h;
                 vid_filter_params->filter = h->filters[h->num_filters];
                 vid_filter_params->input_stream = input_stream;
-                vid_filter_params->target_csp = h->output_streams[i].avc_param.i_csp & X264_CSP_MASK;
 
-                if( pthread_create( &h->filters[h->num_filters]->filter_thread, NULL, video_filter.start_filter, vid_filter_params ) < 0 )
+                h->filters[h->num_filters]->filter_ctx = video_filter.open_filter( vid_filter_params );
+                if( !h->filters[h->num_filters]->filter_ctx )
                 {
-                    fprintf( stderr, "Couldn't create video filter thread \n" );
+                    fprintf( stderr, "Couldn't open video filter \n" );
                     goto fail;
                 }
+                h->filters[h->num_filters]->filter_frame = video_filter.filter_frame;
+                h->filters[h->num_filters]->close_filter = video_filter.close_filter;
             }
             else
             {
@@ -1187,13 +1857,18 @@ int obe_start( obe_t *h )
                 aud_filter_params->h = h;
                 aud_filter_params->filter = h->filters[h->num_filters];
 
-                if( pthread_create( &h->filters[h->num_filters]->filter_thread, NULL, audio_filter.start_filter, aud_filter_params ) < 0 )
+                h->filters[h->num_filters]->filter_ctx = audio_filter.open_filter( aud_filter_params );
+                if( !h->filters[h->num_filters]->filter_ctx )
                 {
-                    fprintf( stderr, "Couldn't create filter thread \n" );
+                    fprintf( stderr, "Couldn't open audio filter \n" );
                     goto fail;
                 }
+                h->filters[h->num_filters]->filter_frame = audio_filter.filter_frame;
+                h->filters[h->num_filters]->close_filter = audio_filter.close_filter;
             }
 
+            obe_task_init( h->task_pool, &h->filters[h->num_filters]->task, run_filter_task, h->filters[h->num_filters] );
+            h->filters[h->num_filters]->queue.task = &h->filters[h->num_filters]->task;
             h->num_filters++;
         }
     }
@@ -1245,18 +1920,35 @@ void obe_close( obe_t *h )
 
     fprintf( stderr, "input cancelled \n" );
 
-    /* Cancel filter threads */
+    /* Cancel filters. They are closed once the task pool has stopped */
     for( int i = 0; i < h->num_filters; i++ )
     {
         pthread_mutex_lock( &h->filters[i]->queue.mutex );
         h->filters[i]->cancel_thread = 1;
-        pthread_cond_signal( &h->filters[i]->queue.in_cv );
         pthread_mutex_unlock( &h->filters[i]->queue.mutex );
-        __pthread_join( h->filters[i]->filter_thread, &ret_ptr );
     }
 
     fprintf( stderr, "filters cancelled \n" );
 
+    /* Cancel statmux thread */
+    if( h->statmux_thread )
+    {
+        pthread_mutex_lock( &h->statmux_mutex );
+        h->cancel_statmux_thread = 1;
+        pthread_cond_signal( &h->statmux_cv );
+        pthread_mutex_unlock( &h->statmux_mutex );
+        /* wake it in case it is waiting for an encoder to open */
+        for( int i = 0; i < h->num_encoders; i++ )
+        {
+            pthread_mutex_lock( &h->encoders[i]->queue.mutex );
+            pthread_cond_broadcast( &h->encoders[i]->queue.in_cv );
+            pthread_mutex_unlock( &h->encoders[i]->queue.mutex );
+        }
+        __pthread_join( h->statmux_thread, &ret_ptr );
+
+        fprintf( stderr, "statmux cancelled \n" );
+    }
+
     /* Cancel encoder threads */
     for( int i = 0; i < h->num_encoders; i++ )
     {
@@ -1267,6 +1959,10 @@ void obe_close( obe_t *h )
         __pthread_join( h->encoders[i]->encoder_thread, &ret_ptr );
     }
 
+    /* Wait for any running filter and encoder tasks */
+    if( h->task_pool )
+        obe_task_pool_destroy( h->task_pool );
+
     fprintf( stderr, "encoders cancelled \n" );
 
     /* Cancel encoder smoothing thread */
@@ -1291,29 +1987,35 @@ void obe_close( obe_t *h )
     h->cancel_mux_thread = 1;
     pthread_cond_signal( &h->mux_queue.in_cv );
     pthread_mutex_unlock( &h->mux_queue.mutex );
+    /* the mux may be waiting for the outputs */
+    obe_ts_ring_wake( &h->ts_ring );
     __pthread_join( h->mux_thread, &ret_ptr );
 
     fprintf( stderr, "mux cancelled \n" );
 
     /* Cancel mux smoothing thread */
-    pthread_mutex_lock( &h->mux_smoothing_queue.mutex );
     h->cancel_mux_smoothing_thread = 1;
-    pthread_cond_signal( &h->mux_smoothing_queue.in_cv );
-    pthread_mutex_unlock( &h->mux_smoothing_queue.mutex );
+    obe_ts_ring_wake( &h->ts_ring );
     __pthread_join( h->mux_smoothing_thread, &ret_ptr );
 
     fprintf( stderr, "mux smoothing cancelled \n" );
 
-    /* Cancel output threads */
+    /* Cancel output thread */
+    h->cancel_output_thread = 1;
+    obe_ts_ring_wake( &h->ts_ring );
+    /* could be blocking on OS so have to cancel thread too */
+    __pthread_cancel( h->output_thread );
+    __pthread_join( h->output_thread, &ret_ptr );
+
+    /* File outputs finish writing what they have buffered */
     for( int i = 0; i < h->num_outputs; i++ )
     {
-        pthread_mutex_lock( &h->outputs[i]->queue.mutex );
-        h->outputs[i]->cancel_thread = 1;
-        pthread_cond_signal( &h->outputs[i]->queue.in_cv );
-        pthread_mutex_unlock( &h->outputs[i]->queue.mutex );
-        /* could be blocking on OS so have to cancel thread too */
-        __pthread_cancel( h->outputs[i]->output_thread );
-        __pthread_join( h->outputs[i]->output_thread, &ret_ptr );
+        if( h->outputs[i]->output_dest.type == OUTPUT_FILE || h->outputs[i]->output_dest.type == OUTPUT_HLS )
+        {
+            h->outputs[i]->cancel_thread = 1;
+            obe_ts_ring_wake( &h->ts_ring );
+            __pthread_join( h->outputs[i]->output_thread, &ret_ptr );
+        }
     }
 
     fprintf( stderr, "output thread cancelled \n" );
@@ -1332,7 +2034,11 @@ void obe_close( obe_t *h )
 
     /* Destroy encoders */
     for( int i = 0; i < h->num_encoders; i++ )
+    {
+        if( h->encoders[i]->encoder_ctx )
+            h->encoders[i]->close_encoder( h->encoders[i]->encoder_ctx );
         destroy_encoder( h->encoders[i] );
+    }
 
     fprintf( stderr, "encoders destroyed \n" );
 
@@ -1344,7 +2050,7 @@ void obe_close( obe_t *h )
 
     fprintf( stderr, "mux destroyed \n" );
 
-    destroy_mux_smoothing( &h->mux_smoothing_queue );
+    obe_ts_ring_destroy( &h->ts_ring );
     fprintf( stderr, "mux smoothing destroyed \n" );
 
     /* Destroy output */
@@ -228,6 +228,7 @@ typedef struct
     /* Compressed Audio */
     int bitrate;
     int aac_is_latm; /* LATM is sometimes known as MPEG-4 Encapsulation */
+    int sdi_audio_pair; /* SMPTE 337M, set if the stream is carried in an SDI audio pair */
 
     /** Subtitles **/
     int dvb_has_dds; /* Has display definition segment (i.e HD subtitling) */
@@ -385,6 +386,21 @@ typedef struct
      unsigned int wss: 1;
 } obe_dvb_vbi_opts_t;
 
+/* Overload policy of a video encoder. Applied when a frame is queued and the oldest frame waiting
+ * to be encoded is more than max_queue_age (27MHz ticks) older than the new one. */
+enum obe_overload_action_e
+{
+    OBE_OVERLOAD_NONE,
+    OBE_OVERLOAD_SIGNAL, /* reset speedcontrol and the smoothing buffers as if the input had dropped */
+    OBE_OVERLOAD_DROP,   /* shed the oldest queued frames until under the limit, then signal */
+};
+
+typedef struct
+{
+    int action;
+    int64_t max_queue_age;
+} obe_overload_policy_t;
+
 /* Stream Options:
  *
  * input_stream_id - stream id of the INPUT stream
@@ -394,6 +410,9 @@ typedef struct
  * Encode Options: (ignored in passthrough mode)
  * stream_format - stream_format
  *
+ * Video Options:
+ * overload - overload policy of the encoder. Can be changed while running with obe_set_overload_policy
+ *
  * Audio Options:
  * sdi_channel_pair - channel pair to use for encoding stereo (starts from channel pair 1)
  *
@@ -411,6 +430,7 @@ typedef struct
     /* Video */
     int is_wide;
     obe_frame_anc_opts_t video_anc;
+    obe_overload_policy_t overload;
 
     /* AVC */
     x264_param_t avc_param;
@@ -430,6 +450,9 @@ typedef struct
     /* MP2 */
     int mp2_mode;
 
+    /* SMPTE 302M (passed-through PCM). 16, 20 or 24 */
+    int bit_depth;
+
     /* DVB-VBI */
     obe_dvb_vbi_opts_t dvb_vbi_opts;
 
@@ -456,6 +479,21 @@ enum obe_ts_type_t
     OBE_TS_TYPE_ISDB,
 };
 
+/* A program of a multi-program TS. Zero program number and PIDs are chosen automatically.
+ * The PCR goes on the first video stream of the program unless pcr_pid is set */
+typedef struct
+{
+    int program_num;
+    int pmt_pid;
+    int pcr_pid;
+
+    char *service_name;
+    char *provider_name;
+
+    int num_output_streams;
+    int *output_stream_ids;
+} obe_mux_program_t;
+
 typedef struct
 {
     int muxer;
@@ -476,8 +514,28 @@ typedef struct
     int pcr_period;
     int pat_period;
 
+    /* Mux smoothing sleeps until pacing_spin microseconds before each datagram is due and busy-waits
+     * the rest, trading CPU for lower PCR jitter. 0 sleeps until the deadline */
+    int pacing_spin;
+
+    /* Mux smoothing releases each datagram pacing_slack microseconds before it is due, to cover the
+     * hand-off to the output thread. Tune it with obe_get_pacing_stats */
+    int pacing_slack;
+
+    /* With each datagram, mux smoothing also releases those due less than pacing_slot microseconds after it
+     * so the IP output sends them with one call. Segmentation offload (gso=1) only pays off with a slot.
+     * 0 releases datagrams one at a time */
+    int pacing_slot;
+
     int is_3dtv;
 
+    /* Statistical multiplexing - share statmux_bitrate (kbit/s) between the AVC encoders according to
+     * their complexity. If statmux_bitrate is 0, 90% of the mux rate less the encoded audio is shared.
+     * Rates are reallocated once every encoder has coded a keyframe and each encoder switches at its next IDR
+     * (see obe_update_stream). Increases wait until the bitrate they need is no longer in use */
+    int statmux;
+    int statmux_bitrate;
+
     /* DVB */
     char *service_name;
     char *provider_name;
@@ -485,6 +543,12 @@ typedef struct
     /* ATSC */
     int sb_leak_rate;
     int sb_size;
+
+    /* Multi-program TS. If num_programs is 0 all streams go in one program described by
+     * program_num, pmt_pid, pcr_pid, service_name and provider_name above.
+     * Not available in passthrough mode */
+    int num_programs;
+    obe_mux_program_t *programs;
 } obe_mux_opts_t;
 
 int obe_setup_muxer( obe_t *h, obe_mux_opts_t *mux_opts );
@@ -494,6 +558,8 @@ enum output_e
 {
     OUTPUT_UDP, /* MPEG-TS in UDP */
     OUTPUT_RTP, /* MPEG-TS in RTP in UDP */
+    OUTPUT_FILE, /* MPEG-TS recorded to local disk */
+    OUTPUT_HLS,  /* MPEG-TS segmented for HLS into a local directory */
 //    OUTPUT_LINSYS_ASI,
 //    OUTPUT_LINSYS_SMPTE_310M,
 };
@@ -502,6 +568,13 @@ enum output_e
  *
  * target - TODO document url parameters
  *
+ * OUTPUT_FILE target is a path, optionally followed by ?paced=0/1 (default 1, record as sent rather than as muxed),
+ * direct=0/1 (default 1, write with O_DIRECT), rotate_time=seconds and rotate_size=megabytes
+ *
+ * OUTPUT_HLS target is a directory, optionally followed by ?segment_time=seconds (default 6), list_size=segments (default 6),
+ * part_time=seconds (default 0, no low-latency parts) and paced=0/1 (default 0). Segments start on video IDR frames
+ * and are written with index.m3u8 under temporary names then renamed into place
+ *
  */
 
 typedef struct
@@ -518,6 +591,80 @@ typedef struct
 
 int obe_setup_output( obe_t *h, obe_output_opts_t *output_opts );
 
+/**** Encoder statistics ****/
+/* Per-frame speedcontrol state of a video encoder
+ *
+ * buffer_fill - encoder smoothing buffer fill given to speedcontrol (after the governor). Negative values are underflows
+ * encode_time - time spent in x264_encoder_encode in microseconds
+ * frame_size - coded frame size in bytes (0 if no frame was output)
+ * qp - average quantiser of the coded frame
+ * speedcontrol_reset - set if speedcontrol was reset after a drop in the source before this frame
+ */
+typedef struct
+{
+    int64_t pts;
+    float buffer_fill;
+    int64_t encode_time;
+    int frame_size;
+    int frame_type;
+    int qp;
+    int speedcontrol_reset;
+} obe_encoder_stats_t;
+
+/* Copies up to max_stats of the most recent frame statistics, oldest first, into stats.
+ * Returns the number of entries copied or -1 if output_stream_id is not a running video encoder */
+int obe_get_encoder_stats( obe_t *h, int output_stream_id, obe_encoder_stats_t *stats, int max_stats );
+
+/* Governor options (0 to disable):
+ *
+ * min_buffer_fill - buffer fill never reported to speedcontrol as lower than this (e.g. -0.5).
+ *                   Stops short underflows from dropping to the fastest presets.
+ * cpu_budget - fraction of each frame period the encoder may spend encoding (e.g. 0.8).
+ *              Above the budget the buffer fill is scaled down so that speedcontrol picks faster presets.
+ */
+typedef struct
+{
+    float min_buffer_fill;
+    float cpu_budget;
+} obe_encoder_governor_t;
+
+int obe_set_encoder_governor( obe_t *h, int output_stream_id, obe_encoder_governor_t *governor );
+
+/* Overload statistics of a video encoder. See obe_overload_policy_t */
+typedef struct
+{
+    int64_t overloads;      /* times the queue went over the limit */
+    int64_t frames_dropped;
+    int64_t signals;        /* resets signalled because of overload */
+    int64_t max_queue_age;  /* largest queue age seen */
+} obe_overload_stats_t;
+
+/* Output pacing statistics: how long after its deadline each datagram was handed to the network by the IP output thread.
+ * Bucket limits in microseconds are 1, 2, 5, 10, 20, 50, 100, 200, 500, 1000 and 2000. The last bucket counts the rest.
+ * Datagrams sent before their deadline, e.g. because of pacing_slack or pacing_slot, are counted in num_early and the first bucket */
+#define OBE_PACING_BUCKETS 12
+
+typedef struct
+{
+    int64_t num_datagrams;
+    int64_t num_early;
+    int64_t max_lateness; /* microseconds */
+    int64_t buckets[OBE_PACING_BUCKETS];
+} obe_pacing_stats_t;
+
+int obe_get_pacing_stats( obe_t *h, obe_pacing_stats_t *stats );
+
+int obe_set_overload_policy( obe_t *h, int output_stream_id, obe_overload_policy_t *policy );
+int obe_get_overload_stats( obe_t *h, int output_stream_id, obe_overload_stats_t *stats );
+
+/* Changes the rate control of a running AVC encoder without restarting the pipeline.
+ * Only avc_param.rc.i_bitrate, i_vbv_max_bitrate and i_vbv_buffer_size of output_stream are used.
+ * The mux rate is not changed so the new bitrate must still fit in the mux.
+ * libx264 can't change the VBV with NAL HRD, so the encoder is flushed and reopened where its next IDR is due.
+ * The new encoder's HRD timing carries on from the old one.
+ * Mux smoothing keeps its current buffer depth and only uses the new VBV size when it next refills after a drop */
+int obe_update_stream( obe_t *h, obe_output_stream_t *output_stream );
+
 int obe_start( obe_t *h );
 int obe_stop( obe_t *h );
 
@@ -71,7 +71,7 @@ static const char * const input_video_connections[]  = { "sdi", "hdmi", "optical
 static const char * const input_audio_connections[]  = { "embedded", "aes-ebu", "analogue", 0 };
 static const char * const ttx_locations[]            = { "dvb-ttx", "dvb-vbi", "both", 0 };
 static const char * const stream_actions[]           = { "passthrough", "encode", 0 };
-static const char * const encode_formats[]           = { "", "avc", "", "", "mp2", "ac3", "e-ac3", "aac", 0 };
+static const char * const encode_formats[]           = { "", "avc", "mpeg2", "302m", "mp2", "ac3", "e-ac3", "aac", 0 };
 static const char * const frame_packing_modes[]      = { "none", "checkerboard", "column", "row", "side-by-side", "top-bottom", "temporal", 0 };
 static const char * const teletext_types[]           = { "", "initial", "subtitle", "additional-info", "program-schedule", "hearing-imp", 0 };
 static const char * const audio_types[]              = { "undefined", "clean-effects", "hearing-impaired", "visual-impaired", 0 };
@@ -80,8 +80,9 @@ static const char * const aac_encapsulations[]       = { "adts", "latm", 0 };
 static const char * const mp2_modes[]                = { "auto", "stereo", "joint-stereo", "dual-channel", 0 };
 static const char * const channel_maps[]             = { "", "mono", "stereo", "5.0", "5.1", 0 };
 static const char * const mono_channels[]            = { "left", "right", 0 };
-static const char * const output_modules[]           = { "udp", "rtp", "linsys-asi", 0 };
-static const char * const addable_streams[]          = { "audio", "ttx" };
+static const char * const output_modules[]           = { "udp", "rtp", "file", "hls", "linsys-asi", 0 };
+static const char * const addable_streams[]          = { "audio", "ttx", "video", 0 };
+static const char * const overload_actions[]         = { "none", "signal", "drop", 0 };
 
 static const char * system_opts[] = { "system-type", NULL };
 static const char * input_opts[]  = { "location", "card-idx", "video-format", "video-connection", "audio-connection", NULL };
@@ -104,9 +105,17 @@ static const char * stream_opts[] = { "action", "format",
                                       "pid", "lang", "audio-type", "num-ttx", "ttx-lang", "ttx-type", "ttx-mag", "ttx-page",
                                       /* VBI options */
                                       "vbi-ttx", "vbi-inv-ttx", "vbi-vps", "vbi-wss",
+                                      /* Video rendition options */
+                                      "height",
+                                      /* SMPTE 302M options */
+                                      "bit-depth",
+                                      /* Overload options */
+                                      "overload-action", "overload-max-age",
                                       NULL };
 static const char * muxer_opts[]  = { "ts-type", "cbr", "ts-muxrate", "passthrough", "ts-id", "program-num", "pmt-pid", "pcr-pid",
-                                      "pcr-period", "pat-period", "service-name", "provider-name", NULL };
+                                      "pcr-period", "pat-period", "service-name", "provider-name", "statmux",
+                                      "statmux-bitrate", "pacing-spin", "pacing-slack", "pacing-slot", NULL };
+static const char * program_opts[] = { "program-num", "pmt-pid", "pcr-pid", "service-name", "provider-name", "streams", NULL };
 static const char * ts_types[]    = { "generic", "dvb", "cablelabs", "atsc", "isdb", NULL };
 static const char * output_opts[] = { "type", "target", NULL };
 
@@ -134,6 +143,17 @@ const static int allowed_resolutions[17][2] =
     { 0, 0 }
 };
 
+/* Additional renditions of progressive video may also be scaled vertically */
+const static int rendition_resolutions[][2] =
+{
+    { 1280, 720 },
+    {  960, 540 },
+    {  768, 432 },
+    {  640, 360 },
+    {  480, 270 },
+    { 0, 0 }
+};
+
 const static uint64_t channel_layouts[] =
 {
     AV_CH_LAYOUT_STEREO,
@@ -422,6 +442,22 @@ static int add_stream( char *command, obecli_command_t *child )
         cli.output_streams[output_stream_id].input_stream_id = -1;
         cli.output_streams[output_stream_id].stream_format = stream_format;
     }
+    else if( !strcasecmp( type, addable_streams[2] ) ) /* Video rendition */
+    {
+        /* Start from the settings of the first video output */
+        for( int i = 0; i < cli.num_output_streams; i++ )
+        {
+            if( i != output_stream_id && cli.output_streams[i].input_stream_id >= 0 &&
+                cli.program.streams[cli.output_streams[i].input_stream_id].stream_type == STREAM_TYPE_VIDEO )
+            {
+                cli.output_streams[output_stream_id].input_stream_id = cli.output_streams[i].input_stream_id;
+                memcpy( &cli.output_streams[output_stream_id].avc_param, &cli.output_streams[i].avc_param, sizeof(x264_param_t) );
+                memcpy( &cli.output_streams[output_stream_id].video_anc, &cli.output_streams[i].video_anc, sizeof(cli.output_streams[i].video_anc) );
+                cli.output_streams[output_stream_id].is_wide = cli.output_streams[i].is_wide;
+                break;
+            }
+        }
+    }
     cli.output_streams[output_stream_id].output_stream_id = output_stream_id;
 
     printf( "NOTE: output-stream-ids have CHANGED! \n" );
@@ -557,6 +593,89 @@ static int set_input( char *command, obecli_command_t *child )
     return 0;
 }
 
+/* max age is given in milliseconds */
+static int parse_overload_opts( obe_overload_policy_t *policy, char **opts )
+{
+    obe_overload_policy_t new_policy;
+    char *overload_action  = obe_get_option( stream_opts[42], opts );
+    char *overload_max_age = obe_get_option( stream_opts[43], opts );
+
+    memcpy( &new_policy, policy, sizeof(new_policy) );
+
+    FAIL_IF_ERROR( overload_action && ( check_enum_value( overload_action, overload_actions ) < 0 ),
+                   "Invalid overload action\n" );
+    FAIL_IF_ERROR( overload_max_age && obe_otoi( overload_max_age, -1 ) <= 0, "Invalid overload max age\n" );
+
+    if( overload_action )
+        parse_enum_value( overload_action, overload_actions, &new_policy.action );
+    if( overload_max_age )
+        new_policy.max_queue_age = (int64_t)obe_otoi( overload_max_age, -1 ) * 27000; /* 27MHz */
+
+    FAIL_IF_ERROR( new_policy.action != OBE_OVERLOAD_NONE && !new_policy.max_queue_age,
+                   "Overload max age must be set\n" );
+
+    memcpy( policy, &new_policy, sizeof(*policy) );
+
+    return 0;
+}
+
+/* Only rate control and the overload policy can be changed while encoding */
+static int update_running_stream( int output_stream_id, char **opts )
+{
+    obe_output_stream_t *output_stream = &cli.output_streams[output_stream_id];
+    x264_param_t *avc_param = &output_stream->avc_param;
+    obe_output_stream_t new_stream;
+    obe_overload_policy_t overload;
+
+    FAIL_IF_ERROR( output_stream->stream_action != STREAM_ENCODE || cli.program.streams[output_stream->input_stream_id].stream_type != STREAM_TYPE_VIDEO,
+                   "Only video streams can be changed while running\n" );
+
+    for( int i = 0; opts[i]; i += 2 )
+    {
+        FAIL_IF_ERROR( strcmp( opts[i], stream_opts[2] ) && strcmp( opts[i], stream_opts[3] ) && strcmp( opts[i], stream_opts[4] ) &&
+                       strcmp( opts[i], stream_opts[42] ) && strcmp( opts[i], stream_opts[43] ),
+                       "Option '%s' cannot be changed while running\n", opts[i] );
+    }
+
+    char *vbv_maxrate = obe_get_option( stream_opts[2], opts );
+    char *vbv_bufsize = obe_get_option( stream_opts[3], opts );
+    char *bitrate     = obe_get_option( stream_opts[4], opts );
+
+    if( obe_get_option( stream_opts[42], opts ) || obe_get_option( stream_opts[43], opts ) )
+    {
+        memcpy( &overload, &output_stream->overload, sizeof(overload) );
+        if( parse_overload_opts( &overload, opts ) < 0 || obe_set_overload_policy( cli.h, output_stream->output_stream_id, &overload ) < 0 )
+            return -1;
+        memcpy( &output_stream->overload, &overload, sizeof(overload) );
+    }
+
+    if( !vbv_maxrate && !vbv_bufsize && !bitrate )
+        return 0;
+
+    FAIL_IF_ERROR( output_stream->stream_format != VIDEO_AVC, "Only AVC rate control can be changed while running\n" );
+
+    FAIL_IF_ERROR( vbv_bufsize && system_type_value == OBE_SYSTEM_TYPE_LOWEST_LATENCY,
+                   "VBV buffer size is not user-settable in lowest-latency mode\n" );
+
+    memcpy( &new_stream, output_stream, sizeof(new_stream) );
+    new_stream.avc_param.rc.i_vbv_max_bitrate = obe_otoi( vbv_maxrate, avc_param->rc.i_vbv_max_bitrate );
+    new_stream.avc_param.rc.i_vbv_buffer_size = obe_otoi( vbv_bufsize, avc_param->rc.i_vbv_buffer_size );
+    new_stream.avc_param.rc.i_bitrate         = obe_otoi( bitrate, avc_param->rc.i_bitrate );
+
+    /* Keep the CBR relationship between bitrate and maxrate if only one was given */
+    if( bitrate && !vbv_maxrate && avc_param->rc.i_bitrate == avc_param->rc.i_vbv_max_bitrate )
+        new_stream.avc_param.rc.i_vbv_max_bitrate = new_stream.avc_param.rc.i_bitrate;
+    else if( vbv_maxrate && !bitrate && avc_param->rc.i_bitrate == avc_param->rc.i_vbv_max_bitrate )
+        new_stream.avc_param.rc.i_bitrate = new_stream.avc_param.rc.i_vbv_max_bitrate;
+
+    if( obe_update_stream( cli.h, &new_stream ) < 0 )
+        return -1;
+
+    memcpy( &avc_param->rc, &new_stream.avc_param.rc, sizeof(avc_param->rc) );
+
+    return 0;
+}
+
 static int set_stream( char *command, obecli_command_t *child )
 {
     obe_input_stream_t *input_stream = NULL;
@@ -593,6 +712,13 @@ static int set_stream( char *command, obecli_command_t *child )
             if( !opts && params )
                 return -1;
 
+            if( running )
+            {
+                int ret = update_running_stream( output_stream_id, opts );
+                obe_free_string_array( opts );
+                return ret;
+            }
+
             char *action      = obe_get_option( stream_opts[0], opts );
             char *format      = obe_get_option( stream_opts[1], opts );
             char *vbv_maxrate = obe_get_option( stream_opts[2], opts );
@@ -615,6 +741,8 @@ static int set_stream( char *command, obecli_command_t *child )
             char *aspect_ratio = obe_get_option( stream_opts[19], opts );
             char *width = obe_get_option( stream_opts[20], opts );
             char *max_refs = obe_get_option( stream_opts[21], opts );
+            char *height = obe_get_option( stream_opts[40], opts );
+            char *bit_depth = obe_get_option( stream_opts[41], opts );
 
             /* Audio Options */
             char *sdi_audio_pair = obe_get_option( stream_opts[22], opts );
@@ -646,6 +774,9 @@ static int set_stream( char *command, obecli_command_t *child )
                 FAIL_IF_ERROR( frame_packing && ( check_enum_value( frame_packing, frame_packing_modes ) < 0 ),
                                "Invalid frame packing mode\n" )
 
+                if( parse_overload_opts( &cli.output_streams[output_stream_id].overload, opts ) < 0 )
+                    return -1;
+
                 if( aspect_ratio )
                 {
                     int ar_num, ar_den;
@@ -661,20 +792,47 @@ static int set_stream( char *command, obecli_command_t *child )
                     }
                 }
 
-                if( width )
+                if( width || height )
                 {
                     int i_width = obe_otoi( width, avc_param->i_width );
-                    while( allowed_resolutions[i][0] && ( allowed_resolutions[i][1] != avc_param->i_height ||
-                           allowed_resolutions[i][0] != i_width ) )
-                       i++;
+                    int i_height = obe_otoi( height, avc_param->i_height );
+
+                    if( i_height == input_stream->height )
+                    {
+                        while( allowed_resolutions[i][0] && ( allowed_resolutions[i][1] != i_height ||
+                               allowed_resolutions[i][0] != i_width ) )
+                           i++;
+
+                        FAIL_IF_ERROR( !allowed_resolutions[i][0], "Invalid resolution. \n" );
+                    }
+                    else
+                    {
+                        FAIL_IF_ERROR( input_stream->interlaced, "Only progressive video can be scaled vertically\n" );
+
+                        while( rendition_resolutions[i][0] && ( rendition_resolutions[i][1] != i_height ||
+                               rendition_resolutions[i][0] != i_width ) )
+                           i++;
+
+                        FAIL_IF_ERROR( !rendition_resolutions[i][0] || i_height > input_stream->height,
+                                       "Invalid resolution. \n" );
+                    }
 
-                    FAIL_IF_ERROR( !allowed_resolutions[i][0], "Invalid resolution. \n" );
                     avc_param->i_width = i_width;
+                    avc_param->i_height = i_height;
                 }
 
                 /* Set it to encode by default */
                 cli.output_streams[output_stream_id].stream_action = STREAM_ENCODE;
-                cli.output_streams[output_stream_id].stream_format = VIDEO_AVC;
+                if( cli.output_streams[output_stream_id].stream_format != VIDEO_MPEG2 )
+                    cli.output_streams[output_stream_id].stream_format = VIDEO_AVC;
+                if( format )
+                {
+                    int video_format = -1;
+                    parse_enum_value( format, encode_formats, &video_format );
+                    FAIL_IF_ERROR( video_format != VIDEO_AVC && video_format != VIDEO_MPEG2, "Invalid video format\n" );
+                    FAIL_IF_ERROR( video_format == VIDEO_MPEG2 && X264_BIT_DEPTH > 8, "MPEG-2 requires an 8-bit build\n" );
+                    cli.output_streams[output_stream_id].stream_format = video_format;
+                }
                 avc_param->rc.i_vbv_max_bitrate = obe_otoi( vbv_maxrate, 0 );
                 avc_param->rc.i_vbv_buffer_size = obe_otoi( vbv_bufsize, 0 );
                 avc_param->rc.i_bitrate         = obe_otoi( bitrate, 0 );
@@ -781,6 +939,19 @@ static int set_stream( char *command, obecli_command_t *child )
                     if( mp2_mode )
                         parse_enum_value( mp2_mode, mp2_modes, &cli.output_streams[output_stream_id].mp2_mode );
                 }
+                else if( cli.output_streams[output_stream_id].stream_format == AUDIO_PCM )
+                {
+                    /* Uncompressed audio is passed through as SMPTE 302M */
+                    cli.output_streams[output_stream_id].stream_action = STREAM_PASSTHROUGH;
+                    cli.output_streams[output_stream_id].bit_depth = obe_otoi( bit_depth, 24 );
+
+                    FAIL_IF_ERROR( cli.output_streams[output_stream_id].bit_depth != 16 && cli.output_streams[output_stream_id].bit_depth != 20 &&
+                                   cli.output_streams[output_stream_id].bit_depth != 24,
+                                   "SMPTE 302M bit depth must be 16, 20 or 24\n" );
+
+                    FAIL_IF_ERROR( channel_map && av_get_channel_layout_nb_channels( channel_layout ) & 1,
+                                   "SMPTE 302M requires an even number of channels\n" );
+                }
                 else if( cli.output_streams[output_stream_id].stream_format == AUDIO_AC_3 )
                     default_bitrate = 192;
                 else if( cli.output_streams[output_stream_id].stream_format == AUDIO_E_AC_3 )
@@ -864,6 +1035,89 @@ static int set_stream( char *command, obecli_command_t *child )
     return 0;
 }
 
+/* set muxer program id:[opts] - streams are a list of output stream ids separated by '/' */
+static int set_program( char *command )
+{
+    obe_mux_program_t *program;
+    char **stream_ids = NULL;
+
+    int tok_len = strcspn( command, ":" );
+    int str_len = strlen( command );
+    command[tok_len] = 0;
+
+    int program_id = obe_otoi( command, -1 );
+    FAIL_IF_ERROR( program_id < 0 || program_id > cli.mux_opts.num_programs, "Invalid program id\n" );
+
+    if( program_id == cli.mux_opts.num_programs )
+    {
+        program = realloc( cli.mux_opts.programs, (program_id+1) * sizeof(*program) );
+        FAIL_IF_ERROR( !program, "malloc failed\n" );
+        cli.mux_opts.programs = program;
+        memset( &cli.mux_opts.programs[program_id], 0, sizeof(*program) );
+        cli.mux_opts.num_programs++;
+    }
+    program = &cli.mux_opts.programs[program_id];
+
+    if( str_len > tok_len )
+    {
+        char *params = command + tok_len + 1;
+        char **opts = obe_split_options( params, program_opts );
+        if( !opts && params )
+            return -1;
+
+        char *program_num   = obe_get_option( program_opts[0], opts );
+        char *pmt_pid       = obe_get_option( program_opts[1], opts );
+        char *pcr_pid       = obe_get_option( program_opts[2], opts );
+        char *service_name  = obe_get_option( program_opts[3], opts );
+        char *provider_name = obe_get_option( program_opts[4], opts );
+        char *streams       = obe_get_option( program_opts[5], opts );
+
+        program->program_num = obe_otoi( program_num, program->program_num );
+        program->pmt_pid     = obe_otoi( pmt_pid, program->pmt_pid );
+        program->pcr_pid     = obe_otoi( pcr_pid, program->pcr_pid );
+
+        if( service_name )
+        {
+            free( program->service_name );
+            program->service_name = strdup( service_name );
+        }
+        if( provider_name )
+        {
+            free( program->provider_name );
+            program->provider_name = strdup( provider_name );
+        }
+
+        if( streams )
+        {
+            stream_ids = obe_split_string( streams, "/", 0 );
+            int num_ids = 0;
+            while( stream_ids && stream_ids[num_ids] )
+                num_ids++;
+
+            free( program->output_stream_ids );
+            program->output_stream_ids = calloc( MAX( num_ids, 1 ), sizeof(*program->output_stream_ids) );
+            program->num_output_streams = 0;
+            for( int i = 0; program->output_stream_ids && i < num_ids; i++ )
+            {
+                int id = obe_otoi( stream_ids[i], -1 );
+                if( id < 0 || id >= cli.num_output_streams )
+                {
+                    fprintf( stderr, "Invalid stream id %s\n", stream_ids[i] );
+                    obe_free_string_array( stream_ids );
+                    obe_free_string_array( opts );
+                    return -1;
+                }
+                program->output_stream_ids[program->num_output_streams++] = id;
+            }
+            obe_free_string_array( stream_ids );
+        }
+
+        obe_free_string_array( opts );
+    }
+
+    return 0;
+}
+
 static int set_muxer( char *command, obecli_command_t *child )
 {
     if( !strlen( command ) )
@@ -875,6 +1129,8 @@ static int set_muxer( char *command, obecli_command_t *child )
 
     if( !strcasecmp( command, "mpegts" ) )
         cli.mux_opts.muxer = MUXERS_MPEGTS;
+    else if( !strcasecmp( command, "program" ) && str_len > tok_len )
+        return set_program( command + tok_len + 1 );
     else if( !strcasecmp( command, "opts" ) && str_len > tok_len )
     {
         char *params = command + tok_len + 1;
@@ -894,6 +1150,11 @@ static int set_muxer( char *command, obecli_command_t *child )
         char *pat_period  = obe_get_option( muxer_opts[9], opts );
         char *service_name  = obe_get_option( muxer_opts[10], opts );
         char *provider_name = obe_get_option( muxer_opts[11], opts );
+        char *statmux       = obe_get_option( muxer_opts[12], opts );
+        char *statmux_bitrate = obe_get_option( muxer_opts[13], opts );
+        char *pacing_spin   = obe_get_option( muxer_opts[14], opts );
+        char *pacing_slack  = obe_get_option( muxer_opts[15], opts );
+        char *pacing_slot   = obe_get_option( muxer_opts[16], opts );
 
         FAIL_IF_ERROR( ts_type && ( check_enum_value( ts_type, ts_types ) < 0 ),
                       "Invalid AVC profile\n" );
@@ -911,6 +1172,15 @@ static int set_muxer( char *command, obecli_command_t *child )
         cli.mux_opts.pcr_pid    = obe_otoi( pcr_pid, cli.mux_opts.pcr_pid  );
         cli.mux_opts.pcr_period = obe_otoi( pcr_period, cli.mux_opts.pcr_period );
         cli.mux_opts.pat_period = obe_otoi( pat_period, cli.mux_opts.pat_period );
+        cli.mux_opts.statmux    = obe_otob( statmux, cli.mux_opts.statmux );
+        cli.mux_opts.statmux_bitrate = obe_otoi( statmux_bitrate, cli.mux_opts.statmux_bitrate );
+        cli.mux_opts.pacing_spin = obe_otoi( pacing_spin, cli.mux_opts.pacing_spin );
+        cli.mux_opts.pacing_slack = obe_otoi( pacing_slack, cli.mux_opts.pacing_slack );
+        cli.mux_opts.pacing_slot = obe_otoi( pacing_slot, cli.mux_opts.pacing_slot );
+
+        FAIL_IF_ERROR( cli.mux_opts.pacing_spin < 0 || cli.mux_opts.pacing_spin > 1000, "Invalid pacing spin time\n" );
+        FAIL_IF_ERROR( cli.mux_opts.pacing_slack < 0 || cli.mux_opts.pacing_slack > 1000, "Invalid pacing slack time\n" );
+        FAIL_IF_ERROR( cli.mux_opts.pacing_slot < 0 || cli.mux_opts.pacing_slot > 10000, "Invalid pacing slot\n" );
 
         if( service_name )
         {
@@ -1149,6 +1419,45 @@ static int show_outputs( char *command, obecli_command_t *child )
     return 0;
 }
 
+static int show_pacing( char *command, obecli_command_t *child )
+{
+    static const char *bucket_names[OBE_PACING_BUCKETS] = { "<1", "<2", "<5", "<10", "<20", "<50", "<100", "<200",
+                                                            "<500", "<1000", "<2000", ">=2000" };
+    obe_pacing_stats_t stats;
+
+    FAIL_IF_ERROR( !running, "Encoder is not running\n" );
+
+    obe_get_pacing_stats( cli.h, &stats );
+
+    printf( "\nOutput pacing lateness (us): \n" );
+    for( int i = 0; i < OBE_PACING_BUCKETS; i++ )
+        printf( "       %-*s %"PRIi64" \n", 8, bucket_names[i], stats.buckets[i] );
+    printf( "       Datagrams: %"PRIi64", early: %"PRIi64", max lateness: %"PRIi64"us \n", stats.num_datagrams, stats.num_early, stats.max_lateness );
+
+    return 0;
+}
+
+static int show_overload( char *command, obecli_command_t *child )
+{
+    obe_overload_stats_t stats;
+
+    FAIL_IF_ERROR( !running, "Encoder is not running\n" );
+
+    printf( "\nVideo encoder overloads: \n" );
+    for( int i = 0; i < cli.num_output_streams; i++ )
+    {
+        if( obe_get_overload_stats( cli.h, cli.output_streams[i].output_stream_id, &stats ) < 0 )
+            continue;
+
+        printf( "Output-stream-id: %d - Overload action: %s \n", cli.output_streams[i].output_stream_id,
+                overload_actions[cli.output_streams[i].overload.action] );
+        printf( "       Overloads: %"PRIi64", frames dropped: %"PRIi64", signals: %"PRIi64", max queue age: %"PRIi64"ms \n",
+                stats.overloads, stats.frames_dropped, stats.signals, stats.max_queue_age / 27000 );
+    }
+
+    return 0;
+}
+
 static int show_input_streams( char *command, obecli_command_t *child )
 {
     obe_input_stream_t *stream;
@@ -1186,7 +1495,9 @@ static int show_input_streams( char *command, obecli_command_t *child )
         }
         else if( stream->stream_type == STREAM_TYPE_AUDIO )
         {
-            if( !stream->channel_layout )
+            if( stream->sdi_audio_pair )
+                snprintf( buf, sizeof(buf), "SMPTE 337M SDI audio pair %i", stream->sdi_audio_pair );
+            else if( !stream->channel_layout )
                 snprintf( buf, sizeof(buf), "%i channels", stream->num_channels );
             else
                 av_get_channel_layout_string( buf, sizeof(buf), 0, stream->channel_layout );
@@ -1241,7 +1552,8 @@ static int show_output_streams( char *command, obecli_command_t *child )
             printf( "DVB-VBI\n" );
         else if( input_stream->stream_type == STREAM_TYPE_VIDEO )
         {
-            printf( "Video: AVC \n" );
+            printf( "Video: %s %dx%d \n", output_stream->stream_format == VIDEO_MPEG2 ? "MPEG-2" : "AVC",
+                    output_stream->avc_param.i_width, output_stream->avc_param.i_height );
         }
         else if( input_stream->stream_type == STREAM_TYPE_AUDIO )
         {
@@ -1259,7 +1571,7 @@ static int show_output_streams( char *command, obecli_command_t *child )
 static int start_encode( char *command, obecli_command_t *child )
 {
     obe_input_stream_t *input_stream;
-    obe_output_stream_t *output_stream;
+    obe_output_stream_t *output_stream, *first_video_stream = NULL;
     FAIL_IF_ERROR( running, "Encoder already running\n" );
     FAIL_IF_ERROR( !cli.program.num_streams, "No active devices\n" );
 
@@ -1282,18 +1594,36 @@ static int start_encode( char *command, obecli_command_t *child )
             if( !cli.output_streams[i].avc_param.rc.i_vbv_max_bitrate && cli.output_streams[i].avc_param.rc.i_bitrate )
                 cli.output_streams[i].avc_param.rc.i_vbv_max_bitrate = cli.output_streams[i].avc_param.rc.i_bitrate;
 
+            /* Renditions share one set of timestamps so their buffer delays must match */
+            if( !first_video_stream )
+                first_video_stream = output_stream;
+            else if( system_type_value != OBE_SYSTEM_TYPE_LOWEST_LATENCY )
+            {
+                x264_param_t *first_param = &first_video_stream->avc_param, *avc_param = &output_stream->avc_param;
+                FAIL_IF_ERROR( (int64_t)avc_param->rc.i_vbv_buffer_size * first_param->rc.i_vbv_max_bitrate !=
+                               (int64_t)first_param->rc.i_vbv_buffer_size * avc_param->rc.i_vbv_max_bitrate,
+                               "Output-stream-id %i: VBV buffer duration must match the other video streams\n", output_stream->output_stream_id );
+            }
+
             cli.output_streams[i].stream_action = STREAM_ENCODE;
-            cli.output_streams[i].stream_format = VIDEO_AVC;
-            if( cli.avc_profile >= 0 )
+            if( cli.output_streams[i].stream_format != VIDEO_MPEG2 )
+                cli.output_streams[i].stream_format = VIDEO_AVC;
+            if( cli.output_streams[i].stream_format == VIDEO_AVC && cli.avc_profile >= 0 )
                 x264_param_apply_profile( &cli.output_streams[i].avc_param, x264_profile_names[cli.avc_profile] );
         }
         else if( input_stream && input_stream->stream_type == STREAM_TYPE_AUDIO )
         {
             if( cli.output_streams[i].stream_action == STREAM_PASSTHROUGH && input_stream->stream_format == AUDIO_PCM &&
-                cli.output_streams[i].stream_format != AUDIO_MP2 && cli.output_streams[i].stream_format != AUDIO_AC_3 &&
-                cli.output_streams[i].stream_format != AUDIO_AAC )
+                !input_stream->sdi_audio_pair && ( !cli.output_streams[i].bit_depth ||
+                av_get_channel_layout_nb_channels( cli.output_streams[i].channel_layout ) & 1 ) )
             {
-                fprintf( stderr, "Output-stream-id %i: Uncompressed audio cannot yet be placed in TS\n", cli.output_streams[i].output_stream_id );
+                fprintf( stderr, "Output-stream-id %i: Uncompressed audio must be passed through as SMPTE 302M (format=302m)\n",
+                         cli.output_streams[i].output_stream_id );
+                return -1;
+            }
+            else if( cli.output_streams[i].stream_action == STREAM_ENCODE && input_stream->sdi_audio_pair )
+            {
+                fprintf( stderr, "Output-stream-id %i: SMPTE 337M audio can only be passed through\n", cli.output_streams[i].output_stream_id );
                 return -1;
             }
             else if( cli.output_streams[i].stream_action == STREAM_ENCODE && !cli.output_streams[i].bitrate )
@@ -1332,8 +1662,9 @@ static int start_encode( char *command, obecli_command_t *child )
     FAIL_IF_ERROR( !cli.output.num_outputs, "No outputs selected\n" );
     for( int i = 0; i < cli.output.num_outputs; i++ )
     {
-        if( ( cli.output.outputs[i].type == OUTPUT_UDP || cli.output.outputs[i].type == OUTPUT_RTP ) &&
-             !cli.output.outputs[i].target )
+        if( ( cli.output.outputs[i].type == OUTPUT_UDP || cli.output.outputs[i].type == OUTPUT_RTP ||
+              cli.output.outputs[i].type == OUTPUT_FILE || cli.output.outputs[i].type == OUTPUT_HLS ) &&
+            !cli.output.outputs[i].target )
         {
             fprintf( stderr, "No output target chosen. Output-ID %d\n", i );
             return -1;
@@ -1375,6 +1706,16 @@ static int stop_encode( char *command, obecli_command_t *child )
         cli.mux_opts.provider_name = NULL;
     }
 
+    for( int i = 0; i < cli.mux_opts.num_programs; i++ )
+    {
+        free( cli.mux_opts.programs[i].service_name );
+        free( cli.mux_opts.programs[i].provider_name );
+        free( cli.mux_opts.programs[i].output_stream_ids );
+    }
+    free( cli.mux_opts.programs );
+    cli.mux_opts.programs = NULL;
+    cli.mux_opts.num_programs = 0;
+
     if( cli.output_streams )
     {
         free( cli.output_streams );
@@ -1430,6 +1771,14 @@ static int probe_device( char *command, obecli_command_t *child )
                 cli.output_streams[i].video_anc.cea_608 = cli.output_streams[i].video_anc.cea_708 = 1;
                 cli.output_streams[i].video_anc.afd = cli.output_streams[i].video_anc.wss_to_afd = 1;
             }
+            else if( cli.program.streams[i].stream_type == STREAM_TYPE_AUDIO && cli.program.streams[i].sdi_audio_pair )
+            {
+                /* SMPTE 337M is passed through by default */
+                cli.output_streams[i].stream_action = STREAM_PASSTHROUGH;
+                cli.output_streams[i].stream_format = cli.program.streams[i].stream_format;
+                cli.output_streams[i].sdi_audio_pair = cli.program.streams[i].sdi_audio_pair;
+                cli.output_streams[i].channel_layout = AV_CH_LAYOUT_STEREO;
+            }
             else if( cli.program.streams[i].stream_type == STREAM_TYPE_AUDIO )
             {
                 cli.output_streams[i].sdi_audio_pair = 1;
@@ -59,6 +59,8 @@ static int show_inputs( char *command, obecli_command_t *child );
 static int show_muxers( char *command, obecli_command_t *child );
 static int show_output( char *command, obecli_command_t *child );
 static int show_outputs( char *command, obecli_command_t *child );
+static int show_overload( char *command, obecli_command_t *child );
+static int show_pacing( char *command, obecli_command_t *child );
 
 static int show_input_streams( char *command, obecli_command_t *child );
 static int show_output_streams( char *command, obecli_command_t *child );
@@ -132,6 +134,8 @@ static obecli_command_t show_commands[] =
     { "muxers",   "",  "Show supported muxers",      show_muxers,   NULL },
     { "output",   "streams",  "Show output streams", show_output,   NULL },
     { "outputs",  "",  "Show supported outputs",     show_outputs,  NULL },
+    { "overload", "",  "Show video encoder overloads", show_overload, NULL },
+    { "pacing",   "",  "Show output pacing jitter",  show_pacing,   NULL },
     { 0 }
 };
 
@@ -140,8 +144,8 @@ static obecli_command_t set_commands[] =
     { "obe",    "opts [opts]",            "Set OBE options",                set_obe,    NULL },
     { "input",  "opts [opts]",            "Set input options",              set_input,  NULL },
     { "stream", "opts streamid:[opts]",   "Set stream options",             set_stream, NULL },
-    { "muxer",  "[name] OR opts [opts]",  "Set muxer name or muxer opts",   set_muxer,  NULL },
-    { "mux",    "[name] OR opts [opts]",  "Set muxer name or muxer opts",   set_muxer,  NULL },
+    { "muxer",  "[name] OR opts [opts] OR program id:[opts]", "Set muxer name, muxer opts or program", set_muxer, NULL },
+    { "mux",    "[name] OR opts [opts] OR program id:[opts]", "Set muxer name, muxer opts or program", set_muxer, NULL },
     { "output", "opts outputid:[opts]",   "Set output name or output opts", set_output, NULL },
     { "outputs", "[number]",              "Set output name or output opts", set_outputs, NULL },
     { 0 }
@@ -207,6 +211,8 @@ static const obecli_output_name_t output_names[] =
 {
     { OUTPUT_UDP, "UDP",  "MPEG-TS in UDP",        "internal" },
     { OUTPUT_RTP, "RTP",  "MPEG-TS in RTP in UDP", "internal" },
+    { OUTPUT_FILE, "File", "MPEG-TS to local disk", "internal" },
+    { OUTPUT_HLS,  "HLS",  "Segmented MPEG-TS to local directory", "internal" },
     { 0, 0, 0, 0 },
 };
 #endif
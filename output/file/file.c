@@ -0,0 +1,370 @@
+/*****************************************************************************
+ * file.c : File output functions
+ *****************************************************************************
+ * Copyright (C) 2010 Open Broadcast Systems Ltd.
+ *
+ * Authors: Kieran Kunhya <kieran@kunhya.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <libavutil/parseutils.h>
+
+#include "common/common.h"
+#include "output/output.h"
+#include "output/file/hls.h"
+
+/* A whole number of pages and of TS packets so that every full buffer can be written with O_DIRECT
+ * and files are only rotated between TS packets */
+#define FILE_BUFFER_SIZE (4096*47)
+#define FILE_NUM_BUFFERS 32
+
+/* HLS parts are a few hundred ms long so the segmenter is given partly filled buffers this old.
+ * Only when it is idle, otherwise the buffer keeps filling and the queue isn't used up by small buffers */
+#define HLS_FLUSH_TIME (OBE_CLOCK/100)
+
+typedef struct
+{
+    uint8_t *data;
+    int len;
+    int64_t time; /* wallclock when the first packet was added */
+} obe_file_buffer_t;
+
+typedef struct
+{
+    char path[1024];
+    int paced;
+    int direct;
+    int64_t rotate_time;
+    int64_t rotate_size;
+    hnd_t hls; /* HLS outputs hand buffers to the segmenter instead of writing them */
+
+    /* [write_idx, fill_idx) are waiting for the writer thread. fill_idx is being filled if has_buffer is set */
+    pthread_mutex_t mutex;
+    pthread_cond_t cv;
+    obe_file_buffer_t buffers[FILE_NUM_BUFFERS];
+    int64_t fill_idx;
+    int64_t write_idx;
+    int has_buffer;
+    int cancel;
+
+    /* Only used by the writer thread */
+    int fd;
+    int64_t file_start;
+    int64_t file_size;
+    int num_files;
+
+    int64_t num_dropped; /* TS packets dropped because the disk fell behind */
+    int64_t num_errors;
+} obe_file_ctx;
+
+static void file_populate_opts( obe_file_ctx *file, char *uri, int is_hls )
+{
+    char buf[256];
+    const char *p = strchr( uri, '?' );
+    int len = p ? p - uri : strlen( uri );
+
+    snprintf( file->path, sizeof(file->path), "%.*s", len, uri );
+    file->paced = !is_hls;
+    file->direct = !is_hls;
+
+    if( p )
+    {
+        if( av_find_info_tag( buf, sizeof(buf), "paced", p ) )
+            file->paced = strtol( buf, NULL, 10 );
+
+        if( av_find_info_tag( buf, sizeof(buf), "direct", p ) )
+            file->direct = strtol( buf, NULL, 10 );
+
+        /* seconds */
+        if( av_find_info_tag( buf, sizeof(buf), "rotate_time", p ) )
+            file->rotate_time = strtoll( buf, NULL, 10 ) * OBE_CLOCK;
+
+        /* megabytes */
+        if( av_find_info_tag( buf, sizeof(buf), "rotate_size", p ) )
+            file->rotate_size = strtoll( buf, NULL, 10 ) * 1000000;
+    }
+}
+
+static void close_file( obe_file_ctx *file )
+{
+    if( file->fd >= 0 )
+        close( file->fd );
+    file->fd = -1;
+}
+
+/* Rotated files are named after the time they were started and a count, before any extension */
+static int open_file( obe_file_ctx *file )
+{
+    char name[1100], date[32];
+    int flags = O_WRONLY | O_CREAT | O_TRUNC;
+
+    if( file->rotate_time || file->rotate_size )
+    {
+        char *slash = strrchr( file->path, '/' );
+        char *ext = strrchr( slash ? slash : file->path, '.' );
+        int base_len = ext ? ext - file->path : strlen( file->path );
+        time_t now = time( NULL );
+        struct tm tm;
+
+        localtime_r( &now, &tm );
+        strftime( date, sizeof(date), "%Y%m%d-%H%M%S", &tm );
+        snprintf( name, sizeof(name), "%.*s-%s-%04i%s", base_len, file->path, date, file->num_files++, ext ? ext : "" );
+    }
+    else
+        snprintf( name, sizeof(name), "%s", file->path );
+
+    file->fd = open( name, flags | ( file->direct ? O_DIRECT : 0 ), 0644 );
+    if( file->fd < 0 && file->direct && errno == EINVAL )
+    {
+        /* The filesystem doesn't support O_DIRECT */
+        file->direct = 0;
+        file->fd = open( name, flags, 0644 );
+    }
+
+    if( file->fd < 0 )
+    {
+        syslog( LOG_ERR, "[file] Could not open %s\n", name );
+        return -1;
+    }
+
+    file->file_start = get_wallclock_in_mpeg_ticks();
+    file->file_size = 0;
+
+    return 0;
+}
+
+static void write_buffer( obe_file_ctx *file, obe_file_buffer_t *buffer )
+{
+    uint8_t *data = buffer->data;
+    int len = buffer->len, ret;
+
+    /* Only the last buffer is partly filled and O_DIRECT needs whole blocks */
+    if( file->direct && len % 4096 )
+        fcntl( file->fd, F_SETFL, fcntl( file->fd, F_GETFL ) & ~O_DIRECT );
+
+    while( len )
+    {
+        ret = write( file->fd, data, len );
+        if( ret < 0 )
+        {
+            if( errno == EINTR )
+                continue;
+            if( !file->num_errors )
+                syslog( LOG_ERR, "[file] Failed to write to %s\n", file->path );
+            file->num_errors++;
+            return;
+        }
+        data += ret;
+        len -= ret;
+    }
+
+    file->file_size += buffer->len;
+}
+
+static void *write_file( void *ptr )
+{
+    obe_file_ctx *file = ptr;
+    obe_file_buffer_t *buffer;
+
+    while( 1 )
+    {
+        pthread_mutex_lock( &file->mutex );
+        while( file->write_idx == file->fill_idx && !file->cancel )
+            pthread_cond_wait( &file->cv, &file->mutex );
+
+        if( file->write_idx == file->fill_idx )
+        {
+            pthread_mutex_unlock( &file->mutex );
+            break;
+        }
+
+        buffer = &file->buffers[file->write_idx % FILE_NUM_BUFFERS];
+        pthread_mutex_unlock( &file->mutex );
+
+        if( file->hls )
+            hls_write( file->hls, buffer->data, buffer->len );
+        else if( file->fd >= 0 && ( ( file->rotate_time && buffer->time - file->file_start >= file->rotate_time ) ||
+            ( file->rotate_size && file->file_size + buffer->len > file->rotate_size ) ) )
+            close_file( file );
+
+        if( !file->hls && ( file->fd >= 0 || open_file( file ) == 0 ) )
+            write_buffer( file, buffer );
+
+        pthread_mutex_lock( &file->mutex );
+        file->write_idx++;
+        pthread_mutex_unlock( &file->mutex );
+    }
+
+    close_file( file );
+
+    return NULL;
+}
+
+static void queue_buffer( obe_file_ctx *file )
+{
+    pthread_mutex_lock( &file->mutex );
+    file->fill_idx++;
+    file->has_buffer = 0;
+    pthread_cond_signal( &file->cv );
+    pthread_mutex_unlock( &file->mutex );
+}
+
+/* Never waits for the disk. Data which doesn't fit in a free buffer is dropped */
+static void add_data( obe_file_ctx *file, uint8_t *data, int len )
+{
+    obe_file_buffer_t *buffer;
+    int size, has_free;
+
+    while( len )
+    {
+        if( !file->has_buffer )
+        {
+            pthread_mutex_lock( &file->mutex );
+            has_free = file->fill_idx - file->write_idx < FILE_NUM_BUFFERS;
+            pthread_mutex_unlock( &file->mutex );
+
+            if( !has_free )
+            {
+                if( !file->num_dropped )
+                    syslog( LOG_WARNING, "[file] Disk is too slow, dropping packets\n" );
+                file->num_dropped += len / 188;
+                return;
+            }
+
+            buffer = &file->buffers[file->fill_idx % FILE_NUM_BUFFERS];
+            buffer->len = 0;
+            buffer->time = get_wallclock_in_mpeg_ticks();
+            file->has_buffer = 1;
+        }
+
+        buffer = &file->buffers[file->fill_idx % FILE_NUM_BUFFERS];
+        size = MIN( len, FILE_BUFFER_SIZE - buffer->len );
+        memcpy( &buffer->data[buffer->len], data, size );
+        buffer->len += size;
+        data += size;
+        len -= size;
+
+        if( buffer->len == FILE_BUFFER_SIZE )
+            queue_buffer( file );
+    }
+}
+
+static void *open_output( void *ptr )
+{
+    obe_output_t *output = ptr;
+    obe_ts_ring_t *ring = output->ring;
+    obe_file_ctx *file;
+    pthread_t writer_thread;
+    int64_t read_pos = 0, end_pos;
+    int idle;
+
+    file = calloc( 1, sizeof(*file) );
+    if( !file )
+    {
+        syslog( LOG_ERR, "Malloc failed\n" );
+        obe_ts_ring_detach( ring, output->ring_reader );
+        return NULL;
+    }
+
+    file_populate_opts( file, output->output_dest.target, output->output_dest.type == OUTPUT_HLS );
+    file->fd = -1;
+    pthread_mutex_init( &file->mutex, NULL );
+    pthread_cond_init( &file->cv, NULL );
+
+    if( output->output_dest.type == OUTPUT_HLS && hls_open( &file->hls, output->output_dest.target ) < 0 )
+        goto end;
+
+    for( int i = 0; i < FILE_NUM_BUFFERS; i++ )
+    {
+        if( posix_memalign( (void**)&file->buffers[i].data, 4096, FILE_BUFFER_SIZE ) )
+        {
+            syslog( LOG_ERR, "Malloc failed\n" );
+            goto end;
+        }
+    }
+
+    if( pthread_create( &writer_thread, NULL, write_file, file ) < 0 )
+    {
+        syslog( LOG_ERR, "[file] Couldn't create writer thread\n" );
+        goto end;
+    }
+
+    /* Paced recordings are what the network outputs sent. Unpaced ones are written as soon as they are muxed */
+    while( 1 )
+    {
+        pthread_mutex_lock( &ring->mutex );
+        while( ( file->paced ? ring->publish_pos : ring->write_pos ) == read_pos && !output->cancel_thread )
+            pthread_cond_wait( file->paced ? &ring->publish_cv : &ring->write_cv, &ring->mutex );
+
+        if( output->cancel_thread )
+        {
+            pthread_mutex_unlock( &ring->mutex );
+            break;
+        }
+
+        end_pos = file->paced ? ring->publish_pos : ring->write_pos;
+        pthread_mutex_unlock( &ring->mutex );
+
+        for( ; read_pos < end_pos; read_pos++ )
+            add_data( file, get_ts_slot( ring, read_pos )->data, TS_PACKETS_SIZE );
+
+        if( file->hls && file->has_buffer &&
+            get_wallclock_in_mpeg_ticks() - file->buffers[file->fill_idx % FILE_NUM_BUFFERS].time >= HLS_FLUSH_TIME )
+        {
+            pthread_mutex_lock( &file->mutex );
+            idle = file->write_idx == file->fill_idx;
+            pthread_mutex_unlock( &file->mutex );
+            if( idle )
+                queue_buffer( file );
+        }
+
+        pthread_mutex_lock( &ring->mutex );
+        ring->read_pos[output->ring_reader] = read_pos;
+        pthread_cond_signal( &ring->read_cv );
+        pthread_mutex_unlock( &ring->mutex );
+    }
+
+    /* Write out the last buffer and wait for the disk */
+    if( file->has_buffer )
+        queue_buffer( file );
+
+    pthread_mutex_lock( &file->mutex );
+    file->cancel = 1;
+    pthread_cond_signal( &file->cv );
+    pthread_mutex_unlock( &file->mutex );
+    pthread_join( writer_thread, NULL );
+
+    syslog( LOG_INFO, "[file] %s: %"PRIi64" packets dropped, %"PRIi64" write errors\n", file->path, file->num_dropped, file->num_errors );
+
+end:
+    obe_ts_ring_detach( ring, output->ring_reader );
+    if( file->hls )
+        hls_close( file->hls );
+    for( int i = 0; i < FILE_NUM_BUFFERS; i++ )
+        free( file->buffers[i].data );
+    pthread_mutex_destroy( &file->mutex );
+    pthread_cond_destroy( &file->cv );
+    free( file );
+    free( output->output_dest.target );
+
+    return NULL;
+}
+
+const obe_output_func_t file_output = { open_output };
@@ -0,0 +1,440 @@
+/*****************************************************************************
+ * hls.c : HLS segmenter
+ *****************************************************************************
+ * Copyright (C) 2010 Open Broadcast Systems Ltd.
+ *
+ * Authors: Kieran Kunhya <kieran@kunhya.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+#include <fcntl.h>
+#include <math.h>
+#include <libavutil/parseutils.h>
+
+#include "common/common.h"
+#include "output/file/hls.h"
+
+#define HLS_MAX_PARTS 64
+#define HLS_MAX_SEGMENTS 32
+#define HLS_PTS_MASK ((1LL << 33) - 1)
+
+typedef struct
+{
+    int num;
+    double duration;
+
+    int num_parts;
+    double part_duration[HLS_MAX_PARTS];
+} obe_hls_segment_t;
+
+typedef struct
+{
+    char dir[1024];
+    double segment_time;
+    double part_time;
+    int list_size;
+
+    /* Latest PAT and PMT, repeated at the start of every segment */
+    uint8_t pat[188];
+    uint8_t pmt[188];
+    int pmt_pid;
+    int video_pid;
+
+    /* Segment being built. Parts are slices of it */
+    uint8_t *data;
+    int len;
+    int alloc;
+    int part_start;
+    /* Segments start on the PTS of an IDR. Parts and frames are timed from the DTS, which is
+     * monotonic in TS order when there are B-frames */
+    int64_t start_pts;
+    int64_t start_dts;
+    int64_t part_start_dts;
+    int64_t last_dts;
+    int64_t frame_duration;
+
+    /* Finished segments in the playlist window, oldest first, followed by the current one */
+    obe_hls_segment_t segments[HLS_MAX_SEGMENTS+1];
+    int num_segments;
+
+    /* Segment which has just left the playlist. Deleted a segment later so clients with the old playlist can fetch it */
+    obe_hls_segment_t expired;
+    int has_expired;
+    int started;
+
+    int64_t num_errors;
+} obe_hls_ctx;
+
+/* Writes to a temporary file and renames it so that readers never see a partial file */
+static int write_atomic( obe_hls_ctx *hls, const char *name, uint8_t *data, int len )
+{
+    char path[1200], tmp_path[1210];
+    int fd, ret;
+
+    snprintf( path, sizeof(path), "%s/%s", hls->dir, name );
+    snprintf( tmp_path, sizeof(tmp_path), "%s.tmp", path );
+
+    fd = open( tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+    if( fd < 0 )
+        goto fail;
+
+    while( len )
+    {
+        ret = write( fd, data, len );
+        if( ret < 0 )
+        {
+            if( errno == EINTR )
+                continue;
+            close( fd );
+            goto fail;
+        }
+        data += ret;
+        len -= ret;
+    }
+
+    close( fd );
+
+    if( rename( tmp_path, path ) < 0 )
+        goto fail;
+
+    return 0;
+
+fail:
+    if( !hls->num_errors )
+        syslog( LOG_ERR, "[hls] Failed to write %s\n", path );
+    hls->num_errors++;
+    return -1;
+}
+
+static void remove_segment( obe_hls_ctx *hls, obe_hls_segment_t *segment )
+{
+    char path[1200];
+
+    snprintf( path, sizeof(path), "%s/seg%i.ts", hls->dir, segment->num );
+    unlink( path );
+    for( int i = 0; i < segment->num_parts; i++ )
+    {
+        snprintf( path, sizeof(path), "%s/seg%i.%i.ts", hls->dir, segment->num, i );
+        unlink( path );
+    }
+}
+
+/* At the end the current segment is complete too */
+static void write_playlist( obe_hls_ctx *hls, int end )
+{
+    char *buf;
+    int len = 0, size = 2048 + ( HLS_MAX_SEGMENTS + 1 ) * ( 64 + HLS_MAX_PARTS * 80 );
+    int num_complete = end ? hls->num_segments : hls->num_segments - 1;
+    double target = hls->segment_time;
+
+    buf = malloc( size );
+    if( !buf )
+    {
+        syslog( LOG_ERR, "Malloc failed\n" );
+        return;
+    }
+
+    for( int i = 0; i < num_complete; i++ )
+        target = MAX( target, hls->segments[i].duration );
+
+    len += snprintf( buf+len, size-len, "#EXTM3U\n#EXT-X-VERSION:%i\n#EXT-X-TARGETDURATION:%i\n",
+                     hls->part_time ? 9 : 3, (int)ceil( target ) );
+    if( hls->part_time )
+    {
+        len += snprintf( buf+len, size-len, "#EXT-X-PART-INF:PART-TARGET=%.3f\n", hls->part_time );
+        len += snprintf( buf+len, size-len, "#EXT-X-SERVER-CONTROL:PART-HOLD-BACK=%.3f\n", 3 * hls->part_time );
+    }
+    len += snprintf( buf+len, size-len, "#EXT-X-MEDIA-SEQUENCE:%i\n", hls->segments[0].num );
+
+    /* Parts are only listed for the last few segments */
+    for( int i = 0; i < hls->num_segments; i++ )
+    {
+        obe_hls_segment_t *segment = &hls->segments[i];
+
+        if( hls->part_time && i >= hls->num_segments - 3 )
+        {
+            for( int j = 0; j < segment->num_parts; j++ )
+            {
+                len += snprintf( buf+len, size-len, "#EXT-X-PART:DURATION=%.3f,URI=\"seg%i.%i.ts\"%s\n",
+                                 segment->part_duration[j], segment->num, j, j ? "" : ",INDEPENDENT=YES" );
+            }
+        }
+
+        if( i < num_complete )
+            len += snprintf( buf+len, size-len, "#EXTINF:%.3f,\nseg%i.ts\n", segment->duration, segment->num );
+    }
+
+    if( end )
+        len += snprintf( buf+len, size-len, "#EXT-X-ENDLIST\n" );
+
+    write_atomic( hls, "index.m3u8", (uint8_t*)buf, MIN( len, size-1 ) );
+    free( buf );
+}
+
+static void finish_part( obe_hls_ctx *hls, int64_t dts )
+{
+    obe_hls_segment_t *segment = &hls->segments[hls->num_segments-1];
+    char name[64];
+
+    if( segment->num_parts == HLS_MAX_PARTS || hls->len == hls->part_start )
+        return;
+
+    snprintf( name, sizeof(name), "seg%i.%i.ts", segment->num, segment->num_parts );
+    write_atomic( hls, name, &hls->data[hls->part_start], hls->len - hls->part_start );
+
+    segment->part_duration[segment->num_parts++] = ( ( dts - hls->part_start_dts ) & HLS_PTS_MASK ) / 90000.0;
+    hls->part_start = hls->len;
+    hls->part_start_dts = dts;
+}
+
+static void finish_segment( obe_hls_ctx *hls, int64_t pts, int64_t dts )
+{
+    obe_hls_segment_t *segment = &hls->segments[hls->num_segments-1];
+    char name[64];
+
+    if( hls->part_time )
+        finish_part( hls, dts );
+
+    snprintf( name, sizeof(name), "seg%i.ts", segment->num );
+    write_atomic( hls, name, hls->data, hls->len );
+    segment->duration = ( ( pts - hls->start_pts ) & HLS_PTS_MASK ) / 90000.0;
+}
+
+static void start_segment( obe_hls_ctx *hls, int64_t pts, int64_t dts )
+{
+    obe_hls_segment_t *segment;
+    int num = hls->num_segments ? hls->segments[hls->num_segments-1].num + 1 : 0;
+
+    /* Keep list_size finished segments plus the new one */
+    if( hls->num_segments > hls->list_size )
+    {
+        if( hls->has_expired )
+            remove_segment( hls, &hls->expired );
+        hls->expired = hls->segments[0];
+        hls->has_expired = 1;
+        memmove( &hls->segments[0], &hls->segments[1], ( hls->num_segments - 1 ) * sizeof(*hls->segments) );
+        hls->num_segments--;
+    }
+
+    segment = &hls->segments[hls->num_segments++];
+    memset( segment, 0, sizeof(*segment) );
+    segment->num = num;
+
+    /* A segment must be decodable on its own so starts with the PSI */
+    memcpy( hls->data, hls->pat, 188 );
+    memcpy( &hls->data[188], hls->pmt, 188 );
+    hls->len = 376;
+    hls->part_start = 0;
+    hls->start_pts = pts;
+    hls->start_dts = hls->part_start_dts = dts;
+}
+
+/* PMT PID of the first program */
+static void parse_pat( obe_hls_ctx *hls, uint8_t *pkt )
+{
+    uint8_t *section = &pkt[5 + pkt[4]];
+    int section_len = ( ( section[1] & 0x0f ) << 8 ) | section[2];
+
+    for( int i = 8; i + 4 <= section_len - 1 && section + i + 4 <= pkt + 188; i += 4 )
+    {
+        if( ( section[i] << 8 | section[i+1] ) != 0 )
+        {
+            hls->pmt_pid = ( ( section[i+2] & 0x1f ) << 8 ) | section[i+3];
+            break;
+        }
+    }
+}
+
+/* PID of the first video stream */
+static void parse_pmt( obe_hls_ctx *hls, uint8_t *pkt )
+{
+    uint8_t *section = &pkt[5 + pkt[4]];
+    uint8_t *end = section + 3 + ( ( ( section[1] & 0x0f ) << 8 ) | section[2] ) - 4;
+    uint8_t *es = section + 12 + ( ( ( section[10] & 0x0f ) << 8 ) | section[11] );
+
+    end = MIN( end, pkt + 188 );
+    while( es + 5 <= end )
+    {
+        if( es[0] == 0x02 || es[0] == 0x1b || es[0] == 0x24 )
+        {
+            hls->video_pid = ( ( es[1] & 0x1f ) << 8 ) | es[2];
+            return;
+        }
+        es += 5 + ( ( ( es[3] & 0x0f ) << 8 ) | es[4] );
+    }
+}
+
+static void add_packet( obe_hls_ctx *hls, uint8_t *pkt )
+{
+    int pid = ( ( pkt[1] & 0x1f ) << 8 ) | pkt[2];
+    int pusi = pkt[1] & 0x40;
+    int has_adaptation = pkt[3] & 0x20;
+
+    if( pid == 0 && pusi )
+    {
+        memcpy( hls->pat, pkt, 188 );
+        parse_pat( hls, pkt );
+    }
+    else if( pid == hls->pmt_pid && pusi )
+    {
+        memcpy( hls->pmt, pkt, 188 );
+        parse_pmt( hls, pkt );
+    }
+    else if( pid == hls->video_pid && pusi )
+    {
+        int random_access = has_adaptation && pkt[4] && ( pkt[5] & 0x40 );
+        uint8_t *pes = &pkt[4 + ( has_adaptation ? 1 + pkt[4] : 0 )];
+        int64_t pts, dts;
+
+        if( pes + 14 > pkt + 188 || pes[0] || pes[1] || pes[2] != 1 || !( pes[7] & 0x80 ) )
+            return;
+
+        pts = dts = ( (int64_t)( pes[9] & 0x0e ) << 29 ) | ( pes[10] << 22 ) | ( ( pes[11] & 0xfe ) << 14 ) |
+                    ( pes[12] << 7 ) | ( pes[13] >> 1 );
+
+        if( ( pes[7] & 0xc0 ) == 0xc0 )
+        {
+            if( pes + 19 > pkt + 188 )
+                return;
+            dts = ( (int64_t)( pes[14] & 0x0e ) << 29 ) | ( pes[15] << 22 ) | ( ( pes[16] & 0xfe ) << 14 ) |
+                  ( pes[17] << 7 ) | ( pes[18] >> 1 );
+        }
+
+        hls->frame_duration = ( dts - hls->last_dts ) & HLS_PTS_MASK;
+
+        /* Segments start on IDR frames and parts on any frame */
+        if( random_access && ( !hls->started || ( ( pts - hls->start_pts ) & HLS_PTS_MASK ) >= hls->segment_time * 90000 ) )
+        {
+            if( hls->started )
+                finish_segment( hls, pts, dts );
+            start_segment( hls, pts, dts );
+            if( hls->started )
+                write_playlist( hls, 0 );
+            hls->started = 1;
+        }
+        /* Parts must not be longer than the part target, so end one before the next frame would take it over */
+        else if( hls->started && hls->part_time &&
+                 ( ( dts - hls->part_start_dts ) & HLS_PTS_MASK ) + hls->frame_duration > hls->part_time * 90000 )
+        {
+            finish_part( hls, dts );
+            write_playlist( hls, 0 );
+        }
+
+        hls->last_dts = dts;
+    }
+
+    if( !hls->started )
+        return;
+
+    if( hls->len + 188 > hls->alloc )
+    {
+        uint8_t *tmp = realloc( hls->data, hls->alloc * 2 );
+        if( !tmp )
+        {
+            syslog( LOG_ERR, "Malloc failed\n" );
+            return;
+        }
+        hls->data = tmp;
+        hls->alloc *= 2;
+    }
+
+    memcpy( &hls->data[hls->len], pkt, 188 );
+    hls->len += 188;
+}
+
+int hls_open( hnd_t *p_handle, char *uri )
+{
+    obe_hls_ctx *hls;
+    char buf[256];
+    const char *p = strchr( uri, '?' );
+    int len = p ? p - uri : strlen( uri );
+
+    *p_handle = NULL;
+
+    hls = calloc( 1, sizeof(*hls) );
+    if( !hls )
+    {
+        fprintf( stderr, "[hls] malloc failed\n" );
+        return -1;
+    }
+
+    snprintf( hls->dir, sizeof(hls->dir), "%.*s", len, uri );
+    hls->segment_time = 6;
+    hls->list_size = 6;
+    hls->pmt_pid = -1;
+    hls->video_pid = -1;
+
+    if( p )
+    {
+        if( av_find_info_tag( buf, sizeof(buf), "segment_time", p ) )
+            hls->segment_time = strtod( buf, NULL );
+
+        if( av_find_info_tag( buf, sizeof(buf), "part_time", p ) )
+            hls->part_time = strtod( buf, NULL );
+
+        if( av_find_info_tag( buf, sizeof(buf), "list_size", p ) )
+            hls->list_size = strtol( buf, NULL, 10 );
+    }
+
+    if( hls->segment_time <= 0 || hls->part_time < 0 || hls->part_time > hls->segment_time ||
+        hls->list_size < 1 || hls->list_size > HLS_MAX_SEGMENTS )
+    {
+        fprintf( stderr, "[hls] Invalid segmenter options\n" );
+        free( hls );
+        return -1;
+    }
+
+    hls->alloc = 1 << 20;
+    hls->data = malloc( hls->alloc );
+    if( !hls->data )
+    {
+        fprintf( stderr, "[hls] malloc failed\n" );
+        free( hls );
+        return -1;
+    }
+
+    *p_handle = hls;
+
+    return 0;
+}
+
+void hls_write( hnd_t handle, uint8_t *data, int len )
+{
+    obe_hls_ctx *hls = handle;
+
+    for( int i = 0; i + 188 <= len; i += 188 )
+    {
+        if( data[i] == 0x47 )
+            add_packet( hls, &data[i] );
+    }
+}
+
+void hls_close( hnd_t handle )
+{
+    obe_hls_ctx *hls = handle;
+
+    if( hls->started )
+    {
+        /* The segment ends a frame after the last one */
+        int64_t end_dts = ( hls->last_dts + hls->frame_duration ) & HLS_PTS_MASK;
+        finish_segment( hls, ( hls->start_pts + end_dts - hls->start_dts ) & HLS_PTS_MASK, end_dts );
+        write_playlist( hls, 1 );
+    }
+
+    free( hls->data );
+    free( hls );
+}
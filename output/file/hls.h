@@ -0,0 +1,32 @@
+/*****************************************************************************
+ * hls.h : HLS segmenter
+ *****************************************************************************
+ * Copyright (C) 2010 Open Broadcast Systems Ltd.
+ *
+ * Authors: Kieran Kunhya <kieran@kunhya.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+#ifndef OBE_OUTPUT_FILE_HLS_H
+#define OBE_OUTPUT_FILE_HLS_H
+
+int hls_open( hnd_t *p_handle, char *uri );
+/* data is a whole number of TS packets */
+void hls_write( hnd_t handle, uint8_t *data, int len );
+void hls_close( hnd_t handle );
+
+#endif /* OBE_OUTPUT_FILE_HLS_H */
@@ -0,0 +1,304 @@
+/*****************************************************************************
+ * fec.c : SMPTE 2022-1 FEC
+ *****************************************************************************
+ * Copyright (C) 2010 Open Broadcast Systems Ltd.
+ *
+ * Authors: Kieran Kunhya <kieran@kunhya.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+#include <libavutil/cpu.h>
+
+#include "common/common.h"
+#include "common/network/network.h"
+#include "common/bitstream.h"
+#include "output/ip/fec.h"
+#include "output/ip/x86/fec.h"
+
+#define FEC_PAYLOAD_TYPE 96
+#define FEC_HEADER_SIZE 16
+
+#define FEC_COLUMN_PORT_OFFSET 2
+#define FEC_ROW_PORT_OFFSET 4
+
+/* XOR of the media packets covered by one FEC packet */
+typedef struct
+{
+    uint16_t sn_base;
+    uint16_t length_recovery;
+    uint8_t  pt_recovery;
+    uint32_t ts_recovery;
+    uint8_t  payload[TS_PACKETS_SIZE];
+} obe_fec_group_t;
+
+typedef struct
+{
+    uint8_t header[RTP_HEADER_SIZE+FEC_HEADER_SIZE];
+    uint8_t payload[TS_PACKETS_SIZE];
+} obe_fec_packet_t;
+
+typedef struct
+{
+    hnd_t udp_handle;
+    uint16_t seq;
+
+    int num_out;
+    obe_fec_packet_t out[UDP_MAX_BATCH];
+} obe_fec_stream_t;
+
+typedef struct
+{
+    /* L and D */
+    int columns;
+    int rows;
+
+    /* Position of the next media packet in the matrix */
+    int pos;
+
+    obe_fec_group_t *groups;
+    obe_fec_group_t *column_groups;
+    obe_fec_group_t row_group;
+
+    /* Column groups of the last matrix, sent one every D media packets so that FEC is spread evenly */
+    obe_fec_group_t *column_done;
+    int column_next;
+
+    obe_fec_stream_t column;
+    obe_fec_stream_t row;
+
+    void (*xor_block)( uint8_t *dst, const uint8_t *src, int len );
+    int block_size;
+} obe_fec_ctx;
+
+static void fec_xor_c( uint8_t *dst, const uint8_t *src, int len )
+{
+    for( int i = 0; i < len; i++ )
+        dst[i] ^= src[i];
+}
+
+static void add_to_group( obe_fec_ctx *fec, obe_fec_group_t *group, int first, uint16_t seq, uint32_t timestamp, uint8_t *payload )
+{
+    if( first )
+    {
+        group->sn_base = seq;
+        group->length_recovery = TS_PACKETS_SIZE;
+        group->pt_recovery = MPEG_TS_PAYLOAD_TYPE;
+        group->ts_recovery = timestamp;
+        memcpy( group->payload, payload, TS_PACKETS_SIZE );
+    }
+    else
+    {
+        int len = TS_PACKETS_SIZE & ~(fec->block_size-1);
+
+        group->length_recovery ^= TS_PACKETS_SIZE;
+        group->pt_recovery ^= MPEG_TS_PAYLOAD_TYPE;
+        group->ts_recovery ^= timestamp;
+        fec->xor_block( group->payload, payload, len );
+        fec_xor_c( group->payload + len, payload + len, TS_PACKETS_SIZE - len );
+    }
+}
+
+static void queue_packet( obe_fec_stream_t *stream, obe_fec_group_t *group, int is_row, int offset, int na )
+{
+    obe_fec_packet_t *pkt;
+    bs_t s;
+
+    if( stream->num_out == UDP_MAX_BATCH )
+        return;
+
+    pkt = &stream->out[stream->num_out++];
+    bs_init( &s, pkt->header, RTP_HEADER_SIZE+FEC_HEADER_SIZE );
+
+    bs_write( &s, 2, RTP_VERSION ); // version
+    bs_write1( &s, 0 );             // padding
+    bs_write1( &s, 0 );             // extension
+    bs_write( &s, 4, 0 );           // CSRC count
+    bs_write1( &s, 0 );             // marker
+    bs_write( &s, 7, FEC_PAYLOAD_TYPE ); // payload type
+    bs_write( &s, 16, stream->seq++ ); // sequence number
+    bs_write32( &s, 0 );            // timestamp
+    bs_write32( &s, 0 );            // ssrc
+
+    bs_write( &s, 16, group->sn_base ); // SNBase low bits
+    bs_write( &s, 16, group->length_recovery ); // length recovery
+    bs_write1( &s, 1 );             // extension
+    bs_write( &s, 7, group->pt_recovery ); // PT recovery
+    bs_write( &s, 24, 0 );          // mask
+    bs_write32( &s, group->ts_recovery ); // TS recovery
+    bs_write1( &s, 0 );             // X
+    bs_write1( &s, is_row );        // D
+    bs_write( &s, 3, 0 );           // type (XOR)
+    bs_write( &s, 3, 0 );           // index
+    bs_write( &s, 8, offset );      // offset
+    bs_write( &s, 8, na );          // NA
+    bs_write( &s, 8, 0 );           // SNBase ext bits
+    bs_flush( &s );
+
+    memcpy( pkt->payload, group->payload, TS_PACKETS_SIZE );
+}
+
+static int write_stream( obe_fec_stream_t *stream )
+{
+    struct iovec iov[UDP_MAX_BATCH];
+    int ret = 0;
+
+    for( int i = 0; i < stream->num_out; i++ )
+    {
+        iov[i].iov_base = &stream->out[i];
+        iov[i].iov_len = sizeof(stream->out[i]);
+    }
+
+    if( stream->num_out )
+        ret = udp_write_batch( stream->udp_handle, iov, 1, stream->num_out );
+    stream->num_out = 0;
+
+    return ret < 0 ? -1 : 0;
+}
+
+int fec_open( hnd_t *p_handle, obe_udp_opts_t *udp_opts )
+{
+    obe_fec_ctx *fec;
+    obe_udp_opts_t fec_opts;
+    int cpu_flags = av_get_cpu_flags();
+
+    *p_handle = NULL;
+
+    if( udp_opts->fec_columns < 1 || udp_opts->fec_columns > 20 || udp_opts->fec_rows < 4 || udp_opts->fec_rows > 20 ||
+        udp_opts->fec_columns * udp_opts->fec_rows > 100 )
+    {
+        fprintf( stderr, "[fec] Invalid FEC matrix %ix%i\n", udp_opts->fec_columns, udp_opts->fec_rows );
+        return -1;
+    }
+
+    fec = calloc( 1, sizeof(*fec) );
+    if( !fec )
+    {
+        fprintf( stderr, "[fec] malloc failed\n" );
+        return -1;
+    }
+
+    fec->columns = udp_opts->fec_columns;
+    fec->rows = udp_opts->fec_rows;
+    fec->column_next = fec->columns;
+
+    fec->groups = calloc( 2 * fec->columns, sizeof(*fec->groups) );
+    if( !fec->groups )
+    {
+        fprintf( stderr, "[fec] malloc failed\n" );
+        goto fail;
+    }
+    fec->column_groups = fec->groups;
+    fec->column_done = fec->groups + fec->columns;
+
+    fec->xor_block = fec_xor_c;
+    fec->block_size = 1;
+
+    if( cpu_flags & AV_CPU_FLAG_SSE2 )
+    {
+        fec->xor_block = obe_fec_xor_sse2;
+        fec->block_size = 16;
+    }
+
+    if( cpu_flags & AV_CPU_FLAG_AVX2 )
+    {
+        fec->xor_block = obe_fec_xor_avx2;
+        fec->block_size = 32;
+    }
+
+    /* FEC packets are a different size to the media packets */
+    memcpy( &fec_opts, udp_opts, sizeof(fec_opts) );
+    fec_opts.gso = 0;
+    fec_opts.tx_ring = 0;
+    if( fec_opts.local_port )
+        fec_opts.local_port += FEC_COLUMN_PORT_OFFSET;
+
+    fec_opts.port = udp_opts->port + FEC_COLUMN_PORT_OFFSET;
+    if( udp_open( &fec->column.udp_handle, &fec_opts ) < 0 )
+    {
+        fprintf( stderr, "[fec] Could not create column FEC output\n" );
+        goto fail;
+    }
+
+    fec_opts.port = udp_opts->port + FEC_ROW_PORT_OFFSET;
+    if( fec_opts.local_port )
+        fec_opts.local_port += FEC_ROW_PORT_OFFSET - FEC_COLUMN_PORT_OFFSET;
+    if( udp_open( &fec->row.udp_handle, &fec_opts ) < 0 )
+    {
+        fprintf( stderr, "[fec] Could not create row FEC output\n" );
+        goto fail;
+    }
+
+    *p_handle = fec;
+
+    return 0;
+
+fail:
+    fec_close( fec );
+    return -1;
+}
+
+void fec_add_packet( hnd_t handle, uint16_t seq, uint32_t timestamp, uint8_t *payload )
+{
+    obe_fec_ctx *fec = handle;
+    int row = fec->pos / fec->columns, column = fec->pos % fec->columns;
+
+    if( fec->column_next < fec->columns && fec->pos % fec->rows == 0 )
+        queue_packet( &fec->column, &fec->column_done[fec->column_next++], 0, fec->columns, fec->rows );
+
+    add_to_group( fec, &fec->column_groups[column], row == 0, seq, timestamp, payload );
+    add_to_group( fec, &fec->row_group, column == 0, seq, timestamp, payload );
+
+    if( column == fec->columns-1 )
+        queue_packet( &fec->row, &fec->row_group, 1, 1, fec->columns );
+
+    if( ++fec->pos == fec->columns * fec->rows )
+    {
+        obe_fec_group_t *tmp = fec->column_done;
+        fec->column_done = fec->column_groups;
+        fec->column_groups = tmp;
+        fec->column_next = 0;
+        fec->pos = 0;
+    }
+}
+
+int fec_write( hnd_t handle )
+{
+    obe_fec_ctx *fec = handle;
+    int ret = 0;
+
+    if( write_stream( &fec->column ) < 0 )
+        ret = -1;
+    if( write_stream( &fec->row ) < 0 )
+        ret = -1;
+
+    return ret;
+}
+
+void fec_close( hnd_t handle )
+{
+    obe_fec_ctx *fec = handle;
+
+    if( !fec )
+        return;
+
+    if( fec->column.udp_handle )
+        udp_close( fec->column.udp_handle );
+    if( fec->row.udp_handle )
+        udp_close( fec->row.udp_handle );
+    free( fec->groups );
+    free( fec );
+}
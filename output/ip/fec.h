@@ -0,0 +1,40 @@
+/*****************************************************************************
+ * fec.h : SMPTE 2022-1 FEC
+ *****************************************************************************
+ * Copyright (C) 2010 Open Broadcast Systems Ltd.
+ *
+ * Authors: Kieran Kunhya <kieran@kunhya.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+#ifndef OBE_OUTPUT_IP_FEC_H
+#define OBE_OUTPUT_IP_FEC_H
+
+#include "common/network/udp/udp.h"
+
+#define RTP_VERSION 2
+#define MPEG_TS_PAYLOAD_TYPE 33
+#define RTP_HEADER_SIZE 12
+
+/* Column FEC goes to the media port + 2 and row FEC to the media port + 4 */
+int fec_open( hnd_t *p_handle, obe_udp_opts_t *udp_opts );
+/* Adds a media packet to the matrix. FEC packets due after it are queued for fec_write */
+void fec_add_packet( hnd_t handle, uint16_t seq, uint32_t timestamp, uint8_t *payload );
+int fec_write( hnd_t handle );
+void fec_close( hnd_t handle );
+
+#endif /* OBE_OUTPUT_IP_FEC_H */
@@ -23,19 +23,15 @@
  *****************************************************************************/
 
 #include <libavutil/random_seed.h>
-#include <libavutil/intreadwrite.h>
 #include <sys/time.h>
 
 #include "common/common.h"
 #include "common/network/network.h"
 #include "common/network/udp/udp.h"
 #include "output/output.h"
+#include "output/ip/fec.h"
 #include "common/bitstream.h"
 
-#define RTP_VERSION 2
-#define MPEG_TS_PAYLOAD_TYPE 33
-#define RTP_HEADER_SIZE 12
-
 #define RTCP_SR_PACKET_TYPE 200
 #define RTCP_PACKET_SIZE 28
 
@@ -45,18 +41,44 @@
 typedef struct
 {
     hnd_t udp_handle;
+    hnd_t fec_handle;
 
     uint16_t seq;
     uint32_t ssrc;
 
+    /* Header with the fixed fields filled in, patched with seq and timestamp per packet */
+    uint8_t header[RTP_HEADER_SIZE];
+
     uint32_t pkt_cnt;
     uint32_t octet_cnt;
+
+    /* SMPTE 2022-7 second path. It is sent the same packets straight after the first path */
+    hnd_t path2_handle;
+    int64_t path2_lost;
+    int64_t num_skews;
+    int64_t skew_sum;
+    int64_t skew_max;
 } obe_rtp_ctx;
 
+typedef struct
+{
+    obe_output_dest_t *output_dest;
+    hnd_t handle;
+
+    /* A destination which fails or can't keep up loses datagrams rather than holding up the others */
+    int64_t num_datagrams;
+    int64_t num_errors;     /* datagrams lost to send errors */
+    int64_t num_overflows;  /* datagrams dropped because the socket buffer was full */
+} obe_ip_dest_t;
+
 struct ip_status
 {
-    obe_output_t *output;
-    hnd_t *ip_handle;
+    obe_t *h;
+    obe_ip_dest_t *dests;
+    int num_dests;
+    int ring_locked;
+
+    int64_t start_time;
 };
 
 static int rtp_open( hnd_t *p_handle, obe_udp_opts_t *udp_opts )
@@ -74,8 +96,52 @@ static int rtp_open( hnd_t *p_handle, obe_udp_opts_t *udp_opts )
         return -1;
     }
 
+    if( udp_opts->fec_columns && fec_open( &p_rtp->fec_handle, udp_opts ) < 0 )
+    {
+        udp_close( p_rtp->udp_handle );
+        free( p_rtp );
+        return -1;
+    }
+
+    if( udp_opts->path2_hostname[0] )
+    {
+        obe_udp_opts_t path2_opts;
+
+        memcpy( &path2_opts, udp_opts, sizeof(path2_opts) );
+        memcpy( path2_opts.hostname, udp_opts->path2_hostname, sizeof(path2_opts.hostname) );
+        memcpy( path2_opts.iface, udp_opts->path2_iface, sizeof(path2_opts.iface) );
+        path2_opts.port = udp_opts->path2_port;
+        path2_opts.miface = udp_opts->path2_miface;
+        if( path2_opts.local_port )
+            path2_opts.local_port++;
+
+        if( udp_open( &p_rtp->path2_handle, &path2_opts ) < 0 )
+        {
+            fprintf( stderr, "[rtp] Could not create second path udp output" );
+            if( p_rtp->fec_handle )
+                fec_close( p_rtp->fec_handle );
+            udp_close( p_rtp->udp_handle );
+            free( p_rtp );
+            return -1;
+        }
+    }
+
     p_rtp->ssrc = av_get_random_seed();
 
+    bs_t s;
+    bs_init( &s, p_rtp->header, RTP_HEADER_SIZE );
+
+    bs_write( &s, 2, RTP_VERSION ); // version
+    bs_write1( &s, 0 );             // padding
+    bs_write1( &s, 0 );             // extension
+    bs_write( &s, 4, 0 );           // CSRC count
+    bs_write1( &s, 0 );             // marker
+    bs_write( &s, 7, MPEG_TS_PAYLOAD_TYPE ); // payload type
+    bs_write( &s, 16, 0 );          // sequence number
+    bs_write32( &s, 0 );            // timestamp
+    bs_write32( &s, p_rtp->ssrc );  // ssrc
+    bs_flush( &s );
+
     *p_handle = p_rtp;
 
     return 0;
@@ -120,39 +186,124 @@ static int write_rtcp_pkt( hnd_t handle )
     return 0;
 }
 #endif
-static int write_rtp_pkt( hnd_t handle, uint8_t *data, int len, int64_t timestamp )
+static int write_rtp_pkts( hnd_t handle, obe_ts_ring_t *ring, int64_t pos, int num_msgs )
 {
     obe_rtp_ctx *p_rtp = handle;
-    uint8_t pkt[RTP_HEADER_SIZE+TS_PACKETS_SIZE];
-    bs_t s;
-    bs_init( &s, pkt, RTP_HEADER_SIZE+TS_PACKETS_SIZE );
+    uint8_t headers[UDP_MAX_BATCH][RTP_HEADER_SIZE];
+    struct iovec iov[UDP_MAX_BATCH*2];
+    int64_t start, skew;
+    int ret, ret2;
 
-    bs_write( &s, 2, RTP_VERSION ); // version
-    bs_write1( &s, 0 );             // padding
-    bs_write1( &s, 0 );             // extension
-    bs_write( &s, 4, 0 );           // CSRC count
-    bs_write1( &s, 0 );             // marker
-    bs_write( &s, 7, MPEG_TS_PAYLOAD_TYPE ); // payload type
-    bs_write( &s, 16, p_rtp->seq++ ); // sequence number
-    bs_write32( &s, timestamp / 300 ); // timestamp
-    bs_write32( &s, p_rtp->ssrc );    // ssrc
-    bs_flush( &s );
+    for( int i = 0; i < num_msgs; i++ )
+    {
+        obe_ts_datagram_t *datagram = get_ts_slot( ring, pos + i );
+        uint8_t *header = headers[i];
+        uint32_t timestamp = datagram->pcr / 300;
+
+        memcpy( header, p_rtp->header, RTP_HEADER_SIZE );
+        header[2] = p_rtp->seq >> 8;
+        header[3] = p_rtp->seq & 0xff;
+        header[4] = timestamp >> 24;
+        header[5] = timestamp >> 16;
+        header[6] = timestamp >> 8;
+        header[7] = timestamp & 0xff;
+
+        if( p_rtp->fec_handle )
+            fec_add_packet( p_rtp->fec_handle, p_rtp->seq, timestamp, datagram->data );
+        p_rtp->seq++;
+
+        iov[2*i].iov_base = header;
+        iov[2*i].iov_len = RTP_HEADER_SIZE;
+        iov[2*i+1].iov_base = datagram->data;
+        iov[2*i+1].iov_len = TS_PACKETS_SIZE;
+    }
+
+    start = get_wallclock_in_mpeg_ticks();
+    ret = udp_write_batch( p_rtp->udp_handle, iov, 2, num_msgs );
+
+    if( p_rtp->path2_handle )
+    {
+        skew = get_wallclock_in_mpeg_ticks() - start;
+        ret2 = udp_write_batch( p_rtp->path2_handle, iov, 2, num_msgs );
+        if( ret2 < num_msgs )
+        {
+            if( !p_rtp->path2_lost )
+                syslog( LOG_WARNING, "[rtp] Second path failed to send packets\n" );
+            p_rtp->path2_lost += num_msgs - MAX( ret2, 0 );
+        }
+
+        p_rtp->num_skews++;
+        p_rtp->skew_sum += skew;
+        p_rtp->skew_max = MAX( p_rtp->skew_max, skew );
+    }
 
-    memcpy( &pkt[RTP_HEADER_SIZE], data, len );
+    /* FEC follows the media packets it was generated from */
+    if( p_rtp->fec_handle && fec_write( p_rtp->fec_handle ) < 0 )
+        syslog( LOG_ERR, "[fec] Failed to write FEC packets\n" );
 
-    if( udp_write( p_rtp->udp_handle, pkt, RTP_HEADER_SIZE+TS_PACKETS_SIZE ) < 0 )
+    if( ret < 0 )
         return -1;
 
-    p_rtp->pkt_cnt++;
-    p_rtp->octet_cnt += len;
+    p_rtp->pkt_cnt += ret;
+    p_rtp->octet_cnt += ret * TS_PACKETS_SIZE;
 
-    return 0;
+    return ret;
+}
+
+static int write_udp_pkts( hnd_t handle, obe_ts_ring_t *ring, int64_t pos, int num_msgs )
+{
+    struct iovec iov[UDP_MAX_BATCH];
+
+    for( int i = 0; i < num_msgs; i++ )
+    {
+        iov[i].iov_base = get_ts_slot( ring, pos + i )->data;
+        iov[i].iov_len = TS_PACKETS_SIZE;
+    }
+
+    return udp_write_batch( handle, iov, 1, num_msgs );
+}
+
+static void write_dest( obe_ip_dest_t *dest, obe_ts_ring_t *ring, int64_t pos, int num_msgs )
+{
+    int ret;
+
+    if( dest->output_dest->type == OUTPUT_RTP )
+        ret = write_rtp_pkts( dest->handle, ring, pos, num_msgs );
+    else
+        ret = write_udp_pkts( dest->handle, ring, pos, num_msgs );
+
+    if( ret < 0 )
+    {
+        if( !dest->num_errors )
+            syslog( LOG_ERR, "[ip] %s: Failed to write packets\n", dest->output_dest->target );
+        dest->num_errors += num_msgs;
+        return;
+    }
+
+    dest->num_datagrams += ret;
+    if( ret < num_msgs )
+    {
+        if( !dest->num_overflows )
+            syslog( LOG_WARNING, "[ip] %s: Socket buffer full, dropping packets\n", dest->output_dest->target );
+        dest->num_overflows += num_msgs - ret;
+    }
 }
 
 static void rtp_close( hnd_t handle )
 {
     obe_rtp_ctx *p_rtp = handle;
 
+    if( p_rtp->path2_handle )
+    {
+        if( p_rtp->num_skews )
+        {
+            syslog( LOG_INFO, "[rtp] 2022-7 path skew: mean %.1fus, max %.1fus, %"PRIi64" packets lost on the second path\n",
+                    (double)p_rtp->skew_sum / p_rtp->num_skews / 27, p_rtp->skew_max / 27.0, p_rtp->path2_lost );
+        }
+        udp_close( p_rtp->path2_handle );
+    }
+    if( p_rtp->fec_handle )
+        fec_close( p_rtp->fec_handle );
     udp_close( p_rtp->udp_handle );
     free( p_rtp );
 }
@@ -160,105 +311,147 @@ static void rtp_close( hnd_t handle )
 static void close_output( void *handle )
 {
     struct ip_status *status = handle;
+    struct timespec cpu_time;
+    int64_t duration = get_wallclock_in_mpeg_ticks() - status->start_time;
+    int64_t num_datagrams = 0;
 
-    if( status->output->output_dest.type == OUTPUT_RTP )
+    for( int i = 0; i < status->num_dests; i++ )
     {
-        if( *status->ip_handle )
-            rtp_close( *status->ip_handle );
+        obe_ip_dest_t *dest = &status->dests[i];
+
+        if( dest->handle )
+        {
+            syslog( LOG_INFO, "[ip] %s: sent %"PRIi64" datagrams, %"PRIi64" lost to errors, %"PRIi64" dropped on overflow\n",
+                    dest->output_dest->target, dest->num_datagrams, dest->num_errors, dest->num_overflows );
+            num_datagrams += dest->num_datagrams;
+
+            if( dest->output_dest->type == OUTPUT_RTP )
+                rtp_close( dest->handle );
+            else
+                udp_close( dest->handle );
+        }
+        if( dest->output_dest->target )
+            free( dest->output_dest->target );
     }
-    else
+
+    clock_gettime( CLOCK_THREAD_CPUTIME_ID, &cpu_time );
+    if( duration > 0 )
     {
-        if( *status->ip_handle )
-            udp_close( *status->ip_handle );
+        double cpu = ( cpu_time.tv_sec + cpu_time.tv_nsec / 1000000000.0 ) * OBE_CLOCK / duration;
+        double mbits = (double)num_datagrams * TS_PACKETS_SIZE * 8 * OBE_CLOCK / ( duration * 1000000.0 );
+
+        syslog( LOG_INFO, "[ip] %.0f datagrams/s, %.1f%% CPU, %.1f%% CPU per Gbit/s\n", (double)num_datagrams * OBE_CLOCK / duration,
+                cpu * 100, mbits > 0 ? cpu * 100 * 1000 / mbits : 0 );
     }
-    if( status->output->output_dest.target  )
-        free( status->output->output_dest.target );
 
-    pthread_mutex_unlock( &status->output->queue.mutex );
+    free( status->dests );
+
+    if( status->ring_locked )
+        pthread_mutex_unlock( &status->h->ts_ring.mutex );
+    obe_ts_ring_detach( &status->h->ts_ring, 0 );
 }
 
 static void *open_output( void *ptr )
 {
-    obe_output_t *output = ptr;
-    obe_output_dest_t *output_dest = &output->output_dest;
+    obe_t *h = ptr;
     struct ip_status status;
-    hnd_t ip_handle = NULL;
-    int num_muxed_data = 0;
-    AVBufferRef **muxed_data;
+    obe_ts_ring_t *ring = &h->ts_ring;
+    int64_t read_pos = 0, publish_pos, pacing_offset, due_offset, now;
+    int num_msgs;
     obe_udp_opts_t udp_opts;
 
     struct sched_param param = {0};
     param.sched_priority = 99;
     pthread_setschedparam( pthread_self(), SCHED_FIFO, &param );
 
-    status.output = output;
-    status.ip_handle = &ip_handle;
-    pthread_cleanup_push( close_output, (void*)&status );
-
-    udp_populate_opts( &udp_opts, output_dest->target );
-
-    if( output_dest->type == OUTPUT_RTP )
+    status.h = h;
+    status.num_dests = 0;
+    status.ring_locked = 0;
+    status.start_time = get_wallclock_in_mpeg_ticks();
+    status.dests = calloc( h->num_outputs, sizeof(*status.dests) );
+    if( !status.dests )
     {
-        if( rtp_open( &ip_handle, &udp_opts ) < 0 )
-            return NULL;
+        syslog( LOG_ERR, "Malloc failed\n" );
+        obe_ts_ring_detach( ring, 0 );
+        return NULL;
     }
-    else
+    pthread_cleanup_push( close_output, (void*)&status );
+
+    /* A destination which can't be opened is skipped */
+    for( int i = 0; i < h->num_outputs; i++ )
     {
-        if( udp_open( &ip_handle, &udp_opts ) < 0 )
+        obe_ip_dest_t *dest = &status.dests[status.num_dests];
+        obe_output_dest_t *output_dest = &h->outputs[i]->output_dest;
+
+        if( output_dest->type != OUTPUT_UDP && output_dest->type != OUTPUT_RTP )
+            continue;
+
+        dest->output_dest = output_dest;
+        status.num_dests++;
+
+        udp_populate_opts( &udp_opts, output_dest->target );
+        udp_opts.gso_size = output_dest->type == OUTPUT_RTP ? RTP_HEADER_SIZE + TS_PACKETS_SIZE : TS_PACKETS_SIZE;
+        udp_opts.nonblocking = 1;
+
+        if( udp_opts.gso && !h->mux_opts.pacing_slot )
+            fprintf( stderr, "[udp] Segmentation offload has no effect without a pacing slot\n" );
+
+        if( output_dest->type == OUTPUT_RTP )
+        {
+            if( rtp_open( &dest->handle, &udp_opts ) < 0 )
+                dest->handle = NULL;
+        }
+        else
         {
-            fprintf( stderr, "[udp] Could not create udp output" );
-            return NULL;
+            if( udp_open( &dest->handle, &udp_opts ) < 0 )
+                fprintf( stderr, "[udp] Could not create udp output" );
         }
     }
 
     while( 1 )
     {
-        pthread_mutex_lock( &output->queue.mutex );
-        while( !output->queue.size && !output->cancel_thread )
+        pthread_mutex_lock( &ring->mutex );
+        status.ring_locked = 1;
+        while( ring->publish_pos == read_pos && !h->cancel_output_thread )
         {
             /* Often this cond_wait is not because of an underflow */
-            pthread_cond_wait( &output->queue.in_cv, &output->queue.mutex );
+            pthread_cond_wait( &ring->publish_cv, &ring->mutex );
         }
+        status.ring_locked = 0;
 
-        if( output->cancel_thread )
+        if( h->cancel_output_thread )
         {
-            pthread_mutex_unlock( &output->queue.mutex );
+            pthread_mutex_unlock( &ring->mutex );
             break;
         }
 
-        num_muxed_data = output->queue.size;
+        publish_pos = ring->publish_pos;
+        pacing_offset = h->pacing_offset;
+        pthread_mutex_unlock( &ring->mutex );
 
-        muxed_data = malloc( num_muxed_data * sizeof(*muxed_data) );
-        if( !muxed_data )
+        /* Everything published is due so send it to each destination in batches straight from the ring */
+        for( ; read_pos < publish_pos; read_pos += num_msgs )
         {
-            pthread_mutex_unlock( &output->queue.mutex );
-            syslog( LOG_ERR, "Malloc failed\n" );
-            return NULL;
-        }
-        memcpy( muxed_data, output->queue.queue, num_muxed_data * sizeof(*muxed_data) );
-        pthread_mutex_unlock( &output->queue.mutex );
+            num_msgs = MIN( publish_pos - read_pos, UDP_MAX_BATCH );
 
-//        printf("\n START %i \n", num_muxed_data );
+            /* Pacing lateness is the send time against the wallclock time each datagram's PCR was due */
+            now = get_wallclock_in_mpeg_ticks();
+            due_offset = input_clock_to_wallclock( h, pacing_offset );
+            for( int i = 0; i < num_msgs; i++ )
+                update_pacing_stats( h, now - ( get_ts_slot( ring, read_pos + i )->pcr + due_offset ) );
 
-        for( int i = 0; i < num_muxed_data; i++ )
-        {
-            if( output_dest->type == OUTPUT_RTP )
-            {
-                if( write_rtp_pkt( ip_handle, &muxed_data[i]->data[7*sizeof(int64_t)], TS_PACKETS_SIZE, AV_RN64( muxed_data[i]->data ) ) < 0 )
-                    syslog( LOG_ERR, "[rtp] Failed to write RTP packet\n" );
-            }
-            else
+            for( int i = 0; i < status.num_dests; i++ )
             {
-                if( udp_write( ip_handle, &muxed_data[i]->data[7*sizeof(int64_t)], TS_PACKETS_SIZE ) < 0 )
-                    syslog( LOG_ERR, "[udp] Failed to write UDP packet\n" );
+                if( status.dests[i].handle )
+                    write_dest( &status.dests[i], ring, read_pos, num_msgs );
             }
-
-            remove_from_queue( &output->queue );
-            av_buffer_unref( &muxed_data[i] );
         }
 
-        free( muxed_data );
-        muxed_data = NULL;
+        /* Let the mux reuse the slots */
+        pthread_mutex_lock( &ring->mutex );
+        ring->read_pos[0] = read_pos;
+        pthread_cond_signal( &ring->read_cv );
+        pthread_mutex_unlock( &ring->mutex );
     }
 
     pthread_cleanup_pop( 1 );
@@ -0,0 +1,30 @@
+%include "x86util.asm"
+
+SECTION .text
+
+;
+; obe_fec_xor( uint8_t *dst, const uint8_t *src, int len )
+; len must be a multiple of mmsize
+;
+
+%macro FEC_xor 0
+cglobal fec_xor, 3, 3, 2
+    movsxdifnidn r2, r2d
+    add       r0, r2
+    add       r1, r2
+    neg       r2
+
+.loop
+    movu      m0, [r1+r2]
+    movu      m1, [r0+r2]
+    pxor      m0, m1
+    movu      [r0+r2], m0
+    add       r2, mmsize
+    jl        .loop
+    RET
+%endmacro
+
+INIT_XMM sse2
+FEC_xor
+INIT_YMM avx2
+FEC_xor
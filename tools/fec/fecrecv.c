@@ -0,0 +1,598 @@
+/*****************************************************************************
+ * fecrecv.c : SMPTE 2022-1 FEC receiver and self-test
+ *****************************************************************************
+ * Copyright (C) 2010 Open Broadcast Systems Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+/* Captures an RTP output and its column and row FEC streams, drops some of the media packets
+ * it received and rebuilds them from the FEC. Every FEC packet is also checked against the
+ * media it covers. With -s it drives output/ip/fec.c over loopback instead of capturing.
+ *
+ *     fecrecv [-a multicast group] [-n packets] [-l loss %] [-b burst] port
+ *     fecrecv -s [-c columns] [-r rows]
+ */
+
+#include <getopt.h>
+#include <poll.h>
+#include <arpa/inet.h>
+
+#include "common/common.h"
+#include "common/network/network.h"
+#include "output/ip/fec.h"
+
+#define FEC_HEADER_SIZE 16
+#define FEC_PACKET_SIZE (RTP_HEADER_SIZE+FEC_HEADER_SIZE+TS_PACKETS_SIZE)
+#define MEDIA_PACKET_SIZE (RTP_HEADER_SIZE+TS_PACKETS_SIZE)
+
+#define FEC_COLUMN_PORT_OFFSET 2
+#define FEC_ROW_PORT_OFFSET 4
+
+enum media_state_e
+{
+    MEDIA_MISSING,
+    MEDIA_RECEIVED,
+    MEDIA_DROPPED,   /* received, hidden from the decoder and kept to check what it rebuilds */
+    MEDIA_RECOVERED,
+};
+
+typedef struct
+{
+    int state;
+    uint32_t timestamp;
+    uint8_t payload[TS_PACKETS_SIZE];
+} fec_media_t;
+
+typedef struct
+{
+    uint16_t sn_base;
+    uint16_t length_recovery;
+    uint8_t pt_recovery;
+    uint32_t ts_recovery;
+    int offset;
+    int na;
+    int done;
+    uint8_t payload[TS_PACKETS_SIZE];
+} fec_packet_t;
+
+typedef struct
+{
+    /* Media packets by sequence number from the first one captured */
+    int num_media;
+    int max_media;
+    uint16_t first_seq;
+    fec_media_t *media;
+
+    int num_fec;
+    int max_fec;
+    fec_packet_t *fec;
+
+    int64_t num_dropped;
+    int64_t num_recovered;
+    int64_t num_mismatches;  /* rebuilt packets which differ from what was received */
+    int64_t num_unverified;  /* rebuilt packets which were really lost */
+    int64_t num_parity_errors;
+} fec_rx_t;
+
+static int rx_init( fec_rx_t *rx, int max_media )
+{
+    memset( rx, 0, sizeof(*rx) );
+    rx->max_media = max_media;
+    /* Row and column packets plus slack for those sent around the capture */
+    rx->max_fec = max_media + 64;
+    rx->media = calloc( rx->max_media, sizeof(*rx->media) );
+    rx->fec = calloc( rx->max_fec, sizeof(*rx->fec) );
+
+    return rx->media && rx->fec ? 0 : -1;
+}
+
+static void rx_close( fec_rx_t *rx )
+{
+    free( rx->media );
+    free( rx->fec );
+}
+
+/* Returns 0 once the capture is full */
+static int add_media( fec_rx_t *rx, uint8_t *pkt, int len )
+{
+    uint16_t seq;
+    int idx;
+
+    if( len != MEDIA_PACKET_SIZE || pkt[0] >> 6 != RTP_VERSION || ( pkt[1] & 0x7f ) != MPEG_TS_PAYLOAD_TYPE )
+        return 1;
+
+    seq = pkt[2] << 8 | pkt[3];
+    if( !rx->num_media )
+        rx->first_seq = seq;
+
+    idx = (uint16_t)( seq - rx->first_seq );
+    if( idx >= rx->max_media )
+        return 0;
+
+    rx->media[idx].state = MEDIA_RECEIVED;
+    rx->media[idx].timestamp = (uint32_t)pkt[4] << 24 | pkt[5] << 16 | pkt[6] << 8 | pkt[7];
+    memcpy( rx->media[idx].payload, pkt + RTP_HEADER_SIZE, TS_PACKETS_SIZE );
+    rx->num_media = MAX( rx->num_media, idx + 1 );
+
+    return rx->num_media < rx->max_media;
+}
+
+static void add_fec( fec_rx_t *rx, uint8_t *pkt, int len )
+{
+    fec_packet_t *fec;
+    uint8_t *hdr = pkt + RTP_HEADER_SIZE;
+
+    /* Only XOR FEC without SNBase extension bits is sent */
+    if( len != FEC_PACKET_SIZE || pkt[0] >> 6 != RTP_VERSION || rx->num_fec == rx->max_fec ||
+        ( hdr[12] >> 3 & 7 ) || hdr[15] )
+        return;
+
+    fec = &rx->fec[rx->num_fec++];
+    fec->sn_base = hdr[0] << 8 | hdr[1];
+    fec->length_recovery = hdr[2] << 8 | hdr[3];
+    fec->pt_recovery = hdr[4] & 0x7f;
+    fec->ts_recovery = (uint32_t)hdr[8] << 24 | hdr[9] << 16 | hdr[10] << 8 | hdr[11];
+    fec->offset = hdr[13];
+    fec->na = hdr[14];
+    fec->done = 0;
+    memcpy( fec->payload, pkt + RTP_HEADER_SIZE + FEC_HEADER_SIZE, TS_PACKETS_SIZE );
+}
+
+/* Hides media packets from the decoder. Each packet starts a burst with probability loss */
+static void drop_random( fec_rx_t *rx, double loss, int burst )
+{
+    for( int i = 0; i < rx->num_media; i++ )
+    {
+        if( rx->media[i].state != MEDIA_RECEIVED || rand() >= loss * RAND_MAX )
+            continue;
+
+        for( int j = i; j < MIN( i + burst, rx->num_media ); j++ )
+        {
+            if( rx->media[j].state == MEDIA_RECEIVED )
+            {
+                rx->media[j].state = MEDIA_DROPPED;
+                rx->num_dropped++;
+            }
+        }
+        i += burst - 1;
+    }
+}
+
+static int is_available( fec_media_t *media )
+{
+    return media->state == MEDIA_RECEIVED || media->state == MEDIA_RECOVERED;
+}
+
+/* Rebuilds any packet which is the only one missing from an FEC group, repeating until nothing
+ * more can be rebuilt. Groups with nothing missing are checked instead */
+static void recover( fec_rx_t *rx )
+{
+    uint8_t payload[TS_PACKETS_SIZE];
+    int progress = 1;
+
+    while( progress )
+    {
+        progress = 0;
+
+        for( int i = 0; i < rx->num_fec; i++ )
+        {
+            fec_packet_t *fec = &rx->fec[i];
+            int num_missing = 0, missing = -1, complete = 1;
+            uint16_t length = fec->length_recovery;
+            uint8_t pt = fec->pt_recovery;
+            uint32_t timestamp = fec->ts_recovery;
+
+            if( fec->done )
+                continue;
+
+            for( int j = 0; j < fec->na; j++ )
+            {
+                int idx = (uint16_t)( fec->sn_base + j * fec->offset - rx->first_seq );
+                if( idx >= rx->num_media )
+                    complete = 0;
+                else if( !is_available( &rx->media[idx] ) )
+                {
+                    num_missing++;
+                    missing = idx;
+                }
+            }
+
+            /* Covers packets from before or after the capture */
+            if( !complete || !fec->na || !fec->offset )
+            {
+                fec->done = 1;
+                continue;
+            }
+
+            if( num_missing > 1 )
+                continue;
+
+            memcpy( payload, fec->payload, TS_PACKETS_SIZE );
+            for( int j = 0; j < fec->na; j++ )
+            {
+                int idx = (uint16_t)( fec->sn_base + j * fec->offset - rx->first_seq );
+                fec_media_t *media = &rx->media[idx];
+
+                if( idx == missing )
+                    continue;
+
+                for( int k = 0; k < TS_PACKETS_SIZE; k++ )
+                    payload[k] ^= media->payload[k];
+                length ^= TS_PACKETS_SIZE;
+                pt ^= MPEG_TS_PAYLOAD_TYPE;
+                timestamp ^= media->timestamp;
+            }
+
+            fec->done = 1;
+
+            if( missing < 0 )
+            {
+                /* Everything XORs out to zero if the FEC packet matches its media */
+                int nonzero = length || pt || timestamp;
+                for( int k = 0; k < TS_PACKETS_SIZE && !nonzero; k++ )
+                    nonzero = payload[k];
+                rx->num_parity_errors += nonzero;
+                continue;
+            }
+
+            fec_media_t *media = &rx->media[missing];
+            if( length != TS_PACKETS_SIZE || pt != MPEG_TS_PAYLOAD_TYPE )
+                rx->num_mismatches++;
+            else if( media->state == MEDIA_DROPPED )
+            {
+                if( timestamp != media->timestamp || memcmp( payload, media->payload, TS_PACKETS_SIZE ) )
+                    rx->num_mismatches++;
+            }
+            else
+            {
+                media->timestamp = timestamp;
+                memcpy( media->payload, payload, TS_PACKETS_SIZE );
+                rx->num_unverified++;
+            }
+
+            media->state = MEDIA_RECOVERED;
+            rx->num_recovered++;
+            progress = 1;
+        }
+    }
+}
+
+static int64_t count_state( fec_rx_t *rx, int state )
+{
+    int64_t count = 0;
+
+    for( int i = 0; i < rx->num_media; i++ )
+        count += rx->media[i].state == state;
+
+    return count;
+}
+
+static void print_results( fec_rx_t *rx, const char *name )
+{
+    printf( "%-24s media %i, fec %i, dropped %"PRIi64", recovered %"PRIi64", unrecoverable %"PRIi64", "
+            "lost %"PRIi64" (%"PRIi64" rebuilt), mismatches %"PRIi64", parity errors %"PRIi64"\n",
+            name, rx->num_media, rx->num_fec, rx->num_dropped, rx->num_recovered - rx->num_unverified,
+            count_state( rx, MEDIA_DROPPED ), count_state( rx, MEDIA_MISSING ) + rx->num_unverified,
+            rx->num_unverified, rx->num_mismatches, rx->num_parity_errors );
+}
+
+static int open_socket( const char *group, int port )
+{
+    struct sockaddr_in addr = {0};
+    int fd, size = 4 * 1024 * 1024;
+
+    fd = socket( AF_INET, SOCK_DGRAM, 0 );
+    if( fd < 0 )
+        return -1;
+
+    setsockopt( fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size) );
+
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons( port );
+    addr.sin_addr.s_addr = group ? inet_addr( group ) : htonl( INADDR_ANY );
+    if( bind( fd, (struct sockaddr*)&addr, sizeof(addr) ) < 0 )
+    {
+        fprintf( stderr, "Could not bind to port %i\n", port );
+        close( fd );
+        return -1;
+    }
+
+    if( group )
+    {
+        struct ip_mreq mreq = {{0}};
+        mreq.imr_multiaddr.s_addr = inet_addr( group );
+        mreq.imr_interface.s_addr = htonl( INADDR_ANY );
+        if( setsockopt( fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq) ) < 0 )
+        {
+            fprintf( stderr, "Could not join %s\n", group );
+            close( fd );
+            return -1;
+        }
+    }
+
+    return fd;
+}
+
+/* Reads whatever is waiting on the FEC sockets. fds[0] is the media socket if there is one */
+static int read_sockets( fec_rx_t *rx, int *fds, int num_fds, int timeout )
+{
+    struct pollfd pfds[3];
+    uint8_t pkt[2048];
+    int len, more = 1;
+
+    for( int i = 0; i < num_fds; i++ )
+    {
+        pfds[i].fd = fds[i];
+        pfds[i].events = POLLIN;
+    }
+
+    if( poll( pfds, num_fds, timeout ) <= 0 )
+        return more;
+
+    for( int i = 0; i < num_fds; i++ )
+    {
+        while( ( len = recv( fds[i], pkt, sizeof(pkt), MSG_DONTWAIT ) ) > 0 )
+        {
+            if( num_fds == 3 && i == 0 )
+                more = add_media( rx, pkt, len ) && more;
+            else
+                add_fec( rx, pkt, len );
+        }
+    }
+
+    return more;
+}
+
+static int capture( const char *group, int port, int num_packets, double loss, int burst )
+{
+    fec_rx_t rx;
+    int fds[3] = { -1, -1, -1 }, ret = -1;
+    int64_t end;
+
+    if( rx_init( &rx, num_packets ) < 0 )
+    {
+        fprintf( stderr, "Malloc failed\n" );
+        goto end;
+    }
+
+    fds[0] = open_socket( group, port );
+    fds[1] = open_socket( group, port + FEC_COLUMN_PORT_OFFSET );
+    fds[2] = open_socket( group, port + FEC_ROW_PORT_OFFSET );
+    if( fds[0] < 0 || fds[1] < 0 || fds[2] < 0 )
+        goto end;
+
+    while( read_sockets( &rx, fds, 3, 1000 ) )
+        ;
+
+    /* Column FEC for the last matrix arrives with the next one */
+    end = get_wallclock_in_mpeg_ticks() + OBE_CLOCK / 2;
+    while( get_wallclock_in_mpeg_ticks() < end )
+        read_sockets( &rx, &fds[1], 2, 100 );
+
+    drop_random( &rx, loss, burst );
+    recover( &rx );
+    print_results( &rx, "capture" );
+
+    ret = rx.num_mismatches || rx.num_parity_errors ? 1 : 0;
+
+end:
+    for( int i = 0; i < 3; i++ )
+    {
+        if( fds[i] >= 0 )
+            close( fds[i] );
+    }
+    rx_close( &rx );
+
+    return ret;
+}
+
+/* Loss patterns for the self-test. Each returns whether the packet at a matrix position is lost */
+static int drop_one_per_row( int pos, int columns, int rows, int matrix )
+{
+    return pos % columns == ( pos / columns + matrix ) % columns;
+}
+
+static int drop_one_row( int pos, int columns, int rows, int matrix )
+{
+    return pos / columns == matrix % rows;
+}
+
+static int drop_one_column( int pos, int columns, int rows, int matrix )
+{
+    return pos % columns == matrix % columns;
+}
+
+static int drop_random_packets( int pos, int columns, int rows, int matrix )
+{
+    return rand() % 100 < 3;
+}
+
+typedef struct
+{
+    const char *name;
+    int (*drop)( int pos, int columns, int rows, int matrix );
+    int must_recover;
+} fec_pattern_t;
+
+static const fec_pattern_t patterns[] =
+{
+    { "one per row",    drop_one_per_row,    1 },
+    { "burst of a row", drop_one_row,        1 },
+    { "one column",     drop_one_column,     1 },
+    { "random 3%",      drop_random_packets, 0 },
+    { 0 },
+};
+
+#define SELF_TEST_PORT 40000
+#define SELF_TEST_MATRICES 20
+
+/* Feeds generated media through output/ip/fec.c and checks the FEC it sends over loopback */
+static int self_test_pattern( int columns, int rows, const fec_pattern_t *pattern )
+{
+    obe_udp_opts_t udp_opts;
+    hnd_t fec_handle = NULL;
+    fec_rx_t rx;
+    char uri[100];
+    uint8_t pkt[MEDIA_PACKET_SIZE] = {0};
+    int fds[2] = { -1, -1 }, ret = -1, matrix_size = columns * rows;
+    /* The column FEC of the last matrix is sent during one more */
+    int num_media = ( SELF_TEST_MATRICES + 1 ) * matrix_size;
+    uint16_t seq = rand();
+    uint32_t timestamp = rand();
+
+    if( rx_init( &rx, num_media ) < 0 )
+    {
+        fprintf( stderr, "Malloc failed\n" );
+        goto end;
+    }
+
+    fds[0] = open_socket( NULL, SELF_TEST_PORT + FEC_COLUMN_PORT_OFFSET );
+    fds[1] = open_socket( NULL, SELF_TEST_PORT + FEC_ROW_PORT_OFFSET );
+    if( fds[0] < 0 || fds[1] < 0 )
+        goto end;
+
+    snprintf( uri, sizeof(uri), "udp://127.0.0.1:%i?fec=%ix%i", SELF_TEST_PORT, columns, rows );
+    udp_populate_opts( &udp_opts, uri );
+    if( fec_open( &fec_handle, &udp_opts ) < 0 )
+        goto end;
+
+    pkt[0] = RTP_VERSION << 6;
+    pkt[1] = MPEG_TS_PAYLOAD_TYPE;
+
+    for( int i = 0; i < num_media; i++ )
+    {
+        pkt[2] = seq >> 8;
+        pkt[3] = seq & 0xff;
+        pkt[4] = timestamp >> 24;
+        pkt[5] = timestamp >> 16;
+        pkt[6] = timestamp >> 8;
+        pkt[7] = timestamp & 0xff;
+        for( int j = RTP_HEADER_SIZE; j < MEDIA_PACKET_SIZE; j++ )
+            pkt[j] = rand();
+
+        fec_add_packet( fec_handle, seq, timestamp, pkt + RTP_HEADER_SIZE );
+        add_media( &rx, pkt, MEDIA_PACKET_SIZE );
+        seq++;
+        timestamp += 1000 + rand() % 100;
+
+        /* Batches of seven like the IP output */
+        if( i % 7 == 6 || i == num_media - 1 )
+        {
+            if( fec_write( fec_handle ) < 0 )
+            {
+                fprintf( stderr, "Failed to write FEC packets\n" );
+                goto end;
+            }
+            read_sockets( &rx, fds, 2, 0 );
+        }
+    }
+
+    read_sockets( &rx, fds, 2, 100 );
+
+    /* The last matrix only carries the column FEC of the one before */
+    for( int i = 0; i < SELF_TEST_MATRICES * matrix_size; i++ )
+    {
+        if( pattern->drop( i % matrix_size, columns, rows, i / matrix_size ) )
+        {
+            rx.media[i].state = MEDIA_DROPPED;
+            rx.num_dropped++;
+        }
+    }
+
+    recover( &rx );
+
+    snprintf( uri, sizeof(uri), "%ix%i %s", columns, rows, pattern->name );
+    print_results( &rx, uri );
+
+    ret = rx.num_mismatches || rx.num_parity_errors || ( pattern->must_recover && count_state( &rx, MEDIA_DROPPED ) ) ||
+          rx.num_fec < SELF_TEST_MATRICES * ( columns + rows ) ? 1 : 0;
+
+end:
+    if( fec_handle )
+        fec_close( fec_handle );
+    for( int i = 0; i < 2; i++ )
+    {
+        if( fds[i] >= 0 )
+            close( fds[i] );
+    }
+    rx_close( &rx );
+
+    return ret;
+}
+
+static int self_test( int columns, int rows )
+{
+    static const int matrices[][2] = { { 5, 5 }, { 10, 10 }, { 1, 4 }, { 20, 5 }, { 4, 20 }, { 0, 0 } };
+    int ret = 0;
+
+    for( int i = 0; matrices[i][0] || columns; i++ )
+    {
+        int l = columns ? columns : matrices[i][0];
+        int d = columns ? rows : matrices[i][1];
+
+        for( int j = 0; patterns[j].name; j++ )
+            ret |= self_test_pattern( l, d, &patterns[j] );
+
+        if( columns )
+            break;
+    }
+
+    printf( ret ? "FAILED\n" : "OK\n" );
+
+    return ret;
+}
+
+int main( int argc, char **argv )
+{
+    const char *group = NULL;
+    int num_packets = 10000, burst = 1, columns = 0, rows = 0, run_self_test = 0, c;
+    double loss = 0.02;
+
+    while( ( c = getopt( argc, argv, "a:n:l:b:sc:r:" ) ) != -1 )
+    {
+        switch( c )
+        {
+            case 'a': group = optarg; break;
+            case 'n': num_packets = atoi( optarg ); break;
+            case 'l': loss = atof( optarg ) / 100; break;
+            case 'b': burst = MAX( atoi( optarg ), 1 ); break;
+            case 's': run_self_test = 1; break;
+            case 'c': columns = atoi( optarg ); break;
+            case 'r': rows = atoi( optarg ); break;
+            default:  goto usage;
+        }
+    }
+
+    srand( 1 );
+
+    if( run_self_test )
+    {
+        if( !columns != !rows )
+            goto usage;
+        return self_test( columns, rows );
+    }
+
+    if( optind != argc - 1 || num_packets <= 0 || num_packets > 60000 )
+        goto usage;
+
+    return capture( group, atoi( argv[optind] ), num_packets, loss, burst );
+
+usage:
+    fprintf( stderr, "usage: %s [-a multicast group] [-n packets] [-l loss %%] [-b burst] port\n"
+                     "       %s -s [-c columns -r rows]\n", argv[0], argv[0] );
+    return 2;
+}
@@ -0,0 +1,348 @@
+/*****************************************************************************
+ * ipbench.c : IP output send path benchmark
+ *****************************************************************************
+ * Copyright (C) 2010 Open Broadcast Systems Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+/* Sends paced TS datagrams over loopback through common/network/udp the way the IP output does,
+ * one non-blocking socket per output, and receives them in another thread. Reports datagrams per
+ * second, loss, and the CPU time each side spends per Gbit of each output.
+ * With no mode it compares single sends, sendmmsg batches and segmentation offload.
+ * -s sends a batch per pacing slot of that many microseconds like mux smoothing's pacing_slot.
+ *
+ *     ipbench [-r Mbit/s] [-t seconds] [-o outputs] [-p port] [-b batch | -s slot] [-g]
+ */
+
+#define _GNU_SOURCE
+
+#include <getopt.h>
+#include <poll.h>
+#include <arpa/inet.h>
+
+#include "common/common.h"
+#include "common/network/network.h"
+#include "common/network/udp/udp.h"
+
+#define BENCH_MAX_OUTPUTS 16
+#define BENCH_RECV_BATCH 64
+
+typedef struct
+{
+    int num_outputs;
+    int port;
+    int fds[BENCH_MAX_OUTPUTS];
+    volatile int stop;
+
+    int64_t received[BENCH_MAX_OUTPUTS];
+    int64_t reordered;
+    double cpu_time;
+} bench_rx_t;
+
+typedef struct
+{
+    int64_t sent;
+    int64_t overflows;
+    double cpu_time;
+    double elapsed;
+} bench_tx_t;
+
+static double get_cpu_time( void )
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_THREAD_CPUTIME_ID, &ts );
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double get_time( void )
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int open_socket( int port )
+{
+    struct sockaddr_in addr = {0};
+    int fd, size = 16 * 1024 * 1024;
+
+    fd = socket( AF_INET, SOCK_DGRAM, 0 );
+    if( fd < 0 )
+        return -1;
+
+    if( setsockopt( fd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size) ) < 0 )
+        setsockopt( fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size) );
+
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons( port );
+    addr.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+    if( bind( fd, (struct sockaddr*)&addr, sizeof(addr) ) < 0 )
+    {
+        fprintf( stderr, "Could not bind to port %i\n", port );
+        close( fd );
+        return -1;
+    }
+
+    return fd;
+}
+
+static void *receive_thread( void *ptr )
+{
+    bench_rx_t *rx = ptr;
+    struct pollfd pfds[BENCH_MAX_OUTPUTS];
+    struct mmsghdr msgs[BENCH_RECV_BATCH];
+    struct iovec iov[BENCH_RECV_BATCH];
+    static uint8_t buf[BENCH_RECV_BATCH][2048];
+    uint64_t next_seq[BENCH_MAX_OUTPUTS] = {0};
+    double start = get_cpu_time();
+    int ret;
+
+    for( int i = 0; i < rx->num_outputs; i++ )
+    {
+        pfds[i].fd = rx->fds[i];
+        pfds[i].events = POLLIN;
+    }
+
+    /* Keeps reading until the sockets have been quiet for a while after the sender stopped */
+    while( ( ret = poll( pfds, rx->num_outputs, 100 ) ) > 0 || !rx->stop )
+    {
+        if( ret <= 0 )
+            continue;
+
+        for( int i = 0; i < rx->num_outputs; i++ )
+        {
+            if( !( pfds[i].revents & POLLIN ) )
+                continue;
+
+            for( int j = 0; j < BENCH_RECV_BATCH; j++ )
+            {
+                iov[j].iov_base = buf[j];
+                iov[j].iov_len = sizeof(buf[j]);
+                memset( &msgs[j].msg_hdr, 0, sizeof(msgs[j].msg_hdr) );
+                msgs[j].msg_hdr.msg_iov = &iov[j];
+                msgs[j].msg_hdr.msg_iovlen = 1;
+            }
+
+            ret = recvmmsg( rx->fds[i], msgs, BENCH_RECV_BATCH, MSG_DONTWAIT, NULL );
+            for( int j = 0; j < ret; j++ )
+            {
+                uint64_t seq;
+                if( msgs[j].msg_len < 4 + sizeof(seq) )
+                    continue;
+                memcpy( &seq, &buf[j][4], sizeof(seq) );
+                if( seq != next_seq[i] )
+                    rx->reordered++;
+                next_seq[i] = seq + 1;
+                rx->received[i]++;
+            }
+        }
+    }
+
+    rx->cpu_time = get_cpu_time() - start;
+
+    return NULL;
+}
+
+/* Sends to every output in turn, batch datagrams each time a batch is due, like the IP output
+ * does with whatever mux smoothing has published */
+static int send_datagrams( bench_tx_t *tx, hnd_t *handles, int num_outputs, int rate, int batch, int seconds )
+{
+    static uint8_t buf[BENCH_MAX_OUTPUTS][UDP_MAX_BATCH][TS_PACKETS_SIZE];
+    struct iovec iov[UDP_MAX_BATCH];
+    uint64_t seq[BENCH_MAX_OUTPUTS] = {0};
+    int64_t interval = (int64_t)batch * TS_PACKETS_SIZE * 8 * 1000 / rate;
+    int64_t num_batches = (int64_t)seconds * 1000000000 / interval;
+    struct timespec next;
+    double start = get_cpu_time(), start_time = get_time();
+
+    for( int i = 0; i < num_outputs; i++ )
+    {
+        for( int j = 0; j < UDP_MAX_BATCH; j++ )
+        {
+            /* Sync bytes so it looks like TS to anything watching. The sequence number goes after the first one */
+            for( int k = 0; k < TS_PACKETS_SIZE; k += 188 )
+                buf[i][j][k] = 0x47;
+        }
+    }
+
+    clock_gettime( CLOCK_MONOTONIC, &next );
+
+    for( int64_t n = 0; n < num_batches; n++ )
+    {
+        next.tv_nsec += interval;
+        while( next.tv_nsec >= 1000000000 )
+        {
+            next.tv_nsec -= 1000000000;
+            next.tv_sec++;
+        }
+        while( clock_nanosleep( CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL ) == EINTR )
+            ;
+
+        for( int i = 0; i < num_outputs; i++ )
+        {
+            int sent;
+
+            for( int j = 0; j < batch; j++ )
+            {
+                memcpy( &buf[i][j][4], &seq[i], sizeof(seq[i]) );
+                seq[i]++;
+                iov[j].iov_base = buf[i][j];
+                iov[j].iov_len = TS_PACKETS_SIZE;
+            }
+
+            sent = udp_write_batch( handles[i], iov, 1, batch );
+            if( sent < 0 )
+            {
+                fprintf( stderr, "Failed to send datagrams\n" );
+                return -1;
+            }
+            tx->sent += sent;
+            tx->overflows += batch - sent;
+
+            /* What overflowed never left so the receiver only sees gaps it lost itself */
+            seq[i] -= batch - sent;
+        }
+    }
+
+    tx->cpu_time = get_cpu_time() - start;
+    tx->elapsed = get_time() - start_time;
+
+    return 0;
+}
+
+static int run_bench( const char *name, int num_outputs, int port, int rate, int batch, int gso, int seconds )
+{
+    obe_udp_opts_t udp_opts;
+    hnd_t handles[BENCH_MAX_OUTPUTS] = {0};
+    bench_rx_t rx = {0};
+    bench_tx_t tx = {0};
+    pthread_t rx_thread;
+    int64_t received = 0;
+    double gbits;
+    char uri[100];
+    int ret = -1, rx_started = 0;
+
+    rx.num_outputs = num_outputs;
+    rx.port = port;
+    for( int i = 0; i < num_outputs; i++ )
+        rx.fds[i] = -1;
+
+    for( int i = 0; i < num_outputs; i++ )
+    {
+        rx.fds[i] = open_socket( port + i );
+        if( rx.fds[i] < 0 )
+            goto end;
+
+        snprintf( uri, sizeof(uri), "udp://127.0.0.1:%i%s", port + i, gso ? "?gso=1" : "" );
+        udp_populate_opts( &udp_opts, uri );
+        udp_opts.gso_size = TS_PACKETS_SIZE;
+        udp_opts.nonblocking = 1;
+        if( udp_open( &handles[i], &udp_opts ) < 0 )
+        {
+            fprintf( stderr, "Could not open %s\n", uri );
+            goto end;
+        }
+    }
+
+    if( pthread_create( &rx_thread, NULL, receive_thread, &rx ) < 0 )
+    {
+        fprintf( stderr, "Couldn't create receive thread\n" );
+        goto end;
+    }
+    rx_started = 1;
+
+    ret = send_datagrams( &tx, handles, num_outputs, rate, batch, seconds );
+
+end:
+    if( rx_started )
+    {
+        rx.stop = 1;
+        pthread_join( rx_thread, NULL );
+    }
+
+    for( int i = 0; i < num_outputs; i++ )
+    {
+        received += rx.received[i];
+        if( handles[i] )
+            udp_close( handles[i] );
+        if( rx.fds[i] >= 0 )
+            close( rx.fds[i] );
+    }
+
+    if( ret < 0 )
+        return ret;
+
+    gbits = tx.sent * TS_PACKETS_SIZE * 8 / 1e9;
+    printf( "%-10s %3i %11.0f %11"PRIi64" %11"PRIi64" %9"PRIi64" %9"PRIi64" %9"PRIi64" %8.3f %8.3f %10.3f %10.3f\n", name, batch,
+            tx.sent / tx.elapsed, tx.sent, received, tx.overflows, tx.sent - received, rx.reordered,
+            tx.cpu_time, rx.cpu_time, tx.cpu_time / gbits, rx.cpu_time / gbits );
+
+    return 0;
+}
+
+static void print_header( int num_outputs, int rate, int seconds )
+{
+    printf( "%i output%s of %i Mbit/s for %i s over loopback, CPU in seconds\n", num_outputs,
+            num_outputs > 1 ? "s" : "", rate, seconds );
+    printf( "%-10s %3s %11s %11s %11s %9s %9s %9s %8s %8s %10s %10s\n", "mode", "bat", "datagrams/s", "sent",
+            "received", "overflows", "lost", "reordered", "tx cpu", "rx cpu", "tx s/Gbit", "rx s/Gbit" );
+}
+
+int main( int argc, char **argv )
+{
+    int rate = 1000, seconds = 5, num_outputs = 1, port = 41000, batch = 0, slot = 0, gso = 0, ret = 0, c;
+
+    while( ( c = getopt( argc, argv, "r:t:o:p:b:s:g" ) ) != -1 )
+    {
+        switch( c )
+        {
+            case 'r': rate = atoi( optarg ); break;
+            case 't': seconds = atoi( optarg ); break;
+            case 'o': num_outputs = atoi( optarg ); break;
+            case 'p': port = atoi( optarg ); break;
+            case 'b': batch = atoi( optarg ); break;
+            case 's': slot = atoi( optarg ); break;
+            case 'g': gso = 1; break;
+            default:  goto usage;
+        }
+    }
+
+    if( optind != argc || rate <= 0 || seconds <= 0 || num_outputs <= 0 || num_outputs > BENCH_MAX_OUTPUTS ||
+        batch < 0 || batch > UDP_MAX_BATCH || slot < 0 || ( batch && slot ) || ( gso && !batch && !slot ) )
+        goto usage;
+
+    /* Datagrams due within the slot */
+    if( slot )
+        batch = MIN( MAX( (int64_t)rate * slot / ( TS_PACKETS_SIZE * 8 ), 1 ), UDP_MAX_BATCH );
+
+    print_header( num_outputs, rate, seconds );
+
+    if( batch )
+        return run_bench( gso ? "gso" : batch > 1 ? "sendmmsg" : "single", num_outputs, port, rate, batch, gso, seconds ) < 0;
+
+    ret |= run_bench( "single", num_outputs, port, rate, 1, 0, seconds );
+    ret |= run_bench( "sendmmsg", num_outputs, port, rate, 16, 0, seconds );
+    ret |= run_bench( "sendmmsg", num_outputs, port, rate, UDP_MAX_BATCH, 0, seconds );
+    ret |= run_bench( "gso", num_outputs, port, rate, 16, 1, seconds );
+    ret |= run_bench( "gso", num_outputs, port, rate, UDP_MAX_BATCH, 1, seconds );
+
+    return ret < 0;
+
+usage:
+    fprintf( stderr, "usage: %s [-r Mbit/s per output] [-t seconds] [-o outputs] [-p port] [-b batch | -s slot us] [-g]\n", argv[0] );
+    return 2;
+}